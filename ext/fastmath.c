@@ -0,0 +1,101 @@
+/*
+ * FASTMATH
+ * A sample extension: numeric helpers a script would otherwise write in
+ * Lox, and a string hash. Build it with make extensions and load it with
+ * load_extension("ext/fastmath.so").
+ */
+
+#include <math.h>
+#include <stdint.h>
+
+#include "lox.h"
+
+
+/*
+ * hypot(x, y)
+ */
+static bool hypot_native(LoxVM* vm, int arg_count, const LoxValue* args, LoxValue* result, void* userdata)
+{
+	*result = lox_number(hypot(args[0].number, args[1].number));
+	return true;
+}
+
+
+/*
+ * clamp(x, low, high)
+ */
+static bool clamp_native(LoxVM* vm, int arg_count, const LoxValue* args, LoxValue* result, void* userdata)
+{
+	double x = args[0].number;
+	double low = args[1].number;
+	double high = args[2].number;
+	if(low > high)
+		return lox_error(result, "clamp() needs low <= high.");
+
+	*result = lox_number(x < low ? low : x > high ? high : x);
+	return true;
+}
+
+
+/*
+ * lerp(a, b, t)
+ */
+static bool lerp_native(LoxVM* vm, int arg_count, const LoxValue* args, LoxValue* result, void* userdata)
+{
+	*result = lox_number(args[0].number + (args[1].number - args[0].number) * args[2].number);
+	return true;
+}
+
+
+/*
+ * sum(...)
+ * Any number of arguments, so it checks them itself.
+ */
+static bool sum_native(LoxVM* vm, int arg_count, const LoxValue* args, LoxValue* result, void* userdata)
+{
+	double sum = 0;
+	for(int i = 0; i < arg_count; i++)
+	{
+		if(args[i].type != LOX_NUMBER)
+			return lox_error(result, "sum() takes numbers.");
+		sum += args[i].number;
+	}
+
+	*result = lox_number(sum);
+	return true;
+}
+
+
+/*
+ * fnv1a(string)
+ * 32 bit FNV-1a hash of a string's bytes.
+ */
+static bool fnv1a_native(LoxVM* vm, int arg_count, const LoxValue* args, LoxValue* result, void* userdata)
+{
+	uint32_t hash = 2166136261u;
+	for(int i = 0; i < args[0].length; i++)
+	{
+		hash ^= (uint8_t) args[0].string[i];
+		hash *= 16777619u;
+	}
+
+	*result = lox_number(hash);
+	return true;
+}
+
+
+static const LoxNativeDef natives[] = {
+	{"hypot", hypot_native, "nn"},
+	{"clamp", clamp_native, "nnn"},
+	{"lerp",  lerp_native,  "nnn"},
+	{"sum",   sum_native,   NULL},
+	{"fnv1a", fnv1a_native, "s"},
+	{NULL, NULL, NULL},
+};
+
+
+LOX_EXTENSION(vm)
+{
+	lox_define_natives(vm, natives, NULL);
+	return true;
+}
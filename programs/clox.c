@@ -1,8 +1,10 @@
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 
+#include "hotness.h"
 #include "vm.h"
 
 
@@ -57,36 +59,483 @@ static void repl(void)
 }
 
 
-static void run_file(const char* path)
+/*
+ * run_file()
+ * Returns the exit status for the process. We don't exit here so that
+ * reports still get written when the script fails.
+ */
+static int run_file(const char* path)
 {
 	char* source = read_file(path);
 	InterpResult result = interpret(source);
 	free(source);
 
 	if(result == INTERPRET_COMPILE_ERROR)
-		exit(65);
+		return 65;
 	if(result == INTERPRET_RUNTIME_ERROR)
-		exit(70);
+		return 70;
+
+	return 0;
+}
+
+
+/*
+ * write_stats()
+ */
+static void write_stats(const char* json_path)
+{
+	if(json_path == NULL)
+	{
+		print_stats(&vm.stats, stderr);
+		return;
+	}
+
+	FILE* file = fopen(json_path, "w");
+	if(file == NULL)
+	{
+		fprintf(stderr, "Failed to open file [%s]\n", json_path);
+		return;
+	}
+
+	write_stats_json(&vm.stats, file);
+	fclose(file);
+}
+
+
+/*
+ * write_samples()
+ */
+static void write_samples(const char* path)
+{
+	FILE* file = fopen(path, "w");
+	if(file == NULL)
+	{
+		fprintf(stderr, "Failed to open file [%s]\n", path);
+		return;
+	}
+
+	write_folded_stacks(&vm.sampler, file);
+	fclose(file);
+}
+
+
+/*
+ * write_profile()
+ */
+static void write_profile(const char* callgrind_path, const char* source_path)
+{
+	print_profile(&vm.profiler, stderr);
+
+	if(callgrind_path == NULL)
+		return;
+
+	FILE* file = fopen(callgrind_path, "w");
+	if(file == NULL)
+	{
+		fprintf(stderr, "Failed to open file [%s]\n", callgrind_path);
+		return;
+	}
+
+	write_callgrind(&vm.profiler, file, source_path != NULL ? source_path : "<repl>");
+	fclose(file);
+}
+
+
+/*
+ * write_heap_profile()
+ */
+static void write_heap_profile(const char* lines_path, const char* source_path)
+{
+	print_heap_profile(&vm.heap_profile, stderr);
+
+	if(lines_path == NULL)
+		return;
+
+	FILE* file = fopen(lines_path, "w");
+	if(file == NULL)
+	{
+		fprintf(stderr, "Failed to open file [%s]\n", lines_path);
+		return;
+	}
+
+	write_heap_profile_lines(&vm.heap_profile, file, source_path != NULL ? source_path : "<repl>");
+	fclose(file);
 }
 
 
+/*
+ * write_timeline_file()
+ */
+static void write_timeline_file(const char* path)
+{
+	FILE* file = fopen(path, "w");
+	if(file == NULL)
+	{
+		fprintf(stderr, "Failed to open file [%s]\n", path);
+		return;
+	}
+
+	write_timeline(&vm.timeline, file);
+	fclose(file);
+
+	if(vm.timeline.dropped > 0)
+		fprintf(stderr, "The timeline was full, %lu events were dropped\n", (unsigned long) vm.timeline.dropped);
+}
+
+
+/*
+ * write_hotness()
+ */
+static void write_hotness(const char* lines_path, const char* source_path)
+{
+	print_hot_disassembly();
+
+	if(lines_path == NULL)
+		return;
+
+	FILE* file = fopen(lines_path, "w");
+	if(file == NULL)
+	{
+		fprintf(stderr, "Failed to open file [%s]\n", lines_path);
+		return;
+	}
+
+	write_line_hotness(file, source_path != NULL ? source_path : "<repl>");
+	fclose(file);
+}
+
+
+/*
+ * parse_size()
+ * A byte count with an optional K, M or G suffix. Returns 0 if it
+ * doesn't parse.
+ */
+static uint64_t parse_size(const char* text)
+{
+	char* end;
+	unsigned long long size = strtoull(text, &end, 10);
+
+	if(end == text)
+		return 0;
+
+	switch(*end)
+	{
+		case 'k': case 'K': size <<= 10; end++; break;
+		case 'm': case 'M': size <<= 20; end++; break;
+		case 'g': case 'G': size <<= 30; end++; break;
+		default: break;
+	}
+
+	return *end == '\0' ? (uint64_t) size : 0;
+}
 
 
+static void usage(void)
+{
+	fprintf(stderr, "Usage: clox: [options] [path]\n");
+	fprintf(stderr, "    --trace-exec          print the stack and each instruction as it runs\n");
+	fprintf(stderr, "    --dump-bytecode       disassemble each function after compiling it\n");
+	fprintf(stderr, "    --trace-tokens        print each token as it is scanned\n");
+	fprintf(stderr, "    --trace-parse         print what the parser is doing\n");
+	fprintf(stderr, "    --registers           compile to and run the register backend\n");
+	fprintf(stderr, "    --no-super            don't fuse opcodes into superinstructions\n");
+	fprintf(stderr, "    --ngram-profile FILE  append opcode n-gram counts to FILE (needs DEBUG_PROFILE_NGRAMS)\n");
+	fprintf(stderr, "    --stats               print opcode, call and table counts at exit\n");
+	fprintf(stderr, "    --stats-cycles        like --stats, and time each opcode with the TSC\n");
+	fprintf(stderr, "    --stats-json FILE     write the --stats counters to FILE as JSON\n");
+	fprintf(stderr, "    --sample FILE         sample the call stack and write folded stacks to FILE\n");
+	fprintf(stderr, "    --sample-hz N         samples per second of CPU time (default %d)\n", SAMPLER_DEFAULT_HZ);
+	fprintf(stderr, "    --profile             print calls, inclusive and self time per function at exit\n");
+	fprintf(stderr, "    --profile-callgrind FILE  like --profile, and write FILE for kcachegrind\n");
+	fprintf(stderr, "    --record FILE         keep the last instructions in a ring buffer and write\n");
+	fprintf(stderr, "                          it to FILE on a runtime error or SIGUSR1\n");
+	fprintf(stderr, "    --record-events N     size of the ring buffer (default %d)\n", RECORDER_DEFAULT_EVENTS);
+	fprintf(stderr, "    --hotness             print the disassembly with dispatch counts at exit\n");
+	fprintf(stderr, "    --hotness-lines FILE  like --hotness, and write per line counts to FILE\n");
+	fprintf(stderr, "    --timeline FILE       write compile, call and heap events to FILE for chrome://tracing\n");
+	fprintf(stderr, "    --timeline-min-us N   leave out calls shorter than N microseconds (default %d)\n",
+			TIMELINE_DEFAULT_MIN_NS / 1000);
+	fprintf(stderr, "    --max-instructions N  stop each script after about N instructions\n");
+	fprintf(stderr, "    --timeout MS          stop each script after MS milliseconds\n");
+	fprintf(stderr, "    --workers N           run spawn() tasks on N threads (default one per CPU)\n");
+	fprintf(stderr, "    --memory              print bytes allocated, freed, live and peak at exit\n");
+	fprintf(stderr, "    --heap-limit SIZE     fail with a runtime error when the heap goes over SIZE\n");
+	fprintf(stderr, "                          bytes (K, M and G suffixes are allowed)\n");
+	fprintf(stderr, "    --heap-profile        print the lines and kinds of memory that allocate the most at exit\n");
+	fprintf(stderr, "    --heap-profile-lines FILE  like --heap-profile, and write per line totals to FILE\n");
+	fprintf(stderr, "    --perf                print hardware counters for compile, run and teardown\n");
+}
+
 
 int main(int argc, char *argv[])
 {
+	const char* path = NULL;
+	const char* ngram_path = NULL;
+	const char* stats_path = NULL;
+	const char* sample_path = NULL;
+	const char* callgrind_path = NULL;
+	const char* hotness_path = NULL;
+	const char* record_path = NULL;
+	const char* timeline_path = NULL;
+	const char* heap_lines_path = NULL;
+	long record_events = RECORDER_DEFAULT_EVENTS;
+	bool perf = false;
+	bool memory = false;
+	int status = 0;
+
 	init_vm();
 
-	if(argc == 1) {
-		repl();
+	for(int i = 1; i < argc; i++)
+	{
+		if(strcmp(argv[i], "--trace-exec") == 0)
+			vm.trace_exec = true;
+		else if(strcmp(argv[i], "--dump-bytecode") == 0)
+			vm.dump_bytecode = true;
+		else if(strcmp(argv[i], "--trace-tokens") == 0)
+			vm.trace_tokens = true;
+		else if(strcmp(argv[i], "--trace-parse") == 0)
+			vm.trace_parse = true;
+		else if(strcmp(argv[i], "--registers") == 0)
+			vm.backend = BACKEND_REGISTER;
+		else if(strcmp(argv[i], "--no-super") == 0)
+			vm.superinstructions = false;
+		else if(strcmp(argv[i], "--ngram-profile") == 0 && i + 1 < argc)
+			ngram_path = argv[++i];
+		else if(strcmp(argv[i], "--stats") == 0)
+			vm.stats.enabled = true;
+		else if(strcmp(argv[i], "--stats-cycles") == 0)
+		{
+			vm.stats.enabled = true;
+			vm.stats.cycles = true;
+		}
+		else if(strcmp(argv[i], "--stats-json") == 0 && i + 1 < argc)
+		{
+			vm.stats.enabled = true;
+			stats_path = argv[++i];
+		}
+		else if(strcmp(argv[i], "--sample") == 0 && i + 1 < argc)
+		{
+			vm.sampler.enabled = true;
+			sample_path = argv[++i];
+		}
+		else if(strcmp(argv[i], "--profile") == 0)
+			vm.profiler.enabled = true;
+		else if(strcmp(argv[i], "--profile-callgrind") == 0 && i + 1 < argc)
+		{
+			vm.profiler.enabled = true;
+			callgrind_path = argv[++i];
+		}
+		else if(strcmp(argv[i], "--hotness") == 0)
+			vm.hotness = true;
+		else if(strcmp(argv[i], "--hotness-lines") == 0 && i + 1 < argc)
+		{
+			vm.hotness = true;
+			hotness_path = argv[++i];
+		}
+		else if(strcmp(argv[i], "--timeline") == 0 && i + 1 < argc)
+			timeline_path = argv[++i];
+		else if(strcmp(argv[i], "--timeline-min-us") == 0 && i + 1 < argc)
+		{
+			long min_us = atol(argv[++i]);
+			if(min_us < 0)
+			{
+				usage();
+				free_vm();
+				return 64;
+			}
+			vm.timeline.min_duration = (uint64_t) min_us * 1000;
+		}
+		else if(strcmp(argv[i], "--max-instructions") == 0 && i + 1 < argc)
+		{
+			vm.limits.max_instructions = parse_size(argv[++i]);
+			if(vm.limits.max_instructions == 0)
+			{
+				usage();
+				free_vm();
+				return 64;
+			}
+		}
+		else if(strcmp(argv[i], "--timeout") == 0 && i + 1 < argc)
+		{
+			long timeout = atol(argv[++i]);
+			if(timeout <= 0)
+			{
+				usage();
+				free_vm();
+				return 64;
+			}
+			vm.limits.max_ns = (uint64_t) timeout * 1000000;
+		}
+		else if(strcmp(argv[i], "--workers") == 0 && i + 1 < argc)
+		{
+			vm.workers = atoi(argv[++i]);
+			if(vm.workers <= 0)
+			{
+				usage();
+				free_vm();
+				return 64;
+			}
+		}
+		else if(strcmp(argv[i], "--memory") == 0)
+			memory = true;
+		else if(strcmp(argv[i], "--heap-limit") == 0 && i + 1 < argc)
+		{
+			vm.memory.limit = parse_size(argv[++i]);
+			if(vm.memory.limit == 0)
+			{
+				usage();
+				free_vm();
+				return 64;
+			}
+		}
+		else if(strcmp(argv[i], "--heap-profile") == 0)
+			vm.heap_profile.enabled = true;
+		else if(strcmp(argv[i], "--heap-profile-lines") == 0 && i + 1 < argc)
+		{
+			vm.heap_profile.enabled = true;
+			heap_lines_path = argv[++i];
+		}
+		else if(strcmp(argv[i], "--perf") == 0)
+			perf = true;
+		else if(strcmp(argv[i], "--record") == 0 && i + 1 < argc)
+			record_path = argv[++i];
+		else if(strcmp(argv[i], "--record-events") == 0 && i + 1 < argc)
+		{
+			record_events = atol(argv[++i]);
+			if(record_events <= 0 || record_events > (1L << 30))
+			{
+				usage();
+				free_vm();
+				return 64;
+			}
+		}
+		else if(strcmp(argv[i], "--sample-hz") == 0 && i + 1 < argc)
+		{
+			vm.sampler.frequency = atoi(argv[++i]);
+			if(vm.sampler.frequency <= 0 || vm.sampler.frequency > 1000000)
+			{
+				usage();
+				free_vm();
+				return 64;
+			}
+		}
+		else if(argv[i][0] == '-' || path != NULL)
+		{
+			usage();
+			free_vm();
+			return 64;
+		}
+		else
+			path = argv[i];
 	}
-	else if(argc == 2) {
-		run_file(argv[1]);
+
+#ifndef DEBUG_PROFILE_NGRAMS
+	if(ngram_path != NULL)
+	{
+		fprintf(stderr, "--ngram-profile needs a build with DEBUG_PROFILE_NGRAMS defined\n");
+		free_vm();
+		return 64;
+	}
+#endif /*DEBUG_PROFILE_NGRAMS*/
+
+#ifndef STATS_HAVE_CYCLES
+	if(vm.stats.cycles)
+	{
+		fprintf(stderr, "Cycle counts are not available on this platform\n");
+		vm.stats.cycles = false;
 	}
-	else 
-		fprintf(stderr, "Usage: clox: [path]\n");
+#endif /*STATS_HAVE_CYCLES*/
+
+	// These only hook into the stack backend's loops
+	if(vm.backend == BACKEND_REGISTER)
+	{
+		const char* option = NULL;
+		if(vm.stats.enabled)
+			option = "--stats";
+		else if(vm.sampler.enabled)
+			option = "--sample";
+		else if(vm.profiler.enabled)
+			option = "--profile";
+		else if(vm.hotness)
+			option = "--hotness";
+		else if(record_path != NULL)
+			option = "--record";
+		else if(timeline_path != NULL)
+			option = "--timeline";
+		else if(perf)
+			option = "--perf";
+
+		if(option != NULL)
+		{
+			fprintf(stderr, "%s only covers the stack backend, it can't be used with --registers\n", option);
+			free_vm();
+			return 64;
+		}
+	}
+
+	if(record_path != NULL)
+	{
+		if(!start_recorder(&vm.recorder, (uint32_t) record_events, record_path, path != NULL ? path : "<repl>"))
+			fprintf(stderr, "Failed to start the execution recorder\n");
+		else
+			vm.recorder.header.superinstructions = vm.superinstructions;
+	}
+
+	if(timeline_path != NULL)
+		start_timeline(&vm.timeline);
+
+	if(perf)
+	{
+		if(!start_perf(&vm.perf))
+			fprintf(stderr, "Performance counters are not available (%s)\n", strerror(vm.perf.error));
+		else if(!perf_has_hardware(&vm.perf))
+			fprintf(stderr, "Hardware counters are not available (%s), only timing phases\n", strerror(vm.perf.error));
+	}
+
+	if(path == NULL)
+		repl();
+	else
+		status = run_file(path);
+
+	if(vm.stats.enabled)
+		write_stats(stats_path);
+	if(vm.sampler.enabled)
+		write_samples(sample_path);
+	if(vm.profiler.enabled)
+		write_profile(callgrind_path, path);
+	if(vm.hotness)
+		write_hotness(hotness_path, path);
+	if(timeline_path != NULL)
+		write_timeline_file(timeline_path);
+	if(vm.heap_profile.enabled)
+		write_heap_profile(heap_lines_path, path);
+	if(memory)
+		print_memory_stats(&vm.memory, sizeof(vm.stack) + sizeof(vm.frames), stderr);
+
+#ifdef DEBUG_PROFILE_NGRAMS
+	if(ngram_path != NULL)
+	{
+		FILE* file = fopen(ngram_path, "a");
+		if(file == NULL)
+			fprintf(stderr, "Failed to open file [%s]\n", ngram_path);
+		else
+		{
+			write_ngram_profile(file);
+			fclose(file);
+		}
+	}
+#endif /*DEBUG_PROFILE_NGRAMS*/
+
+#ifdef DEBUG_COUNT_TRAFFIC
+	fprintf(stderr, "dispatches: %lu, slot traffic: %lu\n", 
+			(unsigned long) vm.dispatch_count, (unsigned long) vm.slot_traffic);
+#endif /*DEBUG_COUNT_TRAFFIC*/
 
 	free_vm();
 
-	return 0;
+	if(vm.perf.enabled)
+		print_perf(&vm.perf, stderr);
+	free_perf(&vm.perf);
+
+	return status;
 }
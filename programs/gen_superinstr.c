@@ -0,0 +1,321 @@
+/*
+ * GEN_SUPERINSTR
+ * Read the opcode n-gram profile written by clox --ngram-profile and
+ * generate superinstructions.h with the sequences that remove the
+ * most dispatches.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chunk.h"
+#include "debug.h"
+
+
+#define DEFAULT_MAX_SUPER 12
+#define MAX_CANDIDATES (OP_BASE_COUNT * OP_BASE_COUNT * (OP_BASE_COUNT + 1))
+
+
+typedef struct {
+	int count;
+	int ops[SUPER_MAX_OPS];
+	unsigned long executed;		// times the sequence ran in the profile
+	unsigned long fused;		// executions left once overlapping choices are made
+	unsigned long saved;		// estimated dispatches removed
+} Candidate;
+
+
+static unsigned long unigrams[OP_BASE_COUNT];
+static unsigned long bigrams[OP_BASE_COUNT][OP_BASE_COUNT];
+static unsigned long trigrams[OP_BASE_COUNT][OP_BASE_COUNT][OP_BASE_COUNT];
+static Candidate candidates[MAX_CANDIDATES];
+
+
+static int opcode_from_name(const char* name)
+{
+	for(int i = 0; i < OP_BASE_COUNT; i++)
+	{
+		if(strcmp(opcode_name(i), name) == 0)
+			return i;
+	}
+
+	return -1;
+}
+
+
+/*
+ * read_profile()
+ * Profiles from several runs may be appended to the same file, so the
+ * counts for each n-gram are summed.
+ */
+static int read_profile(const char* path)
+{
+	FILE* file = fopen(path, "r");
+	if(file == NULL) {
+		fprintf(stderr, "Failed to open file [%s]\n", path);
+		return -1;
+	}
+
+	char line[256];
+	while(fgets(line, sizeof(line), file))
+	{
+		char names[SUPER_MAX_OPS][64];
+		int ops[SUPER_MAX_OPS];
+		unsigned long count;
+		int n;
+
+		if(sscanf(line, "%d", &n) != 1 || n < 1 || n > SUPER_MAX_OPS)
+			continue;
+
+		int fields;
+		if(n == 1)
+			fields = sscanf(line, "%*d %63s %lu", names[0], &count) - 1;
+		else if(n == 2)
+			fields = sscanf(line, "%*d %63s %63s %lu", names[0], names[1], &count) - 1;
+		else
+			fields = sscanf(line, "%*d %63s %63s %63s %lu", names[0], names[1], names[2], &count) - 1;
+
+		if(fields != n)
+			continue;
+
+		bool valid = true;
+		for(int i = 0; i < n; i++)
+		{
+			ops[i] = opcode_from_name(names[i]);
+			if(ops[i] == -1)
+				valid = false;
+		}
+		if(!valid)
+			continue;
+
+		if(n == 1)
+			unigrams[ops[0]] += count;
+		else if(n == 2)
+			bigrams[ops[0]][ops[1]] += count;
+		else
+			trigrams[ops[0]][ops[1]][ops[2]] += count;
+	}
+
+	fclose(file);
+
+	return 0;
+}
+
+
+static int compare_candidates(const void* a, const void* b)
+{
+	const Candidate* ca = (const Candidate*) a;
+	const Candidate* cb = (const Candidate*) b;
+
+	if(ca->saved == cb->saved)
+		return 0;
+
+	return ca->saved < cb->saved ? 1 : -1;
+}
+
+
+/*
+ * collect_candidates()
+ * Every n-gram whose leading instructions fall through to the next one
+ * can become a superinstruction.
+ */
+static int collect_candidates(void)
+{
+	int num = 0;
+
+	for(int a = 0; a < OP_BASE_COUNT; a++)
+	{
+		if(is_branch_op(a))
+			continue;
+
+		for(int b = 0; b < OP_BASE_COUNT; b++)
+		{
+			if(bigrams[a][b] > 0)
+			{
+				Candidate* c = &candidates[num++];
+				c->count = 2;
+				c->ops[0] = a;
+				c->ops[1] = b;
+				c->executed = bigrams[a][b];
+			}
+
+			if(is_branch_op(b))
+				continue;
+
+			for(int t = 0; t < OP_BASE_COUNT; t++)
+			{
+				if(trigrams[a][b][t] == 0)
+					continue;
+
+				Candidate* c = &candidates[num++];
+				c->count = 3;
+				c->ops[0] = a;
+				c->ops[1] = b;
+				c->ops[2] = t;
+				c->executed = trigrams[a][b][t];
+			}
+		}
+	}
+
+	for(int i = 0; i < num; i++)
+	{
+		candidates[i].fused = candidates[i].executed;
+		candidates[i].saved = candidates[i].executed * (candidates[i].count - 1);
+	}
+
+	return num;
+}
+
+
+/*
+ * overlaps()
+ * True if candidate t would start on instruction k of the chosen sequence.
+ */
+static bool overlaps(Candidate* chosen, int k, Candidate* t)
+{
+	// A longer sequence with the same start wins over the chosen one
+	if(k == 0 && t->count >= chosen->count)
+		return false;
+
+	for(int j = 0; j < t->count && k + j < chosen->count; j++)
+	{
+		if(t->ops[j] != chosen->ops[k + j])
+			return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * select_candidates()
+ * Greedily take the sequence that saves the most dispatches. Every time
+ * a sequence is chosen, the candidates that overlap it lose those 
+ * executions since only one of the two can be dispatched there.
+ */
+static int select_candidates(int num, int max_super)
+{
+	int selected = 0;
+
+	while(selected < max_super && selected < num)
+	{
+		qsort(&candidates[selected], num - selected, sizeof(Candidate), compare_candidates);
+
+		Candidate* chosen = &candidates[selected];
+		if(chosen->saved == 0)
+			break;
+		selected++;
+
+		for(int i = selected; i < num; i++)
+		{
+			Candidate* t = &candidates[i];
+			int longest = chosen->count > t->count ? chosen->count : t->count;
+			for(int k = 0; k < longest; k++)
+			{
+				// Either sequence may start inside the other one
+				bool t_inside = k < chosen->count && overlaps(chosen, k, t);
+				bool chosen_inside = k > 0 && k < t->count && overlaps(t, k, chosen);
+				if(!t_inside && !chosen_inside)
+					continue;
+
+				t->fused -= t->fused < chosen->fused ? t->fused : chosen->fused;
+				t->saved = t->fused * (t->count - 1);
+				break;
+			}
+		}
+	}
+
+	return selected;
+}
+
+
+/*
+ * write_header()
+ */
+static void write_header(FILE* file, const char* profile, int num_selected)
+{
+	fprintf(file, "/*\n");
+	fprintf(file, " * SUPERINSTRUCTIONS\n");
+	fprintf(file, " * Generated by gen_superinstr from %s. Do not edit by hand.\n", profile);
+	fprintf(file, " */\n\n");
+	fprintf(file, "#ifndef __LOX_SUPERINSTRUCTIONS_H\n");
+	fprintf(file, "#define __LOX_SUPERINSTRUCTIONS_H\n\n");
+
+	for(int n = 2; n <= SUPER_MAX_OPS; n++)
+	{
+		fprintf(file, "#define SUPERINSTRUCTIONS_%d(X)", n);
+		for(int i = 0; i < num_selected; i++)
+		{
+			if(candidates[i].count != n)
+				continue;
+
+			fprintf(file, " \\\n\tX(");
+			for(int j = 0; j < n; j++)
+				fprintf(file, "%s%s", j > 0 ? ", " : "", opcode_name(candidates[i].ops[j]) + 3);
+			fprintf(file, ")");
+		}
+		fprintf(file, "\n\n");
+	}
+
+	fprintf(file, "#endif /*__LOX_SUPERINSTRUCTIONS_H*/\n");
+}
+
+
+/*
+ * write_report()
+ */
+static void write_report(FILE* file, int num_selected)
+{
+	unsigned long total = 0;
+	unsigned long saved = 0;
+
+	for(int i = 0; i < OP_BASE_COUNT; i++)
+		total += unigrams[i];
+
+	fprintf(file, "%-60s %12s %12s\n", "sequence", "executed", "saved");
+	for(int i = 0; i < num_selected; i++)
+	{
+		char name[128] = "";
+		for(int j = 0; j < candidates[i].count; j++)
+		{
+			if(j > 0)
+				strcat(name, " + ");
+			strcat(name, opcode_name(candidates[i].ops[j]));
+		}
+
+		fprintf(file, "%-60s %12lu %12lu\n", name, candidates[i].executed, candidates[i].saved);
+		saved += candidates[i].saved;
+	}
+
+	// This is an estimate from n-gram counts. Compare dispatch counts with 
+	// and without --no-super for the real number.
+	fprintf(file, "\n%lu profiled dispatches, about %lu removed (%.1f%%)\n",
+			total, saved, total > 0 ? 100.0 * (double) saved / (double) total : 0.0);
+}
+
+
+int main(int argc, char *argv[])
+{
+	if(argc < 2 || argc > 3) {
+		fprintf(stderr, "Usage: gen_superinstr: profile [max-superinstructions] > src/superinstructions.h\n");
+		return 64;
+	}
+
+	int max_super = argc == 3 ? atoi(argv[2]) : DEFAULT_MAX_SUPER;
+	if(max_super <= 0 || max_super > UINT8_MAX - OP_BASE_COUNT) {
+		fprintf(stderr, "Number of superinstructions must be between 1 and %d\n", UINT8_MAX - OP_BASE_COUNT);
+		return 64;
+	}
+
+	if(read_profile(argv[1]) != 0)
+		return 74;
+
+	int num = collect_candidates();
+	int num_selected = select_candidates(num, max_super);
+
+	write_header(stdout, argv[1], num_selected);
+	write_report(stderr, num_selected);
+
+	return 0;
+}
@@ -0,0 +1,364 @@
+/*
+ * LOX_BENCH
+ * Run each benchmark script with clox a number of times, report the
+ * median and spread of the wall clock times, write them as JSON and
+ * compare the medians against a stored baseline. With -W each script is
+ * run on 1 to N worker threads instead, to see how spawn() scales.
+ */
+
+// fork(), execv() and clock_gettime() are POSIX rather than C99
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+
+
+#define DEFAULT_RUNS 10
+#define DEFAULT_THRESHOLD 5.0		// percent slower than baseline that counts as a regression
+#define MAX_BENCHMARKS 64
+#define MAX_RUNS 1000
+#define MAX_WORKERS 256
+
+
+typedef struct {
+	char name[64];
+	int runs;
+	double median;
+	double mean;
+	double stddev;
+	double min;
+	double max;
+	bool failed;
+} BenchResult;
+
+
+typedef struct {
+	char name[64];
+	double median;
+} Baseline;
+
+
+static double now_seconds(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+
+/*
+ * time_run()
+ * Run clox on script once with its output thrown away, on the given
+ * number of worker threads unless that is 0. Returns the wall clock
+ * time, or a negative value if clox failed.
+ */
+static double time_run(const char* clox, const char* script, int workers)
+{
+	double start = now_seconds();
+
+	pid_t pid = fork();
+	if(pid < 0)
+		return -1.0;
+
+	if(pid == 0)
+	{
+		int null_fd = open("/dev/null", O_WRONLY);
+		if(null_fd >= 0)
+		{
+			dup2(null_fd, STDOUT_FILENO);
+			dup2(null_fd, STDERR_FILENO);
+		}
+
+		char count[16];
+		snprintf(count, sizeof(count), "%d", workers);
+
+		char* const argv[] = {(char*) clox, (char*) script, NULL};
+		char* const worker_argv[] = {(char*) clox, "--workers", count, (char*) script, NULL};
+		execv(clox, workers > 0 ? worker_argv : argv);
+		_exit(127);
+	}
+
+	int status;
+	if(waitpid(pid, &status, 0) < 0)
+		return -1.0;
+
+	double elapsed = now_seconds() - start;
+	if(!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		return -1.0;
+
+	return elapsed;
+}
+
+
+static int compare_doubles(const void* a, const void* b)
+{
+	double da = *(const double*) a;
+	double db = *(const double*) b;
+
+	return (da > db) - (da < db);
+}
+
+
+/*
+ * bench_name()
+ * The script file name without directory or extension, and the number
+ * of workers after a slash if it was run with them.
+ */
+static void bench_name(const char* script, int workers, char* name, int size)
+{
+	const char* start = strrchr(script, '/');
+	start = start != NULL ? start + 1 : script;
+
+	const char* end = strrchr(start, '.');
+	int length = end != NULL ? (int) (end - start) : (int) strlen(start);
+	if(length >= size)
+		length = size - 1;
+
+	memcpy(name, start, length);
+	name[length] = '\0';
+
+	if(workers > 0)
+		snprintf(name + length, size - length, "/%d", workers);
+}
+
+
+/*
+ * run_benchmark()
+ * One untimed warm up run so the script and clox are in the page
+ * cache, then the timed runs.
+ */
+static BenchResult run_benchmark(const char* clox, const char* script, int runs, int workers)
+{
+	BenchResult result;
+	double times[MAX_RUNS];
+
+	bench_name(script, workers, result.name, sizeof(result.name));
+	result.runs = runs;
+	result.failed = time_run(clox, script, workers) < 0.0;
+
+	for(int i = 0; i < runs && !result.failed; i++)
+	{
+		times[i] = time_run(clox, script, workers);
+		if(times[i] < 0.0)
+			result.failed = true;
+	}
+
+	if(result.failed)
+	{
+		result.median = result.mean = result.stddev = result.min = result.max = 0.0;
+		return result;
+	}
+
+	qsort(times, runs, sizeof(double), compare_doubles);
+
+	result.min = times[0];
+	result.max = times[runs - 1];
+	result.median = runs % 2 == 1 ? times[runs / 2] : (times[runs / 2 - 1] + times[runs / 2]) / 2.0;
+
+	double sum = 0.0;
+	for(int i = 0; i < runs; i++)
+		sum += times[i];
+	result.mean = sum / runs;
+
+	double squares = 0.0;
+	for(int i = 0; i < runs; i++)
+		squares += (times[i] - result.mean) * (times[i] - result.mean);
+	result.stddev = runs > 1 ? sqrt(squares / (runs - 1)) : 0.0;
+
+	return result;
+}
+
+
+/*
+ * read_baseline()
+ * Read the name and median of each benchmark from a results file
+ * written by write_results(). This only understands that layout, one
+ * benchmark per line.
+ */
+static int read_baseline(const char* path, Baseline* baseline)
+{
+	FILE* file = fopen(path, "r");
+	if(file == NULL) {
+		fprintf(stderr, "Failed to open file [%s]\n", path);
+		return -1;
+	}
+
+	int num = 0;
+	char line[512];
+	while(fgets(line, sizeof(line), file) && num < MAX_BENCHMARKS)
+	{
+		char* name = strstr(line, "\"name\": \"");
+		char* median = strstr(line, "\"median\": ");
+		if(name == NULL || median == NULL)
+			continue;
+
+		if(sscanf(name, "\"name\": \"%63[^\"]\"", baseline[num].name) == 1 &&
+		   sscanf(median, "\"median\": %lf", &baseline[num].median) == 1)
+			num++;
+	}
+
+	fclose(file);
+
+	return num;
+}
+
+
+/*
+ * write_results()
+ */
+static int write_results(const char* path, BenchResult* results, int num)
+{
+	FILE* file = fopen(path, "w");
+	if(file == NULL) {
+		fprintf(stderr, "Failed to open file [%s]\n", path);
+		return -1;
+	}
+
+	fprintf(file, "{\n  \"benchmarks\": [");
+	for(int i = 0; i < num; i++)
+	{
+		BenchResult* r = &results[i];
+		fprintf(file, "%s\n    {\"name\": \"%s\", \"runs\": %d, \"failed\": %s, \"median\": %.6f, "
+				"\"mean\": %.6f, \"stddev\": %.6f, \"min\": %.6f, \"max\": %.6f}",
+				i > 0 ? "," : "", r->name, r->runs, r->failed ? "true" : "false",
+				r->median, r->mean, r->stddev, r->min, r->max);
+	}
+	fprintf(file, "\n  ]\n}\n");
+
+	fclose(file);
+
+	return 0;
+}
+
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: lox_bench: [options] script...\n");
+	fprintf(stderr, "    -c CLOX        interpreter to run (default ./clox)\n");
+	fprintf(stderr, "    -n RUNS        timed runs per script (default %d)\n", DEFAULT_RUNS);
+	fprintf(stderr, "    -o FILE        write the results to FILE as JSON\n");
+	fprintf(stderr, "    -b FILE        compare medians against the results in FILE\n");
+	fprintf(stderr, "    -t PERCENT     slowdown that counts as a regression (default %.0f)\n", DEFAULT_THRESHOLD);
+	fprintf(stderr, "    -W N           run each script with --workers 1 to N and report the\n");
+	fprintf(stderr, "                   speedup over one worker\n");
+}
+
+
+int main(int argc, char *argv[])
+{
+	const char* clox = "./clox";
+	const char* output_path = NULL;
+	const char* baseline_path = NULL;
+	double threshold = DEFAULT_THRESHOLD;
+	int runs = DEFAULT_RUNS;
+	int max_workers = 0;
+	int first_script = argc;
+
+	for(int i = 1; i < argc; i++)
+	{
+		if(strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+			clox = argv[++i];
+		else if(strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+			runs = atoi(argv[++i]);
+		else if(strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+			output_path = argv[++i];
+		else if(strcmp(argv[i], "-b") == 0 && i + 1 < argc)
+			baseline_path = argv[++i];
+		else if(strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+			threshold = atof(argv[++i]);
+		else if(strcmp(argv[i], "-W") == 0 && i + 1 < argc)
+			max_workers = atoi(argv[++i]);
+		else if(argv[i][0] == '-')
+		{
+			usage();
+			return 64;
+		}
+		else
+		{
+			first_script = i;
+			break;
+		}
+	}
+
+	// One row per script, or per script and worker count
+	int scripts = argc - first_script;
+	int rows = max_workers > 0 ? max_workers : 1;
+	int num = scripts * rows;
+	if(scripts == 0 || num > MAX_BENCHMARKS || runs < 1 || runs > MAX_RUNS ||
+			max_workers < 0 || max_workers > MAX_WORKERS)
+	{
+		usage();
+		return 64;
+	}
+
+	Baseline baseline[MAX_BENCHMARKS];
+	int num_baseline = 0;
+	if(baseline_path != NULL)
+	{
+		num_baseline = read_baseline(baseline_path, baseline);
+		if(num_baseline < 0)
+			return 74;
+	}
+
+	BenchResult results[MAX_BENCHMARKS];
+	int status = 0;
+
+	fprintf(stdout, "%-16s %10s %10s %10s %10s", "benchmark", "median s", "stddev s", "min s", "max s");
+	if(max_workers > 0)
+		fprintf(stdout, " %10s", "speedup");
+	if(baseline_path != NULL)
+		fprintf(stdout, " %10s %8s", "baseline s", "change");
+	fprintf(stdout, "\n");
+
+	for(int i = 0; i < num; i++)
+	{
+		BenchResult* r = &results[i];
+		int workers = max_workers > 0 ? i % rows + 1 : 0;
+		*r = run_benchmark(clox, argv[first_script + i / rows], runs, workers);
+
+		if(r->failed)
+		{
+			fprintf(stdout, "%-16s FAILED\n", r->name);
+			status = 1;
+			continue;
+		}
+
+		fprintf(stdout, "%-16s %10.4f %10.4f %10.4f %10.4f", r->name, r->median, r->stddev, r->min, r->max);
+
+		// Against the same script on one worker, the first of its rows
+		BenchResult* one = &results[i - i % rows];
+		if(max_workers > 0 && !one->failed)
+			fprintf(stdout, " %9.2fx", one->median / r->median);
+
+		for(int j = 0; j < num_baseline; j++)
+		{
+			if(strcmp(baseline[j].name, r->name) != 0 || baseline[j].median <= 0.0)
+				continue;
+
+			double change = 100.0 * (r->median - baseline[j].median) / baseline[j].median;
+			fprintf(stdout, " %10.4f %+7.1f%%", baseline[j].median, change);
+			// Slower by more than the threshold and by more than the noise in this run
+			if(change > threshold && r->median - baseline[j].median > 2.0 * r->stddev)
+			{
+				fprintf(stdout, "  REGRESSION");
+				status = 1;
+			}
+			break;
+		}
+		fprintf(stdout, "\n");
+	}
+
+	if(output_path != NULL && write_results(output_path, results, num) != 0)
+		return 74;
+
+	return status;
+}
@@ -0,0 +1,614 @@
+/*
+ * MICRO_BENCH
+ * Time the scanner, compiler, hash table, allocator, channels and the
+ * embedding API on synthetic inputs, away from the interpreter loop. Each benchmark is warmed up
+ * and then repeated, and the median time is reported per operation.
+ */
+
+// clock_gettime(), dup() and dup2() are POSIX rather than C99
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "channel.h"
+#include "compiler.h"
+#include "lox.h"
+#include "memory.h"
+#include "object.h"
+#include "scanner.h"
+#include "table.h"
+#include "vm.h"
+
+
+#define DEFAULT_WARMUP 3
+#define DEFAULT_REPS 15
+#define MAX_REPS 1000
+
+#define SCAN_LINES 20000
+#define COMPILE_FUNCTIONS 50
+#define COMPILE_DEPTH 100		// literals per function, under the 256 constant limit
+#define TABLE_KEYS 1000
+#define ALLOC_BLOCKS 10000
+#define CHANNEL_MESSAGES 100000
+#define CHANNEL_CAPACITY 64
+#define CHANNEL_STRING_SMALL 16
+#define CHANNEL_STRING_LARGE 65536
+#define EMBED_CALLS 100000
+#define EMBED_INTERPRETS 1000
+
+
+typedef struct {
+	const char* name;
+	void (*setup)(void);
+	long (*run)(void);			// returns the number of operations done
+	void (*teardown)(void);
+} MicroBench;
+
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+
+// ======== SCANNER ======== //
+
+static char* scan_source = NULL;
+
+static void setup_scan(void)
+{
+	static const char* line = "var count_1 = (alpha + 12.5) * beta - \"str\" / gamma; if(x <= 3 and !y) { print x; }\n";
+	size_t length = strlen(line);
+
+	scan_source = malloc(length * SCAN_LINES + 1);
+	for(int i = 0; i < SCAN_LINES; i++)
+		memcpy(scan_source + i * length, line, length);
+	scan_source[length * SCAN_LINES] = '\0';
+}
+
+static long run_scan(void)
+{
+	long tokens = 0;
+
+	init_scanner(scan_source);
+	while(scan_token().type != TOKEN_EOF)
+		tokens++;
+
+	return tokens;
+}
+
+static void teardown_scan(void)
+{
+	free(scan_source);
+	scan_source = NULL;
+}
+
+
+// ======== COMPILER ======== //
+
+static char* compiled_source = NULL;
+
+/*
+ * setup_compile()
+ * Functions whose bodies are one deeply nested expression,
+ * e.g. return (1 + (2 * (3 - ...)));
+ */
+static void setup_compile(void)
+{
+	static const char ops[] = "+-*";
+	size_t capacity = COMPILE_FUNCTIONS * (COMPILE_DEPTH * 16 + 64);
+	size_t length = 0;
+
+	compiled_source = malloc(capacity);
+	for(int f = 0; f < COMPILE_FUNCTIONS; f++)
+	{
+		length += sprintf(compiled_source + length, "func f%d(a%d) {\n\treturn ", f, f);
+		for(int d = 0; d < COMPILE_DEPTH; d++)
+			length += sprintf(compiled_source + length, "(%d %c ", d, ops[d % 3]);
+		length += sprintf(compiled_source + length, "a%d", f);
+		for(int d = 0; d < COMPILE_DEPTH; d++)
+			compiled_source[length++] = ')';
+		length += sprintf(compiled_source + length, ";\n}\n");
+	}
+	compiled_source[length] = '\0';
+
+	init_vm();
+}
+
+static long run_compile(void)
+{
+	if(compile(compiled_source) == NULL)
+		fprintf(stderr, "micro_bench: compile failed\n");
+
+	return 1;
+}
+
+static void teardown_compile(void)
+{
+	free_vm();
+	free(compiled_source);
+	compiled_source = NULL;
+}
+
+
+// ======== HASH TABLE ======== //
+
+static ObjString* keys[TABLE_KEYS];
+static Table table;
+
+static void setup_keys(void)
+{
+	init_vm();
+
+	char name[32];
+	for(int i = 0; i < TABLE_KEYS; i++)
+	{
+		int length = sprintf(name, "key_%d", i);
+		keys[i] = copy_string(name, length);
+	}
+
+	init_table(&table);
+}
+
+static void setup_filled_table(void)
+{
+	setup_keys();
+
+	for(int i = 0; i < TABLE_KEYS; i++)
+		table_set(&table, keys[i], NUMBER_VAL(i));
+}
+
+static long run_table_set(void)
+{
+	free_table(&table);
+
+	for(int i = 0; i < TABLE_KEYS; i++)
+		table_set(&table, keys[i], NUMBER_VAL(i));
+
+	return TABLE_KEYS;
+}
+
+static long run_table_get(void)
+{
+	Value value;
+	long found = 0;
+
+	for(int i = 0; i < TABLE_KEYS; i++)
+		found += table_get(&table, keys[i], &value);
+
+	return found;
+}
+
+static long run_table_find_string(void)
+{
+	long found = 0;
+
+	for(int i = 0; i < TABLE_KEYS; i++)
+		found += table_find_string(&table, keys[i]->chars, keys[i]->length, keys[i]->hash) != NULL;
+
+	return found;
+}
+
+static void teardown_table(void)
+{
+	free_table(&table);
+	free_vm();
+}
+
+
+// ======== ALLOCATOR ======== //
+
+static void* blocks[ALLOC_BLOCKS];
+
+/*
+ * run_reallocate()
+ * Allocate blocks of mixed sizes, grow each of them once the way
+ * GROW_ARRAY does, then free them all.
+ */
+static long run_reallocate(void)
+{
+	for(int i = 0; i < ALLOC_BLOCKS; i++)
+		blocks[i] = reallocate(NULL, 0, 16 << (i % 6));
+
+	for(int i = 0; i < ALLOC_BLOCKS; i++)
+		blocks[i] = reallocate(blocks[i], 16 << (i % 6), 32 << (i % 6));
+
+	for(int i = 0; i < ALLOC_BLOCKS; i++)
+		reallocate(blocks[i], 32 << (i % 6), 0);
+
+	return 3 * ALLOC_BLOCKS;
+}
+
+
+// ======== CHANNELS ======== //
+
+static Channel* bench_channel = NULL;
+static ObjString* message_string = NULL;
+
+static void setup_channel(void)
+{
+	bench_channel = make_channel(CHANNEL_CAPACITY);
+}
+
+static void setup_string(int length)
+{
+	init_vm();
+	setup_channel();
+
+	char* chars = malloc(length + 1);
+	memset(chars, 'x', length);
+	chars[length] = '\0';
+	message_string = take_string(chars, length);
+}
+
+static void setup_small_string(void)
+{
+	setup_string(CHANNEL_STRING_SMALL);
+}
+
+static void setup_large_string(void)
+{
+	setup_string(CHANNEL_STRING_LARGE);
+}
+
+/*
+ * run_channel_numbers()
+ * Fill the channel and empty it again, on one thread.
+ */
+static long run_channel_numbers(void)
+{
+	SharedValue message;
+
+	for(int i = 0; i < CHANNEL_MESSAGES; i += CHANNEL_CAPACITY)
+	{
+		for(int j = 0; j < CHANNEL_CAPACITY; j++)
+		{
+			share_value(NUMBER_VAL(i + j), &message);
+			channel_send(bench_channel, &message, NULL);
+		}
+		for(int j = 0; j < CHANNEL_CAPACITY; j++)
+			channel_receive(bench_channel, &message, NULL);
+	}
+
+	return CHANNEL_MESSAGES;
+}
+
+/*
+ * run_channel_strings()
+ * The same with a string, shared by reference rather than copied, and
+ * taken back as an ObjString.
+ */
+static long run_channel_strings(void)
+{
+	SharedValue message;
+
+	for(int i = 0; i < CHANNEL_MESSAGES; i += CHANNEL_CAPACITY)
+	{
+		for(int j = 0; j < CHANNEL_CAPACITY; j++)
+		{
+			share_value(OBJ_VAL(message_string), &message);
+			channel_send(bench_channel, &message, NULL);
+		}
+		for(int j = 0; j < CHANNEL_CAPACITY; j++)
+		{
+			channel_receive(bench_channel, &message, NULL);
+			unshare_value(&message);
+			release_value(&message);
+		}
+	}
+
+	return CHANNEL_MESSAGES;
+}
+
+static void* channel_producer(void* arg)
+{
+	SharedValue message;
+
+	for(int i = 0; i < CHANNEL_MESSAGES; i++)
+	{
+		share_value(NUMBER_VAL(i), &message);
+		channel_send((Channel*) arg, &message, NULL);
+	}
+
+	return NULL;
+}
+
+/*
+ * run_channel_threads()
+ * A second thread sends while this one receives, both block whenever
+ * the channel is full or empty.
+ */
+static long run_channel_threads(void)
+{
+	pthread_t producer;
+	SharedValue message;
+
+	pthread_create(&producer, NULL, channel_producer, bench_channel);
+	for(int i = 0; i < CHANNEL_MESSAGES; i++)
+		channel_receive(bench_channel, &message, NULL);
+	pthread_join(producer, NULL);
+
+	return CHANNEL_MESSAGES;
+}
+
+static void teardown_channel(void)
+{
+	release_channel(bench_channel);
+	bench_channel = NULL;
+}
+
+static void teardown_string(void)
+{
+	teardown_channel();
+	free_vm();
+	message_string = NULL;
+}
+
+
+// ======== EMBEDDING ======== //
+
+static LoxVM* bench_vm = NULL;
+static LoxFunction* bench_function = NULL;
+
+static const char embed_source[] =
+	"func add(a, b) { return a + b; }\n"
+	"func echo(s) { return s; }\n"
+	"func count_to(n) { var i = 0; while(i < n) { i = host(i); } return i; }\n";
+
+static bool host_next(LoxVM* lox, int arg_count, const LoxValue* args, LoxValue* result, void* userdata)
+{
+	(void) lox;
+	(void) arg_count;
+	(void) userdata;
+
+	*result = lox_number(args[0].number + 1);
+	return true;
+}
+
+static void setup_embed(const char* function)
+{
+	bench_vm = lox_new_vm();
+	lox_define_native(bench_vm, "host", host_next, NULL);
+	if(lox_load(bench_vm, embed_source) != LOX_OK)
+		fprintf(stderr, "micro_bench: embed script failed\n");
+	bench_function = lox_function(bench_vm, function);
+}
+
+static void setup_embed_add(void)
+{
+	setup_embed("add");
+}
+
+static void setup_embed_echo(void)
+{
+	setup_embed("echo");
+}
+
+static void setup_embed_count(void)
+{
+	setup_embed("count_to");
+}
+
+/*
+ * run_embed_call()
+ * Push two numbers, call a function that adds them and read the result.
+ */
+static long run_embed_call(void)
+{
+	double sum = 0;
+
+	for(int i = 0; i < EMBED_CALLS; i++)
+	{
+		lox_push(bench_vm, lox_number(i));
+		lox_push(bench_vm, lox_number(1));
+		lox_call(bench_vm, bench_function, 2);
+		sum += lox_result(bench_vm).number;
+	}
+
+	if(sum == 0)
+		fprintf(stderr, "micro_bench: embed call failed\n");
+
+	return EMBED_CALLS;
+}
+
+/*
+ * run_embed_call_string()
+ * The same with a string argument, interned on the way in, and returned.
+ */
+static long run_embed_call_string(void)
+{
+	int length = 0;
+
+	for(int i = 0; i < EMBED_CALLS; i++)
+	{
+		lox_push(bench_vm, lox_string("sixteen bytes!!!", 16));
+		lox_call(bench_vm, bench_function, 1);
+		length += lox_result(bench_vm).length;
+	}
+
+	if(length != EMBED_CALLS * 16)
+		fprintf(stderr, "micro_bench: embed call failed\n");
+
+	return EMBED_CALLS;
+}
+
+/*
+ * run_embed_native()
+ * A Lox loop that calls back into the host on every iteration.
+ */
+static long run_embed_native(void)
+{
+	lox_push(bench_vm, lox_number(EMBED_CALLS));
+	if(lox_call(bench_vm, bench_function, 1) != LOX_OK)
+		fprintf(stderr, "micro_bench: embed native failed\n");
+
+	return EMBED_CALLS;
+}
+
+/*
+ * run_embed_interpret()
+ * What a call costs when the host passes source instead of a handle, so
+ * the call is compiled each time.
+ */
+static long run_embed_interpret(void)
+{
+	for(int i = 0; i < EMBED_INTERPRETS; i++)
+		lox_load(bench_vm, "add(1, 2);");
+
+	return EMBED_INTERPRETS;
+}
+
+static void teardown_embed(void)
+{
+	lox_free_vm(bench_vm);
+	bench_vm = NULL;
+	bench_function = NULL;
+}
+
+
+static void nothing(void)
+{
+}
+
+
+static const MicroBench benchmarks[] = {
+	{"scan_token",        setup_scan,         run_scan,              teardown_scan},
+	{"compile",           setup_compile,      run_compile,           teardown_compile},
+	{"table_set",         setup_keys,         run_table_set,         teardown_table},
+	{"table_get",         setup_filled_table, run_table_get,         teardown_table},
+	{"table_find_string", setup_filled_table, run_table_find_string, teardown_table},
+	{"reallocate",        nothing,            run_reallocate,        nothing},
+	{"channel_numbers",   setup_channel,      run_channel_numbers,   teardown_channel},
+	{"channel_strings",   setup_small_string, run_channel_strings,   teardown_string},
+	{"channel_64k_strings", setup_large_string, run_channel_strings, teardown_string},
+	{"channel_threads",   setup_channel,      run_channel_threads,   teardown_channel},
+	{"embed_call",        setup_embed_add,    run_embed_call,        teardown_embed},
+	{"embed_call_string", setup_embed_echo,   run_embed_call_string, teardown_embed},
+	{"embed_native",      setup_embed_count,  run_embed_native,      teardown_embed},
+	{"embed_interpret",   setup_embed_add,    run_embed_interpret,   teardown_embed},
+};
+
+
+static int compare_times(const void* a, const void* b)
+{
+	double da = *(const double*) a;
+	double db = *(const double*) b;
+
+	return (da > db) - (da < db);
+}
+
+
+/*
+ * time_benchmark()
+ * Returns the median time per operation in nanoseconds. Anything the
+ * library prints while running is thrown away.
+ */
+static double time_benchmark(const MicroBench* bench, int warmup, int reps, long* ops)
+{
+	double ns_per_op[MAX_REPS];
+
+	fflush(stdout);
+	int saved_stdout = dup(STDOUT_FILENO);
+	int null_fd = open("/dev/null", O_WRONLY);
+	if(null_fd >= 0)
+		dup2(null_fd, STDOUT_FILENO);
+
+	bench->setup();
+
+	for(int i = 0; i < warmup; i++)
+		bench->run();
+
+	for(int i = 0; i < reps; i++)
+	{
+		uint64_t start = now_ns();
+		*ops = bench->run();
+		uint64_t elapsed = now_ns() - start;
+
+		ns_per_op[i] = (double) elapsed / (double) (*ops > 0 ? *ops : 1);
+	}
+
+	bench->teardown();
+
+	fflush(stdout);
+	if(null_fd >= 0)
+	{
+		dup2(saved_stdout, STDOUT_FILENO);
+		close(null_fd);
+	}
+	close(saved_stdout);
+
+	qsort(ns_per_op, reps, sizeof(double), compare_times);
+
+	return ns_per_op[reps / 2];
+}
+
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: micro_bench: [-w WARMUP] [-r REPS] [name...]\n");
+	fprintf(stderr, "    -w WARMUP      untimed runs first (default %d)\n", DEFAULT_WARMUP);
+	fprintf(stderr, "    -r REPS        timed runs, the median is reported (default %d)\n", DEFAULT_REPS);
+	fprintf(stderr, "    name           only run these benchmarks\n");
+}
+
+
+int main(int argc, char *argv[])
+{
+	int warmup = DEFAULT_WARMUP;
+	int reps = DEFAULT_REPS;
+	int first_name = argc;
+
+	for(int i = 1; i < argc; i++)
+	{
+		if(strcmp(argv[i], "-w") == 0 && i + 1 < argc)
+			warmup = atoi(argv[++i]);
+		else if(strcmp(argv[i], "-r") == 0 && i + 1 < argc)
+			reps = atoi(argv[++i]);
+		else if(argv[i][0] == '-')
+		{
+			usage();
+			return 64;
+		}
+		else
+		{
+			first_name = i;
+			break;
+		}
+	}
+
+	if(warmup < 0 || reps < 1 || reps > MAX_REPS)
+	{
+		usage();
+		return 64;
+	}
+
+	fprintf(stdout, "%-20s %12s %14s %12s\n", "benchmark", "ns/op", "ops/sec", "ops/run");
+
+	int num = sizeof(benchmarks) / sizeof(benchmarks[0]);
+	for(int b = 0; b < num; b++)
+	{
+		bool selected = first_name == argc;
+		for(int i = first_name; i < argc; i++)
+		{
+			if(strcmp(argv[i], benchmarks[b].name) == 0)
+				selected = true;
+		}
+		if(!selected)
+			continue;
+
+		long ops = 0;
+		double ns = time_benchmark(&benchmarks[b], warmup, reps, &ops);
+		fprintf(stdout, "%-20s %12.1f %14.0f %12ld\n", benchmarks[b].name, ns, 1e9 / ns, ops);
+	}
+
+	return 0;
+}
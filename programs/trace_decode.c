@@ -0,0 +1,181 @@
+/*
+ * TRACE_DECODE
+ * Print the instructions in an execution record written by
+ * clox --record. The script is compiled again the same way so each
+ * event can be disassembled from the chunk it came from.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "compiler.h"
+#include "debug.h"
+#include "memory.h"
+#include "recorder.h"
+#include "vm.h"
+
+
+#define DEFAULT_LAST 64
+
+
+static const char* tag_names[] = {
+	[TAG_EMPTY]    = "",
+	[TAG_NIL]      = "nil",
+	[TAG_BOOL]     = "bool",
+	[TAG_NUMBER]   = "number",
+	[TAG_STRING]   = "string",
+	[TAG_FUNCTION] = "function",
+	[TAG_NATIVE]   = "native",
+	[TAG_FIBER]    = "fiber",
+	[TAG_TASK]     = "task",
+	[TAG_CHANNEL]  = "channel",
+};
+
+
+static char* read_file(const char* path)
+{
+	FILE* file = fopen(path, "rb");
+	if(file == NULL) {
+		fprintf(stderr, "Failed to open file [%s]\n", path);
+		return NULL;
+	}
+
+	fseek(file, 0L, SEEK_END);
+	size_t file_size = ftell(file);
+	fseek(file, 0L, SEEK_SET);
+
+	char* buffer = malloc(file_size + 1);
+	size_t bytes_read = buffer != NULL ? fread(buffer, sizeof(char), file_size, file) : 0;
+	fclose(file);
+
+	if(buffer == NULL || bytes_read < file_size) {
+		fprintf(stderr, "Failed to read file [%s]\n", path);
+		free(buffer);
+		return NULL;
+	}
+	buffer[bytes_read] = '\0';
+
+	return buffer;
+}
+
+
+/*
+ * function_table()
+ * Every function in the recompiled script, indexed by ObjFunction.id.
+ */
+static ObjFunction** function_table(void)
+{
+	ObjFunction** functions = ALLOCATE(ObjFunction*, vm.function_count);
+
+	for(int i = 0; i < vm.function_count; i++)
+		functions[i] = NULL;
+
+	for(Obj* object = vm.objects; object != NULL; object = object->next)
+	{
+		if(object->type == OBJ_FUNCTION)
+			functions[((ObjFunction*) object)->id] = (ObjFunction*) object;
+	}
+
+	return functions;
+}
+
+
+/*
+ * print_event()
+ */
+static void print_event(uint64_t index, TraceEvent* event, ObjFunction** functions)
+{
+	ObjFunction* function = event->function < vm.function_count ? functions[event->function] : NULL;
+
+	fprintf(stdout, "%10lu %-16s %-8s ", (unsigned long) index,
+			function != NULL ? callable_name((Obj*) function) : "?",
+			event->tag < sizeof(tag_names) / sizeof(tag_names[0]) ? tag_names[event->tag] : "?");
+
+	if(function == NULL || event->offset >= (uint32_t) function->chunk.count)
+	{
+		fprintf(stdout, "%06X %s (not in the recompiled script)\n", event->offset, opcode_name(event->opcode));
+		return;
+	}
+
+	if(function->chunk.code[event->offset] != event->opcode)
+		fprintf(stdout, "(recorded %s) ", opcode_name(event->opcode));
+
+	disassemble_instr(&function->chunk, (int) event->offset);
+}
+
+
+int main(int argc, char *argv[])
+{
+	if(argc < 2 || argc > 4) {
+		fprintf(stderr, "Usage: trace_decode: record [last-n] [script]\n");
+		return 64;
+	}
+
+	FILE* file = fopen(argv[1], "rb");
+	if(file == NULL) {
+		fprintf(stderr, "Failed to open file [%s]\n", argv[1]);
+		return 74;
+	}
+
+	TraceHeader header;
+	if(fread(&header, sizeof(TraceHeader), 1, file) != 1 ||
+	   memcmp(header.magic, RECORDER_MAGIC, sizeof(header.magic)) != 0 ||
+	   header.version != RECORDER_VERSION ||
+	   header.capacity == 0 || (header.capacity & (header.capacity - 1)) != 0)
+	{
+		fprintf(stderr, "[%s] is not an execution record\n", argv[1]);
+		fclose(file);
+		return 65;
+	}
+
+	TraceEvent* events = malloc(sizeof(TraceEvent) * header.capacity);
+	if(events == NULL || fread(events, sizeof(TraceEvent), header.capacity, file) != header.capacity)
+	{
+		fprintf(stderr, "[%s] is truncated\n", argv[1]);
+		free(events);
+		fclose(file);
+		return 65;
+	}
+	fclose(file);
+
+	uint64_t last = argc >= 3 ? strtoull(argv[2], NULL, 10) : DEFAULT_LAST;
+	header.source_path[RECORDER_PATH_MAX - 1] = '\0';
+	const char* script = argc == 4 ? argv[3] : header.source_path;
+
+	char* source = read_file(script);
+	if(source == NULL)
+	{
+		free(events);
+		return 74;
+	}
+
+	init_vm();
+	vm.superinstructions = header.superinstructions;
+	if(compile(source) == NULL)
+	{
+		fprintf(stderr, "[%s] no longer compiles\n", script);
+		free(source);
+		free(events);
+		free_vm();
+		return 65;
+	}
+	ObjFunction** functions = function_table();
+
+	uint64_t first = header.head > header.capacity ? header.head - header.capacity : 0;
+	if(header.head - first > last)
+		first = header.head - last;
+
+	fprintf(stdout, "%s: %lu instructions recorded, showing the last %lu\n", script,
+			(unsigned long) header.head, (unsigned long) (header.head - first));
+	fprintf(stdout, "%10s %-16s %-8s Offset  line  instr\n", "event", "function", "top");
+	for(uint64_t i = first; i < header.head; i++)
+		print_event(i, &events[i & (header.capacity - 1)], functions);
+
+	FREE_ARRAY(ObjFunction*, functions, vm.function_count);
+	free(source);
+	free(events);
+	free_vm();
+
+	return 0;
+}
@@ -0,0 +1,251 @@
+#include <stdlib.h>
+
+#include "channel.h"
+
+
+/*
+ * make_channel()
+ * A channel that buffers up to capacity messages, with one reference.
+ */
+Channel* make_channel(int capacity)
+{
+	Channel* channel = malloc(sizeof(Channel));
+
+	pthread_mutex_init(&channel->lock, NULL);
+	pthread_cond_init(&channel->changed, NULL);
+	channel->blocked = 0;
+	channel->buffer = malloc(sizeof(SharedValue) * capacity);
+	channel->head = 0;
+	channel->count = 0;
+	channel->capacity = capacity;
+	channel->closed = false;
+	channel->refs = 1;
+	channel->senders = NULL;
+	channel->last_sender = NULL;
+	channel->receivers = NULL;
+	channel->last_receiver = NULL;
+
+	return channel;
+}
+
+
+void retain_channel(Channel* channel)
+{
+	__atomic_add_fetch(&channel->refs, 1, __ATOMIC_RELAXED);
+}
+
+
+/*
+ * release_channel()
+ * Drop a reference, the last one frees the channel and the messages
+ * still in it. Tasks parked on it hold a handle on their stack, so by
+ * then none are.
+ */
+void release_channel(Channel* channel)
+{
+	if(__atomic_sub_fetch(&channel->refs, 1, __ATOMIC_ACQ_REL) > 0)
+		return;
+
+	for(int i = 0; i < channel->count; i++)
+		release_value(&channel->buffer[(channel->head + i) % channel->capacity]);
+
+	free(channel->buffer);
+	pthread_cond_destroy(&channel->changed);
+	pthread_mutex_destroy(&channel->lock);
+	free(channel);
+}
+
+
+// ======== QUEUES ======== //
+
+static void park(Task** first, Task** last, Task* task)
+{
+	task->next = NULL;
+	if(*last != NULL)
+		(*last)->next = task;
+	else
+		*first = task;
+	*last = task;
+}
+
+
+static Task* unpark(Task** first, Task** last)
+{
+	Task* task = *first;
+	*first = task->next;
+	if(*first == NULL)
+		*last = NULL;
+	task->next = NULL;
+
+	return task;
+}
+
+
+static void enqueue(Channel* channel, SharedValue* message)
+{
+	channel->buffer[(channel->head + channel->count) % channel->capacity] = *message;
+	channel->count++;
+}
+
+
+static void dequeue(Channel* channel, SharedValue* message)
+{
+	*message = channel->buffer[channel->head];
+	channel->head = (channel->head + 1) % channel->capacity;
+	channel->count--;
+}
+
+
+/*
+ * wait_changed()
+ * Block the thread until another one sends, receives or closes.
+ */
+static void wait_changed(Channel* channel)
+{
+	channel->blocked++;
+	pthread_cond_wait(&channel->changed, &channel->lock);
+	channel->blocked--;
+}
+
+
+static void signal_changed(Channel* channel)
+{
+	if(channel->blocked > 0)
+		pthread_cond_broadcast(&channel->changed);
+}
+
+
+// ======== OPERATIONS ======== //
+
+/*
+ * channel_send()
+ * Hand message to the oldest parked receiver, or buffer it. When the
+ * buffer is full parker, the running task, is parked with the message,
+ * or without one the thread blocks until there is room. The channel
+ * owns the message unless it has been closed.
+ */
+ChannelStatus channel_send(Channel* channel, SharedValue* message, Task* parker)
+{
+	ChannelStatus status = CHANNEL_OK;
+	pthread_mutex_lock(&channel->lock);
+
+	for(;;)
+	{
+		if(channel->closed)
+		{
+			status = CHANNEL_CLOSED;
+			break;
+		}
+
+		if(channel->receivers != NULL)
+		{
+			Task* receiver = unpark(&channel->receivers, &channel->last_receiver);
+			receiver->message = *message;
+			wake_task(receiver);
+			break;
+		}
+
+		if(channel->count < channel->capacity)
+		{
+			enqueue(channel, message);
+			signal_changed(channel);
+			break;
+		}
+
+		if(parker != NULL)
+		{
+			parker->message = *message;
+			park(&channel->senders, &channel->last_sender, parker);
+			status = CHANNEL_PARKED;
+			break;
+		}
+
+		wait_changed(channel);
+	}
+
+	pthread_mutex_unlock(&channel->lock);
+	return status;
+}
+
+
+/*
+ * channel_receive()
+ * Take the oldest message, and move the oldest parked sender's message
+ * into the room that left. When there is none parker is parked, or
+ * without one the thread blocks until there is. A closed channel gives
+ * the messages it still has and then nil.
+ */
+ChannelStatus channel_receive(Channel* channel, SharedValue* message, Task* parker)
+{
+	ChannelStatus status = CHANNEL_OK;
+	pthread_mutex_lock(&channel->lock);
+
+	for(;;)
+	{
+		if(channel->count > 0)
+		{
+			dequeue(channel, message);
+			if(channel->senders != NULL)
+			{
+				Task* sender = unpark(&channel->senders, &channel->last_sender);
+				enqueue(channel, &sender->message);
+				sender->message = SHARED_NIL;
+				wake_task(sender);
+			}
+			signal_changed(channel);
+			break;
+		}
+
+		if(channel->closed)
+		{
+			*message = SHARED_NIL;
+			status = CHANNEL_CLOSED;
+			break;
+		}
+
+		if(parker != NULL)
+		{
+			parker->message = SHARED_NIL;
+			park(&channel->receivers, &channel->last_receiver, parker);
+			status = CHANNEL_PARKED;
+			break;
+		}
+
+		wait_changed(channel);
+	}
+
+	pthread_mutex_unlock(&channel->lock);
+	return status;
+}
+
+
+/*
+ * channel_close()
+ * Stop further sends. Parked receivers are woken with nil and parked
+ * senders with an error, their messages are dropped. False if it was
+ * already closed.
+ */
+bool channel_close(Channel* channel)
+{
+	pthread_mutex_lock(&channel->lock);
+
+	bool was_closed = channel->closed;
+	channel->closed = true;
+
+	while(channel->receivers != NULL)
+		wake_task(unpark(&channel->receivers, &channel->last_receiver));
+
+	while(channel->senders != NULL)
+	{
+		Task* sender = unpark(&channel->senders, &channel->last_sender);
+		release_value(&sender->message);
+		sender->message = SHARED_NIL;
+		sender->error = "Channel is closed.";
+		wake_task(sender);
+	}
+
+	signal_changed(channel);
+	pthread_mutex_unlock(&channel->lock);
+
+	return !was_closed;
+}
@@ -0,0 +1,65 @@
+/*
+ * CHANNEL
+ * A bounded queue of messages that any number of VMs, the script's and
+ * the workers', send to and receive from. A message is a SharedValue:
+ * numbers, booleans and nil by value, strings and channels by reference,
+ * so a string's characters are not copied on the way through.
+ *
+ * A task that has to wait is parked on the channel with its message and
+ * the worker carries on with other tasks. The one that unblocks it hands
+ * it the message directly, or moves its message into the buffer, and
+ * wakes it. A thread that can't park, the script's, waits on the
+ * channel's condition variable instead.
+ */
+
+#ifndef __LOX_CHANNEL_H
+#define __LOX_CHANNEL_H
+
+#include <pthread.h>
+
+#include "common.h"
+#include "scheduler.h"
+
+
+#define CHANNEL_CAPACITY_MAX (1 << 20)		// messages one channel can buffer
+
+
+typedef enum {
+	CHANNEL_OK,
+	CHANNEL_PARKED,			// the task will be woken with the result
+	CHANNEL_CLOSED,
+} ChannelStatus;
+
+
+/*
+ * Channel
+ * Held by every handle to it and every message that carries it. Parked
+ * tasks are kept oldest first and linked by Task.next.
+ */
+typedef struct Channel {
+	pthread_mutex_t lock;
+	pthread_cond_t changed;		// threads blocked in send or receive wait here
+	int blocked;				// threads waiting on changed
+	SharedValue* buffer;		// ring buffer
+	int head;
+	int count;
+	int capacity;
+	bool closed;
+	int refs;
+	Task* senders;				// parked with their message in Task.message
+	Task* last_sender;
+	Task* receivers;
+	Task* last_receiver;
+} Channel;
+
+
+Channel* make_channel(int capacity);
+void retain_channel(Channel* channel);
+void release_channel(Channel* channel);
+
+ChannelStatus channel_send(Channel* channel, SharedValue* message, Task* parker);
+ChannelStatus channel_receive(Channel* channel, SharedValue* message, Task* parker);
+bool channel_close(Channel* channel);
+
+
+#endif /*__LOX_CHANNEL_H*/
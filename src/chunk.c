@@ -2,6 +2,21 @@
 #include "memory.h"
 
 
+#define SUPER2_ENTRY(a, b) {2, {OP_##a, OP_##b, 0}},
+#define SUPER3_ENTRY(a, b, c) {3, {OP_##a, OP_##b, OP_##c}},
+
+const SuperInstr super_instrs[] = {
+	SUPERINSTRUCTIONS_2(SUPER2_ENTRY)
+	SUPERINSTRUCTIONS_3(SUPER3_ENTRY)
+	{0, {0, 0, 0}}		// keeps the array non-empty
+};
+
+const int super_instr_count = (int) (sizeof(super_instrs) / sizeof(super_instrs[0])) - 1;
+
+#undef SUPER2_ENTRY
+#undef SUPER3_ENTRY
+
+
 
 /*
  * init_chunk()
@@ -21,8 +36,8 @@ void init_chunk(Chunk* chunk)
  */
 void free_chunk(Chunk* chunk)
 {
-	FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-	FREE_ARRAY(int, chunk->lines, chunk->capacity);
+	FREE_ARRAY_AS(MEM_CHUNK, uint8_t, chunk->code, chunk->capacity);
+	FREE_ARRAY_AS(MEM_CHUNK, int, chunk->lines, chunk->capacity);
 	free_value_array(&chunk->constants);
 	init_chunk(chunk);
 }
@@ -37,8 +52,8 @@ void write_chunk(Chunk* chunk, uint8_t data, int line)
 	{
 		int prev_capacity = chunk->capacity;
 		chunk->capacity = GROW_CAPACITY(prev_capacity);
-		chunk->code = GROW_ARRAY(uint8_t, chunk->code, prev_capacity, chunk->capacity);
-		chunk->lines = GROW_ARRAY(int, chunk->lines, prev_capacity, chunk->capacity);
+		chunk->code = GROW_ARRAY_AS(MEM_CHUNK, uint8_t, chunk->code, prev_capacity, chunk->capacity);
+		chunk->lines = GROW_ARRAY_AS(MEM_CHUNK, int, chunk->lines, prev_capacity, chunk->capacity);
 	}
 
 	chunk->code[chunk->count] = data;
@@ -53,3 +68,62 @@ int add_constant(Chunk* chunk, Value value)
 	write_value_array(&chunk->constants, value);
 	return chunk->constants.count - 1;	// return index of value
 }
+
+
+
+/*
+ * instr_length()
+ * Size in bytes of the instruction at offset. A superinstruction is as 
+ * long as the first instruction it replaces.
+ */
+int instr_length(Chunk* chunk, int offset)
+{
+	uint8_t instr = chunk->code[offset];
+	if(instr >= OP_BASE_COUNT)
+		instr = super_instrs[instr - OP_BASE_COUNT].ops[0];
+
+	switch(instr)
+	{
+		case OP_CONSTANT:
+		case OP_DEFINE_GLOBAL:
+		case OP_GET_GLOBAL:
+		case OP_SET_GLOBAL:
+		case OP_GET_LOCAL:
+		case OP_SET_LOCAL:
+		case OP_CALL:
+			return 2;
+		case OP_JUMP:
+		case OP_JUMP_IF_FALSE:
+			return 3;
+		case OP_LOOP:
+			return 4;
+		default:
+			return 1;
+	}
+}
+
+
+/*
+ * is_branch_op()
+ * True for instructions after which execution doesn't simply continue 
+ * with the next instruction in the same frame.
+ */
+bool is_branch_op(uint8_t instr)
+{
+	switch(instr)
+	{
+		case OP_JUMP:
+		case OP_JUMP_IF_FALSE:
+		case OP_LOOP:
+		case OP_CALL:
+		case OP_RETURN:
+			return true;
+#define INTRINSIC_CASE(op, name, fn) case OP_##op:
+		MATH_INTRINSICS_1(INTRINSIC_CASE)
+		MATH_INTRINSICS_2(INTRINSIC_CASE)
+#undef INTRINSIC_CASE
+			return true;		// calls whatever the global is when it isn't the native
+		default:
+			return false;
+	}
+}
@@ -2,6 +2,8 @@
 #define __LOX_CHUNK_H
 
 #include "common.h"
+#include "intrinsics.h"
+#include "superinstructions.h"
 #include "value.h"
 
 
@@ -33,9 +35,45 @@ typedef enum {
 	OP_JUMP_IF_FALSE,
 	OP_LOOP,
 	OP_CALL,
+
+	// Calls to the math natives, see intrinsics.h
+#define INTRINSIC_OPCODE(op, name, fn) OP_##op,
+	MATH_INTRINSICS_1(INTRINSIC_OPCODE)
+	MATH_INTRINSICS_2(INTRINSIC_OPCODE)
+#undef INTRINSIC_OPCODE
+
 	OP_RETURN,
+
+	// Superinstructions. These are generated from an opcode profile, 
+	// see superinstructions.h
+#define SUPER2_OPCODE(a, b) OP_##a##__##b,
+#define SUPER3_OPCODE(a, b, c) OP_##a##__##b##__##c,
+	SUPERINSTRUCTIONS_2(SUPER2_OPCODE)
+	SUPERINSTRUCTIONS_3(SUPER3_OPCODE)
+#undef SUPER2_OPCODE
+#undef SUPER3_OPCODE
 } OpCode;
 
+#define OP_BASE_COUNT (OP_RETURN + 1)
+
+
+/*
+ * SuperInstr
+ * The sequence of base opcodes that a superinstruction replaces.
+ * A fused instruction only rewrites the first opcode byte of the 
+ * sequence, all the operand bytes and the later opcodes stay in 
+ * place so jump offsets don't change.
+ */
+#define SUPER_MAX_OPS 3
+
+typedef struct {
+	int count;
+	uint8_t ops[SUPER_MAX_OPS];
+} SuperInstr;
+
+extern const SuperInstr super_instrs[];
+extern const int super_instr_count;
+
 
 typedef struct {
 	int count;
@@ -52,6 +90,8 @@ void init_chunk(Chunk* chunk);
 void free_chunk(Chunk* chunk);
 void write_chunk(Chunk* chunk, uint8_t data, int line);
 int add_constant(Chunk* chunk, Value value);
+int instr_length(Chunk* chunk, int offset);
+bool is_branch_op(uint8_t instr);
 
 // TODO: implement a get_line() that does RLE on the line number
 
@@ -8,10 +8,21 @@
 #include <stdint.h>
 
 
-#define DEBUG_TRACE_EXECUTION
-#define DEBUG_PRINT_CODE
+// Tracing and bytecode dumps are switched on at runtime, see clox --help
+//#define DEBUG_COUNT_TRAFFIC
 
 #define UINT8_COUNT (UINT8_MAX + 1)
 
+// Each thread that runs Lox has its own VM, compiler and scanner, see
+// scheduler.h. C99 has no _Thread_local so this is the GNU spelling.
+// The default TLS model works wherever liblox.a is linked, including a
+// shared object that is dlopen()ed. The linker relaxes it to local-exec
+// in an executable, see TLS_MODEL in the Makefile for the others.
+#ifdef LOX_TLS_MODEL
+#define THREAD_LOCAL __thread __attribute__((tls_model(LOX_TLS_MODEL)))
+#else
+#define THREAD_LOCAL __thread
+#endif /*LOX_TLS_MODEL*/
+
 
 #endif /*__COMMON_H*/
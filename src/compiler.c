@@ -3,12 +3,14 @@
 #include <string.h>
 
 #include "compiler.h"
+#include "lower.h"
+#include "memory.h"
+#include "peephole.h"
 #include "scanner.h"
+#include "vm.h"
 
 
-#ifdef DEBUG_PRINT_CODE
 #include "debug.h"
-#endif /*DEBUG_PRINT_CODE*/
 
 
 /*
@@ -81,11 +83,12 @@ typedef struct {
 	Local locals[UINT8_COUNT];
 	int local_count;
 	int scope_depth;
+	uint64_t timeline_start;	// when compiling this function started, for --timeline
 } Compiler;
 
-Parser parser;
-Chunk* compiling_chunk;
-Compiler* current_compiler = NULL;
+THREAD_LOCAL Parser parser;
+THREAD_LOCAL Chunk* compiling_chunk;
+THREAD_LOCAL Compiler* current_compiler = NULL;
 
 
 // Forward declare some functions
@@ -247,16 +250,60 @@ static int emit_jump(uint8_t instr)
 	return current_chunk()->count - 2;
 }
 
+/*
+ * emit_loop()
+ * OP_LOOP jumps back to loop_start, and its last operand is the number
+ * of instructions in the loop, which is what an iteration is charged
+ * against the instruction limit.
+ */
 static void emit_loop(int loop_start)
 {
+	int cost = 1;
+	for(int offset = loop_start; offset < current_chunk()->count; offset += instr_length(current_chunk(), offset))
+		cost++;
+
 	emit_byte(OP_LOOP);
 
-	int offset = current_chunk()->count - loop_start + 2;
+	int offset = current_chunk()->count - loop_start + 3;
 	if(offset > UINT16_MAX)
 		error("Loop body too large");
 	
 	emit_byte((offset >> 8) & 0xFF);
 	emit_byte(offset & 0xFF);
+	emit_byte(cost < UINT8_MAX ? cost : UINT8_MAX);
+}
+
+/*
+ * straight_line_cost()
+ * The number of instructions in chunk that aren't in a loop, which a
+ * call of its function is charged against the instruction limit. The
+ * loops are charged by their OP_LOOPs, see emit_loop(). Both branches
+ * of an if are counted, so it is what a call can run at most.
+ */
+static int straight_line_cost(Chunk* chunk)
+{
+	bool* in_loop = calloc(chunk->count > 0 ? chunk->count : 1, sizeof(bool));
+
+	for(int offset = 0; offset < chunk->count; offset += instr_length(chunk, offset))
+	{
+		if(chunk->code[offset] != OP_LOOP)
+			continue;
+
+		int start = offset + 4 - ((chunk->code[offset+1] << 8) | chunk->code[offset+2]);
+		for(int i = start; i <= offset; i++)
+			in_loop[i] = true;
+	}
+
+	int cost = 0;
+	for(int offset = 0; offset < chunk->count; offset += instr_length(chunk, offset))
+	{
+		if(!in_loop[offset])
+			cost++;
+	}
+
+	free(in_loop);
+
+	return cost;
 }
 
 static void emit_return(void)
@@ -271,6 +318,23 @@ static void emit_constant(Value value)
 }
 
 
+/*
+ * compiler_position()
+ * The function being compiled and the line the parser is on. False when
+ * nothing is being compiled.
+ */
+bool compiler_position(ObjFunction** function, int* line)
+{
+	if(current_compiler == NULL)
+		return false;
+
+	*function = current_compiler->function;
+	*line = parser.previous.line;
+
+	return true;
+}
+
+
 /*
  * init_compiler()
  */
@@ -281,6 +345,7 @@ static void init_compiler(Compiler* compiler, FunctionType type)
 	compiler->ftype = type;
 	compiler->local_count = 0;
 	compiler->scope_depth = 0;
+	compiler->timeline_start = vm.timeline.enabled ? timeline_now() : 0;
 	compiler->function = new_function(); // compile this function
 	current_compiler = compiler;
 
@@ -307,14 +372,48 @@ static ObjFunction* end_compiler(void)
 {
 	emit_return();
 	ObjFunction* function = current_compiler->function;
-	// TODO: put this behind verbose switch?
-#ifdef DEBUG_PRINT_CODE
-	if(!parser.had_error)
+
+	// Counted on the unfused opcodes, as the loops are
+	function->call_cost = straight_line_cost(current_chunk());
+
+	// The register backend is lowered from the same stack bytecode
+	if(vm.backend == BACKEND_REGISTER && !parser.had_error)
+	{
+		if(!lower_function(function))
+			error("Too many registers in function.");
+	}
+
+#ifndef DEBUG_PROFILE_NGRAMS
+	// Profiling builds need to see the unfused opcodes
+	if(vm.backend == BACKEND_STACK && vm.superinstructions && !parser.had_error)
+		fuse_superinstructions(current_chunk());
+#endif /*DEBUG_PROFILE_NGRAMS*/
+
+	// Counted last so there is a counter for every offset of the final chunk
+	if(vm.hotness && vm.backend == BACKEND_STACK && !parser.had_error)
+	{
+		function->hits = ALLOCATE_AS(MEM_FUNCTION, uint64_t, current_chunk()->count);
+		for(int i = 0; i < current_chunk()->count; i++)
+			function->hits[i] = 0;
+	}
+
+	if(vm.dump_bytecode && !parser.had_error)
 	{
 		disassemble_chunk(current_chunk(), function->name != NULL ? function->name->chars : "<script>");
 		fprintf(stdout, "[%s] compiled chunk of length %d\n", __func__, current_chunk()->count);
+
+		if(vm.backend == BACKEND_REGISTER)
+		{
+			disassemble_reg_chunk(
+					&function->reg_chunk,
+					&current_chunk()->constants,
+					function->name != NULL ? function->name->chars : "<script>"
+			);
+		}
 	}
-#endif /*DEBUG_PRINT_CODE*/
+
+	if(vm.timeline.enabled)
+		timeline_compiled(&vm.timeline, function, current_compiler->timeline_start);
 
 	// Walk back up the linked list each time we are done
 	// with a compiler.
@@ -502,7 +601,8 @@ static void add_local(Token name)
 		return;
 	}
 
-	fprintf(stdout, "[%s] adding local var '%.*s'.\n", __func__, name.length, name.start);
+	if(parser.verbose)
+		fprintf(stdout, "[%s] adding local var '%.*s'.\n", __func__, name.length, name.start);
 
 	Local* local = &current_compiler->locals[current_compiler->local_count];
 	local->name = name;
@@ -560,7 +660,7 @@ static void declare_variable(void)
 	// We check that variables are not re-defined here by
 	// checking all the variables in the current scope.
 	
-	for(int i = current_compiler->local_count; i > 0; --i)
+	for(int i = current_compiler->local_count - 1; i >= 0; --i)
 	{
 		Local* local = &current_compiler->locals[i];
 		if(local->depth != -1 && local->depth < current_compiler->scope_depth)
@@ -642,7 +742,8 @@ static uint8_t argument_list(void)
 
 	consume(TOKEN_RIGHT_PAREN, "Expect ')' after argument list.");
 
-	fprintf(stdout, "[%s] found %d arguments for call instr\n", __func__, arg_count);
+	if(parser.verbose)
+		fprintf(stdout, "[%s] found %d arguments for call instr\n", __func__, arg_count);
 
 	return arg_count;
 }
@@ -872,7 +973,8 @@ static void var_decl(void)
  */
 static void if_statement(void)
 {
-	fprintf(stdout, "[%s] compiling if statement\n", __func__);
+	if(parser.verbose)
+		fprintf(stdout, "[%s] compiling if statement\n", __func__);
 
 	consume(TOKEN_LEFT_PAREN, "Expect '(' after if.");
 	expression();
@@ -1029,12 +1131,59 @@ static void string(bool can_assign)
 /*
  * named_variable()
  */
+static const struct {
+	uint8_t op;
+	uint8_t arity;
+} intrinsics[INTRINSIC_COUNT] = {
+#define INTRINSIC_1(op, name, fn) {OP_##op, 1},
+#define INTRINSIC_2(op, name, fn) {OP_##op, 2},
+	MATH_INTRINSICS_1(INTRINSIC_1)
+	MATH_INTRINSICS_2(INTRINSIC_2)
+#undef INTRINSIC_1
+#undef INTRINSIC_2
+};
+
+
+/*
+ * intrinsic_call()
+ * The call to a global that was just read at get_offset. If the global
+ * is one of the math natives and gets as many arguments as it takes, the
+ * read is dropped and the call becomes the native's opcode, which checks
+ * at run time that the global still holds it, see intrinsics.h. Anything
+ * else is compiled as an ordinary call.
+ */
+static void intrinsic_call(int get_offset)
+{
+	Chunk* chunk = current_chunk();
+	ObjString* name = AS_STRING(chunk->constants.values[chunk->code[get_offset+1]]);
+	if(name->intrinsic == 0)
+		return;
+
+	advance();
+	uint8_t arg_count = argument_list();
+	if(arg_count != intrinsics[name->intrinsic - 1].arity)
+	{
+		emit_bytes(OP_CALL, arg_count);
+		return;
+	}
+
+	// Jumps in the arguments are relative, so they survive the move
+	int end = get_offset + 2;
+	memmove(&chunk->code[get_offset], &chunk->code[end], chunk->count - end);
+	memmove(&chunk->lines[get_offset], &chunk->lines[end], (chunk->count - end) * sizeof(int));
+	chunk->count -= 2;
+
+	emit_byte(intrinsics[name->intrinsic - 1].op);
+}
+
+
 static void named_variable(Token name, bool can_assign)
 {
 	uint8_t get_op, set_op;
 	int arg = resolve_local(current_compiler, &name);
 
-	fprintf(stdout, "[%s] arg: %d\n", __func__, arg);
+	if(parser.verbose)
+		fprintf(stdout, "[%s] arg: %d\n", __func__, arg);
 
 	if(arg != -1)
 	{
@@ -1046,6 +1195,9 @@ static void named_variable(Token name, bool can_assign)
 		arg = identifier_constant(&name);
 		get_op = OP_GET_GLOBAL;
 		set_op = OP_SET_GLOBAL;
+
+		if(current_compiler->ftype != TYPE_SCRIPT && !check(TOKEN_EQUAL))
+			note_read_global(AS_STRING(current_chunk()->constants.values[arg]));
 	}
 
 	if(can_assign && match(TOKEN_EQUAL))
@@ -1054,7 +1206,13 @@ static void named_variable(Token name, bool can_assign)
 		emit_bytes(set_op, (uint8_t) arg);
 	}
 	else
+	{
+		int get_offset = current_chunk()->count;
 		emit_bytes(get_op, (uint8_t) arg);
+
+		if(get_op == OP_GET_GLOBAL && check(TOKEN_LEFT_PAREN))
+			intrinsic_call(get_offset);
+	}
 }
 
 
@@ -1141,12 +1299,13 @@ static ParseRule* get_rule(TokenType type)
 ObjFunction* compile(const char* source)
 {
 	init_scanner(source);
+	scanner_trace(vm.trace_tokens);
 	Compiler compiler;
 	init_compiler(&compiler, TYPE_SCRIPT);
 
 	parser.had_error = false;
 	parser.panic_mode = false;
-	parser.verbose = true;	// TODO: make this settable from shell
+	parser.verbose = vm.trace_parse;
 
 	advance();
 
@@ -11,6 +11,7 @@
 
 
 ObjFunction* compile(const char* source);
+bool compiler_position(ObjFunction** function, int* line);
 
 
 #endif /*__LOX_COMPILER_H*/
@@ -3,6 +3,10 @@
 #include "debug.h"
 
 
+static int disassemble_op(Chunk* chunk, uint8_t instr, int offset);
+static int super_instr(Chunk* chunk, uint8_t instr, int offset);
+
+
 // ======== INSTRUCTION UTIL FUNCTIONS ======== //
 
 /*
@@ -53,6 +57,20 @@ static int jump_instr(const char* name, int sign, Chunk* chunk, int offset)
 }
 
 
+/*
+ * loop_instr()
+ */
+static int loop_instr(const char* name, Chunk* chunk, int offset)
+{
+	uint16_t jump = (uint16_t) (chunk->code[offset+1] << 8);
+	jump |= chunk->code[offset+2];
+
+	fprintf(stdout, "%-16s %4d -> %d (%d)\n", name, offset, offset + 4 - jump, chunk->code[offset+3]);
+
+	return offset + 4;
+}
+
+
 /*
  * disassemble_chunk()
  */
@@ -66,6 +84,42 @@ void disassemble_chunk(Chunk* chunk, const char* name)
 }
 
 
+/*
+ * disassemble_hot_chunk()
+ * Disassemble chunk with the number of dispatches of each instruction 
+ * and its share of all dispatches in front. Each source line 
+ * starts with the sum over its instructions. The operands of a 
+ * superinstruction's later opcodes show up with no dispatches.
+ */
+void disassemble_hot_chunk(Chunk* chunk, const char* name, const uint64_t* hits, uint64_t total)
+{
+	uint64_t chunk_hits = 0;
+	for(int offset = 0; offset < chunk->count; offset++)
+		chunk_hits += hits[offset];
+
+	fprintf(stdout, "==== %s (%lu, %.2f%%) ====\n", name, (unsigned long) chunk_hits,
+			total > 0 ? 100.0 * (double) chunk_hits / (double) total : 0.0);
+	fprintf(stdout, "%12s %7s  Offset  line  instr\n", "count", "%");
+
+	for(int offset = 0; offset < chunk->count;)
+	{
+		if(offset == 0 || chunk->lines[offset] != chunk->lines[offset-1])
+		{
+			uint64_t line_hits = 0;
+			for(int i = offset; i < chunk->count && chunk->lines[i] == chunk->lines[offset]; i++)
+				line_hits += hits[i];
+
+			fprintf(stdout, "%12lu %6.2f%%  -- line %d\n", (unsigned long) line_hits,
+					total > 0 ? 100.0 * (double) line_hits / (double) total : 0.0, chunk->lines[offset]);
+		}
+
+		fprintf(stdout, "%12lu %6.2f%%  ", (unsigned long) hits[offset],
+				total > 0 ? 100.0 * (double) hits[offset] / (double) total : 0.0);
+		offset = disassemble_instr(chunk, offset);
+	}
+}
+
+
 /*
  * disassemble_instr()
  */
@@ -80,6 +134,20 @@ int disassemble_instr(Chunk* chunk, int offset)
 		fprintf(stdout, ":%4d  ", chunk->lines[offset]);
 
 	uint8_t instr = chunk->code[offset];
+	if(instr >= OP_BASE_COUNT)
+		return super_instr(chunk, instr, offset);
+
+	return disassemble_op(chunk, instr, offset);
+}
+
+
+/*
+ * disassemble_op()
+ * Print the opcode name and operands of the instruction at offset as 
+ * if it were instr.
+ */
+static int disassemble_op(Chunk* chunk, uint8_t instr, int offset)
+{
 	switch(instr)
 	{
 		case OP_RETURN:
@@ -127,11 +195,15 @@ int disassemble_instr(Chunk* chunk, int offset)
 		case OP_JUMP_IF_FALSE:
 			return jump_instr("OP_JUMP_IF_FALSE", 1, chunk, offset);
 		case OP_LOOP:
-			return jump_instr("OP_LOOP", -1, chunk, offset);
+			return loop_instr("OP_LOOP", chunk, offset);
 		case OP_CALL:
 			return byte_instr("OP_CALL", chunk, offset);
 		case OP_CONSTANT:
 			return const_instr("OP_CONSTANT", chunk, offset);
+#define INTRINSIC_CASE(op, name, fn) case OP_##op: return simple_instr("OP_" #op, offset);
+		MATH_INTRINSICS_1(INTRINSIC_CASE)
+		MATH_INTRINSICS_2(INTRINSIC_CASE)
+#undef INTRINSIC_CASE
 		default:
 			fprintf(stdout, "Unknown opcode %d\n", instr);
 			return offset + 1;
@@ -139,3 +211,197 @@ int disassemble_instr(Chunk* chunk, int offset)
 
 	return 0;		// <- should be unreachable
 }
+
+
+/*
+ * super_instr()
+ * Superinstructions print the sequence they replace followed by the 
+ * operands of the first instruction. The remaining instructions are 
+ * still in the chunk and get disassembled on their own.
+ */
+static int super_instr(Chunk* chunk, uint8_t instr, int offset)
+{
+	const SuperInstr* super = &super_instrs[instr - OP_BASE_COUNT];
+
+	fprintf(stdout, "[");
+	for(int i = 0; i < super->count; i++)
+		fprintf(stdout, "%s%s", i > 0 ? " + " : "", opcode_name(super->ops[i]));
+	fprintf(stdout, "] ");
+
+	return disassemble_op(chunk, super->ops[0], offset);
+}
+
+
+/*
+ * opcode_name()
+ */
+const char* opcode_name(uint8_t instr)
+{
+	static const char* names[] = {
+		[OP_CONSTANT]      = "OP_CONSTANT",
+		[OP_NIL]           = "OP_NIL",
+		[OP_TRUE]          = "OP_TRUE",
+		[OP_FALSE]         = "OP_FALSE",
+		[OP_POP]           = "OP_POP",
+		[OP_DEFINE_GLOBAL] = "OP_DEFINE_GLOBAL",
+		[OP_GET_GLOBAL]    = "OP_GET_GLOBAL",
+		[OP_SET_GLOBAL]    = "OP_SET_GLOBAL",
+		[OP_GET_LOCAL]     = "OP_GET_LOCAL",
+		[OP_SET_LOCAL]     = "OP_SET_LOCAL",
+		[OP_EQUAL]         = "OP_EQUAL",
+		[OP_GREATER]       = "OP_GREATER",
+		[OP_LESS]          = "OP_LESS",
+		[OP_ADD]           = "OP_ADD",
+		[OP_SUB]           = "OP_SUB",
+		[OP_MUL]           = "OP_MUL",
+		[OP_DIV]           = "OP_DIV",
+		[OP_NOT]           = "OP_NOT",
+		[OP_NEGATE]        = "OP_NEGATE",
+		[OP_PRINT]         = "OP_PRINT",
+		[OP_JUMP]          = "OP_JUMP",
+		[OP_JUMP_IF_FALSE] = "OP_JUMP_IF_FALSE",
+		[OP_LOOP]          = "OP_LOOP",
+		[OP_CALL]          = "OP_CALL",
+		[OP_RETURN]        = "OP_RETURN",
+#define INTRINSIC_NAME(op, name, fn) [OP_##op] = "OP_" #op,
+		MATH_INTRINSICS_1(INTRINSIC_NAME)
+		MATH_INTRINSICS_2(INTRINSIC_NAME)
+#undef INTRINSIC_NAME
+	};
+
+	// Superinstructions are named after the sequence they replace
+	static char super_names[UINT8_COUNT][64];
+
+	if(instr >= OP_BASE_COUNT)
+	{
+		char* name = super_names[instr - OP_BASE_COUNT];
+		if(name[0] == '\0')
+		{
+			const SuperInstr* super = &super_instrs[instr - OP_BASE_COUNT];
+			int length = 0;
+			for(int i = 0; i < super->count; i++)
+			{
+				length += snprintf(name + length, sizeof(super_names[0]) - length, "%s%s",
+						i > 0 ? "+" : "", names[super->ops[i]]);
+			}
+		}
+
+		return name;
+	}
+
+	return names[instr];
+}
+
+
+// ======== REGISTER INSTRUCTIONS ======== //
+
+/*
+ * reg_abc_instr()
+ */
+static int reg_abc_instr(const char* name, RegInstr instr, int offset)
+{
+	fprintf(stdout, "%-16s %4d %4d %4d\n", name, REG_A(instr), REG_B(instr), REG_C(instr));
+	return offset + 1;
+}
+
+/*
+ * reg_const_instr()
+ */
+static int reg_const_instr(const char* name, RegInstr instr, ValueArray* constants, int offset)
+{
+	fprintf(stdout, "%-16s %4d %4d '", name, REG_A(instr), REG_B(instr));
+	print_value(constants->values[REG_B(instr)]);
+	fprintf(stdout, "'\n");
+
+	return offset + 1;
+}
+
+/*
+ * reg_jump_instr()
+ */
+static int reg_jump_instr(const char* name, RegInstr instr, int offset)
+{
+	fprintf(stdout, "%-16s %4d %4d -> %d\n", name, REG_A(instr), offset, offset + 1 + REG_SBX(instr));
+	return offset + 1;
+}
+
+
+/*
+ * disassemble_reg_chunk()
+ */
+void disassemble_reg_chunk(RegChunk* chunk, ValueArray* constants, const char* name)
+{
+	fprintf(stdout, "==== %s (registers: %d) ====\n", name, chunk->max_regs);
+	fprintf(stdout, "Offset  line  instr\n");
+
+	for(int offset = 0; offset < chunk->count;)
+		offset = disassemble_reg_instr(chunk, constants, offset);
+}
+
+
+/*
+ * disassemble_reg_instr()
+ */
+int disassemble_reg_instr(RegChunk* chunk, ValueArray* constants, int offset)
+{
+	fprintf(stdout, "%06X ", offset);
+
+	if(offset > 0 && chunk->lines[offset] == chunk->lines[offset-1])
+		fprintf(stdout, "    |  ");
+	else
+		fprintf(stdout, ":%4d  ", chunk->lines[offset]);
+
+	RegInstr instr = chunk->code[offset];
+	switch(REG_OP(instr))
+	{
+		case ROP_MOVE:
+			return reg_abc_instr("ROP_MOVE", instr, offset);
+		case ROP_LOADK:
+			return reg_const_instr("ROP_LOADK", instr, constants, offset);
+		case ROP_LOADNIL:
+			return reg_abc_instr("ROP_LOADNIL", instr, offset);
+		case ROP_LOADBOOL:
+			return reg_abc_instr("ROP_LOADBOOL", instr, offset);
+		case ROP_DEFINE_GLOBAL:
+			return reg_const_instr("ROP_DEFINE_GLOBAL", instr, constants, offset);
+		case ROP_GET_GLOBAL:
+			return reg_const_instr("ROP_GET_GLOBAL", instr, constants, offset);
+		case ROP_SET_GLOBAL:
+			return reg_const_instr("ROP_SET_GLOBAL", instr, constants, offset);
+		case ROP_EQUAL:
+			return reg_abc_instr("ROP_EQUAL", instr, offset);
+		case ROP_GREATER:
+			return reg_abc_instr("ROP_GREATER", instr, offset);
+		case ROP_LESS:
+			return reg_abc_instr("ROP_LESS", instr, offset);
+		case ROP_ADD:
+			return reg_abc_instr("ROP_ADD", instr, offset);
+		case ROP_SUB:
+			return reg_abc_instr("ROP_SUB", instr, offset);
+		case ROP_MUL:
+			return reg_abc_instr("ROP_MUL", instr, offset);
+		case ROP_DIV:
+			return reg_abc_instr("ROP_DIV", instr, offset);
+		case ROP_NOT:
+			return reg_abc_instr("ROP_NOT", instr, offset);
+		case ROP_NEGATE:
+			return reg_abc_instr("ROP_NEGATE", instr, offset);
+		case ROP_PRINT:
+			return reg_abc_instr("ROP_PRINT", instr, offset);
+		case ROP_JUMP:
+			return reg_jump_instr("ROP_JUMP", instr, offset);
+		case ROP_JUMP_IF_FALSE:
+			return reg_jump_instr("ROP_JUMP_IF_FALSE", instr, offset);
+		case ROP_CALL:
+			return reg_abc_instr("ROP_CALL", instr, offset);
+		case ROP_RETURN:
+			return reg_abc_instr("ROP_RETURN", instr, offset);
+#define INTRINSIC_CASE(op, name, fn) case ROP_##op: return reg_abc_instr("ROP_" #op, instr, offset);
+		MATH_INTRINSICS_1(INTRINSIC_CASE)
+		MATH_INTRINSICS_2(INTRINSIC_CASE)
+#undef INTRINSIC_CASE
+		default:
+			fprintf(stdout, "Unknown register opcode %d\n", REG_OP(instr));
+			return offset + 1;
+	}
+}
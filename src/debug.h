@@ -2,11 +2,16 @@
 #define __LOX_DEBUG_H
 
 #include "chunk.h"
+#include "regchunk.h"
 #include "value.h"
 
 
 void disassemble_chunk(Chunk* chunk, const char* name);
 int disassemble_instr(Chunk* chunk, int offset);
+void disassemble_hot_chunk(Chunk* chunk, const char* name, const uint64_t* hits, uint64_t total);
+const char* opcode_name(uint8_t instr);
+void disassemble_reg_chunk(RegChunk* chunk, ValueArray* constants, const char* name);
+int disassemble_reg_instr(RegChunk* chunk, ValueArray* constants, int offset);
 
 
 #endif /*__LOX_DEBUG_H*/
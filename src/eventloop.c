@@ -0,0 +1,653 @@
+// Sockets, nanosleep() and the Linux extensions are not C99
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#endif /*__linux__*/
+
+#include "eventloop.h"
+#include "memory.h"
+
+
+/*
+ * init_event_loop()
+ */
+void init_event_loop(EventLoop* loop)
+{
+	loop->epoll_fd = -1;
+	loop->current = NULL;
+	loop->ready = NULL;
+	loop->ready_head = 0;
+	loop->ready_count = 0;
+	loop->ready_capacity = 0;
+	loop->waiters = NULL;
+	loop->waiter_count = 0;
+	loop->waiter_capacity = 0;
+	loop->descriptors = NULL;
+	loop->descriptor_capacity = 0;
+}
+
+
+/*
+ * free_event_loop()
+ * Parked fibers are dropped, the descriptors they waited on belong to
+ * the script and are left open, apart from the timers. Descriptors that
+ * io_nonblocking() changed get their flags back.
+ */
+void free_event_loop(EventLoop* loop)
+{
+	for(int i = 0; i < loop->waiter_capacity; i++)
+	{
+		if(loop->waiters[i].fiber != NULL && loop->waiters[i].kind == WAIT_SLEEP)
+			close(loop->waiters[i].fd);
+	}
+
+	for(int fd = 0; fd < loop->descriptor_capacity; fd++)
+	{
+		if(loop->descriptors[fd].restore_flags >= 0)
+			fcntl(fd, F_SETFL, loop->descriptors[fd].restore_flags);
+	}
+
+	if(loop->epoll_fd >= 0)
+		close(loop->epoll_fd);
+
+	FREE_ARRAY(ReadyTask, loop->ready, loop->ready_capacity);
+	FREE_ARRAY(Waiter, loop->waiters, loop->waiter_capacity);
+	FREE_ARRAY(Descriptor, loop->descriptors, loop->descriptor_capacity);
+	init_event_loop(loop);
+}
+
+
+// What each kind of wait is called in errors
+static const char* operations[] = {
+	[WAIT_READ]   = "read",
+	[WAIT_WRITE]  = "write",
+	[WAIT_ACCEPT] = "accept",
+	[WAIT_SLEEP]  = "sleep",
+};
+
+
+// ======== READY QUEUE ======== //
+
+static void push_ready(EventLoop* loop, ObjFiber* fiber, Value value, int error, const char* operation)
+{
+	if(loop->ready_count == loop->ready_capacity)
+	{
+		// A ring buffer can't just be reallocated, the tasks are copied
+		// over in order
+		int capacity = loop->ready_capacity < 8 ? 8 : loop->ready_capacity * 2;
+		ReadyTask* ready = ALLOCATE(ReadyTask, capacity);
+		for(int i = 0; i < loop->ready_count; i++)
+			ready[i] = loop->ready[(loop->ready_head + i) % loop->ready_capacity];
+
+		FREE_ARRAY(ReadyTask, loop->ready, loop->ready_capacity);
+		loop->ready = ready;
+		loop->ready_head = 0;
+		loop->ready_capacity = capacity;
+	}
+
+	ReadyTask* task = &loop->ready[(loop->ready_head + loop->ready_count) % loop->ready_capacity];
+	task->fiber = fiber;
+	task->value = value;
+	task->error = error;
+	task->operation = operation;
+	loop->ready_count++;
+}
+
+
+/*
+ * loop_schedule()
+ * Queue a fiber to be resumed with value.
+ */
+void loop_schedule(EventLoop* loop, ObjFiber* fiber, Value value)
+{
+	push_ready(loop, fiber, value, 0, NULL);
+}
+
+
+/*
+ * loop_next()
+ * Take the task at the front of the queue, false if it is empty.
+ */
+bool loop_next(EventLoop* loop, ReadyTask* task)
+{
+	if(loop->ready_count == 0)
+		return false;
+
+	*task = loop->ready[loop->ready_head];
+	loop->ready_head = (loop->ready_head + 1) % loop->ready_capacity;
+	loop->ready_count--;
+
+	return true;
+}
+
+
+/*
+ * loop_pending()
+ * Fibers that are queued or parked.
+ */
+int loop_pending(EventLoop* loop)
+{
+	return loop->ready_count + loop->waiter_count;
+}
+
+
+// ======== OPERATIONS ======== //
+
+/*
+ * io_read()
+ * Up to LOOP_READ_SIZE bytes as a string, nil at the end of the file.
+ */
+IoStatus io_read(int fd, Value* result)
+{
+	char buffer[LOOP_READ_SIZE];
+	ssize_t count = read(fd, buffer, sizeof(buffer));
+
+	if(count < 0)
+		return errno == EAGAIN || errno == EWOULDBLOCK ? IO_AGAIN : IO_FAILED;
+
+	*result = count == 0 ? NIL_VAL : OBJ_VAL(copy_string(buffer, (int) count));
+
+	return IO_DONE;
+}
+
+
+/*
+ * io_write()
+ * Write what is left of data after the first *written bytes, and add
+ * what was written to *written. Done once all of it is.
+ */
+IoStatus io_write(int fd, ObjString* data, int* written)
+{
+	while(*written < data->length)
+	{
+		ssize_t count = write(fd, data->chars + *written, data->length - *written);
+		if(count < 0)
+			return errno == EAGAIN || errno == EWOULDBLOCK ? IO_AGAIN : IO_FAILED;
+
+		*written += (int) count;
+	}
+
+	return IO_DONE;
+}
+
+
+static bool set_nonblocking(int fd)
+{
+	int flags = fcntl(fd, F_GETFL);
+
+	return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0 &&
+		fcntl(fd, F_SETFD, FD_CLOEXEC) == 0;
+}
+
+
+/*
+ * io_accept()
+ * The new connection is non-blocking like the listening socket.
+ */
+IoStatus io_accept(int fd, Value* result)
+{
+	int client = accept(fd, NULL, NULL);
+	if(client < 0)
+		return errno == EAGAIN || errno == EWOULDBLOCK ? IO_AGAIN : IO_FAILED;
+
+	if(!set_nonblocking(client))
+	{
+		int error = errno;
+		close(client);
+		errno = error;
+		return IO_FAILED;
+	}
+
+	*result = NUMBER_VAL(client);
+
+	return IO_DONE;
+}
+
+
+/*
+ * io_wait()
+ * Block until fd is ready, for the natives when they are not called
+ * from a scheduled fiber. Returns 0 or an errno.
+ */
+int io_wait(int fd, WaitKind kind)
+{
+	struct pollfd poll_fd;
+	poll_fd.fd = fd;
+	poll_fd.events = kind == WAIT_WRITE ? POLLOUT : POLLIN;
+
+	while(poll(&poll_fd, 1, -1) < 0)
+	{
+		if(errno != EINTR)
+			return errno;
+	}
+
+	return 0;
+}
+
+
+/*
+ * io_sleep()
+ */
+int io_sleep(double ms)
+{
+	if(ms <= 0)
+		return 0;
+
+	struct timespec ts;
+	ts.tv_sec = (time_t) (ms / 1000);
+	ts.tv_nsec = (long) ((ms - (double) ts.tv_sec * 1000) * 1000000);
+
+	while(nanosleep(&ts, &ts) < 0)
+	{
+		if(errno != EINTR)
+			return errno;
+	}
+
+	return 0;
+}
+
+
+static int unix_address(const char* path, struct sockaddr_un* address)
+{
+	if(strlen(path) >= sizeof(address->sun_path))
+		return ENAMETOOLONG;
+
+	memset(address, 0, sizeof(*address));
+	address->sun_family = AF_UNIX;
+	strcpy(address->sun_path, path);
+
+	return 0;
+}
+
+
+/*
+ * io_listen()
+ * A non-blocking UNIX stream socket listening at path. A socket left
+ * there by an earlier run is removed first, anything else at path is
+ * an error.
+ */
+int io_listen(const char* path, int* fd)
+{
+	struct sockaddr_un address;
+	int error = unix_address(path, &address);
+	if(error != 0)
+		return error;
+
+	struct stat st;
+	if(stat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+		unlink(path);
+
+	*fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(*fd < 0)
+		return errno;
+
+	if(bind(*fd, (struct sockaddr*) &address, sizeof(address)) < 0 ||
+			listen(*fd, SOMAXCONN) < 0 || !set_nonblocking(*fd))
+	{
+		error = errno;
+		close(*fd);
+		return error;
+	}
+
+	return 0;
+}
+
+
+/*
+ * io_connect()
+ * Connecting to a UNIX socket doesn't wait on the other side, so this
+ * is done blocking and the socket made non-blocking afterwards.
+ */
+int io_connect(const char* path, int* fd)
+{
+	struct sockaddr_un address;
+	int error = unix_address(path, &address);
+	if(error != 0)
+		return error;
+
+	*fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(*fd < 0)
+		return errno;
+
+	if(connect(*fd, (struct sockaddr*) &address, sizeof(address)) < 0 || !set_nonblocking(*fd))
+	{
+		error = errno;
+		close(*fd);
+		return error;
+	}
+
+	return 0;
+}
+
+
+static void reset_descriptor(Descriptor* descriptor)
+{
+	descriptor->peer = -1;
+	descriptor->checked = false;
+	descriptor->restore_flags = -1;
+}
+
+
+/*
+ * descriptor()
+ * What the loop knows about fd, which is a valid descriptor number.
+ */
+static Descriptor* descriptor(EventLoop* loop, int fd)
+{
+	if(fd >= loop->descriptor_capacity)
+	{
+		int capacity = loop->descriptor_capacity < 64 ? 64 : loop->descriptor_capacity;
+		while(capacity <= fd)
+			capacity *= 2;
+
+		loop->descriptors = GROW_ARRAY(Descriptor, loop->descriptors, loop->descriptor_capacity, capacity);
+		for(int i = loop->descriptor_capacity; i < capacity; i++)
+			reset_descriptor(&loop->descriptors[i]);
+		loop->descriptor_capacity = capacity;
+	}
+
+	return &loop->descriptors[fd];
+}
+
+
+/*
+ * io_nonblocking()
+ * Make a descriptor that didn't come from these natives, like stdin or a
+ * pipe, non-blocking the first time a scheduled fiber uses it, so the
+ * fiber can be parked rather than block the loop. Returns 0 or an errno.
+ */
+int io_nonblocking(EventLoop* loop, int fd)
+{
+	if(fd >= 0 && fd < loop->descriptor_capacity && loop->descriptors[fd].checked)
+		return 0;
+
+	// Only open descriptors get an entry
+	int flags = fcntl(fd, F_GETFL);
+	if(flags < 0)
+		return errno;
+
+	Descriptor* entry = descriptor(loop, fd);
+
+	// The open file can be shared with other processes, so the flags go
+	// back once the VM is freed
+	if(!(flags & O_NONBLOCK))
+	{
+		if(fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+			return errno;
+		entry->restore_flags = flags;
+	}
+
+	entry->checked = true;
+
+	return 0;
+}
+
+
+/*
+ * io_socketpair()
+ * A connected pair of non-blocking sockets. Lox functions return one
+ * value, so this gives one end and io_peer() the other.
+ */
+int io_socketpair(EventLoop* loop, int* fd)
+{
+	int pair[2];
+	if(socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0)
+		return errno;
+
+	if(!set_nonblocking(pair[0]) || !set_nonblocking(pair[1]))
+	{
+		int error = errno;
+		close(pair[0]);
+		close(pair[1]);
+		return error;
+	}
+
+	descriptor(loop, pair[0])->peer = pair[1];
+	descriptor(loop, pair[1])->peer = pair[0];
+	*fd = pair[0];
+
+	return 0;
+}
+
+
+/*
+ * io_peer()
+ * The other end of a socketpair(), or -1.
+ */
+int io_peer(EventLoop* loop, int fd)
+{
+	return fd >= 0 && fd < loop->descriptor_capacity ? loop->descriptors[fd].peer : -1;
+}
+
+
+/*
+ * io_close()
+ * epoll forgets a descriptor once it is closed, so the fibers parked on
+ * it are queued to fail with EBADF rather than wait forever.
+ */
+int io_close(EventLoop* loop, int fd)
+{
+	if(fd >= 0 && fd < loop->descriptor_capacity)
+	{
+		if(loop->descriptors[fd].restore_flags >= 0)
+			fcntl(fd, F_SETFL, loop->descriptors[fd].restore_flags);
+		reset_descriptor(&loop->descriptors[fd]);
+	}
+
+	for(int i = 0; i < loop->waiter_capacity; i++)
+	{
+		Waiter* waiter = &loop->waiters[i];
+		if(waiter->fiber == NULL || waiter->kind == WAIT_SLEEP || waiter->fd != fd)
+			continue;
+
+#ifdef __linux__
+		epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+#endif /*__linux__*/
+		push_ready(loop, waiter->fiber, NIL_VAL, EBADF, operations[waiter->kind]);
+		waiter->fiber = NULL;
+		loop->waiter_count--;
+	}
+
+	return close(fd) < 0 ? errno : 0;
+}
+
+
+// ======== PARKED FIBERS ======== //
+
+#ifdef __linux__
+static uint32_t wait_events(WaitKind kind)
+{
+	return (kind == WAIT_WRITE ? EPOLLOUT : EPOLLIN) | EPOLLONESHOT;
+}
+
+
+/*
+ * loop_park()
+ * Register the fiber's operation on fd with epoll. Only one fiber at a
+ * time can wait on a descriptor, epoll refuses a second one with EEXIST.
+ * Returns 0 or an errno.
+ */
+int loop_park(EventLoop* loop, ObjFiber* fiber, WaitKind kind, int fd, ObjString* data, int written)
+{
+	if(loop->epoll_fd < 0)
+	{
+		loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		if(loop->epoll_fd < 0)
+			return errno;
+	}
+
+	if(loop->waiter_count == loop->waiter_capacity)
+	{
+		int capacity = loop->waiter_capacity < 8 ? 8 : loop->waiter_capacity * 2;
+		loop->waiters = GROW_ARRAY(Waiter, loop->waiters, loop->waiter_capacity, capacity);
+		for(int i = loop->waiter_capacity; i < capacity; i++)
+			loop->waiters[i].fiber = NULL;
+		loop->waiter_capacity = capacity;
+	}
+
+	int slot = 0;
+	while(loop->waiters[slot].fiber != NULL)
+		slot++;
+
+	// The waiters can move when they grow, so epoll gets the slot
+	struct epoll_event event;
+	event.events = wait_events(kind);
+	event.data.u32 = (uint32_t) slot;
+	if(epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0)
+		return errno;
+
+	Waiter* waiter = &loop->waiters[slot];
+	waiter->kind = kind;
+	waiter->fd = fd;
+	waiter->fiber = fiber;
+	waiter->data = data;
+	waiter->written = written;
+	loop->waiter_count++;
+
+	return 0;
+}
+
+
+/*
+ * loop_sleep()
+ * Park the fiber on a timer of its own for ms milliseconds.
+ */
+int loop_sleep(EventLoop* loop, ObjFiber* fiber, double ms)
+{
+	int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if(fd < 0)
+		return errno;
+
+	// A zero time would disarm the timer instead
+	struct itimerspec spec;
+	memset(&spec, 0, sizeof(spec));
+	spec.it_value.tv_sec = (time_t) (ms / 1000);
+	spec.it_value.tv_nsec = (long) ((ms - (double) spec.it_value.tv_sec * 1000) * 1000000);
+	if(spec.it_value.tv_sec <= 0 && spec.it_value.tv_nsec <= 0)
+	{
+		spec.it_value.tv_sec = 0;
+		spec.it_value.tv_nsec = 1;
+	}
+
+	int error = 0;
+	if(timerfd_settime(fd, 0, &spec, NULL) < 0)
+		error = errno;
+	else
+		error = loop_park(loop, fiber, WAIT_SLEEP, fd, NULL, 0);
+
+	if(error != 0)
+		close(fd);
+
+	return error;
+}
+
+
+/*
+ * finish_waiter()
+ * Try the parked operation again now that epoll says it is ready. The
+ * fiber is queued unless the descriptor turns out not to be ready after
+ * all, or a write only got part of the way, then it waits again.
+ */
+static void finish_waiter(EventLoop* loop, int slot)
+{
+	Waiter* waiter = &loop->waiters[slot];
+	Value value = NIL_VAL;
+	IoStatus status = IO_DONE;
+
+	switch(waiter->kind)
+	{
+		case WAIT_READ:
+			status = io_read(waiter->fd, &value);
+			break;
+
+		case WAIT_WRITE:
+			status = io_write(waiter->fd, waiter->data, &waiter->written);
+			value = NUMBER_VAL(waiter->written);
+			break;
+
+		case WAIT_ACCEPT:
+			status = io_accept(waiter->fd, &value);
+			break;
+
+		case WAIT_SLEEP: {
+			uint64_t expirations;
+			if(read(waiter->fd, &expirations, sizeof(expirations)) < 0)
+				status = errno == EAGAIN ? IO_AGAIN : IO_FAILED;
+			break;
+		}
+	}
+
+	int error = status == IO_FAILED ? errno : 0;
+
+	if(status == IO_AGAIN)
+	{
+		struct epoll_event event;
+		event.events = wait_events(waiter->kind);
+		event.data.u32 = (uint32_t) slot;
+		if(epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, waiter->fd, &event) == 0)
+			return;
+
+		error = errno;
+	}
+
+	// The descriptor stays registered after a one shot event, it has to
+	// go before another fiber can wait on it
+	if(waiter->kind == WAIT_SLEEP)
+		close(waiter->fd);
+	else
+		epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, waiter->fd, NULL);
+
+	push_ready(loop, waiter->fiber, value, error, operations[waiter->kind]);
+	waiter->fiber = NULL;
+	loop->waiter_count--;
+}
+
+
+/*
+ * loop_wait()
+ * Block until epoll has something ready and finish those operations.
+ * Returns 0, or an errno if epoll failed.
+ */
+int loop_wait(EventLoop* loop)
+{
+	struct epoll_event events[LOOP_EVENTS_MAX];
+
+	int count = epoll_wait(loop->epoll_fd, events, LOOP_EVENTS_MAX, -1);
+	if(count < 0)
+		return errno == EINTR ? 0 : errno;
+
+	for(int i = 0; i < count; i++)
+		finish_waiter(loop, (int) events[i].data.u32);
+
+	return 0;
+}
+#else
+int loop_park(EventLoop* loop, ObjFiber* fiber, WaitKind kind, int fd, ObjString* data, int written)
+{
+	return ENOSYS;
+}
+
+
+int loop_sleep(EventLoop* loop, ObjFiber* fiber, double ms)
+{
+	return ENOSYS;
+}
+
+
+int loop_wait(EventLoop* loop)
+{
+	return ENOSYS;
+}
+#endif /*__linux__*/
@@ -0,0 +1,114 @@
+/*
+ * EVENT LOOP
+ * Fibers handed to the loop with schedule() are run one at a time by
+ * run(). When one of them reads, writes or accepts on a descriptor that
+ * isn't ready, or sleeps, it is parked and the descriptor registered
+ * with epoll. Once epoll says it is ready the loop finishes the
+ * operation itself and queues the fiber to carry on with the result,
+ * so one process can serve many fibers that mostly wait on I/O.
+ */
+
+#ifndef __LOX_EVENTLOOP_H
+#define __LOX_EVENTLOOP_H
+
+#include "common.h"
+#include "object.h"
+#include "value.h"
+
+
+#define LOOP_READ_SIZE 4096			// most bytes one read() returns
+#define LOOP_EVENTS_MAX 64			// events taken from epoll at a time
+
+
+typedef enum {
+	IO_DONE,
+	IO_AGAIN,			// the descriptor isn't ready
+	IO_FAILED,			// errno says why
+} IoStatus;
+
+
+typedef enum {
+	WAIT_READ,
+	WAIT_WRITE,
+	WAIT_ACCEPT,
+	WAIT_SLEEP,
+} WaitKind;
+
+
+/*
+ * Waiter
+ * A parked fiber and the operation to finish for it. A sleep waits on a
+ * timerfd of its own. fiber is NULL for a free slot.
+ */
+typedef struct {
+	WaitKind kind;
+	int fd;
+	ObjFiber* fiber;
+	ObjString* data;			// what is left to write
+	int written;
+} Waiter;
+
+
+/*
+ * Descriptor
+ * What the loop knows about a descriptor the script has used.
+ */
+typedef struct {
+	int peer;					// other end of a socketpair(), or -1
+	bool checked;				// made non-blocking if it wasn't already
+	int restore_flags;			// file status flags it had before that, or -1
+} Descriptor;
+
+
+/*
+ * ReadyTask
+ * A fiber to resume with value. If its operation failed instead, error
+ * is the errno, raised as a runtime error in the fiber once it resumes.
+ */
+typedef struct {
+	ObjFiber* fiber;
+	Value value;
+	int error;
+	const char* operation;
+} ReadyTask;
+
+
+typedef struct {
+	int epoll_fd;				// -1 until the first fiber is parked
+	ObjFiber* current;			// fiber run() last resumed
+	ReadyTask* ready;			// ring buffer
+	int ready_head;
+	int ready_count;
+	int ready_capacity;
+	Waiter* waiters;
+	int waiter_count;			// slots in use
+	int waiter_capacity;
+	Descriptor* descriptors;	// by descriptor
+	int descriptor_capacity;
+} EventLoop;
+
+
+void init_event_loop(EventLoop* loop);
+void free_event_loop(EventLoop* loop);
+
+void loop_schedule(EventLoop* loop, ObjFiber* fiber, Value value);
+bool loop_next(EventLoop* loop, ReadyTask* task);
+int  loop_pending(EventLoop* loop);
+int  loop_park(EventLoop* loop, ObjFiber* fiber, WaitKind kind, int fd, ObjString* data, int written);
+int  loop_sleep(EventLoop* loop, ObjFiber* fiber, double ms);
+int  loop_wait(EventLoop* loop);
+
+IoStatus io_read(int fd, Value* result);
+IoStatus io_write(int fd, ObjString* data, int* written);
+IoStatus io_accept(int fd, Value* result);
+int io_wait(int fd, WaitKind kind);
+int io_sleep(double ms);
+int io_nonblocking(EventLoop* loop, int fd);
+int io_listen(const char* path, int* fd);
+int io_connect(const char* path, int* fd);
+int io_socketpair(EventLoop* loop, int* fd);
+int io_peer(EventLoop* loop, int fd);
+int io_close(EventLoop* loop, int fd);
+
+
+#endif /*__LOX_EVENTLOOP_H*/
@@ -0,0 +1,141 @@
+#include <string.h>
+
+#include "fiber.h"
+#include "memory.h"
+#include "vm.h"
+
+
+/*
+ * fiber_fits()
+ * True if the fiber's frames fit above the current ones, with room for
+ * a full window of values on top of its stack.
+ */
+bool fiber_fits(ObjFiber* fiber)
+{
+	int frames = fiber->state == FIBER_NEW ? 1 : fiber->frame_count;
+
+	return vm.frame_count + frames <= FRAMES_MAX &&
+		vm.stack_top + fiber->stack_count + UINT8_COUNT <= vm.stack + STACK_MAX;
+}
+
+
+/*
+ * enter_fiber()
+ * Make fiber the running one, starting at the current top of the stack.
+ */
+static void enter_fiber(ObjFiber* fiber)
+{
+	fiber->state = FIBER_RUNNING;
+	fiber->caller = vm.fiber;
+	fiber->frame_base = vm.frame_count;
+	fiber->stack_base = vm.stack_top;
+
+	vm.fiber = fiber;
+	vm.frame_base = fiber->frame_base;
+}
+
+
+/*
+ * leave_fiber()
+ * Hand the VM back to whoever resumed the running fiber.
+ */
+static void leave_fiber(FiberState state)
+{
+	ObjFiber* fiber = vm.fiber;
+	fiber->state = state;
+
+	vm.fiber = fiber->caller;
+	vm.frame_base = vm.fiber != NULL ? vm.fiber->frame_base : 0;
+	fiber->caller = NULL;
+}
+
+
+/*
+ * start_fiber()
+ * The caller pushes the function and its argument and calls it, the
+ * frame it gets is the fiber's first.
+ */
+void start_fiber(ObjFiber* fiber)
+{
+	enter_fiber(fiber);
+}
+
+
+/*
+ * restore_fiber()
+ * Copy a suspended fiber's frames and values back onto the top of the
+ * stack. They are moved by however far the stack top is from where it
+ * was when the fiber was last running.
+ */
+void restore_fiber(ObjFiber* fiber)
+{
+	ptrdiff_t moved = vm.stack_top - fiber->stack_base;
+	CallFrame* frames = &vm.frames[vm.frame_count];
+
+	memcpy(frames, fiber->frames, sizeof(CallFrame) * fiber->frame_count);
+	for(int i = 0; i < fiber->frame_count; i++)
+		frames[i].slots += moved;
+	memcpy(vm.stack_top, fiber->stack, sizeof(Value) * fiber->stack_count);
+
+	enter_fiber(fiber);
+	vm.frame_count += fiber->frame_count;
+	vm.stack_top += fiber->stack_count;
+}
+
+
+/*
+ * suspend_fiber()
+ * Copy the running fiber's frames and values off the stack. Its buffers
+ * only grow, a fiber that yields at the same depth each time reuses them.
+ */
+void suspend_fiber(void)
+{
+	ObjFiber* fiber = vm.fiber;
+	int frame_count = vm.frame_count - fiber->frame_base;
+	int stack_count = (int) (vm.stack_top - fiber->stack_base);
+
+	if(frame_count > fiber->frame_capacity)
+	{
+		fiber->frames = GROW_ARRAY_AS(MEM_FIBER, CallFrame, fiber->frames,
+				fiber->frame_capacity, frame_count);
+		fiber->frame_capacity = frame_count;
+	}
+
+	if(stack_count > fiber->stack_capacity)
+	{
+		fiber->stack = GROW_ARRAY_AS(MEM_FIBER, Value, fiber->stack,
+				fiber->stack_capacity, stack_count);
+		fiber->stack_capacity = stack_count;
+	}
+
+	memcpy(fiber->frames, &vm.frames[fiber->frame_base], sizeof(CallFrame) * frame_count);
+	memcpy(fiber->stack, fiber->stack_base, sizeof(Value) * stack_count);
+	fiber->frame_count = frame_count;
+	fiber->stack_count = stack_count;
+
+	vm.frame_count = fiber->frame_base;
+	vm.stack_top = fiber->stack_base;
+	leave_fiber(FIBER_SUSPENDED);
+}
+
+
+/*
+ * finish_fiber()
+ * The running fiber's first frame has returned.
+ */
+void finish_fiber(void)
+{
+	leave_fiber(FIBER_DONE);
+}
+
+
+/*
+ * abandon_fibers()
+ * A runtime error has thrown away the stack along with the frames of
+ * every fiber that was running, none of them can be resumed.
+ */
+void abandon_fibers(void)
+{
+	while(vm.fiber != NULL)
+		leave_fiber(FIBER_DONE);
+}
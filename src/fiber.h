@@ -0,0 +1,26 @@
+/*
+ * FIBERS
+ * A fiber runs on the VM's value stack and call frames like any other
+ * call, on top of whoever resumed it. When it yields, its frames and
+ * values are copied out into buffers of its own and the resumer carries
+ * on; resuming copies them back on top of the new resumer, wherever its
+ * stack is then. A suspended fiber costs the object and as much stack as
+ * it was using, and a switch costs a copy of that much stack.
+ */
+
+#ifndef __LOX_FIBER_H
+#define __LOX_FIBER_H
+
+#include "common.h"
+#include "object.h"
+
+
+bool fiber_fits(ObjFiber* fiber);
+void start_fiber(ObjFiber* fiber);
+void restore_fiber(ObjFiber* fiber);
+void suspend_fiber(void);
+void finish_fiber(void);
+void abandon_fibers(void);
+
+
+#endif /*__LOX_FIBER_H*/
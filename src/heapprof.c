@@ -0,0 +1,388 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "heapprof.h"
+#include "compiler.h"
+#include "vm.h"
+
+
+// Marks for HeapBlock.site
+#define HEAP_BLOCK_EMPTY -1
+#define HEAP_BLOCK_TOMBSTONE -2
+
+
+/*
+ * init_heap_profile()
+ */
+void init_heap_profile(HeapProfiler* profiler)
+{
+	profiler->enabled = false;
+	profiler->site_count = 0;
+	profiler->site_capacity = 0;
+	profiler->sites = NULL;
+	profiler->site_index = NULL;
+	profiler->block_count = 0;
+	profiler->block_capacity = 0;
+	profiler->blocks = NULL;
+}
+
+
+/*
+ * free_heap_profile()
+ * The profiler's own tables come from malloc() rather than reallocate(),
+ * which would otherwise profile its own bookkeeping.
+ */
+void free_heap_profile(HeapProfiler* profiler)
+{
+	free(profiler->sites);
+	free(profiler->site_index);
+	free(profiler->blocks);
+	init_heap_profile(profiler);
+}
+
+
+// ======== SITES ======== //
+
+/*
+ * current_site()
+ * The compiler's position while compiling, otherwise the instruction
+ * the innermost frame is running.
+ */
+static void current_site(HeapSite* site)
+{
+	site->compiling = compiler_position(&site->function, &site->line);
+	if(site->compiling)
+		return;
+
+	site->function = NULL;
+	site->line = 0;
+	if(vm.frame_count == 0)
+		return;
+
+	CallFrame* frame = &vm.frames[vm.frame_count - 1];
+	site->function = frame->function;
+
+	// ip is past the instruction that is running, or at the start of a
+	// function that hasn't run anything yet
+	if(vm.backend == BACKEND_REGISTER)
+	{
+		int offset = (int) (frame->rip - frame->function->reg_chunk.code);
+		site->line = frame->function->reg_chunk.lines[offset > 0 ? offset - 1 : 0];
+	}
+	else
+	{
+		int offset = (int) (frame->ip - frame->function->chunk.code);
+		site->line = frame->function->chunk.lines[offset > 0 ? offset - 1 : 0];
+	}
+}
+
+
+static uint32_t hash_site(HeapSite* site)
+{
+	uint32_t hash = (uint32_t) ((uintptr_t) site->function >> 3);
+	hash = hash * 31 + (uint32_t) site->line;
+	hash = hash * 31 + (uint32_t) site->kind;
+	hash = hash * 31 + (uint32_t) site->compiling;
+
+	return hash;
+}
+
+
+static bool same_site(HeapSite* a, HeapSite* b)
+{
+	return a->function == b->function && a->line == b->line &&
+		a->kind == b->kind && a->compiling == b->compiling;
+}
+
+
+static int* find_site(HeapProfiler* profiler, int* index, int capacity, HeapSite* site)
+{
+	uint32_t slot = hash_site(site) & (uint32_t) (capacity - 1);
+
+	while(index[slot] != -1 && !same_site(&profiler->sites[index[slot]], site))
+		slot = (slot + 1) & (uint32_t) (capacity - 1);
+
+	return &index[slot];
+}
+
+
+/*
+ * grow_sites()
+ * The index has twice the capacity of the site array, so it stays at
+ * most half full.
+ */
+static bool grow_sites(HeapProfiler* profiler)
+{
+	int capacity = profiler->site_capacity < 64 ? 64 : profiler->site_capacity * 2;
+	HeapSite* sites = realloc(profiler->sites, sizeof(HeapSite) * capacity);
+	int* index = malloc(sizeof(int) * capacity * 2);
+	if(sites == NULL || index == NULL)
+	{
+		if(sites != NULL)
+			profiler->sites = sites;
+		free(index);
+		return false;
+	}
+
+	profiler->sites = sites;
+	for(int i = 0; i < capacity * 2; i++)
+		index[i] = -1;
+	for(int i = 0; i < profiler->site_count; i++)
+		*find_site(profiler, index, capacity * 2, &sites[i]) = i;
+
+	free(profiler->site_index);
+	profiler->site_index = index;
+	profiler->site_capacity = capacity;
+
+	return true;
+}
+
+
+/*
+ * site_for()
+ * Index of the site for this kind of allocation at the current position,
+ * or -1 if there was no memory to add it.
+ */
+static int site_for(HeapProfiler* profiler, MemoryKind kind)
+{
+	HeapSite site;
+	current_site(&site);
+	site.kind = kind;
+
+	if(profiler->site_count == profiler->site_capacity && !grow_sites(profiler))
+		return -1;
+
+	int* slot = find_site(profiler, profiler->site_index, profiler->site_capacity * 2, &site);
+	if(*slot == -1)
+	{
+		site.allocs = 0;
+		site.bytes = 0;
+		site.live_count = 0;
+		site.live_bytes = 0;
+		profiler->sites[profiler->site_count] = site;
+		*slot = profiler->site_count++;
+	}
+
+	return *slot;
+}
+
+
+// ======== LIVE BLOCKS ======== //
+
+static HeapBlock* find_block(HeapBlock* blocks, int capacity, void* pointer)
+{
+	// Blocks are at least 8 byte aligned so the low bits carry nothing
+	uint32_t index = (uint32_t) (((uintptr_t) pointer >> 3) & (uintptr_t) (capacity - 1));
+	HeapBlock* tombstone = NULL;
+
+	for(;;)
+	{
+		HeapBlock* block = &blocks[index];
+
+		if(block->site == HEAP_BLOCK_EMPTY)
+			return tombstone != NULL ? tombstone : block;
+		if(block->site == HEAP_BLOCK_TOMBSTONE)
+		{
+			if(tombstone == NULL)
+				tombstone = block;
+		}
+		else if(block->pointer == pointer)
+			return block;
+
+		index = (index + 1) & (uint32_t) (capacity - 1);
+	}
+}
+
+
+static bool grow_blocks(HeapProfiler* profiler)
+{
+	int capacity = profiler->block_capacity < 1024 ? 1024 : profiler->block_capacity * 2;
+	HeapBlock* blocks = malloc(sizeof(HeapBlock) * capacity);
+	if(blocks == NULL)
+		return false;
+
+	for(int i = 0; i < capacity; i++)
+		blocks[i].site = HEAP_BLOCK_EMPTY;
+
+	// Tombstones are dropped on the way
+	profiler->block_count = 0;
+	for(int i = 0; i < profiler->block_capacity; i++)
+	{
+		if(profiler->blocks[i].site < 0)
+			continue;
+
+		*find_block(blocks, capacity, profiler->blocks[i].pointer) = profiler->blocks[i];
+		profiler->block_count++;
+	}
+
+	free(profiler->blocks);
+	profiler->blocks = blocks;
+	profiler->block_capacity = capacity;
+
+	return true;
+}
+
+
+/*
+ * heap_profile_free()
+ * Blocks allocated before profiling started aren't known and are
+ * ignored.
+ */
+void heap_profile_free(HeapProfiler* profiler, void* pointer)
+{
+	if(pointer == NULL || profiler->block_capacity == 0)
+		return;
+
+	HeapBlock* block = find_block(profiler->blocks, profiler->block_capacity, pointer);
+	if(block->site < 0)
+		return;
+
+	HeapSite* site = &profiler->sites[block->site];
+	site->live_count--;
+	site->live_bytes -= block->size;
+	block->site = HEAP_BLOCK_TOMBSTONE;
+}
+
+
+/*
+ * heap_profile_alloc()
+ * Record that pointer holds size bytes of kind, allocated here.
+ */
+void heap_profile_alloc(HeapProfiler* profiler, void* pointer, size_t size, MemoryKind kind)
+{
+	int index = site_for(profiler, kind);
+	if(index < 0)
+		return;
+
+	HeapSite* site = &profiler->sites[index];
+	site->allocs++;
+	site->bytes += size;
+
+	if((profiler->block_count + 1) * 4 > profiler->block_capacity * 3 && !grow_blocks(profiler))
+		return;
+
+	HeapBlock* block = find_block(profiler->blocks, profiler->block_capacity, pointer);
+	if(block->site == HEAP_BLOCK_EMPTY)
+		profiler->block_count++;
+
+	block->pointer = pointer;
+	block->size = size;
+	block->site = index;
+	site->live_count++;
+	site->live_bytes += size;
+}
+
+
+// ======== REPORTS ======== //
+
+static int compare_sites(const void* a, const void* b)
+{
+	uint64_t ba = ((const HeapSite*) a)->bytes;
+	uint64_t bb = ((const HeapSite*) b)->bytes;
+
+	if(ba == bb)
+		return 0;
+
+	return ba < bb ? 1 : -1;
+}
+
+
+/*
+ * sorted_sites()
+ * A copy of the sites, most bytes allocated first. Free it with free().
+ */
+static HeapSite* sorted_sites(HeapProfiler* profiler)
+{
+	HeapSite* sites = malloc(sizeof(HeapSite) * (profiler->site_count > 0 ? profiler->site_count : 1));
+	if(sites == NULL)
+		return NULL;
+
+	memcpy(sites, profiler->sites, sizeof(HeapSite) * profiler->site_count);
+	qsort(sites, profiler->site_count, sizeof(HeapSite), compare_sites);
+
+	return sites;
+}
+
+
+static void site_name(HeapSite* site, char* name, int size)
+{
+	if(site->function == NULL)
+		snprintf(name, size, "<vm>");
+	else
+		snprintf(name, size, "%s%s:%d", site->compiling ? "compile " : "",
+				callable_name((Obj*) site->function), site->line);
+}
+
+
+/*
+ * print_heap_profile()
+ */
+void print_heap_profile(HeapProfiler* profiler, FILE* file)
+{
+	HeapSite* sites = sorted_sites(profiler);
+	if(sites == NULL)
+		return;
+
+	uint64_t kind_allocs[MEM_KIND_COUNT] = {0};
+	uint64_t kind_bytes[MEM_KIND_COUNT] = {0};
+	uint64_t kind_live[MEM_KIND_COUNT] = {0};
+	for(int i = 0; i < profiler->site_count; i++)
+	{
+		kind_allocs[sites[i].kind] += sites[i].allocs;
+		kind_bytes[sites[i].kind] += sites[i].bytes;
+		kind_live[sites[i].kind] += sites[i].live_bytes;
+	}
+
+	fprintf(file, "==== heap profile: top %d sites by bytes allocated ====\n", HEAP_PROFILE_TOP);
+	fprintf(file, "%-40s %-10s %10s %14s %10s %14s\n", "site", "kind", "allocs", "bytes", "live", "live bytes");
+
+	char name[128];
+	for(int i = 0; i < profiler->site_count && i < HEAP_PROFILE_TOP; i++)
+	{
+		site_name(&sites[i], name, sizeof(name));
+		fprintf(file, "%-40s %-10s %10lu %14lu %10lu %14lu\n", name, memory_kind_name(sites[i].kind),
+				(unsigned long) sites[i].allocs, (unsigned long) sites[i].bytes,
+				(unsigned long) sites[i].live_count, (unsigned long) sites[i].live_bytes);
+	}
+
+	fprintf(file, "\n==== heap profile by kind ====\n");
+	fprintf(file, "%-40s %-10s %10s %14s %10s %14s\n", "", "kind", "allocs", "bytes", "", "live bytes");
+	for(int k = 0; k < MEM_KIND_COUNT; k++)
+	{
+		if(kind_allocs[k] == 0)
+			continue;
+
+		fprintf(file, "%-40s %-10s %10lu %14lu %10s %14lu\n", "", memory_kind_name(k),
+				(unsigned long) kind_allocs[k], (unsigned long) kind_bytes[k], "",
+				(unsigned long) kind_live[k]);
+	}
+
+	free(sites);
+}
+
+
+/*
+ * write_heap_profile_lines()
+ * One "path:line: message" line per site with a source line, most bytes
+ * allocated first, in the format editors load as compiler messages.
+ */
+void write_heap_profile_lines(HeapProfiler* profiler, FILE* file, const char* source_path)
+{
+	HeapSite* sites = sorted_sites(profiler);
+	if(sites == NULL)
+		return;
+
+	for(int i = 0; i < profiler->site_count; i++)
+	{
+		HeapSite* site = &sites[i];
+		if(site->function == NULL)
+			continue;
+
+		fprintf(file, "%s:%d: %lu bytes of %s in %lu allocations, %lu bytes live%s (%s)\n",
+				source_path, site->line, (unsigned long) site->bytes, memory_kind_name(site->kind),
+				(unsigned long) site->allocs, (unsigned long) site->live_bytes,
+				site->compiling ? " while compiling" : "", callable_name((Obj*) site->function));
+	}
+
+	free(sites);
+}
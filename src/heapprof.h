@@ -0,0 +1,72 @@
+/*
+ * HEAP PROFILER
+ * Attributes every allocation made through reallocate() to the Lox
+ * function and line that was running, or to the function and line the
+ * compiler was on, and to the kind of memory it was for. Each site
+ * keeps its total allocations and the blocks that are still live, so
+ * both churn and retained memory can be traced back to the source.
+ */
+
+#ifndef __LOX_HEAPPROF_H
+#define __LOX_HEAPPROF_H
+
+#include <stdio.h>
+
+#include "common.h"
+#include "memory.h"
+#include "object.h"
+
+
+#define HEAP_PROFILE_TOP 20
+
+
+/*
+ * HeapSite
+ * Allocations of one kind of memory from one source line. function is
+ * NULL for allocations made outside of compiling and running, like
+ * setting up the natives.
+ */
+typedef struct {
+	ObjFunction* function;
+	int line;
+	MemoryKind kind;
+	bool compiling;
+	uint64_t allocs;
+	uint64_t bytes;				// every allocation and reallocation, in bytes asked for
+	uint64_t live_count;
+	uint64_t live_bytes;
+} HeapSite;
+
+
+/*
+ * HeapBlock
+ * A live allocation and the site that last (re)allocated it.
+ */
+typedef struct {
+	void* pointer;
+	size_t size;
+	int site;					// index into sites, or one of the HEAP_BLOCK_ marks
+} HeapBlock;
+
+
+typedef struct {
+	bool enabled;
+	int site_count;
+	int site_capacity;
+	HeapSite* sites;			// in the order they were first seen
+	int* site_index;			// open addressed, indexes into sites or -1
+	int block_count;			// live blocks and tombstones
+	int block_capacity;
+	HeapBlock* blocks;			// open addressed on the pointer
+} HeapProfiler;
+
+
+void init_heap_profile(HeapProfiler* profiler);
+void free_heap_profile(HeapProfiler* profiler);
+void heap_profile_alloc(HeapProfiler* profiler, void* pointer, size_t size, MemoryKind kind);
+void heap_profile_free(HeapProfiler* profiler, void* pointer);
+void print_heap_profile(HeapProfiler* profiler, FILE* file);
+void write_heap_profile_lines(HeapProfiler* profiler, FILE* file, const char* source_path);
+
+
+#endif /*__LOX_HEAPPROF_H*/
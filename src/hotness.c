@@ -0,0 +1,114 @@
+#include "hotness.h"
+#include "debug.h"
+#include "memory.h"
+#include "vm.h"
+
+
+/*
+ * collect_functions()
+ * Every function that was counted, in the order they were compiled. 
+ * The caller frees the array.
+ */
+static ObjFunction** collect_functions(int* count)
+{
+	*count = 0;
+	for(Obj* object = vm.objects; object != NULL; object = object->next)
+	{
+		if(object->type == OBJ_FUNCTION && ((ObjFunction*) object)->hits != NULL)
+			(*count)++;
+	}
+
+	ObjFunction** functions = ALLOCATE(ObjFunction*, *count);
+
+	// The object list is newest first
+	int i = *count;
+	for(Obj* object = vm.objects; object != NULL; object = object->next)
+	{
+		if(object->type == OBJ_FUNCTION && ((ObjFunction*) object)->hits != NULL)
+			functions[--i] = (ObjFunction*) object;
+	}
+
+	return functions;
+}
+
+
+static uint64_t total_hits(ObjFunction** functions, int count)
+{
+	uint64_t total = 0;
+
+	for(int i = 0; i < count; i++)
+	{
+		for(int offset = 0; offset < functions[i]->chunk.count; offset++)
+			total += functions[i]->hits[offset];
+	}
+
+	return total;
+}
+
+
+/*
+ * print_hot_disassembly()
+ */
+void print_hot_disassembly(void)
+{
+	int count;
+	ObjFunction** functions = collect_functions(&count);
+	uint64_t total = total_hits(functions, count);
+
+	for(int i = 0; i < count; i++)
+	{
+		disassemble_hot_chunk(&functions[i]->chunk, callable_name((Obj*) functions[i]),
+				functions[i]->hits, total);
+		fprintf(stdout, "\n");
+	}
+
+	FREE_ARRAY(ObjFunction*, functions, count);
+}
+
+
+/*
+ * write_line_hotness()
+ * One "path:line: count (share%)" line per executed source line, in
+ * the same shape as compiler messages so editors can jump to and mark
+ * them (e.g. vim's quickfix list or emacs compilation mode).
+ */
+void write_line_hotness(FILE* file, const char* source_path)
+{
+	int count;
+	ObjFunction** functions = collect_functions(&count);
+	uint64_t total = total_hits(functions, count);
+
+	int max_line = 0;
+	for(int i = 0; i < count; i++)
+	{
+		Chunk* chunk = &functions[i]->chunk;
+		for(int offset = 0; offset < chunk->count; offset++)
+		{
+			if(chunk->lines[offset] > max_line)
+				max_line = chunk->lines[offset];
+		}
+	}
+
+	uint64_t* lines = ALLOCATE(uint64_t, max_line + 1);
+	for(int line = 0; line <= max_line; line++)
+		lines[line] = 0;
+
+	for(int i = 0; i < count; i++)
+	{
+		Chunk* chunk = &functions[i]->chunk;
+		for(int offset = 0; offset < chunk->count; offset++)
+			lines[chunk->lines[offset]] += functions[i]->hits[offset];
+	}
+
+	for(int line = 0; line <= max_line; line++)
+	{
+		if(lines[line] == 0)
+			continue;
+
+		fprintf(file, "%s:%d: %lu dispatches (%.2f%%)\n", source_path, line, (unsigned long) lines[line],
+				100.0 * (double) lines[line] / (double) total);
+	}
+
+	FREE_ARRAY(uint64_t, lines, max_line + 1);
+	FREE_ARRAY(ObjFunction*, functions, count);
+}
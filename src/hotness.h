@@ -0,0 +1,19 @@
+/*
+ * HOTNESS
+ * Reports from the per offset dispatch counters that --hotness keeps
+ * in each ObjFunction.
+ */
+
+#ifndef __LOX_HOTNESS_H
+#define __LOX_HOTNESS_H
+
+#include <stdio.h>
+
+#include "common.h"
+
+
+void print_hot_disassembly(void);
+void write_line_hotness(FILE* file, const char* source_path);
+
+
+#endif /*__LOX_HOTNESS_H*/
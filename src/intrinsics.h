@@ -0,0 +1,39 @@
+/*
+ * INTRINSICS
+ * Math natives that have an opcode of their own. A call whose callee is
+ * one of these names, as a global, is compiled to the opcode instead of
+ * OP_GET_GLOBAL and OP_CALL, see named_variable(). The opcode applies
+ * the C function to the numbers on the stack directly. If the global has
+ * been set since init_vm(), or the arguments aren't numbers, it calls
+ * whatever the global holds the usual way instead, so a script that
+ * defines its own sqrt() gets it and errors are the native's.
+ *
+ *   X(opcode suffix, name, C function)
+ */
+
+#ifndef __LOX_INTRINSICS_H
+#define __LOX_INTRINSICS_H
+
+#define MATH_INTRINSICS_1(X) \
+	X(SQRT, "sqrt", sqrt) \
+	X(FLOOR, "floor", floor) \
+	X(ABS, "abs", fabs) \
+	X(SIN, "sin", sin) \
+	X(COS, "cos", cos) \
+	X(LOG, "log", log)
+
+#define MATH_INTRINSICS_2(X) \
+	X(MIN, "min", fmin) \
+	X(MAX, "max", fmax) \
+	X(POW, "pow", pow)
+
+
+typedef enum {
+#define INTRINSIC_ID(op, name, fn) INTRINSIC_##op,
+	MATH_INTRINSICS_1(INTRINSIC_ID)
+	MATH_INTRINSICS_2(INTRINSIC_ID)
+#undef INTRINSIC_ID
+	INTRINSIC_COUNT
+} Intrinsic;
+
+#endif /*__LOX_INTRINSICS_H*/
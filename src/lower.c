@@ -0,0 +1,456 @@
+#include "lower.h"
+#include "memory.h"
+
+
+/*
+ * The stack VM keeps locals and temporaries in the same frame
+ * window: local i lives in slot i and every temporary sits
+ * directly above the locals. Because the compiler emits structured
+ * code the depth of that window is known statically at every
+ * instruction, so stack position i can simply become register i.
+ *
+ * Pushes of constants and locals are not emitted straight away.
+ * Instead we remember where the value would come from and only
+ * materialise it into its register when something needs it there
+ * (a call window, a jump, or an overwrite of the source local).
+ * Most binary operations can then read their operands directly out
+ * of the local registers without any intermediate moves.
+ */
+
+
+typedef enum {
+	SLOT_REG,       // value is already in the register for this position
+	SLOT_LOCAL,     // value is a copy of local register `index`
+	SLOT_CONST,     // value is constant `index`
+	SLOT_NIL,
+	SLOT_TRUE,
+	SLOT_FALSE,
+} SlotKind;
+
+
+typedef struct {
+	SlotKind kind;
+	uint8_t index;
+} Slot;
+
+
+typedef struct {
+	int reg_offset;     // register instruction to patch
+	int target;         // stack bytecode offset we are jumping to
+} JumpFixup;
+
+
+typedef struct {
+	RegChunk* out;
+	Slot slots[UINT8_COUNT];
+	int depth;
+	int line;
+	bool ok;
+} Lowering;
+
+
+
+/*
+ * jump_target()
+ */
+static int jump_target(Chunk* chunk, int offset)
+{
+	uint16_t jump = (uint16_t) ((chunk->code[offset+1] << 8) | chunk->code[offset+2]);
+
+	if(chunk->code[offset] == OP_LOOP)
+		return offset + 4 - jump;
+
+	return offset + 3 + jump;
+}
+
+
+static void emit(Lowering* lower, RegInstr instr)
+{
+	write_reg_chunk(lower->out, instr, lower->line);
+}
+
+
+/*
+ * push_slot()
+ */
+static void push_slot(Lowering* lower, SlotKind kind, uint8_t index)
+{
+	if(lower->depth >= UINT8_COUNT)
+	{
+		lower->ok = false;
+		return;
+	}
+
+	lower->slots[lower->depth].kind = kind;
+	lower->slots[lower->depth].index = index;
+	lower->depth++;
+
+	if(lower->depth > lower->out->max_regs)
+		lower->out->max_regs = lower->depth;
+}
+
+
+/*
+ * materialize()
+ * Make sure the value for stack position pos is actually in register pos.
+ */
+static void materialize(Lowering* lower, int pos)
+{
+	Slot* slot = &lower->slots[pos];
+
+	switch(slot->kind)
+	{
+		case SLOT_REG:
+			return;
+		case SLOT_LOCAL:
+			emit(lower, REG_ABC(ROP_MOVE, pos, slot->index, 0));
+			break;
+		case SLOT_CONST:
+			emit(lower, REG_ABC(ROP_LOADK, pos, slot->index, 0));
+			break;
+		case SLOT_NIL:
+			emit(lower, REG_ABC(ROP_LOADNIL, pos, 0, 0));
+			break;
+		case SLOT_TRUE:
+			emit(lower, REG_ABC(ROP_LOADBOOL, pos, 1, 0));
+			break;
+		case SLOT_FALSE:
+			emit(lower, REG_ABC(ROP_LOADBOOL, pos, 0, 0));
+			break;
+	}
+
+	slot->kind = SLOT_REG;
+}
+
+
+/*
+ * operand()
+ * Return a register that holds the value at stack position pos.
+ * Copies of locals are read straight out of the local register.
+ */
+static uint8_t operand(Lowering* lower, int pos)
+{
+	Slot* slot = &lower->slots[pos];
+
+	if(slot->kind == SLOT_LOCAL)
+		return slot->index;
+
+	materialize(lower, pos);
+
+	return (uint8_t) pos;
+}
+
+
+/*
+ * flush()
+ * Materialize every pending value, used at basic block boundaries.
+ */
+static void flush(Lowering* lower)
+{
+	for(int i = 0; i < lower->depth; i++)
+		materialize(lower, i);
+}
+
+
+/*
+ * set_local()
+ */
+static void set_local(Lowering* lower, uint8_t local)
+{
+	int top = lower->depth - 1;
+
+	// Anything still waiting to copy the old value must do so now
+	for(int i = 0; i < top; i++)
+	{
+		if(lower->slots[i].kind == SLOT_LOCAL && lower->slots[i].index == local)
+			materialize(lower, i);
+	}
+
+	Slot* slot = &lower->slots[top];
+	switch(slot->kind)
+	{
+		case SLOT_REG:
+			emit(lower, REG_ABC(ROP_MOVE, local, top, 0));
+			break;
+		case SLOT_LOCAL:
+			if(slot->index != local)
+				emit(lower, REG_ABC(ROP_MOVE, local, slot->index, 0));
+			break;
+		case SLOT_CONST:
+			emit(lower, REG_ABC(ROP_LOADK, local, slot->index, 0));
+			break;
+		case SLOT_NIL:
+			emit(lower, REG_ABC(ROP_LOADNIL, local, 0, 0));
+			break;
+		case SLOT_TRUE:
+			emit(lower, REG_ABC(ROP_LOADBOOL, local, 1, 0));
+			break;
+		case SLOT_FALSE:
+			emit(lower, REG_ABC(ROP_LOADBOOL, local, 0, 0));
+			break;
+	}
+
+	lower->slots[local].kind = SLOT_REG;
+	// The assignment expression leaves its value behind, which is now the local
+	slot->kind = SLOT_LOCAL;
+	slot->index = local;
+}
+
+
+/*
+ * binary_op()
+ */
+static void binary_op(Lowering* lower, RegOpCode op)
+{
+	uint8_t b = operand(lower, lower->depth - 1);
+	uint8_t a = operand(lower, lower->depth - 2);
+	lower->depth--;
+
+	int dst = lower->depth - 1;
+	emit(lower, REG_ABC(op, dst, a, b));
+	lower->slots[dst].kind = SLOT_REG;
+}
+
+
+/*
+ * unary_op()
+ */
+static void unary_op(Lowering* lower, RegOpCode op)
+{
+	int dst = lower->depth - 1;
+	uint8_t a = operand(lower, dst);
+
+	emit(lower, REG_ABC(op, dst, a, 0));
+	lower->slots[dst].kind = SLOT_REG;
+}
+
+
+/*
+ * intrinsic_op()
+ * An intrinsic reads its operands like the other operators, but when
+ * it has to call the global instead it needs a register for the callee
+ * below each argument, starting at the destination, see run_registers().
+ */
+static void intrinsic_op(Lowering* lower, RegOpCode op, int arg_count)
+{
+	if(lower->depth >= UINT8_COUNT)
+	{
+		lower->ok = false;
+		return;
+	}
+
+	if(lower->depth + 1 > lower->out->max_regs)
+		lower->out->max_regs = lower->depth + 1;
+
+	if(arg_count == 1)
+		unary_op(lower, op);
+	else
+		binary_op(lower, op);
+}
+
+
+/*
+ * lower_function()
+ * Fill in function->reg_chunk from function->chunk. Returns false if the
+ * function needs more registers than an instruction can address.
+ */
+bool lower_function(ObjFunction* function)
+{
+	Chunk* chunk = &function->chunk;
+	RegChunk* out = &function->reg_chunk;
+
+	free_reg_chunk(out);
+
+	Lowering lower;
+	lower.out = out;
+	lower.depth = 0;
+	lower.line = 0;
+	lower.ok = true;
+
+	// Slot zero holds the callee and the parameters follow it
+	for(int i = 0; i <= function->arity; i++)
+		push_slot(&lower, SLOT_REG, 0);
+
+	bool* is_target = ALLOCATE(bool, chunk->count + 1);
+	int* target_depth = ALLOCATE(int, chunk->count + 1);
+	int* reg_at = ALLOCATE(int, chunk->count + 1);
+	JumpFixup* fixups = ALLOCATE(JumpFixup, chunk->count + 1);
+	int fixup_count = 0;
+
+	for(int i = 0; i <= chunk->count; i++)
+	{
+		is_target[i] = false;
+		target_depth[i] = -1;
+		reg_at[i] = 0;
+	}
+
+	// First pass finds the basic block boundaries
+	for(int offset = 0; offset < chunk->count; offset += instr_length(chunk, offset))
+	{
+		uint8_t instr = chunk->code[offset];
+		if(instr == OP_JUMP || instr == OP_JUMP_IF_FALSE || instr == OP_LOOP)
+			is_target[jump_target(chunk, offset)] = true;
+	}
+
+	bool falls_through = true;
+	for(int offset = 0; offset < chunk->count && lower.ok; offset += instr_length(chunk, offset))
+	{
+		uint8_t instr = chunk->code[offset];
+		lower.line = chunk->lines[offset];
+
+		if(is_target[offset])
+		{
+			if(falls_through)
+				flush(&lower);
+			if(target_depth[offset] != -1)
+				lower.depth = target_depth[offset];
+			for(int i = 0; i < lower.depth; i++)
+				lower.slots[i].kind = SLOT_REG;
+		}
+
+		reg_at[offset] = out->count;
+		falls_through = true;
+
+		switch(instr)
+		{
+			case OP_CONSTANT:
+				push_slot(&lower, SLOT_CONST, chunk->code[offset+1]);
+				break;
+			case OP_NIL:
+				push_slot(&lower, SLOT_NIL, 0);
+				break;
+			case OP_TRUE:
+				push_slot(&lower, SLOT_TRUE, 0);
+				break;
+			case OP_FALSE:
+				push_slot(&lower, SLOT_FALSE, 0);
+				break;
+
+			case OP_POP:
+				lower.depth--;
+				break;
+
+			case OP_DEFINE_GLOBAL: {
+				uint8_t src = operand(&lower, lower.depth - 1);
+				emit(&lower, REG_ABC(ROP_DEFINE_GLOBAL, src, chunk->code[offset+1], 0));
+				lower.depth--;
+				break;
+			}
+
+			case OP_GET_GLOBAL:
+				push_slot(&lower, SLOT_REG, 0);
+				emit(&lower, REG_ABC(ROP_GET_GLOBAL, lower.depth - 1, chunk->code[offset+1], 0));
+				break;
+
+			case OP_SET_GLOBAL: {
+				uint8_t src = operand(&lower, lower.depth - 1);
+				emit(&lower, REG_ABC(ROP_SET_GLOBAL, src, chunk->code[offset+1], 0));
+				break;
+			}
+
+			case OP_GET_LOCAL: {
+				uint8_t local = chunk->code[offset+1];
+				if(local < lower.depth)
+					materialize(&lower, local);
+				push_slot(&lower, SLOT_LOCAL, local);
+				break;
+			}
+
+			case OP_SET_LOCAL:
+				set_local(&lower, chunk->code[offset+1]);
+				break;
+
+			case OP_EQUAL:   binary_op(&lower, ROP_EQUAL); break;
+			case OP_GREATER: binary_op(&lower, ROP_GREATER); break;
+			case OP_LESS:    binary_op(&lower, ROP_LESS); break;
+			case OP_ADD:     binary_op(&lower, ROP_ADD); break;
+			case OP_SUB:     binary_op(&lower, ROP_SUB); break;
+			case OP_MUL:     binary_op(&lower, ROP_MUL); break;
+			case OP_DIV:     binary_op(&lower, ROP_DIV); break;
+			case OP_NOT:     unary_op(&lower, ROP_NOT); break;
+			case OP_NEGATE:  unary_op(&lower, ROP_NEGATE); break;
+
+#define INTRINSIC_1_CASE(op, name, fn) case OP_##op: intrinsic_op(&lower, ROP_##op, 1); break;
+#define INTRINSIC_2_CASE(op, name, fn) case OP_##op: intrinsic_op(&lower, ROP_##op, 2); break;
+			MATH_INTRINSICS_1(INTRINSIC_1_CASE)
+			MATH_INTRINSICS_2(INTRINSIC_2_CASE)
+#undef INTRINSIC_1_CASE
+#undef INTRINSIC_2_CASE
+
+			case OP_PRINT: {
+				uint8_t src = operand(&lower, lower.depth - 1);
+				emit(&lower, REG_ABC(ROP_PRINT, src, 0, 0));
+				lower.depth--;
+				break;
+			}
+
+			case OP_JUMP:
+			case OP_JUMP_IF_FALSE:
+			case OP_LOOP: {
+				int target = jump_target(chunk, offset);
+				flush(&lower);
+
+				if(instr != OP_LOOP)
+					target_depth[target] = lower.depth;
+
+				fixups[fixup_count].reg_offset = out->count;
+				fixups[fixup_count].target = target;
+				fixup_count++;
+
+				if(instr == OP_JUMP_IF_FALSE)
+					emit(&lower, REG_ASBX(ROP_JUMP_IF_FALSE, lower.depth - 1, 0));
+				else
+				{
+					emit(&lower, REG_ASBX(ROP_JUMP, 0, 0));
+					falls_through = false;
+				}
+				break;
+			}
+
+			case OP_CALL: {
+				int arg_count = chunk->code[offset+1];
+				int base = lower.depth - arg_count - 1;
+
+				// The callee and its arguments must sit in consecutive registers
+				for(int i = base; i < lower.depth; i++)
+					materialize(&lower, i);
+
+				emit(&lower, REG_ABC(ROP_CALL, base, arg_count, 0));
+				lower.depth = base + 1;
+				break;
+			}
+
+			case OP_RETURN: {
+				uint8_t src = operand(&lower, lower.depth - 1);
+				emit(&lower, REG_ABC(ROP_RETURN, src, 0, 0));
+				lower.depth--;
+				falls_through = false;
+				break;
+			}
+		}
+	}
+
+	// Now that every block has a register offset we can patch the jumps
+	for(int i = 0; i < fixup_count && lower.ok; i++)
+	{
+		int jump = reg_at[fixups[i].target] - (fixups[i].reg_offset + 1);
+		if(jump > INT16_MAX || jump < INT16_MIN)
+		{
+			lower.ok = false;
+			break;
+		}
+
+		RegInstr old = out->code[fixups[i].reg_offset];
+		out->code[fixups[i].reg_offset] = REG_ASBX(REG_OP(old), REG_A(old), jump);
+	}
+
+	FREE_ARRAY(bool, is_target, chunk->count + 1);
+	FREE_ARRAY(int, target_depth, chunk->count + 1);
+	FREE_ARRAY(int, reg_at, chunk->count + 1);
+	FREE_ARRAY(JumpFixup, fixups, chunk->count + 1);
+
+	if(!lower.ok)
+		free_reg_chunk(out);
+
+	return lower.ok;
+}
@@ -0,0 +1,16 @@
+/*
+ * LOWERING
+ * Translate the stack bytecode of a function into the
+ * three-address register format used by the register backend.
+ */
+
+#ifndef __LOX_LOWER_H
+#define __LOX_LOWER_H
+
+#include "object.h"
+
+
+bool lower_function(ObjFunction* function);
+
+
+#endif /*__LOX_LOWER_H*/
@@ -0,0 +1,322 @@
+#include <dlfcn.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lox.h"
+#include "object.h"
+#include "table.h"
+#include "vm.h"
+
+
+/*
+ * LoxVM
+ * The handle on a thread's VM. Arguments are pushed here rather than on
+ * the VM's stack, which is only in a known state between calls, and
+ * calls run on a fiber of their own so they start from the bottom of it.
+ */
+struct LoxVM {
+	ObjFiber* fiber;
+	Value args[LOX_ARGS_MAX];
+	int arg_count;
+	Value result;
+};
+
+
+static THREAD_LOCAL LoxVM* thread_vm = NULL;
+
+
+// ======== VALUES ======== //
+
+static LoxValue to_lox(Value value)
+{
+	switch(value.type)
+	{
+		case VAL_BOOL:   return lox_bool(AS_BOOL(value));
+		case VAL_NUMBER: return lox_number(AS_NUMBER(value));
+		case VAL_OBJ:
+			if(IS_STR(value))
+				return lox_string(AS_CSTRING(value), AS_STRING(value)->length);
+			return (LoxValue) {LOX_OBJECT, false, 0, NULL, 0, AS_OBJ(value)};
+		default:
+			return lox_nil();
+	}
+}
+
+
+static Value from_lox(LoxValue value)
+{
+	switch(value.type)
+	{
+		case LOX_BOOL:   return BOOL_VAL(value.boolean);
+		case LOX_NUMBER: return NUMBER_VAL(value.number);
+		case LOX_STRING: return OBJ_VAL(copy_string(value.string, value.length));
+		case LOX_OBJECT:
+			if(value.object != NULL)
+				return OBJ_VAL(value.object);
+			return NIL_VAL;
+		default:
+			return NIL_VAL;
+	}
+}
+
+
+// ======== VM ======== //
+
+/*
+ * host_vm()
+ * The handle on this thread's VM, made the first time it is needed when
+ * the VM was set up by clox rather than lox_new_vm().
+ */
+static LoxVM* host_vm(void)
+{
+	if(thread_vm == NULL)
+	{
+		thread_vm = malloc(sizeof(LoxVM));
+		thread_vm->fiber = new_fiber(NULL);
+		thread_vm->arg_count = 0;
+		thread_vm->result = NIL_VAL;
+	}
+
+	return thread_vm;
+}
+
+
+/*
+ * detach_host()
+ * free_vm() has freed the heap the handle points into.
+ */
+void detach_host(void)
+{
+	free(thread_vm);
+	thread_vm = NULL;
+}
+
+
+/*
+ * lox_new_vm()
+ * Set up the calling thread's VM, NULL if it already has one.
+ */
+LoxVM* lox_new_vm(void)
+{
+	if(thread_vm != NULL)
+		return NULL;
+
+	init_vm();
+	return host_vm();
+}
+
+
+/*
+ * lox_free_vm()
+ * Free the VM and everything it allocated, handles included.
+ */
+void lox_free_vm(LoxVM* lox)
+{
+	(void) lox;
+
+	free_vm();
+}
+
+
+/*
+ * lox_load()
+ * Compile and run a script, which defines the functions and globals
+ * later calls use.
+ */
+LoxStatus lox_load(LoxVM* lox, const char* source)
+{
+	(void) lox;
+
+	switch(interpret(source))
+	{
+		case INTERPRET_OK:            return LOX_OK;
+		case INTERPRET_COMPILE_ERROR: return LOX_COMPILE_ERROR;
+		default:                      return LOX_RUNTIME_ERROR;
+	}
+}
+
+
+/*
+ * lox_compile()
+ * Compile a script without running it, NULL after a compile error. The
+ * handle runs it each time it is passed to lox_call() with no arguments.
+ */
+LoxFunction* lox_compile(LoxVM* lox, const char* source)
+{
+	(void) lox;
+
+	return (LoxFunction*) compile_source(source);
+}
+
+
+/*
+ * lox_function()
+ * The function a global is set to, NULL if it is not set to one. Looking
+ * it up once and calling the handle saves a lookup per call.
+ */
+LoxFunction* lox_function(LoxVM* lox, const char* name)
+{
+	(void) lox;
+
+	Value value;
+	if(!table_get(&vm.globals, copy_string(name, (int) strlen(name)), &value) || !IS_FUNCTION(value))
+		return NULL;
+
+	return (LoxFunction*) AS_FUNCTION(value);
+}
+
+
+static void define_host_native(const char* name, LoxNative native, const char* signature, void* userdata)
+{
+	push(OBJ_VAL(copy_string(name, (int) strlen(name))));
+	ObjNative* host = new_native(NULL, AS_STRING(peek(0)));
+	host->host = native;
+	host->userdata = userdata;
+	set_signature(host, signature);
+	push(OBJ_VAL(host));
+	note_global(AS_STRING(peek(1)));
+	table_set(&vm.globals, AS_STRING(peek(1)), peek(0));
+	pop();
+	pop();
+}
+
+
+/*
+ * lox_define_native()
+ * Set a global to a native that calls back into the host.
+ */
+void lox_define_native(LoxVM* lox, const char* name, LoxNative native, void* userdata)
+{
+	(void) lox;
+
+	define_host_native(name, native, NULL, userdata);
+}
+
+
+/*
+ * lox_define_natives()
+ * Define every native in a table, all with the same userdata.
+ */
+void lox_define_natives(LoxVM* lox, const LoxNativeDef* natives, void* userdata)
+{
+	(void) lox;
+
+	for(const LoxNativeDef* def = natives; def->name != NULL; def++)
+		define_host_native(def->name, def->native, def->signature, userdata);
+}
+
+
+/*
+ * load_extension()
+ * Load a shared library and call its init function, NULL if it defined
+ * its natives or else what went wrong. The library stays loaded until
+ * the process exits, since its natives may be anywhere in the heap.
+ */
+const char* load_extension(const char* path)
+{
+	void* library = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+	if(library == NULL)
+		return dlerror();
+
+	const int* abi = dlsym(library, "lox_extension_abi");
+	bool (*init)(LoxVM*) = (bool (*)(LoxVM*)) dlsym(library, "lox_extension_init");
+	if(abi == NULL || init == NULL)
+		return "Not a Lox extension, it has no LOX_EXTENSION() function.";
+	if(*abi != LOX_ABI)
+		return "The extension was built for another version of lox.h.";
+
+	if(!init(host_vm()))
+		return "The extension failed to initialize.";
+
+	return NULL;
+}
+
+
+// ======== CALLS ======== //
+
+/*
+ * lox_push()
+ * Push an argument for the next call, false if there are already
+ * LOX_ARGS_MAX.
+ */
+bool lox_push(LoxVM* lox, LoxValue value)
+{
+	if(lox->arg_count == LOX_ARGS_MAX)
+		return false;
+
+	lox->args[lox->arg_count++] = from_lox(value);
+	return true;
+}
+
+
+/*
+ * lox_call()
+ * Call function with the last arg_count arguments pushed and run it to
+ * the end. Every pushed argument is used up, whether or not the call
+ * goes ahead. It can't be made from a native while the VM is running.
+ */
+LoxStatus lox_call(LoxVM* lox, LoxFunction* function, int arg_count)
+{
+	Obj* callee = (Obj*) function;
+	int pushed = lox->arg_count;
+
+	lox->arg_count = 0;
+	lox->result = NIL_VAL;
+
+	if(callee == NULL || callee->type != OBJ_FUNCTION)
+	{
+		fprintf(stderr, "lox_call() takes a function.\n");
+		return LOX_RUNTIME_ERROR;
+	}
+	if(arg_count < 0 || arg_count > pushed)
+	{
+		fprintf(stderr, "lox_call() was given %d arguments but %d were pushed.\n", arg_count, pushed);
+		return LOX_RUNTIME_ERROR;
+	}
+	if(vm.frame_count > 0)
+	{
+		fprintf(stderr, "lox_call() can't be made while the VM is running.\n");
+		return LOX_RUNTIME_ERROR;
+	}
+
+	vm.memory.exceeded = false;
+	if(call_fiber(lox->fiber, (ObjFunction*) callee, arg_count, &lox->args[pushed - arg_count]) != INTERPRET_OK)
+		return LOX_RUNTIME_ERROR;
+
+	lox->result = vm.stack[0];
+	vm.stack_top = vm.stack;
+
+	return LOX_OK;
+}
+
+
+/*
+ * lox_result()
+ * What the last call returned, nil if it failed.
+ */
+LoxValue lox_result(LoxVM* lox)
+{
+	return to_lox(lox->result);
+}
+
+
+/*
+ * call_host()
+ * Call a native the host defined. On failure result is the message it
+ * gave, or nil.
+ */
+bool call_host(ObjNative* native, int arg_count, Value* args, Value* result)
+{
+	LoxValue lox_args[LOX_ARGS_MAX];
+	for(int i = 0; i < arg_count; i++)
+		lox_args[i] = to_lox(args[i]);
+
+	LoxValue returned = lox_nil();
+	bool ok = native->host(thread_vm, arg_count, lox_args, &returned, native->userdata);
+
+	if(!ok && returned.type != LOX_STRING)
+		returned = lox_nil();
+
+	*result = from_lox(returned);
+	return ok;
+}
@@ -0,0 +1,170 @@
+/*
+ * LOX
+ * The embedding API. A host program makes a VM, loads scripts into it
+ * once and then calls their functions as often as it likes:
+ *
+ *     LoxVM* vm = lox_new_vm();
+ *     lox_load(vm, "func area(w, h) { return w * h; }");
+ *     LoxFunction* area = lox_function(vm, "area");
+ *
+ *     lox_push(vm, lox_number(3));
+ *     lox_push(vm, lox_number(4));
+ *     if(lox_call(vm, area, 2) == LOX_OK)
+ *         printf("%g\n", lox_result(vm).number);
+ *
+ *     lox_free_vm(vm);
+ *
+ * The VM is the calling thread's, so a thread can have one at a time and
+ * must make every call on it itself. VMs on different threads share
+ * nothing, not even the workers that run spawn()'s tasks. Nothing a VM
+ * allocates is freed before lox_free_vm(), so function handles, object
+ * handles and the strings in values it returns stay valid until then.
+ *
+ * An extension is a shared library that scripts load with
+ * load_extension("path.so"). It only uses this header and registers its
+ * natives from its init function:
+ *
+ *     static const LoxNativeDef natives[] = {
+ *         {"area", area, "nn"},
+ *         {NULL, NULL, NULL},
+ *     };
+ *
+ *     LOX_EXTENSION(vm)
+ *     {
+ *         lox_define_natives(vm, natives, NULL);
+ *         return true;
+ *     }
+ */
+
+#ifndef __LOX_H
+#define __LOX_H
+
+#include <stdbool.h>
+#include <string.h>
+
+
+#define LOX_ARGS_MAX 255			// arguments one call can take
+#define LOX_ABI 2					// changes whenever extensions have to be rebuilt
+
+
+typedef struct LoxVM LoxVM;
+typedef struct LoxFunction LoxFunction;		// a compiled Lox function
+
+
+typedef enum {
+	LOX_OK,
+	LOX_COMPILE_ERROR,
+	LOX_RUNTIME_ERROR,			// printed to stderr along with the stack trace
+} LoxStatus;
+
+
+typedef enum {
+	LOX_NIL,
+	LOX_BOOL,
+	LOX_NUMBER,
+	LOX_STRING,
+	LOX_OBJECT,					// a function, fiber, task or channel
+} LoxType;
+
+
+/*
+ * LoxValue
+ * A value on its way into or out of the VM. Strings going in are copied,
+ * strings coming out point at the VM's own characters, which end with a
+ * '\0'. object is a handle that can be passed back in.
+ */
+typedef struct {
+	LoxType type;
+	bool boolean;
+	double number;
+	const char* string;
+	int length;
+	void* object;
+} LoxValue;
+
+
+/*
+ * LoxNative
+ * A C function the host registers with lox_define_native(), called with
+ * the arguments and the userdata it was registered with. It stores what
+ * the call evaluates to in result, nil unless it does. Returning false
+ * raises a runtime error with result's string as the message, if it is
+ * one.
+ */
+typedef bool (*LoxNative)(LoxVM* vm, int arg_count, const LoxValue* args, LoxValue* result, void* userdata);
+
+
+/*
+ * LoxNativeDef
+ * An entry in a table of natives, which ends with one whose name is NULL.
+ * The signature has a character per argument: n for a number, s a
+ * string, b a boolean, f a function and * anything. A call that doesn't
+ * match it is a runtime error, raised before native is called, so
+ * native can read the arguments without checking them. A native without
+ * one takes any number of arguments of any type. The signature has to
+ * outlive the VM.
+ */
+typedef struct {
+	const char* name;
+	LoxNative native;
+	const char* signature;		// or NULL
+} LoxNativeDef;
+
+
+/*
+ * LOX_EXTENSION
+ * Starts the definition of an extension's init function, which
+ * load_extension() calls once the library is loaded. Returning false
+ * fails the load.
+ */
+#define LOX_EXTENSION(vm) \
+	const int lox_extension_abi = LOX_ABI; \
+	bool lox_extension_init(LoxVM* vm)
+
+
+LoxVM*       lox_new_vm(void);
+void         lox_free_vm(LoxVM* vm);
+
+LoxStatus    lox_load(LoxVM* vm, const char* source);
+LoxFunction* lox_compile(LoxVM* vm, const char* source);
+LoxFunction* lox_function(LoxVM* vm, const char* name);
+void         lox_define_native(LoxVM* vm, const char* name, LoxNative native, void* userdata);
+void         lox_define_natives(LoxVM* vm, const LoxNativeDef* natives, void* userdata);
+
+bool         lox_push(LoxVM* vm, LoxValue value);
+LoxStatus    lox_call(LoxVM* vm, LoxFunction* function, int arg_count);
+LoxValue     lox_result(LoxVM* vm);
+
+
+static inline LoxValue lox_nil(void)
+{
+	return (LoxValue) {LOX_NIL, false, 0, NULL, 0, NULL};
+}
+
+static inline LoxValue lox_bool(bool boolean)
+{
+	return (LoxValue) {LOX_BOOL, boolean, 0, NULL, 0, NULL};
+}
+
+static inline LoxValue lox_number(double number)
+{
+	return (LoxValue) {LOX_NUMBER, false, number, NULL, 0, NULL};
+}
+
+static inline LoxValue lox_string(const char* string, int length)
+{
+	return (LoxValue) {LOX_STRING, false, 0, string, length, NULL};
+}
+
+/*
+ * lox_error()
+ * For a native to fail with: return lox_error(result, "Bad input.");
+ */
+static inline bool lox_error(LoxValue* result, const char* message)
+{
+	*result = lox_string(message, (int) strlen(message));
+	return false;
+}
+
+
+#endif /*__LOX_H*/
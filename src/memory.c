@@ -1,15 +1,125 @@
 #include <stdlib.h>
 
+#include "channel.h"
 #include "memory.h"
+#include "scheduler.h"
 #include "vm.h"
 
 
 
+static const char* kind_names[] = {
+	[MEM_STRING]    = "string",
+	[MEM_FUNCTION]  = "function",
+	[MEM_NATIVE]    = "native",
+	[MEM_FIBER]     = "fiber",
+	[MEM_TASK]      = "task",
+	[MEM_CHANNEL]   = "channel",
+	[MEM_CHUNK]     = "chunk",
+	[MEM_CONSTANTS] = "constants",
+	[MEM_TABLE]     = "table",
+	[MEM_OTHER]     = "other",
+};
+
+
+/*
+ * memory_kind_name()
+ */
+const char* memory_kind_name(MemoryKind kind)
+{
+	return kind < MEM_KIND_COUNT ? kind_names[kind] : "?";
+}
+
+
+/*
+ * init_memory_stats()
+ */
+void init_memory_stats(MemoryStats* memory)
+{
+	memory->allocated = 0;
+	memory->freed = 0;
+	memory->live = 0;
+	memory->peak = 0;
+	memory->limit = 0;
+	memory->exceeded = false;
+
+	for(int i = 0; i < MEM_KIND_COUNT; i++)
+	{
+		memory->live_by_kind[i] = 0;
+		memory->peak_by_kind[i] = 0;
+	}
+}
+
+
+/*
+ * heap_has_room()
+ * Check an allocation whose size the script controls before making it.
+ * If it would go over the heap limit this marks the limit as exceeded.
+ */
+bool heap_has_room(size_t size)
+{
+	if(vm.memory.limit == 0 || vm.memory.live + size <= vm.memory.limit)
+		return true;
+
+	vm.memory.exceeded = true;
+
+	return false;
+}
+
+
+/*
+ * count_allocation()
+ */
+static inline void count_allocation(MemoryStats* memory, MemoryKind kind, size_t old_size, size_t new_size)
+{
+	if(new_size >= old_size)
+	{
+		memory->allocated += new_size - old_size;
+		memory->live += new_size - old_size;
+		memory->live_by_kind[kind] += new_size - old_size;
+	}
+	else
+	{
+		memory->freed += old_size - new_size;
+		memory->live -= old_size - new_size;
+		memory->live_by_kind[kind] -= old_size - new_size;
+	}
+
+	if(memory->live > memory->peak)
+		memory->peak = memory->live;
+	if(memory->live_by_kind[kind] > memory->peak_by_kind[kind])
+		memory->peak_by_kind[kind] = memory->live_by_kind[kind];
+
+	// The allocation still happens, the interpreter raises the error once
+	// it is back somewhere it can unwind from
+	if(memory->limit > 0 && memory->live > memory->limit)
+		memory->exceeded = true;
+}
+
+
 /*
  * reallocate()
  */
 void* reallocate(void* pointer, size_t old_size, size_t new_size)
 {
+	return reallocate_as(MEM_OTHER, pointer, old_size, new_size);
+}
+
+
+/*
+ * reallocate_as()
+ * reallocate() for memory of a known kind.
+ */
+void* reallocate_as(MemoryKind kind, void* pointer, size_t old_size, size_t new_size)
+{
+	count_allocation(&vm.memory, kind, old_size, new_size);
+
+	if(vm.timeline.enabled)
+		timeline_allocation(&vm.timeline, old_size, new_size, vm.memory.live);
+
+	// A block that is grown is charged to the site that grew it
+	if(vm.heap_profile.enabled)
+		heap_profile_free(&vm.heap_profile, pointer);
+
 	if(new_size == 0) {
 		free(pointer);
 		return NULL;
@@ -17,6 +127,9 @@ void* reallocate(void* pointer, size_t old_size, size_t new_size)
 
 	void* result = realloc(pointer, new_size);
 
+	if(vm.heap_profile.enabled && result != NULL)
+		heap_profile_alloc(&vm.heap_profile, result, new_size, kind);
+
 	return result;
 }
 
@@ -31,18 +144,40 @@ void free_object(Obj* object)
 	{
 		case OBJ_STRING: {
 			ObjString* str = (ObjString*) object;
-			FREE_ARRAY(char, str->chars, str->length + 1);
-			FREE(ObjString, object);
+			if(str->shared)
+				release_string(SHARED_STRING(str->chars));
+			else
+				FREE_ARRAY_AS(MEM_STRING, char, str->chars, str->length + 1);
+			FREE_AS(MEM_STRING, ObjString, object);
 			break;
 		}
 		case OBJ_FUNCTION: {
 			ObjFunction* function = (ObjFunction*) object;
+			FREE_ARRAY_AS(MEM_FUNCTION, uint64_t, function->hits, function->chunk.count);
 			free_chunk(&function->chunk);
-			FREE(ObjFunction, object);
+			free_reg_chunk(&function->reg_chunk);
+			FREE_AS(MEM_FUNCTION, ObjFunction, object);
 			break;
 		}
 		case OBJ_NATIVE: {
-			FREE(ObjNative, object);
+			FREE_AS(MEM_NATIVE, ObjNative, object);
+			break;
+		}
+		case OBJ_FIBER: {
+			ObjFiber* fiber = (ObjFiber*) object;
+			FREE_ARRAY_AS(MEM_FIBER, CallFrame, fiber->frames, fiber->frame_capacity);
+			FREE_ARRAY_AS(MEM_FIBER, Value, fiber->stack, fiber->stack_capacity);
+			FREE_AS(MEM_FIBER, ObjFiber, object);
+			break;
+		}
+		case OBJ_TASK: {
+			release_task(((ObjTask*) object)->task);
+			FREE_AS(MEM_TASK, ObjTask, object);
+			break;
+		}
+		case OBJ_CHANNEL: {
+			release_channel(((ObjChannel*) object)->channel);
+			FREE_AS(MEM_CHANNEL, ObjChannel, object);
 			break;
 		}
 	}
@@ -64,3 +199,33 @@ void free_objects(void)
 		object = next;
 	}
 }
+
+
+/*
+ * print_memory_stats()
+ * The value stack and call frames are a fixed part of the VM rather
+ * than heap, stack_bytes is listed for comparison.
+ */
+void print_memory_stats(MemoryStats* memory, size_t stack_bytes, FILE* file)
+{
+	fprintf(file, "==== memory ====\n");
+	fprintf(file, "%-16s %14lu\n", "allocated", (unsigned long) memory->allocated);
+	fprintf(file, "%-16s %14lu\n", "freed", (unsigned long) memory->freed);
+	fprintf(file, "%-16s %14lu\n", "live", (unsigned long) memory->live);
+	fprintf(file, "%-16s %14lu\n", "peak", (unsigned long) memory->peak);
+	if(memory->limit > 0)
+		fprintf(file, "%-16s %14lu%s\n", "limit", (unsigned long) memory->limit, memory->exceeded ? " (exceeded)" : "");
+
+	uint64_t objects_live = 0;
+	for(int k = MEM_STRING; k <= MEM_CHANNEL; k++)
+		objects_live += memory->live_by_kind[k];
+
+	fprintf(file, "\n%-16s %14s %14s\n", "kind", "live", "peak");
+	for(int k = 0; k < MEM_KIND_COUNT; k++)
+	{
+		fprintf(file, "%-16s %14lu %14lu\n", kind_names[k],
+				(unsigned long) memory->live_by_kind[k], (unsigned long) memory->peak_by_kind[k]);
+	}
+	fprintf(file, "%-16s %14lu %14s\n", "objects", (unsigned long) objects_live, "");
+	fprintf(file, "%-16s %14lu %14s\n", "stack (fixed)", (unsigned long) stack_bytes, "");
+}
@@ -5,12 +5,53 @@
 #ifndef __LOX_MEMORY_H
 #define __LOX_MEMORY_H
 
+#include <stdio.h>
+
 #include "common.h"
 #include "object.h"
 
 
-#define ALLOCATE(type, count) \
-	(type*) reallocate(NULL, 0, sizeof(type) * (count))
+/*
+ * MemoryKind
+ * What an allocation is for, so the heap profiler can break memory down.
+ * The plain macros below allocate MEM_OTHER, the _AS variants take a kind.
+ */
+typedef enum {
+	MEM_STRING,			// ObjString and its characters
+	MEM_FUNCTION,		// ObjFunction and its hotness counters
+	MEM_NATIVE,			// ObjNative
+	MEM_FIBER,			// ObjFiber and the frames and values it has saved
+	MEM_TASK,			// ObjTask, the handles spawn() returns
+	MEM_CHANNEL,		// ObjChannel, the handles channel() returns
+	MEM_CHUNK,			// bytecode and line arrays of both backends
+	MEM_CONSTANTS,		// value arrays
+	MEM_TABLE,			// hash table entries
+	MEM_OTHER,			// diagnostics and temporary buffers
+	MEM_KIND_COUNT,
+} MemoryKind;
+
+
+/*
+ * MemoryStats
+ * Everything that goes through reallocate(), counted by the sizes the
+ * callers pass in. The limit is checked against live bytes.
+ */
+typedef struct {
+	uint64_t allocated;
+	uint64_t freed;
+	uint64_t live;
+	uint64_t peak;
+	uint64_t live_by_kind[MEM_KIND_COUNT];
+	uint64_t peak_by_kind[MEM_KIND_COUNT];
+	uint64_t limit;				// 0 for no limit
+	bool exceeded;				// an allocation went over the limit or was refused
+} MemoryStats;
+
+
+#define ALLOCATE(type, count) ALLOCATE_AS(MEM_OTHER, type, count)
+
+#define ALLOCATE_AS(kind, type, count) \
+	(type*) reallocate_as(kind, NULL, 0, sizeof(type) * (count))
 
 
 // Scale the capacity increase by a factor of 2 each time
@@ -20,19 +61,30 @@
 
 // Macro to build new array
 #define GROW_ARRAY(type, pointer, old_count, new_count) \
-	(type*) reallocate( \
+	GROW_ARRAY_AS(MEM_OTHER, type, pointer, old_count, new_count)
+
+#define GROW_ARRAY_AS(kind, type, pointer, old_count, new_count) \
+	(type*) reallocate_as( \
+			kind, \
 			pointer, \
 			sizeof(type) * (old_count), \
 			sizeof(type) * (new_count)) 
 
-#define FREE(type, pointer) reallocate(pointer, sizeof(type), 0)
+#define FREE(type, pointer) FREE_AS(MEM_OTHER, type, pointer)
+#define FREE_AS(kind, type, pointer) reallocate_as(kind, pointer, sizeof(type), 0)
 
-#define FREE_ARRAY(type, pointer, old_count) \
-	reallocate(pointer, sizeof(type) * (old_count), 0)
+#define FREE_ARRAY(type, pointer, old_count) FREE_ARRAY_AS(MEM_OTHER, type, pointer, old_count)
+#define FREE_ARRAY_AS(kind, type, pointer, old_count) \
+	reallocate_as(kind, pointer, sizeof(type) * (old_count), 0)
 
 
 // TODO: implement a custom allocator.
 void* reallocate(void* pointer, size_t old_size, size_t new_size);
+void* reallocate_as(MemoryKind kind, void* pointer, size_t old_size, size_t new_size);
+const char* memory_kind_name(MemoryKind kind);
+void init_memory_stats(MemoryStats* memory);
+bool heap_has_room(size_t size);
+void print_memory_stats(MemoryStats* memory, size_t stack_bytes, FILE* file);
 void free_objects(void);
 
 
@@ -2,6 +2,7 @@
 #include <string.h>
 
 #include "object.h"
+#include "scheduler.h"
 #include "table.h"
 #include "value.h"
 #include "memory.h"
@@ -9,8 +10,8 @@
 
 
 
-#define ALLOCATE_OBJ(type, obj_type) \
-	(type*) allocate_object(sizeof(type), obj_type)
+#define ALLOCATE_OBJ(type, obj_type, kind) \
+	(type*) allocate_object(sizeof(type), obj_type, kind)
 
 
 /*
@@ -31,9 +32,9 @@ static uint32_t hash_string(const char* key, int length)
 }
 
 
-static Obj* allocate_object(size_t size, ObjType type)
+static Obj* allocate_object(size_t size, ObjType type, MemoryKind kind)
 {
-	Obj* object = (Obj*) reallocate(NULL, 0, size);
+	Obj* object = (Obj*) reallocate_as(kind, NULL, 0, size);
 	object->type = type;
 	object->next = vm.objects;
 	vm.objects = object;
@@ -44,11 +45,14 @@ static Obj* allocate_object(size_t size, ObjType type)
 
 ObjString* make_objstring(char* chars, int length)
 {
-	ObjString* str = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+	ObjString* str = ALLOCATE_OBJ(ObjString, OBJ_STRING, MEM_STRING);
 
 	str->chars = chars;
 	str->length = length;
 	str->hash = hash_string(chars, length);
+	str->shared = false;
+	str->intrinsic = 0;
+	str->read_in_function = false;
 
 	return str;
 }
@@ -58,10 +62,13 @@ ObjString* make_objstring(char* chars, int length)
  */
 static ObjString* allocate_string(char* chars, int length, uint32_t hash)
 {
-	ObjString* str = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+	ObjString* str = ALLOCATE_OBJ(ObjString, OBJ_STRING, MEM_STRING);
 	str->length = length;
 	str->chars = chars;
 	str->hash = hash;
+	str->shared = false;
+	str->intrinsic = 0;
+	str->read_in_function = false;
 
 	// Add this string to deduplication table 
 	table_set(&vm.strings, str, NIL_VAL);
@@ -84,7 +91,7 @@ ObjString* copy_string(const char* chars, int length)
 	if(interned != NULL)
 		return interned; 
 
-	char* heap_chars = ALLOCATE(char, length + 1);
+	char* heap_chars = ALLOCATE_AS(MEM_STRING, char, length + 1);
 	memcpy(heap_chars, chars, length);
 	heap_chars[length] = '\0';
 	
@@ -105,7 +112,7 @@ ObjString* take_string(char* chars, int length)
 	ObjString* interned = table_find_string(&vm.strings, chars, length, hash);
 	if(interned != NULL)
 	{
-		FREE_ARRAY(char, chars, length + 1);
+		FREE_ARRAY_AS(MEM_STRING, char, chars, length + 1);
 		return interned;
 	}
 
@@ -113,17 +120,41 @@ ObjString* take_string(char* chars, int length)
 }
 
 
+/*
+ * copy_shared_string()
+ * An ObjString for the characters of a SharedString, another VM's. This
+ * VM's own string if it has interned one that is equal, otherwise a new
+ * one that refers to the same characters rather than a copy.
+ */
+ObjString* copy_shared_string(SharedString* string)
+{
+	ObjString* interned = table_find_string(&vm.strings, string->chars, string->length, string->hash);
+	if(interned != NULL)
+		return interned;
+
+	__atomic_add_fetch(&string->refs, 1, __ATOMIC_RELAXED);
+	ObjString* str = allocate_string(string->chars, string->length, string->hash);
+	str->shared = true;
+
+	return str;
+}
+
+
 /*
  * Function
  */
 
 ObjFunction* new_function(void)
 {
-	ObjFunction* function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
+	ObjFunction* function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION, MEM_FUNCTION);
 
 	function->arity = 0;
+	function->id = vm.function_count++;
 	function->name = NULL;
+	function->call_cost = 0;
+	function->hits = NULL;
 	init_chunk(&function->chunk);
+	init_reg_chunk(&function->reg_chunk);
 
 	return function;
 }
@@ -132,15 +163,94 @@ ObjFunction* new_function(void)
 /*
  * new_native()
  */
-ObjNative* new_native(NativeFn function)
+ObjNative* new_native(NativeFn function, ObjString* name)
 {
-	ObjNative* native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
+	ObjNative* native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE, MEM_NATIVE);
 	native->function = function;
+	native->control = NULL;
+	native->host = NULL;
+	native->userdata = NULL;
+	native->number1 = NULL;
+	native->number2 = NULL;
+	native->signature = NULL;
+	native->arity = ANY_ARITY;
+	native->name = name;
 	
 	return native;
 }
 
 
+/*
+ * new_control_native()
+ */
+ObjNative* new_control_native(ControlFn control, ObjString* name)
+{
+	ObjNative* native = new_native(NULL, name);
+	native->control = control;
+
+	return native;
+}
+
+
+/*
+ * set_signature()
+ * One character per argument: n number, s string, b boolean, f function
+ * and * anything. NULL for any number of arguments of any type.
+ */
+void set_signature(ObjNative* native, const char* signature)
+{
+	native->signature = signature;
+	native->arity = signature != NULL ? (int) strlen(signature) : ANY_ARITY;
+}
+
+
+/*
+ * new_fiber()
+ */
+ObjFiber* new_fiber(ObjFunction* function)
+{
+	ObjFiber* fiber = ALLOCATE_OBJ(ObjFiber, OBJ_FIBER, MEM_FIBER);
+	fiber->state = FIBER_NEW;
+	fiber->function = function;
+	fiber->caller = NULL;
+	fiber->frame_base = 0;
+	fiber->stack_base = NULL;
+	fiber->frames = NULL;
+	fiber->frame_count = 0;
+	fiber->frame_capacity = 0;
+	fiber->stack = NULL;
+	fiber->stack_count = 0;
+	fiber->stack_capacity = 0;
+
+	return fiber;
+}
+
+
+/*
+ * new_task()
+ */
+ObjTask* new_task(struct Task* task, ObjFunction* function)
+{
+	ObjTask* handle = ALLOCATE_OBJ(ObjTask, OBJ_TASK, MEM_TASK);
+	handle->task = task;
+	handle->function = function;
+
+	return handle;
+}
+
+
+/*
+ * new_channel()
+ */
+ObjChannel* new_channel(struct Channel* channel)
+{
+	ObjChannel* handle = ALLOCATE_OBJ(ObjChannel, OBJ_CHANNEL, MEM_CHANNEL);
+	handle->channel = channel;
+
+	return handle;
+}
+
+
 
 void print_object(Value value)
 {
@@ -160,5 +270,36 @@ void print_object(Value value)
 		case OBJ_NATIVE:
 			fprintf(stdout, "<native fn>");
 			break;
+		case OBJ_FIBER:
+			fprintf(stdout, "<fiber %s>", callable_name((Obj*) AS_FIBER(value)->function));
+			break;
+		case OBJ_TASK:
+			fprintf(stdout, "<task %s>", callable_name((Obj*) AS_TASK(value)->function));
+			break;
+		case OBJ_CHANNEL:
+			fprintf(stdout, "<channel>");
+			break;
+	}
+}
+
+
+/*
+ * callable_name()
+ * Name of a function or native, for reports and profiles.
+ */
+const char* callable_name(Obj* object)
+{
+	switch(object->type)
+	{
+		case OBJ_FUNCTION: {
+			ObjFunction* function = (ObjFunction*) object;
+			return function->name == NULL ? "<script>" : function->name->chars;
+		}
+		case OBJ_NATIVE: {
+			ObjNative* native = (ObjNative*) object;
+			return native->name == NULL ? "<native fn>" : native->name->chars;
+		}
+		default:
+			return "<object>";
 	}
 }
@@ -7,6 +7,8 @@
 
 #include "common.h"
 #include "chunk.h"
+#include "lox.h"
+#include "regchunk.h"
 #include "value.h"
 
 
@@ -15,17 +17,27 @@
 #define IS_STR(value)      is_obj_type(value, OBJ_STRING)
 #define IS_FUNCTION(value) is_obj_type(value, OBJ_FUNCTION)
 #define IS_NATIVE(value)   is_obj_type(value, OBJ_NATIVE)
+#define IS_FIBER(value)    is_obj_type(value, OBJ_FIBER)
+#define IS_TASK(value)     is_obj_type(value, OBJ_TASK)
+#define IS_CHANNEL(value)  is_obj_type(value, OBJ_CHANNEL)
 
 #define AS_STRING(value)   ((ObjString*)AS_OBJ(value))
 #define AS_CSTRING(value)  (((ObjString*)AS_OBJ(value))->chars)
 #define AS_FUNCTION(value) ((ObjFunction*)AS_OBJ(value))
 #define AS_NATIVE(value)   (((ObjNative*)AS_OBJ(value))->function)
+#define AS_NATIVE_OBJ(value) ((ObjNative*)AS_OBJ(value))
+#define AS_FIBER(value)    ((ObjFiber*)AS_OBJ(value))
+#define AS_TASK(value)     ((ObjTask*)AS_OBJ(value))
+#define AS_CHANNEL(value)  ((ObjChannel*)AS_OBJ(value))
 
 
 typedef enum {
 	OBJ_STRING,
 	OBJ_FUNCTION,
 	OBJ_NATIVE,
+	OBJ_FIBER,
+	OBJ_TASK,
+	OBJ_CHANNEL,
 } ObjType;
 
 
@@ -46,11 +58,17 @@ struct ObjString {
 	int length;
 	char* chars;
 	uint32_t hash;
+	bool shared;		// chars belong to a SharedString, see scheduler.h
+	uint8_t intrinsic;	// Intrinsic + 1 for the names in intrinsics.h, else 0
+	bool read_in_function;	// a function reads the global of this name, see vm.read_globals
 };
 
+struct SharedString;
+
 ObjString* make_objstring(char* chars, int length);
 ObjString* copy_string(const char* chars, int length);
 ObjString* take_string(char* chars, int length);
+ObjString* copy_shared_string(struct SharedString* string);
 
 
 // ==== Regular Functions ===== /
@@ -61,8 +79,12 @@ ObjString* take_string(char* chars, int length);
 typedef struct {
 	Obj obj;
 	int arity;
+	int id;					// functions are numbered in the order they are compiled
 	Chunk chunk;
+	RegChunk reg_chunk;		// only filled in for the register backend
 	ObjString* name;
+	int call_cost;			// instructions outside of its loops, charged to each call, see ExecLimits
+	uint64_t* hits;			// dispatches per code offset, only filled in with --hotness
 } ObjFunction;
 
 
@@ -71,17 +93,114 @@ ObjFunction* new_function(void);
 // ==== Native Functions ===== //
 typedef Value (*NativeFn)(int arg_count, Value* args);
 
+// Natives that switch fibers, or can fail, manage the stack themselves.
+// They replace the callee and arguments with the result, or with what
+// the fiber they switch to is waiting for, and return false after a
+// runtime error.
+typedef bool (*ControlFn)(int arg_count, Value* args);
+
+#define ANY_ARITY -1
+
+// Natives whose signature is all numbers, with a number result, are
+// called with the numbers unboxed
+typedef double (*Number1Fn)(double a);
+typedef double (*Number2Fn)(double a, double b);
+
 typedef struct {
 	Obj obj;				// header
 	NativeFn function;		// pointer to C function that implements behaviour
+	ControlFn control;		// used instead of function when not NULL
+	LoxNative host;			// registered by the embedder, used instead of both
+	void* userdata;			// passed to host
+	Number1Fn number1;		// used instead of all of them when not NULL
+	Number2Fn number2;
+	const char* signature;	// argument types checked before the call, NULL for none
+	int arity;				// length of signature, ANY_ARITY without one
+	ObjString* name;		// name the native was registered under
 } ObjNative;
 
 
-ObjNative* new_native(NativeFn function);
+ObjNative* new_native(NativeFn function, ObjString* name);
+ObjNative* new_control_native(ControlFn control, ObjString* name);
+void set_signature(ObjNative* native, const char* signature);
+
+
+// ==== Fibers ===== //
+struct CallFrame;
+
+typedef enum {
+	FIBER_NEW,				// not resumed yet
+	FIBER_RUNNING,			// its frames are on the VM's stack
+	FIBER_SUSPENDED,		// stopped in yield(), its frames are saved in the fiber
+	FIBER_WAITING,			// suspended until the event loop finishes its I/O
+	FIBER_DONE,				// returned, or stopped by a runtime error
+} FiberState;
+
+
+/*
+ * Fiber
+ * A function that can stop part way with yield() and carry on where
+ * it left off when it is resumed. While it runs, frame_base and
+ * stack_base are where its frames and values start on the VM's stack.
+ */
+typedef struct ObjFiber {
+	Obj obj;
+	FiberState state;
+	ObjFunction* function;
+	struct ObjFiber* caller;	// the fiber that resumed it, NULL for the script
+	int frame_base;
+	Value* stack_base;
+	struct CallFrame* frames;	// saved while suspended
+	int frame_count;
+	int frame_capacity;
+	Value* stack;				// saved while suspended
+	int stack_count;
+	int stack_capacity;
+} ObjFiber;
+
+
+ObjFiber* new_fiber(ObjFunction* function);
+
+
+// ==== Tasks ===== //
+struct Task;
+
+/*
+ * Task handle
+ * What spawn() returns. The task itself lives outside of any VM's heap,
+ * see scheduler.h, the handle holds a reference to it.
+ */
+typedef struct {
+	Obj obj;
+	struct Task* task;
+	ObjFunction* function;
+} ObjTask;
+
+
+ObjTask* new_task(struct Task* task, ObjFunction* function);
+
+
+// ==== Channels ===== //
+struct Channel;
+
+/*
+ * Channel handle
+ * What channel() returns, holding a reference to a channel that lives
+ * outside of any VM's heap, see channel.h. A channel sent to another VM
+ * gets a handle of its own there.
+ */
+typedef struct {
+	Obj obj;
+	struct Channel* channel;
+} ObjChannel;
+
+
+ObjChannel* new_channel(struct Channel* channel);
 
 
 // Other junk
 void print_object(Value value);
+const char* callable_name(Obj* object);
 
 static inline bool is_obj_type(Value value, ObjType type)
 {
@@ -0,0 +1,52 @@
+#include "peephole.h"
+
+
+
+/*
+ * matches_super()
+ * Check if the instructions starting at offset are the sequence 
+ * replaced by super.
+ */
+static bool matches_super(Chunk* chunk, int offset, const SuperInstr* super)
+{
+	for(int i = 0; i < super->count; i++)
+	{
+		if(offset >= chunk->count || chunk->code[offset] != super->ops[i])
+			return false;
+
+		// Only the last instruction of a sequence may leave the frame or jump
+		if(i < super->count - 1 && is_branch_op(super->ops[i]))
+			return false;
+
+		offset += instr_length(chunk, offset);
+	}
+
+	return true;
+}
+
+
+/*
+ * fuse_superinstructions()
+ * Replace the first opcode of every sequence that has a superinstruction
+ * with that superinstruction, preferring the longest match. Nothing
+ * else in the chunk moves so jumps into the middle of a sequence still 
+ * land on the original instruction.
+ */
+void fuse_superinstructions(Chunk* chunk)
+{
+	for(int offset = 0; offset < chunk->count; offset += instr_length(chunk, offset))
+	{
+		int best = -1;
+
+		for(int i = 0; i < super_instr_count; i++)
+		{
+			if(!matches_super(chunk, offset, &super_instrs[i]))
+				continue;
+			if(best == -1 || super_instrs[i].count > super_instrs[best].count)
+				best = i;
+		}
+
+		if(best != -1)
+			chunk->code[offset] = (uint8_t) (OP_BASE_COUNT + best);
+	}
+}
@@ -0,0 +1,15 @@
+/*
+ * PEEPHOLE
+ * Rewrites that run over a finished chunk.
+ */
+
+#ifndef __LOX_PEEPHOLE_H
+#define __LOX_PEEPHOLE_H
+
+#include "chunk.h"
+
+
+void fuse_superinstructions(Chunk* chunk);
+
+
+#endif /*__LOX_PEEPHOLE_H*/
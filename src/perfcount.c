@@ -0,0 +1,250 @@
+// syscall() is neither C99 nor POSIX
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif /*__linux__*/
+
+#include "perfcount.h"
+
+
+static const char* counter_names[] = {
+	[PERF_TASK_CLOCK]    = "task-clock",
+	[PERF_CYCLES]        = "cycles",
+	[PERF_INSTRUCTIONS]  = "instructions",
+	[PERF_BRANCHES]      = "branches",
+	[PERF_BRANCH_MISSES] = "branch-misses",
+	[PERF_L1D_MISSES]    = "L1d-misses",
+	[PERF_LLC_MISSES]    = "LLC-misses",
+};
+
+static const char* phase_names[] = {
+	[PERF_PHASE_COMPILE]  = "compile",
+	[PERF_PHASE_RUN]      = "run",
+	[PERF_PHASE_TEARDOWN] = "teardown",
+};
+
+
+/*
+ * init_perf()
+ */
+void init_perf(PerfCounters* perf)
+{
+	perf->enabled = false;
+	perf->error = 0;
+	perf->dispatches = 0;
+
+	for(int i = 0; i < PERF_COUNTER_COUNT; i++)
+	{
+		perf->fds[i] = -1;
+		perf->start[i] = 0;
+		for(int p = 0; p < PERF_PHASE_COUNT; p++)
+			perf->totals[p][i] = 0;
+	}
+}
+
+
+/*
+ * free_perf()
+ */
+void free_perf(PerfCounters* perf)
+{
+	for(int i = 0; i < PERF_COUNTER_COUNT; i++)
+	{
+		if(perf->fds[i] >= 0)
+			close(perf->fds[i]);
+	}
+
+	init_perf(perf);
+}
+
+
+#ifdef __linux__
+/*
+ * open_counter()
+ * Count one event for this thread in user space only, so that the
+ * figures don't depend on perf_event_paranoid allowing kernel counts.
+ */
+static int open_counter(uint32_t type, uint64_t config)
+{
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = type;
+	attr.config = config;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+	return (int) syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+
+#define CACHE_READ_MISSES(cache) \
+	((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+/*
+ * start_perf()
+ * Open every counter we can. Returns false if none of them could be
+ * opened, in which case perf->error says why.
+ */
+bool start_perf(PerfCounters* perf)
+{
+	static const struct {
+		uint32_t type;
+		uint64_t config;
+	} events[] = {
+		[PERF_TASK_CLOCK]    = {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK},
+		[PERF_CYCLES]        = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+		[PERF_INSTRUCTIONS]  = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+		[PERF_BRANCHES]      = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS},
+		[PERF_BRANCH_MISSES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+		[PERF_L1D_MISSES]    = {PERF_TYPE_HW_CACHE, CACHE_READ_MISSES(PERF_COUNT_HW_CACHE_L1D)},
+		[PERF_LLC_MISSES]    = {PERF_TYPE_HW_CACHE, CACHE_READ_MISSES(PERF_COUNT_HW_CACHE_LL)},
+	};
+
+	bool opened = false;
+
+	for(int i = 0; i < PERF_COUNTER_COUNT; i++)
+	{
+		perf->fds[i] = open_counter(events[i].type, events[i].config);
+		if(perf->fds[i] >= 0)
+			opened = true;
+		else if(perf->error == 0)
+			perf->error = errno;
+	}
+
+	perf->enabled = opened;
+
+	return opened;
+}
+
+#undef CACHE_READ_MISSES
+
+
+/*
+ * perf_read()
+ * Current value of each counter. When the kernel had to multiplex a
+ * counter it only ran for part of the time, so the count is scaled up.
+ */
+void perf_read(PerfCounters* perf, uint64_t* values)
+{
+	for(int i = 0; i < PERF_COUNTER_COUNT; i++)
+	{
+		// value, time enabled, time running
+		uint64_t data[3];
+
+		values[i] = 0;
+		if(perf->fds[i] < 0 || read(perf->fds[i], data, sizeof(data)) != sizeof(data))
+			continue;
+
+		if(data[2] > 0 && data[2] < data[1])
+			values[i] = (uint64_t) ((double) data[0] * (double) data[1] / (double) data[2]);
+		else
+			values[i] = data[0];
+	}
+}
+#else
+bool start_perf(PerfCounters* perf)
+{
+	perf->error = ENOSYS;
+
+	return false;
+}
+
+
+void perf_read(PerfCounters* perf, uint64_t* values)
+{
+	for(int i = 0; i < PERF_COUNTER_COUNT; i++)
+		values[i] = 0;
+}
+#endif /*__linux__*/
+
+
+/*
+ * perf_has_hardware()
+ * True if at least one counter other than the task clock is open.
+ */
+bool perf_has_hardware(PerfCounters* perf)
+{
+	for(int i = PERF_CYCLES; i < PERF_COUNTER_COUNT; i++)
+	{
+		if(perf->fds[i] >= 0)
+			return true;
+	}
+
+	return false;
+}
+
+
+static void print_count(PerfCounters* perf, FILE* file, PerfCounter counter, uint64_t value)
+{
+	if(perf->fds[counter] < 0)
+		fprintf(file, " %14s", "n/a");
+	else
+		fprintf(file, " %14lu", (unsigned long) value);
+}
+
+
+static void print_per_bytecode(PerfCounters* perf, FILE* file, PerfCounter counter, uint64_t value)
+{
+	if(perf->fds[counter] >= 0)
+		fprintf(file, "%-16s %12.3f\n", counter_names[counter], (double) value / (double) perf->dispatches);
+}
+
+
+/*
+ * print_perf()
+ */
+void print_perf(PerfCounters* perf, FILE* file)
+{
+	uint64_t total[PERF_COUNTER_COUNT];
+	for(int i = 0; i < PERF_COUNTER_COUNT; i++)
+	{
+		total[i] = 0;
+		for(int p = 0; p < PERF_PHASE_COUNT; p++)
+			total[i] += perf->totals[p][i];
+	}
+
+	fprintf(file, "==== perf counters ====\n");
+	fprintf(file, "%-10s %10s", "phase", "ms");
+	for(int i = PERF_CYCLES; i < PERF_COUNTER_COUNT; i++)
+		fprintf(file, " %14s", counter_names[i]);
+	fprintf(file, " %6s\n", "IPC");
+
+	for(int p = 0; p <= PERF_PHASE_COUNT; p++)
+	{
+		uint64_t* values = p < PERF_PHASE_COUNT ? perf->totals[p] : total;
+
+		fprintf(file, "%-10s", p < PERF_PHASE_COUNT ? phase_names[p] : "total");
+		if(perf->fds[PERF_TASK_CLOCK] < 0)
+			fprintf(file, " %10s", "n/a");
+		else
+			fprintf(file, " %10.3f", (double) values[PERF_TASK_CLOCK] / 1e6);
+
+		for(int i = PERF_CYCLES; i < PERF_COUNTER_COUNT; i++)
+			print_count(perf, file, i, values[i]);
+
+		if(perf->fds[PERF_CYCLES] >= 0 && perf->fds[PERF_INSTRUCTIONS] >= 0 && values[PERF_CYCLES] > 0)
+			fprintf(file, " %6.2f", (double) values[PERF_INSTRUCTIONS] / (double) values[PERF_CYCLES]);
+		else
+			fprintf(file, " %6s", "n/a");
+		fprintf(file, "\n");
+	}
+
+	if(perf->dispatches == 0)
+		return;
+
+	uint64_t* run = perf->totals[PERF_PHASE_RUN];
+
+	fprintf(file, "\n==== per bytecode (%lu executed) ====\n", (unsigned long) perf->dispatches);
+	if(perf->fds[PERF_TASK_CLOCK] >= 0)
+		fprintf(file, "%-16s %12.3f\n", "ns", (double) run[PERF_TASK_CLOCK] / (double) perf->dispatches);
+	for(int i = PERF_CYCLES; i < PERF_COUNTER_COUNT; i++)
+		print_per_bytecode(perf, file, i, run[i]);
+}
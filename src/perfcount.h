@@ -0,0 +1,88 @@
+/*
+ * HARDWARE COUNTERS
+ * Linux perf_event counters read at the start and end of each phase
+ * of a run (compiling, running, tearing down the VM), so that time can
+ * be split into cycles, instructions, branch misses and cache misses.
+ * Counters the kernel or CPU won't give us are left out of the report,
+ * and on other platforms nothing can be opened at all.
+ */
+
+#ifndef __LOX_PERFCOUNT_H
+#define __LOX_PERFCOUNT_H
+
+#include <stdio.h>
+
+#include "common.h"
+
+
+typedef enum {
+	PERF_TASK_CLOCK,		// software counter, nanoseconds on the CPU
+	PERF_CYCLES,
+	PERF_INSTRUCTIONS,
+	PERF_BRANCHES,
+	PERF_BRANCH_MISSES,
+	PERF_L1D_MISSES,
+	PERF_LLC_MISSES,
+	PERF_COUNTER_COUNT,
+} PerfCounter;
+
+
+typedef enum {
+	PERF_PHASE_COMPILE,		// scanning and compiling, they are one pass
+	PERF_PHASE_RUN,
+	PERF_PHASE_TEARDOWN,	// free_vm()
+	PERF_PHASE_COUNT,
+} PerfPhase;
+
+
+typedef struct {
+	bool enabled;
+	int fds[PERF_COUNTER_COUNT];	// -1 for counters that couldn't be opened
+	int error;						// errno from the first counter that failed
+	uint64_t start[PERF_COUNTER_COUNT];
+	uint64_t totals[PERF_PHASE_COUNT][PERF_COUNTER_COUNT];
+	uint64_t dispatches;			// instructions executed in the run phase
+} PerfCounters;
+
+
+void init_perf(PerfCounters* perf);
+void free_perf(PerfCounters* perf);
+bool start_perf(PerfCounters* perf);
+bool perf_has_hardware(PerfCounters* perf);
+void perf_read(PerfCounters* perf, uint64_t* values);
+void print_perf(PerfCounters* perf, FILE* file);
+
+
+/*
+ * perf_begin()
+ * Start counting a phase. Phases don't nest.
+ */
+static inline void perf_begin(PerfCounters* perf)
+{
+	if(perf->enabled)
+		perf_read(perf, perf->start);
+}
+
+
+/*
+ * perf_end()
+ * Add everything counted since perf_begin() to phase.
+ */
+static inline void perf_end(PerfCounters* perf, PerfPhase phase)
+{
+	if(!perf->enabled)
+		return;
+
+	uint64_t now[PERF_COUNTER_COUNT];
+	perf_read(perf, now);
+
+	// Scaled counts of multiplexed counters can step back a little
+	for(int i = 0; i < PERF_COUNTER_COUNT; i++)
+	{
+		if(now[i] > perf->start[i])
+			perf->totals[phase][i] += now[i] - perf->start[i];
+	}
+}
+
+
+#endif /*__LOX_PERFCOUNT_H*/
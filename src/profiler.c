@@ -0,0 +1,349 @@
+// clock_gettime() is POSIX rather than C99
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdlib.h>
+#include <time.h>
+
+#include "profiler.h"
+#include "memory.h"
+#include "object.h"
+
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+
+/*
+ * init_profiler()
+ */
+void init_profiler(CallProfiler* profiler)
+{
+	profiler->enabled = false;
+	profiler->function_count = 0;
+	profiler->function_capacity = 0;
+	profiler->functions = NULL;
+	profiler->edge_count = 0;
+	profiler->edge_capacity = 0;
+	profiler->edges = NULL;
+	profiler->depth = 0;
+}
+
+
+/*
+ * free_profiler()
+ */
+void free_profiler(CallProfiler* profiler)
+{
+	FREE_ARRAY(FunctionProfile, profiler->functions, profiler->function_capacity);
+	FREE_ARRAY(CallEdge, profiler->edges, profiler->edge_capacity);
+	init_profiler(profiler);
+}
+
+
+static uint32_t hash_pointer(Obj* object)
+{
+	// Objects are at least 8 byte aligned so the low bits carry nothing
+	return (uint32_t) ((uintptr_t) object >> 3);
+}
+
+
+static FunctionProfile* find_function(FunctionProfile* functions, int capacity, Obj* callee)
+{
+	uint32_t index = hash_pointer(callee) % capacity;
+
+	while(functions[index].callee != NULL && functions[index].callee != callee)
+		index = (index + 1) % capacity;
+
+	return &functions[index];
+}
+
+
+static CallEdge* find_edge(CallEdge* edges, int capacity, Obj* caller, Obj* callee, int line)
+{
+	uint32_t index = (hash_pointer(caller) * 31 + hash_pointer(callee) * 17 + (uint32_t) line) % capacity;
+
+	while(edges[index].callee != NULL)
+	{
+		CallEdge* edge = &edges[index];
+		if(edge->caller == caller && edge->callee == callee && edge->line == line)
+			break;
+
+		index = (index + 1) % capacity;
+	}
+
+	return &edges[index];
+}
+
+
+static void grow_functions(CallProfiler* profiler)
+{
+	int capacity = GROW_CAPACITY(profiler->function_capacity) * 2;
+	FunctionProfile* functions = ALLOCATE(FunctionProfile, capacity);
+
+	for(int i = 0; i < capacity; i++)
+		functions[i].callee = NULL;
+
+	for(int i = 0; i < profiler->function_capacity; i++)
+	{
+		FunctionProfile* old = &profiler->functions[i];
+		if(old->callee != NULL)
+			*find_function(functions, capacity, old->callee) = *old;
+	}
+
+	FREE_ARRAY(FunctionProfile, profiler->functions, profiler->function_capacity);
+	profiler->functions = functions;
+	profiler->function_capacity = capacity;
+}
+
+
+static void grow_edges(CallProfiler* profiler)
+{
+	int capacity = GROW_CAPACITY(profiler->edge_capacity) * 2;
+	CallEdge* edges = ALLOCATE(CallEdge, capacity);
+
+	for(int i = 0; i < capacity; i++)
+		edges[i].callee = NULL;
+
+	for(int i = 0; i < profiler->edge_capacity; i++)
+	{
+		CallEdge* old = &profiler->edges[i];
+		if(old->callee != NULL)
+			*find_edge(edges, capacity, old->caller, old->callee, old->line) = *old;
+	}
+
+	FREE_ARRAY(CallEdge, profiler->edges, profiler->edge_capacity);
+	profiler->edges = edges;
+	profiler->edge_capacity = capacity;
+}
+
+
+/*
+ * open_call()
+ * Push a call of callee from line of the current function, which counts
+ * as calls calls.
+ */
+static void open_call(CallProfiler* profiler, Value value, int line, int calls)
+{
+	if(!IS_OBJ(value) || profiler->depth == PROFILE_DEPTH_MAX)
+		return;
+
+	Obj* callee = AS_OBJ(value);
+	Obj* caller = profiler->depth > 0 ? profiler->stack[profiler->depth - 1].callee : NULL;
+
+	if((profiler->function_count + 1) * 4 > profiler->function_capacity * 3)
+		grow_functions(profiler);
+
+	FunctionProfile* function = find_function(profiler->functions, profiler->function_capacity, callee);
+	if(function->callee == NULL)
+	{
+		function->callee = callee;
+		function->calls = 0;
+		function->inclusive = 0;
+		function->self = 0;
+		function->depth = 0;
+		profiler->function_count++;
+	}
+	function->calls += calls;
+	function->depth++;
+
+	if((profiler->edge_count + 1) * 4 > profiler->edge_capacity * 3)
+		grow_edges(profiler);
+
+	CallEdge* edge = find_edge(profiler->edges, profiler->edge_capacity, caller, callee, line);
+	if(edge->callee == NULL)
+	{
+		edge->caller = caller;
+		edge->callee = callee;
+		edge->line = line;
+		edge->calls = 0;
+		edge->inclusive = 0;
+		profiler->edge_count++;
+	}
+	edge->calls += calls;
+
+	ProfileFrame* frame = &profiler->stack[profiler->depth++];
+	frame->callee = callee;
+	frame->caller = caller;
+	frame->line = line;
+	frame->children = 0;
+	frame->start = now_ns();
+}
+
+
+/*
+ * profiler_enter()
+ * Called just before callee is called from line of the current function.
+ */
+void profiler_enter(CallProfiler* profiler, Value value, int line)
+{
+	open_call(profiler, value, line, 1);
+}
+
+
+/*
+ * profiler_reenter()
+ * Like profiler_enter() for a call that was counted already and carries
+ * on, one of a fiber's when it is resumed.
+ */
+void profiler_reenter(CallProfiler* profiler, Value value, int line)
+{
+	open_call(profiler, value, line, 0);
+}
+
+
+/*
+ * profiler_exit()
+ * Called when the innermost call returns.
+ */
+void profiler_exit(CallProfiler* profiler)
+{
+	uint64_t now = now_ns();
+
+	if(profiler->depth == 0)
+		return;
+
+	ProfileFrame* frame = &profiler->stack[--profiler->depth];
+	uint64_t elapsed = now - frame->start;
+
+	FunctionProfile* function = find_function(profiler->functions, profiler->function_capacity, frame->callee);
+	function->self += elapsed - frame->children;
+	// A recursive call is already inside the time of its outermost activation
+	if(--function->depth == 0)
+		function->inclusive += elapsed;
+
+	CallEdge* edge = find_edge(profiler->edges, profiler->edge_capacity, frame->caller, frame->callee, frame->line);
+	edge->inclusive += elapsed;
+
+	if(profiler->depth > 0)
+		profiler->stack[profiler->depth - 1].children += elapsed;
+}
+
+
+/*
+ * profiler_unwind()
+ * Close any calls left open when a runtime error ends the program.
+ */
+void profiler_unwind(CallProfiler* profiler)
+{
+	while(profiler->depth > 0)
+		profiler_exit(profiler);
+}
+
+
+// ======== REPORTS ======== //
+
+static int compare_functions(const void* a, const void* b)
+{
+	uint64_t sa = ((const FunctionProfile*) a)->self;
+	uint64_t sb = ((const FunctionProfile*) b)->self;
+
+	if(sa == sb)
+		return 0;
+
+	return sa < sb ? 1 : -1;
+}
+
+
+/*
+ * print_profile()
+ * One line per function, most self time first.
+ */
+void print_profile(CallProfiler* profiler, FILE* file)
+{
+	if(profiler->function_count == 0)
+		return;
+
+	FunctionProfile* functions = ALLOCATE(FunctionProfile, profiler->function_count);
+	int num = 0;
+	uint64_t total = 0;
+
+	for(int i = 0; i < profiler->function_capacity; i++)
+	{
+		if(profiler->functions[i].callee != NULL)
+		{
+			functions[num++] = profiler->functions[i];
+			total += profiler->functions[i].self;
+		}
+	}
+
+	qsort(functions, num, sizeof(FunctionProfile), compare_functions);
+
+	fprintf(file, "==== call profile ====\n");
+	fprintf(file, "%-32s %12s %14s %14s %7s %12s\n", "function", "calls", "inclusive ms", "self ms", "self %", "self us/call");
+	for(int i = 0; i < num; i++)
+	{
+		FunctionProfile* f = &functions[i];
+		fprintf(file, "%-32s %12lu %14.3f %14.3f %6.2f%% %12.3f\n",
+				callable_name(f->callee), (unsigned long) f->calls,
+				(double) f->inclusive / 1e6, (double) f->self / 1e6,
+				total > 0 ? 100.0 * (double) f->self / (double) total : 0.0,
+				(double) f->self / 1e3 / (double) f->calls);
+	}
+
+	FREE_ARRAY(FunctionProfile, functions, profiler->function_count);
+}
+
+
+static int first_line(Obj* callee)
+{
+	if(callee->type == OBJ_FUNCTION && ((ObjFunction*) callee)->chunk.count > 0)
+		return ((ObjFunction*) callee)->chunk.lines[0];
+
+	return 0;
+}
+
+
+/*
+ * write_callgrind()
+ * Write the profile in the callgrind format read by kcachegrind. Self
+ * time is charged to the first line of each function and inclusive
+ * time to the line of each call site.
+ */
+void write_callgrind(CallProfiler* profiler, FILE* file, const char* source_path)
+{
+	uint64_t total = 0;
+	for(int i = 0; i < profiler->function_capacity; i++)
+	{
+		if(profiler->functions[i].callee != NULL)
+			total += profiler->functions[i].self;
+	}
+
+	fprintf(file, "# callgrind format\n");
+	fprintf(file, "version: 1\n");
+	fprintf(file, "creator: clox\n");
+	fprintf(file, "cmd: %s\n", source_path);
+	fprintf(file, "positions: line\n");
+	fprintf(file, "events: Nanoseconds\n");
+	fprintf(file, "summary: %lu\n", (unsigned long) total);
+
+	for(int i = 0; i < profiler->function_capacity; i++)
+	{
+		FunctionProfile* f = &profiler->functions[i];
+		if(f->callee == NULL)
+			continue;
+
+		fprintf(file, "\nfl=%s\n", f->callee->type == OBJ_NATIVE ? "<native>" : source_path);
+		fprintf(file, "fn=%s\n", callable_name(f->callee));
+		fprintf(file, "%d %lu\n", first_line(f->callee), (unsigned long) f->self);
+
+		for(int j = 0; j < profiler->edge_capacity; j++)
+		{
+			CallEdge* edge = &profiler->edges[j];
+			if(edge->callee == NULL || edge->caller != f->callee)
+				continue;
+
+			if(edge->callee->type == OBJ_NATIVE)
+				fprintf(file, "cfl=<native>\n");
+			else
+				fprintf(file, "cfl=%s\n", source_path);
+			fprintf(file, "cfn=%s\n", callable_name(edge->callee));
+			fprintf(file, "calls=%lu %d\n", (unsigned long) edge->calls, first_line(edge->callee));
+			fprintf(file, "%d %lu\n", edge->line, (unsigned long) edge->inclusive);
+		}
+	}
+}
@@ -0,0 +1,85 @@
+/*
+ * CALL PROFILER
+ * Deterministic profile of every call made by the instrumented loop.
+ * Each function and native gets a call count, inclusive time and self
+ * time, and each call site gets an edge so the profile can be written
+ * in the callgrind format.
+ */
+
+#ifndef __LOX_PROFILER_H
+#define __LOX_PROFILER_H
+
+#include <stdio.h>
+
+#include "common.h"
+#include "value.h"
+
+
+// FRAMES_MAX frames and a native called from the innermost one
+#define PROFILE_DEPTH_MAX (64 + 1)
+
+
+/*
+ * FunctionProfile
+ * Totals for one function or native. Times are in nanoseconds.
+ */
+typedef struct {
+	Obj* callee;
+	uint64_t calls;
+	uint64_t inclusive;
+	uint64_t self;
+	int depth;			// activations on the stack, so recursion is only timed once
+} FunctionProfile;
+
+
+/*
+ * CallEdge
+ * Calls from one caller to one callee from one source line.
+ */
+typedef struct {
+	Obj* caller;
+	Obj* callee;
+	int line;
+	uint64_t calls;
+	uint64_t inclusive;
+} CallEdge;
+
+
+/*
+ * ProfileFrame
+ * One activation on the profiler's shadow of the call stack. This keeps
+ * the keys rather than pointers since the tables move when they grow.
+ */
+typedef struct {
+	Obj* callee;
+	Obj* caller;
+	int line;
+	uint64_t start;
+	uint64_t children;		// inclusive time of the calls made from here
+} ProfileFrame;
+
+
+typedef struct {
+	bool enabled;
+	int function_count;
+	int function_capacity;
+	FunctionProfile* functions;		// open addressed on the callee pointer
+	int edge_count;
+	int edge_capacity;
+	CallEdge* edges;				// open addressed on caller, callee and line
+	int depth;
+	ProfileFrame stack[PROFILE_DEPTH_MAX];
+} CallProfiler;
+
+
+void init_profiler(CallProfiler* profiler);
+void free_profiler(CallProfiler* profiler);
+void profiler_enter(CallProfiler* profiler, Value callee, int line);
+void profiler_reenter(CallProfiler* profiler, Value callee, int line);
+void profiler_exit(CallProfiler* profiler);
+void profiler_unwind(CallProfiler* profiler);
+void print_profile(CallProfiler* profiler, FILE* file);
+void write_callgrind(CallProfiler* profiler, FILE* file, const char* source_path);
+
+
+#endif /*__LOX_PROFILER_H*/
@@ -0,0 +1,142 @@
+// sigaction() is POSIX rather than C99
+#define _XOPEN_SOURCE 700
+
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "recorder.h"
+#include "memory.h"
+
+
+// The signal handler can only reach the recorder through a global
+static Recorder* active_recorder = NULL;
+
+
+static void sigusr1_handler(int signal)
+{
+	(void) signal;
+
+	// dump_recorder() only uses open(), write() and close(), which are
+	// safe to call here. An event being written right now may be torn.
+	if(active_recorder != NULL)
+		dump_recorder(active_recorder);
+}
+
+
+/*
+ * init_recorder()
+ */
+void init_recorder(Recorder* recorder)
+{
+	recorder->enabled = false;
+	recorder->mask = 0;
+	recorder->head = 0;
+	recorder->events = NULL;
+	recorder->dump_path[0] = '\0';
+	memset(&recorder->header, 0, sizeof(TraceHeader));
+}
+
+
+/*
+ * free_recorder()
+ */
+void free_recorder(Recorder* recorder)
+{
+	if(active_recorder == recorder)
+	{
+		signal(SIGUSR1, SIG_DFL);
+		active_recorder = NULL;
+	}
+
+	if(recorder->events != NULL)
+		FREE_ARRAY(TraceEvent, recorder->events, recorder->mask + 1);
+
+	init_recorder(recorder);
+}
+
+
+/*
+ * start_recorder()
+ * Allocate room for at least capacity events and dump to dump_path on
+ * SIGUSR1 from now on.
+ */
+bool start_recorder(Recorder* recorder, uint32_t capacity, const char* dump_path, const char* source_path)
+{
+	uint32_t size = 1;
+	while(size < capacity && size < (1u << 30))
+		size <<= 1;
+
+	if(strlen(dump_path) >= RECORDER_PATH_MAX || strlen(source_path) >= RECORDER_PATH_MAX)
+		return false;
+
+	recorder->events = ALLOCATE(TraceEvent, size);
+	memset(recorder->events, 0, sizeof(TraceEvent) * size);
+	recorder->mask = size - 1;
+	recorder->head = 0;
+	strcpy(recorder->dump_path, dump_path);
+
+	TraceHeader* header = &recorder->header;
+	memset(header, 0, sizeof(TraceHeader));
+	memcpy(header->magic, RECORDER_MAGIC, sizeof(header->magic));
+	header->version = RECORDER_VERSION;
+	header->capacity = size;
+	strcpy(header->source_path, source_path);
+
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = sigusr1_handler;
+	action.sa_flags = SA_RESTART;
+	sigemptyset(&action.sa_mask);
+
+	active_recorder = recorder;
+	if(sigaction(SIGUSR1, &action, NULL) != 0)
+		active_recorder = NULL;
+
+	recorder->enabled = true;
+
+	return true;
+}
+
+
+static bool write_all(int fd, const void* data, size_t size)
+{
+	const char* bytes = (const char*) data;
+
+	while(size > 0)
+	{
+		ssize_t written = write(fd, bytes, size);
+		if(written <= 0)
+			return false;
+
+		bytes += written;
+		size -= (size_t) written;
+	}
+
+	return true;
+}
+
+
+/*
+ * dump_recorder()
+ * Write the header and the whole ring to the dump file.
+ */
+bool dump_recorder(Recorder* recorder)
+{
+	if(recorder->events == NULL)
+		return false;
+
+	int fd = open(recorder->dump_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(fd < 0)
+		return false;
+
+	recorder->header.head = recorder->head;
+
+	bool ok = write_all(fd, &recorder->header, sizeof(TraceHeader)) &&
+		write_all(fd, recorder->events, sizeof(TraceEvent) * (recorder->mask + 1));
+
+	close(fd);
+
+	return ok;
+}
@@ -0,0 +1,125 @@
+/*
+ * EXECUTION RECORDER
+ * A ring buffer of compact binary events, one per dispatched
+ * instruction, that keeps the last few thousand instructions of a run.
+ * The buffer is written out when the script fails or when the process
+ * gets SIGUSR1, and trace_decode turns the dump back into a readable
+ * trace by compiling the script again and disassembling each event.
+ */
+
+#ifndef __LOX_RECORDER_H
+#define __LOX_RECORDER_H
+
+#include "common.h"
+#include "object.h"
+#include "value.h"
+
+
+#define RECORDER_MAGIC "LOXTRACE"
+#define RECORDER_VERSION 1
+#define RECORDER_DEFAULT_EVENTS (1 << 16)
+#define RECORDER_PATH_MAX 256
+
+
+/*
+ * TraceTag
+ * Type of the value on top of the stack when an instruction starts.
+ */
+typedef enum {
+	TAG_EMPTY,
+	TAG_NIL,
+	TAG_BOOL,
+	TAG_NUMBER,
+	TAG_STRING,
+	TAG_FUNCTION,
+	TAG_NATIVE,
+	TAG_FIBER,
+	TAG_TASK,
+	TAG_CHANNEL,
+} TraceTag;
+
+
+/*
+ * TraceEvent
+ * One dispatched instruction. Functions are identified by the order in
+ * which they were compiled (ObjFunction.id).
+ */
+typedef struct {
+	uint32_t offset;
+	uint16_t function;
+	uint8_t opcode;
+	uint8_t tag;
+} TraceEvent;
+
+
+/*
+ * TraceHeader
+ * Start of a dump. The events follow in ring order, and with
+ * head > capacity the oldest event is at head % capacity.
+ */
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t capacity;
+	uint64_t head;				// number of events ever recorded
+	uint8_t superinstructions;	// the script has to be compiled the same way to decode it
+	char source_path[RECORDER_PATH_MAX];
+} TraceHeader;
+
+
+typedef struct {
+	bool enabled;
+	uint32_t mask;				// capacity - 1, the capacity is a power of 2
+	uint64_t head;
+	TraceEvent* events;
+	TraceHeader header;			// filled in up front so a signal handler can just write it
+	char dump_path[RECORDER_PATH_MAX];
+} Recorder;
+
+
+void init_recorder(Recorder* recorder);
+void free_recorder(Recorder* recorder);
+bool start_recorder(Recorder* recorder, uint32_t capacity, const char* dump_path, const char* source_path);
+bool dump_recorder(Recorder* recorder);
+
+
+static inline TraceTag value_tag(Value value)
+{
+	switch(value.type)
+	{
+		case VAL_NIL:    return TAG_NIL;
+		case VAL_BOOL:   return TAG_BOOL;
+		case VAL_NUMBER: return TAG_NUMBER;
+		case VAL_OBJ:    break;
+	}
+
+	switch(OBJ_TYPE(value))
+	{
+		case OBJ_STRING:   return TAG_STRING;
+		case OBJ_FUNCTION: return TAG_FUNCTION;
+		case OBJ_NATIVE:   return TAG_NATIVE;
+		case OBJ_FIBER:    return TAG_FIBER;
+		case OBJ_TASK:     return TAG_TASK;
+		case OBJ_CHANNEL:  return TAG_CHANNEL;
+	}
+
+	return TAG_EMPTY;
+}
+
+
+/*
+ * record_event()
+ * This is on the dispatch path, so it is a store and an increment.
+ */
+static inline void record_event(Recorder* recorder, uint16_t function, uint32_t offset, uint8_t opcode, uint8_t tag)
+{
+	TraceEvent* event = &recorder->events[recorder->head & recorder->mask];
+	event->offset = offset;
+	event->function = function;
+	event->opcode = opcode;
+	event->tag = tag;
+	recorder->head++;
+}
+
+
+#endif /*__LOX_RECORDER_H*/
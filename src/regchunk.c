@@ -0,0 +1,46 @@
+#include "regchunk.h"
+#include "memory.h"
+
+
+
+/*
+ * init_reg_chunk()
+ */
+void init_reg_chunk(RegChunk* chunk)
+{
+	chunk->count = 0;
+	chunk->capacity = 0;
+	chunk->code = NULL;
+	chunk->lines = NULL;
+	chunk->max_regs = 0;
+}
+
+
+/*
+ * free_reg_chunk()
+ */
+void free_reg_chunk(RegChunk* chunk)
+{
+	FREE_ARRAY_AS(MEM_CHUNK, RegInstr, chunk->code, chunk->capacity);
+	FREE_ARRAY_AS(MEM_CHUNK, int, chunk->lines, chunk->capacity);
+	init_reg_chunk(chunk);
+}
+
+
+/*
+ * write_reg_chunk()
+ */
+void write_reg_chunk(RegChunk* chunk, RegInstr instr, int line)
+{
+	if(chunk->capacity < chunk->count + 1)
+	{
+		int prev_capacity = chunk->capacity;
+		chunk->capacity = GROW_CAPACITY(prev_capacity);
+		chunk->code = GROW_ARRAY_AS(MEM_CHUNK, RegInstr, chunk->code, prev_capacity, chunk->capacity);
+		chunk->lines = GROW_ARRAY_AS(MEM_CHUNK, int, chunk->lines, prev_capacity, chunk->capacity);
+	}
+
+	chunk->code[chunk->count] = instr;
+	chunk->lines[chunk->count] = line;
+	chunk->count++;
+}
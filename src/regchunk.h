@@ -0,0 +1,85 @@
+/*
+ * REGISTER CHUNK
+ * Three-address instruction format for the register backend.
+ * Registers are slots in the current call frame, so a local
+ * variable is just a register with a fixed index.
+ */
+
+#ifndef __LOX_REGCHUNK_H
+#define __LOX_REGCHUNK_H
+
+#include "common.h"
+#include "intrinsics.h"
+#include "value.h"
+
+
+/*
+ * Each instruction is a single 32-bit word laid out as
+ *
+ *   | op (8) | a (8) | b (8) | c (8) |
+ *
+ * Jumps use b and c together as a signed 16-bit offset (sbx)
+ * relative to the next instruction.
+ */
+typedef uint32_t RegInstr;
+
+#define REG_OP(i)  ((uint8_t) ((i) & 0xFF))
+#define REG_A(i)   ((uint8_t) (((i) >> 8) & 0xFF))
+#define REG_B(i)   ((uint8_t) (((i) >> 16) & 0xFF))
+#define REG_C(i)   ((uint8_t) (((i) >> 24) & 0xFF))
+#define REG_SBX(i) ((int16_t) (((i) >> 16) & 0xFFFF))
+
+#define REG_ABC(op, a, b, c) \
+	((RegInstr) (op) | ((RegInstr) (a) << 8) | ((RegInstr) (b) << 16) | ((RegInstr) (c) << 24))
+#define REG_ASBX(op, a, sbx) \
+	((RegInstr) (op) | ((RegInstr) (a) << 8) | ((RegInstr) (uint16_t) (sbx) << 16))
+
+
+/*
+ * Register VM Opcodes
+ * R(x) is frame register x, K(x) is constant x.
+ */
+typedef enum {
+	ROP_MOVE,           // R(a) = R(b)
+	ROP_LOADK,          // R(a) = K(b)
+	ROP_LOADNIL,        // R(a) = nil
+	ROP_LOADBOOL,       // R(a) = (bool) b
+	ROP_DEFINE_GLOBAL,  // globals[K(b)] = R(a)
+	ROP_GET_GLOBAL,     // R(a) = globals[K(b)]
+	ROP_SET_GLOBAL,     // globals[K(b)] = R(a)
+	ROP_EQUAL,          // R(a) = R(b) == R(c)
+	ROP_GREATER,        // R(a) = R(b) > R(c)
+	ROP_LESS,           // R(a) = R(b) < R(c)
+	ROP_ADD,            // R(a) = R(b) + R(c)
+	ROP_SUB,            // R(a) = R(b) - R(c)
+	ROP_MUL,            // R(a) = R(b) * R(c)
+	ROP_DIV,            // R(a) = R(b) / R(c)
+	ROP_NOT,            // R(a) = !R(b)
+	ROP_NEGATE,         // R(a) = -R(b)
+	ROP_PRINT,          // print R(a)
+	ROP_JUMP,           // ip += sbx
+	ROP_JUMP_IF_FALSE,  // if falsey(R(a)) ip += sbx
+	ROP_CALL,           // R(a) = R(a)(R(a+1), ..., R(a+b))
+#define INTRINSIC_ROPCODE(op, name, fn) ROP_##op,
+	MATH_INTRINSICS_1(INTRINSIC_ROPCODE)   // R(a) = fn(R(b))
+	MATH_INTRINSICS_2(INTRINSIC_ROPCODE)   // R(a) = fn(R(b), R(c))
+#undef INTRINSIC_ROPCODE
+	ROP_RETURN,         // return R(a)
+} RegOpCode;
+
+
+typedef struct {
+	int count;
+	int capacity;
+	RegInstr* code;
+	int* lines;
+	int max_regs;       // size of the register window a frame needs
+} RegChunk;
+
+
+void init_reg_chunk(RegChunk* chunk);
+void free_reg_chunk(RegChunk* chunk);
+void write_reg_chunk(RegChunk* chunk, RegInstr instr, int line);
+
+
+#endif /*__LOX_REGCHUNK_H*/
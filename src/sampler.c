@@ -0,0 +1,203 @@
+// setitimer() and sigaction() are POSIX rather than C99
+#define _XOPEN_SOURCE 700
+
+#include <string.h>
+#include <sys/time.h>
+
+#include "sampler.h"
+#include "memory.h"
+
+
+// The signal handler can only reach the sampler through a global
+static Sampler* active_sampler = NULL;
+
+
+static void sigprof_handler(int signal)
+{
+	(void) signal;
+
+	if(active_sampler != NULL)
+		active_sampler->pending = 1;
+}
+
+
+/*
+ * init_sampler()
+ */
+void init_sampler(Sampler* sampler)
+{
+	sampler->enabled = false;
+	sampler->frequency = SAMPLER_DEFAULT_HZ;
+	sampler->pending = 0;
+	sampler->total = 0;
+	sampler->count = 0;
+	sampler->capacity = 0;
+	sampler->samples = NULL;
+}
+
+
+/*
+ * free_sampler()
+ */
+void free_sampler(Sampler* sampler)
+{
+	stop_sampler(sampler);
+
+	for(int i = 0; i < sampler->capacity; i++)
+	{
+		if(sampler->samples[i].stack != NULL)
+			FREE_ARRAY(char, sampler->samples[i].stack, sampler->samples[i].length + 1);
+	}
+
+	FREE_ARRAY(Sample, sampler->samples, sampler->capacity);
+	init_sampler(sampler);
+}
+
+
+/*
+ * start_sampler()
+ * Install the SIGPROF handler and start the CPU time interval timer.
+ */
+bool start_sampler(Sampler* sampler)
+{
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = sigprof_handler;
+	action.sa_flags = SA_RESTART;
+	sigemptyset(&action.sa_mask);
+
+	if(sigaction(SIGPROF, &action, NULL) != 0)
+		return false;
+
+	active_sampler = sampler;
+
+	long interval = 1000000L / (sampler->frequency > 0 ? sampler->frequency : SAMPLER_DEFAULT_HZ);
+	struct itimerval timer;
+	timer.it_interval.tv_sec = interval / 1000000L;
+	timer.it_interval.tv_usec = interval % 1000000L;
+	timer.it_value = timer.it_interval;
+
+	if(setitimer(ITIMER_PROF, &timer, NULL) != 0)
+	{
+		active_sampler = NULL;
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * stop_sampler()
+ */
+void stop_sampler(Sampler* sampler)
+{
+	if(active_sampler != sampler)
+		return;
+
+	struct itimerval timer;
+	memset(&timer, 0, sizeof(timer));
+	setitimer(ITIMER_PROF, &timer, NULL);
+
+	active_sampler = NULL;
+	sampler->pending = 0;
+}
+
+
+static uint32_t hash_stack(const char* stack, int length)
+{
+	uint32_t hash = 2166136261u;
+
+	for(int i = 0; i < length; i++)
+	{
+		hash ^= (uint8_t) stack[i];
+		hash *= 16777619;
+	}
+
+	return hash;
+}
+
+
+static Sample* find_sample(Sample* samples, int capacity, const char* stack, int length, uint32_t hash)
+{
+	uint32_t index = hash % capacity;
+
+	while(1)
+	{
+		Sample* sample = &samples[index];
+		if(sample->stack == NULL)
+			return sample;
+		if(sample->hash == hash && sample->length == length && memcmp(sample->stack, stack, length) == 0)
+			return sample;
+
+		index = (index + 1) % capacity;
+	}
+}
+
+
+static void grow_samples(Sampler* sampler)
+{
+	int capacity = GROW_CAPACITY(sampler->capacity) * 2;
+	Sample* samples = ALLOCATE(Sample, capacity);
+
+	for(int i = 0; i < capacity; i++)
+	{
+		samples[i].stack = NULL;
+		samples[i].length = 0;
+		samples[i].count = 0;
+	}
+
+	for(int i = 0; i < sampler->capacity; i++)
+	{
+		Sample* old = &sampler->samples[i];
+		if(old->stack != NULL)
+			*find_sample(samples, capacity, old->stack, old->length, old->hash) = *old;
+	}
+
+	FREE_ARRAY(Sample, sampler->samples, sampler->capacity);
+	sampler->samples = samples;
+	sampler->capacity = capacity;
+}
+
+
+/*
+ * sampler_record()
+ * Count one sample of a folded stack ("outer;inner;innermost").
+ */
+void sampler_record(Sampler* sampler, const char* stack, int length)
+{
+	if((sampler->count + 1) * 4 > sampler->capacity * 3)
+		grow_samples(sampler);
+
+	uint32_t hash = hash_stack(stack, length);
+	Sample* sample = find_sample(sampler->samples, sampler->capacity, stack, length, hash);
+
+	if(sample->stack == NULL)
+	{
+		sample->stack = ALLOCATE(char, length + 1);
+		memcpy(sample->stack, stack, length);
+		sample->stack[length] = '\0';
+		sample->length = length;
+		sample->hash = hash;
+		sampler->count++;
+	}
+
+	sample->count++;
+	sampler->total++;
+}
+
+
+/*
+ * write_folded_stacks()
+ * One line per distinct stack followed by its sample count. This is
+ * the input format for flamegraph.pl.
+ */
+void write_folded_stacks(Sampler* sampler, FILE* file)
+{
+	for(int i = 0; i < sampler->capacity; i++)
+	{
+		Sample* sample = &sampler->samples[i];
+		if(sample->stack != NULL)
+			fprintf(file, "%s %lu\n", sample->stack, (unsigned long) sample->count);
+	}
+}
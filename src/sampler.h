@@ -0,0 +1,53 @@
+/*
+ * SAMPLING PROFILER
+ * A SIGPROF timer asks the interpreter loop for a sample and the loop
+ * records the Lox call stack at the next instruction boundary. Stacks
+ * are aggregated in memory and written out in the folded format used
+ * by flamegraph.pl.
+ */
+
+#ifndef __LOX_SAMPLER_H
+#define __LOX_SAMPLER_H
+
+#include <signal.h>
+#include <stdio.h>
+
+#include "common.h"
+
+
+#define SAMPLER_DEFAULT_HZ 1000
+#define SAMPLE_STACK_MAX 4096
+
+
+/*
+ * Sample
+ * One distinct folded stack and the number of times it was seen.
+ */
+typedef struct {
+	char* stack;
+	int length;
+	uint32_t hash;
+	uint64_t count;
+} Sample;
+
+
+typedef struct {
+	bool enabled;
+	int frequency;					// samples per second of CPU time
+	volatile sig_atomic_t pending;	// set by the signal handler
+	uint64_t total;
+	int count;
+	int capacity;
+	Sample* samples;
+} Sampler;
+
+
+void init_sampler(Sampler* sampler);
+void free_sampler(Sampler* sampler);
+bool start_sampler(Sampler* sampler);
+void stop_sampler(Sampler* sampler);
+void sampler_record(Sampler* sampler, const char* stack, int length);
+void write_folded_stacks(Sampler* sampler, FILE* file);
+
+
+#endif /*__LOX_SAMPLER_H*/
@@ -15,7 +15,7 @@ typedef struct {
 
 
 // Create a new Scanner global in this translation unit
-Scanner scanner;
+THREAD_LOCAL Scanner scanner;
 
 // Token creation helpers
 static Token make_token(TokenType type)
@@ -286,7 +286,17 @@ void init_scanner(const char* source)
 	scanner.start = source;
 	scanner.current = source;
 	scanner.line = 1;
-	scanner.verbose = true;		// TODO: make settable
+	scanner.verbose = false;
+}
+
+
+/*
+ * scanner_trace()
+ * Print each token as it is scanned.
+ */
+void scanner_trace(bool enable)
+{
+	scanner.verbose = enable;
 }
 
 
@@ -5,6 +5,8 @@
 #ifndef __LOX_SCANNER_H
 #define __LOX_SCANNER_H
 
+#include <stdbool.h>
+
 
 // All valid Lox tokens
 typedef enum {
@@ -72,6 +74,7 @@ typedef struct {
 
 
 void init_scanner(const char* source);
+void scanner_trace(bool enable);
 Token scan_token(void);
 
 
@@ -0,0 +1,1388 @@
+// sysconf() and strdup() are POSIX rather than C99
+#define _DEFAULT_SOURCE
+
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "channel.h"
+#include "compiler.h"
+#include "memory.h"
+#include "scheduler.h"
+#include "vm.h"
+
+
+/*
+ * TaskDeque
+ * A ring buffer of tasks with a lock of its own. The worker that owns it
+ * pushes and takes at the back, thieves take from the front.
+ */
+typedef struct {
+	pthread_mutex_t lock;
+	Task** tasks;
+	int head;
+	int count;
+	int capacity;
+} TaskDeque;
+
+
+#define RANGE_PARTS_PER_WORKER 4		// parts parallel_for() splits its range into
+
+
+/*
+ * Range
+ * The indexes from start up to end that a parallel_for() task calls its
+ * body for. The task for the whole range splits it once it starts and
+ * spawns a task for each part but the first.
+ */
+typedef struct Range {
+	double start;
+	double end;
+	int reduce;					// ObjFunction id, -1 to keep no result
+	bool split;					// the whole range, not a part
+	double next;				// the next index of its own part to call the body for
+	double stop;				// where its own part ends
+	bool calling;				// parked in the body's call for next
+	Task** parts;				// the tasks it spawned, in order
+	int part_count;
+	int folded;					// parts whose results are in acc
+	bool has_acc;
+	Value acc;					// in the owner's heap
+} Range;
+
+
+/*
+ * Script
+ * Source that interpret() compiled, and the id of its script function,
+ * or an extension that the script loaded.
+ */
+typedef struct {
+	char* source;				// or the extension's path
+	int first_function;
+	bool extension;
+} Script;
+
+
+typedef struct Worker {
+	pthread_t thread;
+	int index;
+	struct Scheduler* scheduler;	// the one it belongs to, also its VM's
+	TaskDeque deque;
+	Task* running;				// the task whose fiber is on the stack
+	Task* woken;				// parked tasks that can carry on, guarded by the scheduler's lock
+	int loaded;					// scripts compiled and extensions loaded so far
+	ObjFunction** functions;	// in this worker's VM, by id
+	int function_capacity;
+	ObjFiber** spare;			// fibers of finished tasks, to run the next ones on
+	int spare_count;
+	int spare_capacity;
+} Worker;
+
+
+/*
+ * Scheduler
+ * Each VM that spawns has one of its own, which its workers share. So
+ * do their VMs, to spawn tasks of their own on it.
+ */
+typedef struct Scheduler {
+	bool started;
+	Script* scripts;			// every worker compiles or loads all of them, in order
+	int script_count;
+	int script_capacity;
+	Backend backend;
+	bool superinstructions;
+	uint64_t max_instructions;	// the script's limits, which each task gets to itself
+	uint64_t max_ns;
+	uint64_t heap_limit;		// for each worker's VM
+	Worker* workers;
+	int worker_count;
+	TaskDeque injected;			// tasks spawned by the script
+	pthread_mutex_t lock;
+	pthread_cond_t work;		// idle workers wait here
+	pthread_cond_t finished;	// the script waits here in join()
+	int queued;					// tasks in all the deques
+	int sleeping;				// idle workers
+	bool stopping;				// also cancels the tasks that are running, see ExecLimits
+} Scheduler;
+
+
+static THREAD_LOCAL Worker* current_worker = NULL;
+
+
+// ======== VALUES ======== //
+
+/*
+ * can_share()
+ * True for the values a task can take or return, or a channel carry.
+ */
+bool can_share(Value value)
+{
+	return IS_NIL(value) || IS_BOOL(value) || IS_NUMBER(value) || IS_STR(value) || IS_CHANNEL(value);
+}
+
+
+/*
+ * share_string()
+ * The SharedString for an ObjString, with a reference for the caller.
+ * The first time a string is shared its characters move out of the VM's
+ * heap, so sharing it again copies nothing.
+ */
+static SharedString* share_string(ObjString* string)
+{
+	if(!string->shared)
+	{
+		SharedString* shared = malloc(sizeof(SharedString) + string->length + 1);
+		shared->refs = 1;		// the ObjString's
+		shared->length = string->length;
+		shared->hash = string->hash;
+		memcpy(shared->chars, string->chars, string->length + 1);
+
+		FREE_ARRAY_AS(MEM_STRING, char, string->chars, string->length + 1);
+		string->chars = shared->chars;
+		string->shared = true;
+	}
+
+	SharedString* shared = SHARED_STRING(string->chars);
+	__atomic_add_fetch(&shared->refs, 1, __ATOMIC_RELAXED);
+
+	return shared;
+}
+
+
+/*
+ * release_string()
+ * Drop a reference, the last one frees the characters.
+ */
+void release_string(SharedString* string)
+{
+	if(__atomic_sub_fetch(&string->refs, 1, __ATOMIC_ACQ_REL) == 0)
+		free(string);
+}
+
+
+/*
+ * share_value()
+ * A value that can_share() as one that any VM can take.
+ */
+void share_value(Value value, SharedValue* shared)
+{
+	*shared = SHARED_NIL;
+	shared->type = value.type;
+	shared->number = IS_NUMBER(value) ? AS_NUMBER(value) : 0;
+	shared->boolean = IS_BOOL(value) && AS_BOOL(value);
+
+	if(IS_STR(value))
+	{
+		shared->string = share_string(AS_STRING(value));
+	}
+	else if(IS_CHANNEL(value))
+	{
+		shared->channel = AS_CHANNEL(value)->channel;
+		retain_channel(shared->channel);
+	}
+}
+
+
+/*
+ * unshare_value()
+ * The value in this VM. shared keeps its references.
+ */
+Value unshare_value(SharedValue* shared)
+{
+	switch(shared->type)
+	{
+		case VAL_BOOL:   return BOOL_VAL(shared->boolean);
+		case VAL_NUMBER: return NUMBER_VAL(shared->number);
+		case VAL_OBJ:
+			if(shared->string != NULL)
+				return OBJ_VAL(copy_shared_string(shared->string));
+
+			retain_channel(shared->channel);
+			return OBJ_VAL(new_channel(shared->channel));
+		default:         return NIL_VAL;
+	}
+}
+
+
+void release_value(SharedValue* shared)
+{
+	if(shared->string != NULL)
+		release_string(shared->string);
+	if(shared->channel != NULL)
+		release_channel(shared->channel);
+
+	*shared = SHARED_NIL;
+}
+
+
+/*
+ * share_globals()
+ * The globals that functions read, see note_read_global(), and that
+ * can_share(). NULL if there are none. The natives are left out, every
+ * VM has the built-in ones and each worker loads the script's
+ * extensions, see share_extension(). So are the functions, which each
+ * worker defines as it compiles the script.
+ */
+static Globals* share_globals(void)
+{
+	Globals* globals = NULL;
+
+	for(int i = 0; i < vm.read_global_count; i++)
+	{
+		Value value;
+		ObjString* name = vm.read_globals[i];
+		if(!table_get(&vm.globals, name, &value) || !can_share(value))
+			continue;
+
+		// Room for every one, in a block with the Globals
+		if(globals == NULL)
+		{
+			globals = malloc(sizeof(Globals) + (sizeof(SharedValue) + sizeof(SharedString*)) * vm.read_global_count);
+			globals->refs = 1;
+			globals->count = 0;
+			globals->values = (SharedValue*) (globals + 1);
+			globals->names = (SharedString**) (globals->values + vm.read_global_count);
+		}
+
+		globals->names[globals->count] = share_string(name);
+		share_value(value, &globals->values[globals->count]);
+		globals->count++;
+	}
+
+	return globals;
+}
+
+
+static void release_globals(Globals* globals)
+{
+	if(globals == NULL || __atomic_sub_fetch(&globals->refs, 1, __ATOMIC_ACQ_REL) > 0)
+		return;
+
+	for(int i = 0; i < globals->count; i++)
+	{
+		release_string(globals->names[i]);
+		release_value(&globals->values[i]);
+	}
+
+	free(globals);
+}
+
+
+/*
+ * define_globals()
+ * Set the globals in this VM, over what an earlier task on the worker
+ * left in them.
+ */
+static void define_globals(Globals* globals)
+{
+	if(globals == NULL)
+		return;
+
+	for(int i = 0; i < globals->count; i++)
+	{
+		ObjString* name = copy_shared_string(globals->names[i]);
+		note_global(name);
+		table_set(&vm.globals, name, unshare_value(&globals->values[i]));
+	}
+}
+
+
+// ======== DEQUES ======== //
+
+static void init_deque(TaskDeque* deque)
+{
+	pthread_mutex_init(&deque->lock, NULL);
+	deque->tasks = NULL;
+	deque->head = 0;
+	deque->count = 0;
+	deque->capacity = 0;
+}
+
+
+/*
+ * free_deque()
+ * Tasks that never started are dropped.
+ */
+static void free_deque(TaskDeque* deque)
+{
+	for(int i = 0; i < deque->count; i++)
+		release_task(deque->tasks[(deque->head + i) % deque->capacity]);
+
+	free(deque->tasks);
+	pthread_mutex_destroy(&deque->lock);
+}
+
+
+/*
+ * push_task()
+ * The queued count goes up before the task can be taken and down after,
+ * so it never says there is less work than there is.
+ */
+static void push_task(TaskDeque* deque, Task* task)
+{
+	Scheduler* scheduler = vm.scheduler;
+
+	pthread_mutex_lock(&deque->lock);
+
+	if(deque->count == deque->capacity)
+	{
+		int capacity = deque->capacity < 8 ? 8 : deque->capacity * 2;
+		Task** tasks = malloc(sizeof(Task*) * capacity);
+		for(int i = 0; i < deque->count; i++)
+			tasks[i] = deque->tasks[(deque->head + i) % deque->capacity];
+
+		free(deque->tasks);
+		deque->tasks = tasks;
+		deque->head = 0;
+		deque->capacity = capacity;
+	}
+
+	deque->tasks[(deque->head + deque->count) % deque->capacity] = task;
+	deque->count++;
+	__atomic_add_fetch(&scheduler->queued, 1, __ATOMIC_SEQ_CST);
+
+	pthread_mutex_unlock(&deque->lock);
+}
+
+
+/*
+ * take_task()
+ * The newest task in the deque, or the oldest. NULL if it is empty.
+ */
+static Task* take_task(TaskDeque* deque, bool newest)
+{
+	Scheduler* scheduler = vm.scheduler;
+	Task* task = NULL;
+	pthread_mutex_lock(&deque->lock);
+
+	if(deque->count > 0)
+	{
+		if(newest)
+		{
+			task = deque->tasks[(deque->head + deque->count - 1) % deque->capacity];
+		}
+		else
+		{
+			task = deque->tasks[deque->head];
+			deque->head = (deque->head + 1) % deque->capacity;
+		}
+		deque->count--;
+		__atomic_sub_fetch(&scheduler->queued, 1, __ATOMIC_SEQ_CST);
+	}
+
+	pthread_mutex_unlock(&deque->lock);
+	return task;
+}
+
+
+/*
+ * wake_worker()
+ * A worker that finds nothing to do counts itself as sleeping before it
+ * looks at the queued count for the last time, and spawn_task() raises
+ * the count before it looks at the sleepers, so one of them always sees
+ * the other.
+ */
+static void wake_worker(void)
+{
+	Scheduler* scheduler = vm.scheduler;
+
+	if(__atomic_load_n(&scheduler->sleeping, __ATOMIC_SEQ_CST) == 0)
+		return;
+
+	pthread_mutex_lock(&scheduler->lock);
+	pthread_cond_signal(&scheduler->work);
+	pthread_mutex_unlock(&scheduler->lock);
+}
+
+
+// ======== TASKS ======== //
+
+/*
+ * release_task()
+ * Drop a reference, the last one frees the task.
+ */
+void release_task(Task* task)
+{
+	if(__atomic_sub_fetch(&task->refs, 1, __ATOMIC_ACQ_REL) > 0)
+		return;
+
+	release_value(&task->arg);
+	release_globals(task->globals);
+	release_value(&task->result);
+	release_value(&task->message);
+	if(task->range != NULL)
+		free(task->range->parts);
+	free(task->range);
+	free(task);
+}
+
+
+/*
+ * new_shared_task()
+ * A task that hasn't been queued yet, with holders references for
+ * whoever spawned it as well as the scheduler's.
+ */
+static Task* new_shared_task(int function, int holders)
+{
+	Task* task = malloc(sizeof(Task));
+	task->function = function;
+	task->arg = SHARED_NIL;
+	task->globals = NULL;
+	task->result = SHARED_NIL;
+	task->state = TASK_QUEUED;
+	task->refs = holders + 1;
+	task->owner = NULL;
+	task->fiber = NULL;
+	task->joined = NULL;
+	task->message = SHARED_NIL;
+	task->error = NULL;
+	task->waiters = NULL;
+	task->next = NULL;
+	task->range = NULL;
+
+	return task;
+}
+
+
+/*
+ * queue_task()
+ * A task spawned by a task goes on its worker's deque, one spawned by
+ * the script on the scheduler's own queue.
+ */
+static void queue_task(Task* task)
+{
+	Scheduler* scheduler = vm.scheduler;
+
+	push_task(current_worker != NULL ? &current_worker->deque : &scheduler->injected, task);
+	wake_worker();
+}
+
+
+/*
+ * push_woken()
+ * Hand a parked task back to the worker it was running on. The caller
+ * holds the scheduler's lock.
+ */
+static void push_woken(Task* task)
+{
+	task->next = task->owner->woken;
+	__atomic_store_n(&task->owner->woken, task, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * wake_task()
+ * Let a task parked on a channel carry on, with the message or error
+ * left in it.
+ */
+void wake_task(Task* task)
+{
+	Scheduler* scheduler = task->owner->scheduler;
+
+	pthread_mutex_lock(&scheduler->lock);
+	push_woken(task);
+	pthread_cond_broadcast(&scheduler->work);
+	pthread_mutex_unlock(&scheduler->lock);
+}
+
+
+/*
+ * complete_task()
+ * Publish the result and hand the tasks parked on this one back to the
+ * workers they were running on.
+ */
+static void complete_task(Task* task, TaskState state, SharedValue* result)
+{
+	Scheduler* scheduler = vm.scheduler;
+
+	pthread_mutex_lock(&scheduler->lock);
+
+	task->result = *result;
+	task->state = state;
+
+	Task* waiter = task->waiters;
+	task->waiters = NULL;
+	if(waiter != NULL)
+		pthread_cond_broadcast(&scheduler->work);
+
+	while(waiter != NULL)
+	{
+		Task* next = waiter->next;
+		push_woken(waiter);
+		waiter = next;
+	}
+
+	pthread_cond_broadcast(&scheduler->finished);
+	pthread_mutex_unlock(&scheduler->lock);
+
+	release_task(task);
+}
+
+
+/*
+ * task_result()
+ * The task's state, and its result in this VM once it is done.
+ */
+TaskState task_result(Task* task, Value* result)
+{
+	Scheduler* scheduler = vm.scheduler;
+
+	pthread_mutex_lock(&scheduler->lock);
+	TaskState state = task->state;
+	pthread_mutex_unlock(&scheduler->lock);
+
+	if(state == TASK_DONE)
+		*result = unshare_value(&task->result);
+
+	return state;
+}
+
+
+/*
+ * parkable_task()
+ * The task whose own fiber is running, which can be parked rather than
+ * block the worker. NULL on the script's thread, and in a fiber that a
+ * task resumed.
+ */
+Task* parkable_task(void)
+{
+	if(current_worker == NULL || vm.fiber == NULL || vm.frame_base != 0)
+		return NULL;
+
+	return current_worker->running;
+}
+
+
+/*
+ * park_on_task()
+ * Make the running task wait for task, unless it has already finished.
+ * The caller suspends the fiber, the worker resumes it once task is done.
+ */
+bool park_on_task(Task* task)
+{
+	Scheduler* scheduler = vm.scheduler;
+	Task* running = current_worker->running;
+	pthread_mutex_lock(&scheduler->lock);
+
+	bool parked = task->state < TASK_DONE;
+	if(parked)
+	{
+		running->joined = task;
+		running->next = task->waiters;
+		task->waiters = running;
+	}
+
+	pthread_mutex_unlock(&scheduler->lock);
+	return parked;
+}
+
+
+/*
+ * wait_task()
+ * Block the thread until task has finished, or on a worker until the
+ * scheduler is stopping.
+ */
+void wait_task(Task* task)
+{
+	Scheduler* scheduler = vm.scheduler;
+
+	pthread_mutex_lock(&scheduler->lock);
+	while(task->state < TASK_DONE && !(current_worker != NULL && scheduler->stopping))
+		pthread_cond_wait(&scheduler->finished, &scheduler->lock);
+	pthread_mutex_unlock(&scheduler->lock);
+}
+
+
+bool on_worker(void)
+{
+	return current_worker != NULL;
+}
+
+
+// ======== WORKERS ======== //
+
+/*
+ * load_script()
+ * Compile a script again in this worker's VM, without running it. Its
+ * functions get the same ids they got in the script's VM. The ones it
+ * declares at the top level are defined as globals, that is a constant
+ * followed by OP_DEFINE_GLOBAL in the script's code. A script that
+ * failed to compile in the script's VM fails here too, but it still
+ * used up the ids of the functions it got to.
+ */
+static void load_script(Worker* worker, Script* loaded)
+{
+	vm.function_count = loaded->first_function;
+	ObjFunction* script = compile(loaded->source);
+
+	if(vm.function_count > worker->function_capacity)
+	{
+		worker->functions = realloc(worker->functions, sizeof(ObjFunction*) * vm.function_count);
+		for(int i = worker->function_capacity; i < vm.function_count; i++)
+			worker->functions[i] = NULL;
+		worker->function_capacity = vm.function_count;
+	}
+
+	// New objects go on the front of the list
+	for(Obj* object = vm.objects; object != NULL; object = object->next)
+	{
+		if(object->type != OBJ_FUNCTION)
+			continue;
+		if(((ObjFunction*) object)->id < loaded->first_function)
+			break;
+
+		worker->functions[((ObjFunction*) object)->id] = (ObjFunction*) object;
+	}
+
+	if(script == NULL)
+		return;
+
+	Chunk* chunk = &script->chunk;
+	Value* constants = chunk->constants.values;
+
+	for(int offset = 0; offset < chunk->count; offset += instr_length(chunk, offset))
+	{
+		int next = offset + 2;
+		uint8_t instr = chunk->code[offset];
+		if(instr >= OP_BASE_COUNT)
+			instr = super_instrs[instr - OP_BASE_COUNT].ops[0];
+
+		if(instr != OP_CONSTANT || !IS_FUNCTION(constants[chunk->code[offset+1]]) || next >= chunk->count)
+			continue;
+
+		uint8_t define = chunk->code[next];
+		if(define >= OP_BASE_COUNT)
+			define = super_instrs[define - OP_BASE_COUNT].ops[0];
+
+		if(define == OP_DEFINE_GLOBAL)
+		{
+			ObjString* name = AS_STRING(constants[chunk->code[next+1]]);
+			note_global(name);
+			table_set(&vm.globals, name, constants[chunk->code[offset+1]]);
+		}
+	}
+}
+
+
+/*
+ * load_scripts()
+ * Compile the scripts this worker hasn't seen yet, and load the
+ * extensions in between them.
+ */
+static void load_scripts(Worker* worker)
+{
+	Scheduler* scheduler = worker->scheduler;
+
+	for(;;)
+	{
+		pthread_mutex_lock(&scheduler->lock);
+		bool pending = worker->loaded < scheduler->script_count;
+		Script script;
+		const char* error;
+		if(pending)
+			script = scheduler->scripts[worker->loaded];
+		pthread_mutex_unlock(&scheduler->lock);
+
+		if(!pending)
+			return;
+
+		if(!script.extension)
+			load_script(worker, &script);
+		else if((error = load_extension(script.source)) != NULL)
+			fprintf(stderr, "Worker can't load extension '%s': %s\n", script.source, error);
+		worker->loaded++;
+	}
+}
+
+
+/*
+ * next_task()
+ * What a worker runs next: a parked task that can carry on, then the
+ * newest task it spawned itself, then the oldest one the script spawned,
+ * then the oldest one of another worker's. NULL once the scheduler is
+ * stopping.
+ */
+static Task* next_task(Worker* worker)
+{
+	Scheduler* scheduler = worker->scheduler;
+
+	for(;;)
+	{
+		Task* task = NULL;
+
+		if(__atomic_load_n(&worker->woken, __ATOMIC_ACQUIRE) != NULL)
+		{
+			pthread_mutex_lock(&scheduler->lock);
+			task = worker->woken;
+			worker->woken = task->next;
+			task->next = NULL;
+			pthread_mutex_unlock(&scheduler->lock);
+			return task;
+		}
+
+		if(__atomic_load_n(&scheduler->stopping, __ATOMIC_ACQUIRE))
+			return NULL;
+
+		task = take_task(&worker->deque, true);
+		if(task == NULL)
+			task = take_task(&scheduler->injected, false);
+		for(int i = 1; task == NULL && i < scheduler->worker_count; i++)
+			task = take_task(&scheduler->workers[(worker->index + i) % scheduler->worker_count].deque, false);
+
+		if(task != NULL)
+			return task;
+
+		pthread_mutex_lock(&scheduler->lock);
+		__atomic_add_fetch(&scheduler->sleeping, 1, __ATOMIC_SEQ_CST);
+		while(!scheduler->stopping && worker->woken == NULL &&
+				__atomic_load_n(&scheduler->queued, __ATOMIC_SEQ_CST) == 0)
+			pthread_cond_wait(&scheduler->work, &scheduler->lock);
+		__atomic_sub_fetch(&scheduler->sleeping, 1, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&scheduler->lock);
+	}
+}
+
+
+/*
+ * start_task()
+ * Give a task that hasn't run yet a fiber in this worker's VM, a spare
+ * one if there is, and the globals it was spawned with.
+ */
+static bool has_functions(Worker* worker, Task* task)
+{
+	int reduce = task->range != NULL ? task->range->reduce : -1;
+
+	return task->function < worker->function_capacity && worker->functions[task->function] != NULL &&
+		(reduce < 0 || (reduce < worker->function_capacity && worker->functions[reduce] != NULL));
+}
+
+
+static bool start_task(Worker* worker, Task* task)
+{
+	Scheduler* scheduler = worker->scheduler;
+
+	// The task may come from a script that was compiled, or call the
+	// natives of an extension that was loaded, after this worker last
+	// looked
+	if(worker->loaded < __atomic_load_n(&scheduler->script_count, __ATOMIC_ACQUIRE))
+		load_scripts(worker);
+	if(!has_functions(worker, task))
+		return false;
+
+	ObjFunction* function = worker->functions[task->function];
+	define_globals(task->globals);
+
+	pthread_mutex_lock(&scheduler->lock);
+	task->state = TASK_RUNNING;
+	task->owner = worker;
+	pthread_mutex_unlock(&scheduler->lock);
+
+	if(worker->spare_count > 0)
+	{
+		task->fiber = worker->spare[--worker->spare_count];
+		task->fiber->state = FIBER_NEW;
+		task->fiber->function = function;
+	}
+	else
+	{
+		task->fiber = new_fiber(function);
+	}
+
+	return true;
+}
+
+
+/*
+ * recycle_fiber()
+ * Keep the fiber of a task that has finished for the next one.
+ */
+static void recycle_fiber(Worker* worker, Task* task)
+{
+	if(worker->spare_count == worker->spare_capacity)
+	{
+		worker->spare_capacity = worker->spare_capacity < 8 ? 8 : worker->spare_capacity * 2;
+		worker->spare = realloc(worker->spare, sizeof(ObjFiber*) * worker->spare_capacity);
+	}
+	worker->spare[worker->spare_count++] = task->fiber;
+	task->fiber = NULL;
+}
+
+
+/*
+ * woken_with()
+ * What a parked task carries on with: the result of the task it joined,
+ * or what the channel it waited on left in it.
+ */
+static void woken_with(Task* task, Value* value, const char** error)
+{
+	if(task->joined != NULL)
+	{
+		if(task_result(task->joined, value) != TASK_DONE)
+			*error = "Joined task failed.";
+		task->joined = NULL;
+	}
+	else
+	{
+		*value = unshare_value(&task->message);
+		release_value(&task->message);
+		*error = task->error;
+		task->error = NULL;
+	}
+}
+
+
+// ======== RANGES ======== //
+
+static Range* new_range(double start, double end, int reduce, bool split)
+{
+	Range* range = malloc(sizeof(Range));
+	range->start = start;
+	range->end = end;
+	range->reduce = reduce;
+	range->split = split;
+	range->next = start;
+	range->stop = end;
+	range->calling = false;
+	range->parts = NULL;
+	range->part_count = 0;
+	range->folded = 0;
+	range->has_acc = false;
+	range->acc = NIL_VAL;
+
+	return range;
+}
+
+
+/*
+ * split_range()
+ * Spawn a task for each part of the range but the first, which the task
+ * keeps, and return where that ends. The second part is spawned last so
+ * that it is the one this worker takes next, thieves take the far end.
+ */
+static double split_range(Task* task)
+{
+	Scheduler* scheduler = vm.scheduler;
+	Range* range = task->range;
+	double count = ceil(range->end - range->start);
+	double parts = scheduler->worker_count * RANGE_PARTS_PER_WORKER;
+	if(parts > count)
+		parts = count;
+
+	double size = ceil(count / parts);
+	range->part_count = (int) ceil(count / size) - 1;
+	range->parts = malloc(sizeof(Task*) * (range->part_count > 0 ? range->part_count : 1));
+
+	for(int i = range->part_count; i >= 1; i--)
+	{
+		double start = range->start + i * size;
+		Task* part = new_shared_task(task->function, 1);
+		part->globals = task->globals;
+		if(part->globals != NULL)
+			__atomic_add_fetch(&part->globals->refs, 1, __ATOMIC_RELAXED);
+		part->range = new_range(start, fmin(start + size, range->end), range->reduce, false);
+		range->parts[i-1] = part;
+		queue_task(part);
+	}
+
+	return fmin(range->start + size, range->end);
+}
+
+
+/*
+ * fold()
+ * Fold value into the range's result with its reduce function. The
+ * first value is the result as it is.
+ */
+static bool fold(Worker* worker, Task* task, Value value)
+{
+	Range* range = task->range;
+	vm.stack_top = vm.stack;
+
+	if(range->reduce < 0)
+		return true;
+
+	if(!range->has_acc)
+	{
+		range->acc = value;
+		range->has_acc = true;
+		return true;
+	}
+
+	Value args[2] = {range->acc, value};
+	if(call_fiber(task->fiber, worker->functions[range->reduce], 2, args) != INTERPRET_OK)
+		return false;
+
+	range->acc = vm.stack[0];
+	vm.stack_top = vm.stack;
+
+	return true;
+}
+
+
+/*
+ * run_range()
+ * Call the body for each index of the task's own part that it hasn't
+ * yet and fold in what it returns. The body runs as the task, so one
+ * that joins or waits on a channel parks it, with range->calling set.
+ */
+static bool run_range(Worker* worker, Task* task)
+{
+	Range* range = task->range;
+	ObjFunction* body = worker->functions[task->function];
+
+	while(range->next < range->stop)
+	{
+		Value arg = NUMBER_VAL(range->next);
+		worker->running = task;
+		InterpResult status = call_fiber(task->fiber, body, 1, &arg);
+		worker->running = NULL;
+
+		if(task->fiber->state == FIBER_WAITING)
+		{
+			range->calling = true;
+			return true;
+		}
+		if(status != INTERPRET_OK || !fold(worker, task, vm.stack[0]))
+			return false;
+		range->next++;
+	}
+
+	return true;
+}
+
+
+/*
+ * run_range_task()
+ * Run the task's own part of the range, then fold in the results of the
+ * parts it spawned, in order, parking on each one that hasn't finished.
+ * A parked task carries on from the call of the body or the part it was
+ * waiting for.
+ */
+static void run_range_task(Worker* worker, Task* task)
+{
+	Range* range = task->range;
+	SharedValue result = SHARED_NIL;
+	bool ok = true;
+
+	if(task->fiber == NULL)
+	{
+		if(!start_task(worker, task))
+		{
+			complete_task(task, TASK_FAILED, &result);
+			return;
+		}
+
+		if(range->split)
+			range->stop = split_range(task);
+	}
+	else if(range->calling)
+	{
+		Value value = NIL_VAL;
+		const char* error = NULL;
+		woken_with(task, &value, &error);
+
+		worker->running = task;
+		InterpResult status = resume_task(task->fiber, value, error);
+		worker->running = NULL;
+
+		if(task->fiber->state == FIBER_WAITING)
+		{
+			task->limits = vm.limits;
+			return;
+		}
+
+		range->calling = false;
+		ok = status == INTERPRET_OK && fold(worker, task, vm.stack[0]);
+		range->next++;
+	}
+
+	ok = ok && run_range(worker, task);
+	if(range->calling)
+	{
+		task->limits = vm.limits;
+		return;
+	}
+
+	while(ok && range->folded < range->part_count)
+	{
+		Task* part = range->parts[range->folded];
+		Value value = NIL_VAL;
+		TaskState state = task_result(part, &value);
+
+		if(state < TASK_DONE)
+		{
+			worker->running = task;
+			bool parked = park_on_task(part);
+			worker->running = NULL;
+			if(parked)
+			{
+				task->limits = vm.limits;
+				return;
+			}
+			continue;
+		}
+
+		task->joined = NULL;
+		ok = state == TASK_DONE && fold(worker, task, value);
+		range->folded++;
+	}
+
+	Value acc = range->has_acc ? range->acc : NIL_VAL;
+	TaskState state = ok ? TASK_DONE : TASK_FAILED;
+	if(ok && !can_share(acc))
+	{
+		fprintf(stderr, "parallel_for() of %s reduced to a value that can't leave its worker.\n",
+				worker->functions[task->function]->name->chars);
+		state = TASK_FAILED;
+	}
+	if(state == TASK_DONE)
+		share_value(acc, &result);
+	vm.stack_top = vm.stack;
+
+	for(int i = 0; i < range->part_count; i++)
+		release_task(range->parts[i]);
+	range->part_count = 0;
+
+	recycle_fiber(worker, task);
+	complete_task(task, state, &result);
+}
+
+
+/*
+ * run_task()
+ * Run a task until it returns or parks in join() or on a channel. A
+ * parked task is resumed with the result of the task it joined, or with
+ * what the channel left in it.
+ */
+static void run_task(Worker* worker, Task* task)
+{
+	SharedValue result = SHARED_NIL;
+	Value value = NIL_VAL;
+	const char* error = NULL;
+
+	// Each task has the script's limits to itself, a parked one carries
+	// on with what it had left of them
+	if(task->fiber == NULL)
+	{
+		vm.memory.exceeded = false;
+		start_limits();
+	}
+	else
+	{
+		vm.limits = task->limits;
+	}
+
+	if(task->range != NULL)
+	{
+		run_range_task(worker, task);
+		return;
+	}
+
+	if(task->fiber == NULL)
+	{
+		if(!start_task(worker, task))
+		{
+			complete_task(task, TASK_FAILED, &result);
+			return;
+		}
+		value = unshare_value(&task->arg);
+	}
+	else
+	{
+		woken_with(task, &value, &error);
+	}
+
+	worker->running = task;
+	InterpResult status = resume_task(task->fiber, value, error);
+	worker->running = NULL;
+
+	if(task->fiber->state == FIBER_WAITING)
+	{
+		task->limits = vm.limits;
+		return;
+	}
+
+	// The fiber's first frame returned into the bottom of the stack
+	TaskState state = status == INTERPRET_OK ? TASK_DONE : TASK_FAILED;
+	if(state == TASK_DONE && !can_share(vm.stack[0]))
+	{
+		fprintf(stderr, "Task %s returned a value that can't leave its worker.\n",
+				task->fiber->function->name->chars);
+		state = TASK_FAILED;
+	}
+	if(state == TASK_DONE)
+		share_value(vm.stack[0], &result);
+	vm.stack_top = vm.stack;
+
+	recycle_fiber(worker, task);
+	complete_task(task, state, &result);
+}
+
+
+static void* worker_main(void* arg)
+{
+	Worker* worker = (Worker*) arg;
+	Scheduler* scheduler = worker->scheduler;
+
+	current_worker = worker;
+
+	init_vm();
+	vm.scheduler = scheduler;
+	vm.backend = scheduler->backend;
+	vm.superinstructions = scheduler->superinstructions;
+	vm.limits.max_instructions = scheduler->max_instructions;
+	vm.limits.max_ns = scheduler->max_ns;
+	vm.limits.cancel = &scheduler->stopping;
+	vm.memory.limit = scheduler->heap_limit;
+	load_scripts(worker);
+
+	Task* task;
+	while((task = next_task(worker)) != NULL)
+		run_task(worker, task);
+
+	free(worker->functions);
+	free(worker->spare);
+	free_vm();
+
+	return NULL;
+}
+
+
+/*
+ * vm_scheduler()
+ * This VM's scheduler, made the first time it is needed. Its workers
+ * start once something is spawned.
+ */
+static Scheduler* vm_scheduler(void)
+{
+	if(vm.scheduler == NULL)
+	{
+		Scheduler* scheduler = calloc(1, sizeof(Scheduler));
+		pthread_mutex_init(&scheduler->lock, NULL);
+		pthread_cond_init(&scheduler->work, NULL);
+		pthread_cond_init(&scheduler->finished, NULL);
+		vm.scheduler = scheduler;
+	}
+
+	return vm.scheduler;
+}
+
+
+static void add_script(const char* source, bool extension)
+{
+	Scheduler* scheduler = vm_scheduler();
+	pthread_mutex_lock(&scheduler->lock);
+
+	if(scheduler->script_count == scheduler->script_capacity)
+	{
+		scheduler->script_capacity = scheduler->script_capacity < 8 ? 8 : scheduler->script_capacity * 2;
+		scheduler->scripts = realloc(scheduler->scripts, sizeof(Script) * scheduler->script_capacity);
+	}
+
+	Script* script = &scheduler->scripts[scheduler->script_count];
+	script->source = strdup(source);
+	script->first_function = vm.function_count;
+	script->extension = extension;
+
+	// start_task() reads the count without the lock
+	__atomic_store_n(&scheduler->script_count, scheduler->script_count + 1, __ATOMIC_RELEASE);
+
+	pthread_mutex_unlock(&scheduler->lock);
+}
+
+
+/*
+ * share_script()
+ * Keep a copy of source, which interpret() is about to compile, for the
+ * workers to compile as well.
+ */
+void share_script(const char* source)
+{
+	add_script(source, false);
+}
+
+
+/*
+ * share_extension()
+ * Have the workers load an extension that the script has loaded, so
+ * tasks can call its natives. One that a task loads stays on its
+ * worker.
+ */
+void share_extension(const char* path)
+{
+	if(!on_worker())
+		add_script(path, true);
+}
+
+
+/*
+ * start_scheduler()
+ * Start vm.workers worker threads, or one per CPU.
+ */
+static void start_scheduler(void)
+{
+	Scheduler* scheduler = vm.scheduler;
+	long count = vm.workers > 0 ? vm.workers : sysconf(_SC_NPROCESSORS_ONLN);
+	if(count < 1)
+		count = 1;
+
+	scheduler->backend = vm.backend;
+	scheduler->superinstructions = vm.superinstructions;
+	scheduler->max_instructions = vm.limits.max_instructions;
+	scheduler->max_ns = vm.limits.max_ns;
+	scheduler->heap_limit = vm.memory.limit;
+	scheduler->queued = 0;
+	scheduler->sleeping = 0;
+	scheduler->stopping = false;
+	init_deque(&scheduler->injected);
+
+	scheduler->workers = calloc(count, sizeof(Worker));
+	scheduler->worker_count = 0;
+	for(int i = 0; i < count; i++)
+	{
+		Worker* worker = &scheduler->workers[i];
+		worker->index = i;
+		worker->scheduler = scheduler;
+		init_deque(&worker->deque);
+	}
+
+	// The workers read worker_count, it is set before any of them start
+	// and lowered again if not all of them could be
+	scheduler->worker_count = (int) count;
+	for(int i = 0; i < count; i++)
+	{
+		if(pthread_create(&scheduler->workers[i].thread, NULL, worker_main, &scheduler->workers[i]) != 0)
+		{
+			scheduler->worker_count = i;
+			break;
+		}
+	}
+
+	scheduler->started = true;
+}
+
+
+/*
+ * stop_workers()
+ * Tell the workers to stop and wait for them. A task that is running is
+ * cancelled at its next limit check, which the workers make at least
+ * every so many instructions, and one blocked in join() gives up.
+ */
+static void stop_workers(void)
+{
+	Scheduler* scheduler = vm.scheduler;
+
+	pthread_mutex_lock(&scheduler->lock);
+	__atomic_store_n(&scheduler->stopping, true, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&scheduler->work);
+	pthread_cond_broadcast(&scheduler->finished);
+	pthread_mutex_unlock(&scheduler->lock);
+
+	for(int i = 0; i < scheduler->worker_count; i++)
+		pthread_join(scheduler->workers[i].thread, NULL);
+
+	for(int i = 0; i < scheduler->worker_count; i++)
+		free_deque(&scheduler->workers[i].deque);
+	free_deque(&scheduler->injected);
+	free(scheduler->workers);
+	scheduler->workers = NULL;
+	scheduler->worker_count = 0;
+	scheduler->started = false;
+}
+
+
+/*
+ * stop_scheduler()
+ * Cancel the tasks that are running and wait for the workers to exit.
+ * Tasks that are still queued or parked are dropped, and so are the
+ * scripts and the scheduler. Once the workers are gone no other thread
+ * can reach it, so it is freed without the lock.
+ */
+void stop_scheduler(void)
+{
+	Scheduler* scheduler = vm.scheduler;
+
+	if(on_worker() || scheduler == NULL)
+		return;
+
+	if(scheduler->started)
+		stop_workers();
+
+	for(int i = 0; i < scheduler->script_count; i++)
+		free(scheduler->scripts[i].source);
+	free(scheduler->scripts);
+	pthread_mutex_destroy(&scheduler->lock);
+	pthread_cond_destroy(&scheduler->work);
+	pthread_cond_destroy(&scheduler->finished);
+	free(scheduler);
+	vm.scheduler = NULL;
+}
+
+
+/*
+ * have_workers()
+ * Start the workers the first time. Their VMs have none of the
+ * profiling and tracing options, so tasks aren't allowed while one is on
+ * rather than going unseen.
+ */
+static bool have_workers(const char** error)
+{
+	Scheduler* scheduler = vm_scheduler();
+
+	if(watching_vm())
+	{
+		*error = "Tasks can't run with profiling or tracing options, which only see the script's thread.";
+		return false;
+	}
+
+	if(!scheduler->started)
+		start_scheduler();
+
+	if(scheduler->worker_count == 0)
+	{
+		*error = "Could not start the worker threads.";
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * spawn_task()
+ * Queue a call of function with arg, which can_share().
+ */
+Task* spawn_task(ObjFunction* function, Value arg, const char** error)
+{
+	if(!have_workers(error))
+		return NULL;
+
+	Task* task = new_shared_task(function->id, 1);		// the handle
+	share_value(arg, &task->arg);
+	task->globals = share_globals();
+	queue_task(task);
+
+	return task;
+}
+
+
+/*
+ * spawn_range()
+ * Queue the task for a parallel_for() from start up to end. reduce can
+ * be NULL.
+ */
+Task* spawn_range(ObjFunction* body, ObjFunction* reduce, double start, double end, const char** error)
+{
+	if(!have_workers(error))
+		return NULL;
+
+	Task* task = new_shared_task(body->id, 1);			// the handle
+	task->range = new_range(start, end, reduce != NULL ? reduce->id : -1, true);
+	task->globals = share_globals();
+	queue_task(task);
+
+	return task;
+}
@@ -0,0 +1,139 @@
+/*
+ * SCHEDULER
+ * spawn() hands a function and an argument to a pool of worker threads.
+ * Every worker has a VM of its own, compiled from the same source as
+ * the script, so no heap, intern table or globals table is ever shared:
+ * a task names its function by id, which comes out the same in every
+ * VM, and its argument and result are copied from one heap to another.
+ * So are the spawner's other globals, as they are at the spawn, and
+ * what a task assigns to them stays in its worker.
+ *
+ * The workers, and the scripts they compile, are those of the VM that
+ * spawned the task. Every VM has its own, so VMs on other threads can
+ * spawn at the same time and freeing one stops only its workers.
+ *
+ * Each worker keeps a deque of the tasks spawned on it. It runs the
+ * newest itself and idle workers steal the oldest, tasks spawned by the
+ * script go on a queue of their own. A task runs as a fiber of the
+ * worker that took it, so one that joins a task that hasn't finished, or
+ * waits on a channel, is parked with its stack and the worker carries on
+ * with other tasks.
+ *
+ * parallel_for() is a task too. It splits its range into parts, spawns
+ * a task for each but the first, calls the body for the indexes of the
+ * first itself and then folds in the results of the others.
+ */
+
+#ifndef __LOX_SCHEDULER_H
+#define __LOX_SCHEDULER_H
+
+#include "common.h"
+#include "object.h"
+#include "value.h"
+#include "vm.h"
+
+
+typedef enum {
+	TASK_QUEUED,
+	TASK_RUNNING,			// or parked in join()
+	TASK_DONE,
+	TASK_FAILED,			// stopped by a runtime error
+} TaskState;
+
+
+/*
+ * SharedString
+ * Characters outside of any VM's heap, which never change. Every VM that
+ * has an ObjString for them, and every SharedValue of them, holds a
+ * reference.
+ */
+typedef struct SharedString {
+	int refs;
+	int length;
+	uint32_t hash;
+	char chars[];
+} SharedString;
+
+#define SHARED_STRING(characters) ((SharedString*) ((characters) - offsetof(SharedString, chars)))
+
+
+struct Channel;
+
+/*
+ * SharedValue
+ * A value outside of any VM's heap, holding a reference to the string or
+ * channel.
+ */
+typedef struct {
+	ValueType type;			// VAL_OBJ for a string or a channel
+	double number;
+	bool boolean;
+	SharedString* string;
+	struct Channel* channel;
+} SharedValue;
+
+#define SHARED_NIL ((SharedValue) {VAL_NIL, 0, false, NULL, NULL})
+
+
+/*
+ * Globals
+ * The globals that can_share() of the VM that spawned a task, as they
+ * were when it did. The parts of a parallel_for() hold the same ones.
+ */
+typedef struct {
+	int refs;
+	int count;
+	SharedString** names;
+	SharedValue* values;
+} Globals;
+
+
+struct Worker;
+struct Range;
+
+/*
+ * Task
+ * Held by the handle that spawn() returned and by the scheduler until
+ * the task finishes. state, result and waiters are guarded by the
+ * scheduler's lock, message and error by the lock of the channel it is
+ * parked on.
+ */
+typedef struct Task {
+	int function;				// ObjFunction id
+	SharedValue arg;
+	Globals* globals;			// defined in the worker's VM before the task starts, or NULL
+	SharedValue result;
+	ExecLimits limits;			// the worker's, kept while the task is parked
+	TaskState state;
+	int refs;
+	struct Worker* owner;		// the worker running it
+	ObjFiber* fiber;			// in the owner's heap
+	struct Task* joined;		// the task it is parked on, if not a channel
+	SharedValue message;		// to send, or received while parked
+	const char* error;			// raised once it is resumed
+	struct Task* waiters;		// tasks parked on it
+	struct Task* next;			// in a list of waiters or woken tasks
+	struct Range* range;		// for parallel_for(), NULL for spawn()
+} Task;
+
+
+void  share_script(const char* source);
+void  share_extension(const char* path);
+bool  can_share(Value value);
+void  share_value(Value value, SharedValue* shared);
+Value unshare_value(SharedValue* shared);
+void  release_value(SharedValue* shared);
+void  release_string(SharedString* string);
+Task* spawn_task(ObjFunction* function, Value arg, const char** error);
+Task* spawn_range(ObjFunction* body, ObjFunction* reduce, double start, double end, const char** error);
+void  release_task(Task* task);
+bool  on_worker(void);
+Task* parkable_task(void);
+bool  park_on_task(Task* task);
+void  wake_task(Task* task);
+void  wait_task(Task* task);
+TaskState task_result(Task* task, Value* result);
+void  stop_scheduler(void);
+
+
+#endif /*__LOX_SCHEDULER_H*/
@@ -0,0 +1,278 @@
+#include <stdlib.h>
+
+#include "stats.h"
+#include "debug.h"
+#include "memory.h"
+#include "object.h"
+
+
+
+/*
+ * init_stats()
+ */
+void init_stats(VMStats* stats)
+{
+	stats->enabled = false;
+	stats->cycles = false;
+
+	for(int i = 0; i < UINT8_COUNT; i++)
+	{
+		stats->op_counts[i] = 0;
+		stats->op_cycles[i] = 0;
+	}
+
+	stats->table_lookups = 0;
+	stats->table_probes = 0;
+	stats->call_count = 0;
+	stats->call_capacity = 0;
+	stats->calls = NULL;
+}
+
+
+/*
+ * free_stats()
+ */
+void free_stats(VMStats* stats)
+{
+	FREE_ARRAY(CallCount, stats->calls, stats->call_capacity);
+	init_stats(stats);
+}
+
+
+static uint32_t hash_pointer(Obj* object, int capacity)
+{
+	// Objects are at least 8 byte aligned so the low bits carry nothing
+	return (uint32_t) (((uintptr_t) object >> 3) % (uintptr_t) capacity);
+}
+
+
+static CallCount* find_call(CallCount* calls, int capacity, Obj* callee)
+{
+	uint32_t index = hash_pointer(callee, capacity);
+
+	while(calls[index].callee != NULL && calls[index].callee != callee)
+		index = (index + 1) % capacity;
+
+	return &calls[index];
+}
+
+
+static void grow_calls(VMStats* stats)
+{
+	int capacity = GROW_CAPACITY(stats->call_capacity) * 2;
+	CallCount* calls = ALLOCATE(CallCount, capacity);
+
+	for(int i = 0; i < capacity; i++)
+	{
+		calls[i].callee = NULL;
+		calls[i].count = 0;
+	}
+
+	for(int i = 0; i < stats->call_capacity; i++)
+	{
+		if(stats->calls[i].callee != NULL)
+			*find_call(calls, capacity, stats->calls[i].callee) = stats->calls[i];
+	}
+
+	FREE_ARRAY(CallCount, stats->calls, stats->call_capacity);
+	stats->calls = calls;
+	stats->call_capacity = capacity;
+}
+
+
+/*
+ * stats_count_call()
+ */
+void stats_count_call(VMStats* stats, Value callee)
+{
+	if(!IS_OBJ(callee))
+		return;
+
+	if((stats->call_count + 1) * 4 > stats->call_capacity * 3)
+		grow_calls(stats);
+
+	CallCount* entry = find_call(stats->calls, stats->call_capacity, AS_OBJ(callee));
+	if(entry->callee == NULL)
+	{
+		entry->callee = AS_OBJ(callee);
+		stats->call_count++;
+	}
+
+	entry->count++;
+}
+
+
+/*
+ * stats_count_probes()
+ */
+void stats_count_probes(VMStats* stats, Table* table, ObjString* key)
+{
+	stats->table_lookups++;
+	stats->table_probes += table_probe_count(table, key);
+}
+
+
+// ======== REPORTS ======== //
+
+static VMStats* sort_stats;
+
+static int compare_ops(const void* a, const void* b)
+{
+	uint64_t ca = sort_stats->op_counts[*(const int*) a];
+	uint64_t cb = sort_stats->op_counts[*(const int*) b];
+
+	if(ca == cb)
+		return 0;
+
+	return ca < cb ? 1 : -1;
+}
+
+static int compare_calls(const void* a, const void* b)
+{
+	uint64_t ca = ((const CallCount*) a)->count;
+	uint64_t cb = ((const CallCount*) b)->count;
+
+	if(ca == cb)
+		return 0;
+
+	return ca < cb ? 1 : -1;
+}
+
+
+/*
+ * sorted_ops()
+ * Fill ops with every executed opcode, most executed first.
+ */
+static int sorted_ops(VMStats* stats, int* ops)
+{
+	int num = 0;
+	for(int i = 0; i < UINT8_COUNT; i++)
+	{
+		if(stats->op_counts[i] > 0)
+			ops[num++] = i;
+	}
+
+	sort_stats = stats;
+	qsort(ops, num, sizeof(int), compare_ops);
+
+	return num;
+}
+
+
+/*
+ * sorted_calls()
+ * Pack the call table into calls, most called first.
+ */
+static int sorted_calls(VMStats* stats, CallCount* calls)
+{
+	int num = 0;
+	for(int i = 0; i < stats->call_capacity; i++)
+	{
+		if(stats->calls[i].callee != NULL)
+			calls[num++] = stats->calls[i];
+	}
+
+	qsort(calls, num, sizeof(CallCount), compare_calls);
+
+	return num;
+}
+
+
+/*
+ * print_stats()
+ */
+void print_stats(VMStats* stats, FILE* file)
+{
+	int ops[UINT8_COUNT];
+	int num_ops = sorted_ops(stats, ops);
+
+	uint64_t total = 0;
+	uint64_t total_cycles = 0;
+	for(int i = 0; i < num_ops; i++)
+	{
+		total += stats->op_counts[ops[i]];
+		total_cycles += stats->op_cycles[ops[i]];
+	}
+
+	fprintf(file, "==== opcodes ====\n");
+	fprintf(file, "%-48s %12s %7s", "opcode", "count", "%");
+	if(stats->cycles)
+		fprintf(file, " %14s %7s %10s", "cycles", "%", "cyc/op");
+	fprintf(file, "\n");
+
+	for(int i = 0; i < num_ops; i++)
+	{
+		uint64_t count = stats->op_counts[ops[i]];
+		fprintf(file, "%-48s %12lu %6.2f%%", opcode_name(ops[i]), (unsigned long) count,
+				100.0 * (double) count / (double) total);
+
+		if(stats->cycles)
+		{
+			uint64_t cycles = stats->op_cycles[ops[i]];
+			fprintf(file, " %14lu %6.2f%% %10.1f", (unsigned long) cycles,
+					total_cycles > 0 ? 100.0 * (double) cycles / (double) total_cycles : 0.0,
+					(double) cycles / (double) count);
+		}
+		fprintf(file, "\n");
+	}
+	fprintf(file, "%-48s %12lu\n", "total", (unsigned long) total);
+
+	if(stats->call_count > 0)
+	{
+		CallCount* calls = ALLOCATE(CallCount, stats->call_count);
+		int num_calls = sorted_calls(stats, calls);
+
+		fprintf(file, "\n==== calls ====\n");
+		for(int i = 0; i < num_calls; i++)
+			fprintf(file, "%-48s %12lu\n", callable_name(calls[i].callee), (unsigned long) calls[i].count);
+
+		FREE_ARRAY(CallCount, calls, stats->call_count);
+	}
+
+	fprintf(file, "\n==== globals table ====\n");
+	fprintf(file, "%-48s %12lu\n", "lookups", (unsigned long) stats->table_lookups);
+	fprintf(file, "%-48s %12lu\n", "probes", (unsigned long) stats->table_probes);
+	if(stats->table_lookups > 0)
+	{
+		fprintf(file, "%-48s %12.2f\n", "probes/lookup",
+				(double) stats->table_probes / (double) stats->table_lookups);
+	}
+}
+
+
+/*
+ * write_stats_json()
+ */
+void write_stats_json(VMStats* stats, FILE* file)
+{
+	int ops[UINT8_COUNT];
+	int num_ops = sorted_ops(stats, ops);
+
+	fprintf(file, "{\n  \"opcodes\": [");
+	for(int i = 0; i < num_ops; i++)
+	{
+		fprintf(file, "%s\n    {\"name\": \"%s\", \"count\": %lu", i > 0 ? "," : "",
+				opcode_name(ops[i]), (unsigned long) stats->op_counts[ops[i]]);
+		if(stats->cycles)
+			fprintf(file, ", \"cycles\": %lu", (unsigned long) stats->op_cycles[ops[i]]);
+		fprintf(file, "}");
+	}
+	fprintf(file, "\n  ],\n  \"calls\": [");
+
+	if(stats->call_count > 0)
+	{
+		CallCount* calls = ALLOCATE(CallCount, stats->call_count);
+		int num_calls = sorted_calls(stats, calls);
+
+		for(int i = 0; i < num_calls; i++)
+		{
+			fprintf(file, "%s\n    {\"name\": \"%s\", \"count\": %lu}", i > 0 ? "," : "",
+					callable_name(calls[i].callee), (unsigned long) calls[i].count);
+		}
+
+		FREE_ARRAY(CallCount, calls, stats->call_count);
+	}
+
+	fprintf(file, "\n  ],\n  \"globals\": {\"lookups\": %lu, \"probes\": %lu}\n}\n",
+			(unsigned long) stats->table_lookups, (unsigned long) stats->table_probes);
+}
@@ -0,0 +1,64 @@
+/*
+ * EXECUTION STATISTICS
+ * Counters collected by the stats variant of the interpreter loop.
+ * None of this is touched unless stats are enabled.
+ */
+
+#ifndef __LOX_STATS_H
+#define __LOX_STATS_H
+
+#include <stdio.h>
+
+#include "common.h"
+#include "table.h"
+#include "value.h"
+
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define STATS_HAVE_CYCLES
+
+static inline uint64_t read_cycles(void)
+{
+	return __rdtsc();
+}
+#else
+static inline uint64_t read_cycles(void)
+{
+	return 0;
+}
+#endif
+
+
+/*
+ * CallCount
+ * Number of calls made to one function or native.
+ */
+typedef struct {
+	Obj* callee;
+	uint64_t count;
+} CallCount;
+
+
+typedef struct {
+	bool enabled;
+	bool cycles;					// also time each opcode with the TSC
+	uint64_t op_counts[UINT8_COUNT];
+	uint64_t op_cycles[UINT8_COUNT];
+	uint64_t table_lookups;			// global variable table accesses
+	uint64_t table_probes;			// entries looked at by those accesses
+	int call_count;
+	int call_capacity;
+	CallCount* calls;				// open addressed on the callee pointer
+} VMStats;
+
+
+void init_stats(VMStats* stats);
+void free_stats(VMStats* stats);
+void stats_count_call(VMStats* stats, Value callee);
+void stats_count_probes(VMStats* stats, Table* table, ObjString* key);
+void print_stats(VMStats* stats, FILE* file);
+void write_stats_json(VMStats* stats, FILE* file);
+
+
+#endif /*__LOX_STATS_H*/
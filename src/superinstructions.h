@@ -0,0 +1,21 @@
+/*
+ * SUPERINSTRUCTIONS
+ * Generated by gen_superinstr from ngrams.txt. Do not edit by hand.
+ */
+
+#ifndef __LOX_SUPERINSTRUCTIONS_H
+#define __LOX_SUPERINSTRUCTIONS_H
+
+#define SUPERINSTRUCTIONS_2(X) \
+	X(ADD, RETURN) \
+	X(GET_GLOBAL, GET_LOCAL) \
+	X(CONSTANT, DEFINE_GLOBAL)
+
+#define SUPERINSTRUCTIONS_3(X) \
+	X(CONSTANT, LESS, JUMP_IF_FALSE) \
+	X(CONSTANT, SUB, CALL) \
+	X(POP, GET_LOCAL, RETURN) \
+	X(POP, GET_GLOBAL, GET_LOCAL) \
+	X(PRINT, NIL, RETURN)
+
+#endif /*__LOX_SUPERINSTRUCTIONS_H*/
@@ -23,7 +23,7 @@ void init_table(Table* table)
  */
 void free_table(Table* table)
 {
-	FREE_ARRAY(Entry, table->entries, table->capacity);
+	FREE_ARRAY_AS(MEM_TABLE, Entry, table->entries, table->capacity);
 	init_table(table);
 }
 
@@ -68,7 +68,7 @@ static Entry* find_entry(Entry* entries, int capacity, ObjString* key)
 static void adjust_capacity(Table* table, int capacity)
 {
 	// Allocate new memory
-	Entry* entries = ALLOCATE(Entry, capacity);
+	Entry* entries = ALLOCATE_AS(MEM_TABLE, Entry, capacity);
 
 	for(int i = 0; i < capacity; i++)
 	{
@@ -93,7 +93,7 @@ static void adjust_capacity(Table* table, int capacity)
 	}
 
 	// Release the old array memory
-	FREE_ARRAY(Entry, table->entries, table->capacity);
+	FREE_ARRAY_AS(MEM_TABLE, Entry, table->entries, table->capacity);
 
 	table->entries = entries;
 	table->capacity = capacity;
@@ -122,7 +122,7 @@ bool table_get(Table* table, ObjString* key, Value* value)
  */
 bool table_set(Table* table, ObjString* key, Value value)
 {
-	if(table->count + 1 > table->capacity + TABLE_MAX_LOAD)
+	if(table->count + 1 > table->capacity * TABLE_MAX_LOAD)
 	{
 		int capacity = GROW_CAPACITY(table->capacity);
 		adjust_capacity(table, capacity);
@@ -192,9 +192,10 @@ ObjString* table_find_string(Table* table, const char* chars, int length, uint32
 			if(IS_NIL(entry->value))
 				return NULL;
 		}
+		// Strings received from another VM can share their characters
 		else if((entry->key->length == length) && 
 				(entry->key->hash == hash) &&
-				(memcmp(entry->key->chars, chars, length) == 0))
+				(entry->key->chars == chars || memcmp(entry->key->chars, chars, length) == 0))
 			return entry->key;  // <- this is the key we want
 
 		index = (index + 1) % table->capacity;
@@ -221,3 +222,32 @@ bool table_delete(Table* table, ObjString* key)
 
 	return true;
 }
+
+
+/*
+ * table_probe_count()
+ * Number of entries find_entry() looks at to resolve key. This walks 
+ * the probe sequence again rather than instrumenting find_entry() so 
+ * that normal lookups don't pay for it.
+ */
+int table_probe_count(Table* table, ObjString* key)
+{
+	if(table->capacity == 0)
+		return 0;
+
+	uint32_t index = key->hash % table->capacity;
+	int probes = 1;
+
+	while(probes < table->capacity)
+	{
+		Entry* entry = &table->entries[index];
+
+		if(entry->key == key || (entry->key == NULL && IS_NIL(entry->value)))
+			break;
+
+		index = (index + 1) % table->capacity;
+		probes++;
+	}
+
+	return probes;
+}
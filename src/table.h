@@ -41,6 +41,7 @@ void table_add(Table* from, Table* to);
 void table_add_all(Table* from, Table* to);
 ObjString* table_find_string(Table* table, const char* chars, int length, uint32_t hash);
 bool table_delete(Table* table, ObjString* key);
+int table_probe_count(Table* table, ObjString* key);
 
 
 #endif /*__LOX_TABLE_H*/
@@ -0,0 +1,225 @@
+// clock_gettime() is POSIX rather than C99
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdlib.h>
+#include <time.h>
+
+#include "timeline.h"
+
+
+/*
+ * timeline_now()
+ */
+uint64_t timeline_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+
+/*
+ * init_timeline()
+ */
+void init_timeline(Timeline* timeline)
+{
+	timeline->enabled = false;
+	timeline->origin = 0;
+	timeline->min_duration = TIMELINE_DEFAULT_MIN_NS;
+	timeline->skipped = 0;
+	timeline->dropped = 0;
+	timeline->heap_recorded = 0;
+	timeline->count = 0;
+	timeline->capacity = 0;
+	timeline->events = NULL;
+	timeline->depth = 0;
+}
+
+
+/*
+ * free_timeline()
+ */
+void free_timeline(Timeline* timeline)
+{
+	free(timeline->events);
+	init_timeline(timeline);
+}
+
+
+/*
+ * start_timeline()
+ * Event times are taken relative to now.
+ */
+void start_timeline(Timeline* timeline)
+{
+	timeline->enabled = true;
+	timeline->origin = timeline_now();
+}
+
+
+/*
+ * add_event()
+ * The buffer is grown with realloc() rather than reallocate(), which
+ * would record the growth as a heap event while we are adding one.
+ */
+static void add_event(Timeline* timeline, TimelineKind kind, Obj* object, uint64_t ts, uint64_t value)
+{
+	if(timeline->count == timeline->capacity)
+	{
+		if(timeline->capacity >= TIMELINE_MAX_EVENTS)
+		{
+			timeline->dropped++;
+			return;
+		}
+
+		int capacity = timeline->capacity < 1024 ? 1024 : timeline->capacity * 2;
+		TimelineEvent* events = realloc(timeline->events, sizeof(TimelineEvent) * capacity);
+		if(events == NULL)
+		{
+			timeline->dropped++;
+			return;
+		}
+
+		timeline->events = events;
+		timeline->capacity = capacity;
+	}
+
+	TimelineEvent* event = &timeline->events[timeline->count++];
+	event->kind = kind;
+	event->object = object;
+	event->ts = ts - timeline->origin;
+	event->value = value;
+}
+
+
+/*
+ * timeline_compiled()
+ * Every function is recorded however quickly it compiled, there are
+ * only as many of these as there are functions in the source.
+ */
+void timeline_compiled(Timeline* timeline, ObjFunction* function, uint64_t start)
+{
+	add_event(timeline, TIMELINE_COMPILE, (Obj*) function, start, timeline_now() - start);
+}
+
+
+/*
+ * timeline_enter()
+ * Start timing a call. Nothing is recorded until it returns.
+ */
+void timeline_enter(Timeline* timeline, Value callee)
+{
+	if(timeline->depth == TIMELINE_DEPTH_MAX)
+		return;
+
+	TimelineFrame* frame = &timeline->stack[timeline->depth++];
+	frame->callee = AS_OBJ(callee);
+	frame->start = timeline_now();
+}
+
+
+/*
+ * timeline_exit()
+ * Record the call on top of the stack if it took long enough.
+ */
+void timeline_exit(Timeline* timeline)
+{
+	if(timeline->depth == 0)
+		return;
+
+	TimelineFrame* frame = &timeline->stack[--timeline->depth];
+	uint64_t duration = timeline_now() - frame->start;
+
+	if(duration < timeline->min_duration)
+		timeline->skipped++;
+	else
+		add_event(timeline, TIMELINE_CALL, frame->callee, frame->start, duration);
+}
+
+
+/*
+ * timeline_unwind()
+ * Close the calls left open when a runtime error ends the script.
+ */
+void timeline_unwind(Timeline* timeline)
+{
+	while(timeline->depth > 0)
+		timeline_exit(timeline);
+}
+
+
+/*
+ * timeline_allocation()
+ * Called from reallocate() with the live bytes after the allocation.
+ * Allocations of at least TIMELINE_HEAP_STEP bytes are recorded on their
+ * own, the heap size only once it has moved that far since it was last
+ * recorded.
+ */
+void timeline_allocation(Timeline* timeline, size_t old_size, size_t new_size, uint64_t live)
+{
+	if(new_size >= old_size + TIMELINE_HEAP_STEP)
+		add_event(timeline, TIMELINE_ALLOC, NULL, timeline_now(), new_size - old_size);
+
+	if(live >= timeline->heap_recorded + TIMELINE_HEAP_STEP || live + TIMELINE_HEAP_STEP <= timeline->heap_recorded)
+	{
+		add_event(timeline, TIMELINE_HEAP, NULL, timeline_now(), live);
+		timeline->heap_recorded = live;
+	}
+}
+
+
+/*
+ * write_timeline()
+ * Complete ("X") events for compiling and calls, instant events for
+ * large allocations and a counter track for the heap. Times in the
+ * format are microseconds.
+ */
+void write_timeline(Timeline* timeline, FILE* file)
+{
+	fprintf(file, "{\"traceEvents\": [\n");
+	fprintf(file, "  {\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 1, \"args\": {\"name\": \"clox\"}}");
+
+	for(int i = 0; i < timeline->count; i++)
+	{
+		TimelineEvent* event = &timeline->events[i];
+		// Microseconds with three decimals, printing doubles is much slower
+		unsigned long ts = (unsigned long) event->ts / 1000;
+		unsigned long ts_ns = (unsigned long) event->ts % 1000;
+		unsigned long dur = (unsigned long) event->value / 1000;
+		unsigned long dur_ns = (unsigned long) event->value % 1000;
+
+		switch(event->kind)
+		{
+			case TIMELINE_COMPILE:
+				fprintf(file, ",\n  {\"name\": \"compile %s\", \"cat\": \"compile\", \"ph\": \"X\", "
+						"\"ts\": %lu.%03lu, \"dur\": %lu.%03lu, \"pid\": 1, \"tid\": 1}",
+						callable_name(event->object), ts, ts_ns, dur, dur_ns);
+				break;
+
+			case TIMELINE_CALL:
+				fprintf(file, ",\n  {\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", "
+						"\"ts\": %lu.%03lu, \"dur\": %lu.%03lu, \"pid\": 1, \"tid\": 1}",
+						callable_name(event->object), event->object->type == OBJ_NATIVE ? "native" : "call",
+						ts, ts_ns, dur, dur_ns);
+				break;
+
+			case TIMELINE_ALLOC:
+				fprintf(file, ",\n  {\"name\": \"allocate\", \"cat\": \"memory\", \"ph\": \"i\", \"s\": \"t\", "
+						"\"ts\": %lu.%03lu, \"pid\": 1, \"tid\": 1, \"args\": {\"bytes\": %lu}}",
+						ts, ts_ns, (unsigned long) event->value);
+				break;
+
+			case TIMELINE_HEAP:
+				fprintf(file, ",\n  {\"name\": \"heap\", \"cat\": \"memory\", \"ph\": \"C\", "
+						"\"ts\": %lu.%03lu, \"pid\": 1, \"args\": {\"bytes\": %lu}}",
+						ts, ts_ns, (unsigned long) event->value);
+				break;
+		}
+	}
+
+	fprintf(file, "\n],\n\"displayTimeUnit\": \"ns\",\n");
+	fprintf(file, "\"otherData\": {\"min_call_ns\": %lu, \"calls_below_min\": %lu, \"dropped\": %lu}}\n",
+			(unsigned long) timeline->min_duration, (unsigned long) timeline->skipped,
+			(unsigned long) timeline->dropped);
+}
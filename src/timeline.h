@@ -0,0 +1,80 @@
+/*
+ * TIMELINE
+ * Events for the compilation of each function, Lox and native calls
+ * and the heap, kept in memory while the script runs and written out at
+ * exit in the Chrome trace event format (chrome://tracing, Perfetto).
+ * Calls shorter than a threshold and small changes in the heap are left
+ * out so long runs stay cheap to record and small enough to load.
+ */
+
+#ifndef __LOX_TIMELINE_H
+#define __LOX_TIMELINE_H
+
+#include <stdio.h>
+
+#include "common.h"
+#include "object.h"
+#include "value.h"
+
+
+#define TIMELINE_DEFAULT_MIN_NS 1000		// calls shorter than this are only counted
+#define TIMELINE_HEAP_STEP 4096				// bytes the heap has to move by to be recorded
+#define TIMELINE_MAX_EVENTS (1 << 20)
+// FRAMES_MAX frames and a native called from the innermost one
+#define TIMELINE_DEPTH_MAX (64 + 1)
+
+
+typedef enum {
+	TIMELINE_COMPILE,		// object is the function, value the duration
+	TIMELINE_CALL,			// object is the callee, value the duration
+	TIMELINE_ALLOC,			// one allocation of value bytes
+	TIMELINE_HEAP,			// value bytes live, from vm.memory
+} TimelineKind;
+
+
+/*
+ * TimelineEvent
+ * Times are nanoseconds since the timeline was started.
+ */
+typedef struct {
+	TimelineKind kind;
+	Obj* object;
+	uint64_t ts;
+	uint64_t value;
+} TimelineEvent;
+
+
+typedef struct {
+	Obj* callee;
+	uint64_t start;
+} TimelineFrame;
+
+
+typedef struct {
+	bool enabled;
+	uint64_t origin;
+	uint64_t min_duration;		// nanoseconds
+	uint64_t skipped;			// calls shorter than min_duration
+	uint64_t dropped;			// events that didn't fit in the buffer
+	uint64_t heap_recorded;		// live bytes in the last TIMELINE_HEAP event
+	int count;
+	int capacity;
+	TimelineEvent* events;
+	int depth;
+	TimelineFrame stack[TIMELINE_DEPTH_MAX];
+} Timeline;
+
+
+void init_timeline(Timeline* timeline);
+void free_timeline(Timeline* timeline);
+void start_timeline(Timeline* timeline);
+uint64_t timeline_now(void);
+void timeline_compiled(Timeline* timeline, ObjFunction* function, uint64_t start);
+void timeline_enter(Timeline* timeline, Value callee);
+void timeline_exit(Timeline* timeline);
+void timeline_unwind(Timeline* timeline);
+void timeline_allocation(Timeline* timeline, size_t old_size, size_t new_size, uint64_t live);
+void write_timeline(Timeline* timeline, FILE* file);
+
+
+#endif /*__LOX_TIMELINE_H*/
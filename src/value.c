@@ -37,7 +37,7 @@ void init_value_array(ValueArray* array)
 
 void free_value_array(ValueArray* array)
 {
-	FREE_ARRAY(Value, array->values, array->capacity);
+	FREE_ARRAY_AS(MEM_CONSTANTS, Value, array->values, array->capacity);
 	init_value_array(array);
 }
 
@@ -48,7 +48,7 @@ void write_value_array(ValueArray* array, Value value)
 	{
 		int prev_capacity = array->capacity;
 		array->capacity = GROW_CAPACITY(prev_capacity);
-		array->values = GROW_ARRAY(Value, array->values, prev_capacity, array->capacity);
+		array->values = GROW_ARRAY_AS(MEM_CONSTANTS, Value, array->values, prev_capacity, array->capacity);
 	}
 
 	array->values[array->count] = value;
@@ -1,26 +1,44 @@
+// clock_gettime() is POSIX rather than C99
+#define _POSIX_C_SOURCE 199309L
+
+#include <errno.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <string.h>
 #include <time.h>
 
+#include "channel.h"
 #include "common.h"
 #include "compiler.h"
+#include "fiber.h"
+#include "scheduler.h"
 #include "vm.h"
 #include "memory.h"
 #include "debug.h"
 
 
-VM vm;
+THREAD_LOCAL VM vm;
 
 // ==== Native function definitions ==== // 
+
+/*
+ * clock_native()
+ * clock() is the CPU time the process has used, in seconds.
+ */
 static Value clock_native(int arg_count, Value* args)
 {
-	return NUMBER_VAL((double) clock() / CLOCKS_PER_SEC);
+	struct timespec ts;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+
+	return NUMBER_VAL((double) ts.tv_sec + (double) ts.tv_nsec / 1e9);
 }
 
 
 
 static void reset_stack(void);
+static bool instrumented(void);
+static InterpResult run_called(ObjFunction* function);
 
 
 /*
@@ -43,8 +61,13 @@ static void runtime_error(const char* format, ...)
 		// The instruction pointer always points to the NEXT instruction
 		// to execute, so we subtract 1 here so that we are sitting on the 
 		// current instruction.
-		size_t instr = frame->ip - function->chunk.code - 1;
-		fprintf(stderr, "[line %d] in ", function->chunk.lines[instr]);
+		int line;
+		if(vm.backend == BACKEND_REGISTER)
+			line = function->reg_chunk.lines[frame->rip - function->reg_chunk.code - 1];
+		else
+			line = function->chunk.lines[frame->ip - function->chunk.code - 1];
+
+		fprintf(stderr, "[line %d] in ", line);
 		if(function->name == NULL)
 			fprintf(stderr, "script\n");
 		else
@@ -55,13 +78,68 @@ static void runtime_error(const char* format, ...)
 }
 
 
+/*
+ * heap_limit_error()
+ */
+static void heap_limit_error(void)
+{
+	runtime_error("Out of memory, the heap limit is %lu bytes.", (unsigned long) vm.memory.limit);
+}
+
+
 /*
  * define_native()
  */
 static void define_native(const char* name, NativeFn function)
 {
 	push(OBJ_VAL(copy_string(name, (int) strlen(name))));
-	push(OBJ_VAL(new_native(function)));
+	push(OBJ_VAL(new_native(function, AS_STRING(vm.stack[0]))));
+	table_set(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
+	pop();
+	pop();
+}
+
+
+/*
+ * define_number_native()
+ * A native that takes numbers and evaluates to one, called unboxed.
+ */
+static void define_number_native(const char* name, Number1Fn number1, Number2Fn number2)
+{
+	push(OBJ_VAL(copy_string(name, (int) strlen(name))));
+	ObjNative* native = new_native(NULL, AS_STRING(vm.stack[0]));
+	native->number1 = number1;
+	native->number2 = number2;
+	set_signature(native, number1 != NULL ? "n" : "nn");
+	push(OBJ_VAL(native));
+	table_set(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
+	pop();
+	pop();
+}
+
+
+/*
+ * define_intrinsic()
+ * A number native that also has an opcode, see intrinsics.h. The
+ * compiler knows its name by the mark on the interned string.
+ */
+static void define_intrinsic(Intrinsic id, const char* name, Number1Fn number1, Number2Fn number2)
+{
+	define_number_native(name, number1, number2);
+
+	ObjString* string = copy_string(name, (int) strlen(name));
+	string->intrinsic = (uint8_t) (id + 1);
+	vm.intrinsic_names[id] = string;
+}
+
+
+/*
+ * define_control_native()
+ */
+static void define_control_native(const char* name, ControlFn control)
+{
+	push(OBJ_VAL(copy_string(name, (int) strlen(name))));
+	push(OBJ_VAL(new_control_native(control, AS_STRING(vm.stack[0]))));
 	table_set(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
 	pop();
 	pop();
@@ -73,6 +151,7 @@ static void reset_stack(void)
 {
 	vm.stack_top = vm.stack;
 	vm.frame_count = 0;
+	abandon_fibers();
 }
 
 void push(Value value)
@@ -99,19 +178,147 @@ static bool is_falsey(Value value)
 }
 
 
-static void concatenate(void)
+/*
+ * concatenate()
+ * Returns false with a runtime error if the result would go over the
+ * heap limit. The operands are left on the stack then.
+ */
+static bool concatenate(void)
 {
-	ObjString* bstr = AS_STRING(pop());
-	ObjString* astr = AS_STRING(pop());
+	ObjString* bstr = AS_STRING(peek(0));
+	ObjString* astr = AS_STRING(peek(1));
 
 	int length = astr->length + bstr->length;
-	char* chars = ALLOCATE(char, length + 1);
+	if(!heap_has_room(length + 1))
+	{
+		heap_limit_error();
+		return false;
+	}
+
+	pop();
+	pop();
+	char* chars = ALLOCATE_AS(MEM_STRING, char, length + 1);
 	memcpy(chars, astr->chars, astr->length);
 	memcpy(chars + astr->length, bstr->chars, bstr->length);
 	chars[length] = '\0';
 
 	ObjString* result = take_string(chars, length);
 	push(OBJ_VAL(result));
+
+	return true;
+}
+
+
+// Instructions between reads of the clock when there is a time limit
+#define LIMIT_CHECK_INTERVAL 100000
+
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+
+/*
+ * clock_ns_native()
+ * clock_ns() is wall time in nanoseconds from the monotonic clock, for
+ * timing with a difference of two readings. A double holds it exactly
+ * for over a hundred days of uptime.
+ */
+static Value clock_ns_native(int arg_count, Value* args)
+{
+	return NUMBER_VAL((double) now_ns());
+}
+
+
+/*
+ * next_limit_check()
+ * Fold what ran since the last check into executed and set the budget
+ * to run before the next one.
+ */
+static void next_limit_check(void)
+{
+	ExecLimits* limits = &vm.limits;
+	uint64_t window = INT64_MAX;
+
+	if(limits->max_ns > 0 || limits->cancel != NULL)
+		window = LIMIT_CHECK_INTERVAL;
+	if(limits->max_instructions > 0)
+	{
+		uint64_t left = limits->executed < limits->max_instructions ?
+				limits->max_instructions - limits->executed : 0;
+		if(left < window)
+			window = left;
+	}
+
+	limits->window = (int64_t) window;
+	limits->budget = (int64_t) window;
+}
+
+
+/*
+ * start_limits()
+ * Called at the start of each interpret(), and of each task on a worker.
+ */
+void start_limits(void)
+{
+	vm.limits.executed = 0;
+	vm.limits.window = 0;
+	vm.limits.budget = 0;
+	vm.limits.deadline = vm.limits.max_ns > 0 ? now_ns() + vm.limits.max_ns : 0;
+	next_limit_check();
+}
+
+
+/*
+ * check_limits()
+ * Slow path of charge_instructions(), once the budget has run out.
+ * Returns false with a runtime error if the script has gone over a limit
+ * or been cancelled.
+ */
+static bool check_limits(void)
+{
+	ExecLimits* limits = &vm.limits;
+
+	limits->executed += (uint64_t) (limits->window - limits->budget);
+	limits->window = limits->budget = 0;
+
+	if(limits->max_instructions > 0 && limits->executed >= limits->max_instructions)
+	{
+		runtime_error("Instruction limit of %lu exceeded.", (unsigned long) limits->max_instructions);
+		return false;
+	}
+
+	if(limits->max_ns > 0 && now_ns() >= limits->deadline)
+	{
+		runtime_error("Time limit of %lu ms exceeded.", (unsigned long) (limits->max_ns / 1000000));
+		return false;
+	}
+
+	if(limits->cancel != NULL && __atomic_load_n(limits->cancel, __ATOMIC_ACQUIRE))
+	{
+		runtime_error("Task cancelled, the script has finished.");
+		return false;
+	}
+
+	next_limit_check();
+
+	return true;
+}
+
+
+/*
+ * charge_instructions()
+ * This is all a back edge or call costs when there are no limits.
+ */
+static inline bool charge_instructions(int count)
+{
+	vm.limits.budget -= count;
+
+	return vm.limits.budget > 0 || check_limits();
 }
 
 
@@ -133,14 +340,66 @@ static bool call(ObjFunction* function, int arg_count)
 		return false;
 	}
 
+	if(!charge_instructions(function->call_cost))
+		return false;
+
+	Value* slots = vm.stack_top - arg_count - 1;
+
+	// Register frames claim their whole window up front
+	if(vm.backend == BACKEND_REGISTER && slots + function->reg_chunk.max_regs > vm.stack + STACK_MAX)
+	{
+		runtime_error("Stack overflow");
+		return false;
+	}
+
 	CallFrame* frame = &vm.frames[vm.frame_count++];
 	frame->function = function;
 	frame->ip = function->chunk.code;
-	frame->slots = vm.stack_top - arg_count - 1;
+	frame->rip = function->reg_chunk.code;
+	frame->slots = slots;
+
+	if(vm.backend == BACKEND_REGISTER)
+		vm.stack_top = slots + function->reg_chunk.max_regs;
+
+	return true;
+}
+
+/*
+ * check_signature()
+ * Raise a runtime error unless the arguments are as many, and of the
+ * types, that the native's signature lists.
+ */
+static bool check_signature(ObjNative* native, int arg_count, Value* args)
+{
+	if(arg_count != native->arity)
+	{
+		runtime_error("Expected %d arguments but got %d.", native->arity, arg_count);
+		return false;
+	}
+
+	for(int i = 0; i < arg_count; i++)
+	{
+		const char* expected = NULL;
+		switch(native->signature[i])
+		{
+			case 'n': if(!IS_NUMBER(args[i]))   expected = "a number"; break;
+			case 's': if(!IS_STR(args[i]))      expected = "a string"; break;
+			case 'b': if(!IS_BOOL(args[i]))     expected = "a boolean"; break;
+			case 'f': if(!IS_FUNCTION(args[i])) expected = "a function"; break;
+			default: break;
+		}
+
+		if(expected != NULL)
+		{
+			runtime_error("%s() takes %s as argument %d.", native->name->chars, expected, i + 1);
+			return false;
+		}
+	}
 
 	return true;
 }
 
+
 /*
  * call_value()
  */
@@ -154,11 +413,57 @@ static bool call_value(Value callee, int arg_count)
 				return call(AS_FUNCTION(callee), arg_count);
 
 			case OBJ_NATIVE: {
-				NativeFn native = AS_NATIVE(callee);
-				Value result = native(arg_count, vm.stack_top - arg_count);
-				vm.stack_top -= arg_count + 1;
-				push(result);
-				
+				ObjNative* native = AS_NATIVE_OBJ(callee);
+				Value* args = vm.stack_top - arg_count;
+				if(native->signature != NULL && !check_signature(native, arg_count, args))
+					return false;
+
+				// The signature has checked that these are numbers
+				if(native->number1 != NULL)
+				{
+					args[-1] = NUMBER_VAL(native->number1(AS_NUMBER(args[0])));
+					vm.stack_top = args;
+					return true;
+				}
+				if(native->number2 != NULL)
+				{
+					args[-1] = NUMBER_VAL(native->number2(AS_NUMBER(args[0]), AS_NUMBER(args[1])));
+					vm.stack_top = args;
+					return true;
+				}
+
+				if(native->host != NULL)
+				{
+					Value result;
+					if(!call_host(native, arg_count, args, &result))
+					{
+						if(IS_STR(result))
+							runtime_error("%s", AS_CSTRING(result));
+						else
+							runtime_error("%s() failed.", native->name->chars);
+						return false;
+					}
+					vm.stack_top -= arg_count + 1;
+					push(result);
+				}
+				else if(native->control != NULL)
+				{
+					if(!native->control(arg_count, args))
+						return false;
+				}
+				else
+				{
+					Value result = native->function(arg_count, args);
+					vm.stack_top -= arg_count + 1;
+					push(result);
+				}
+
+				if(vm.memory.exceeded)
+				{
+					heap_limit_error();
+					return false;
+				}
+
 				return true;
 			}
 
@@ -173,258 +478,1812 @@ static bool call_value(Value callee, int arg_count)
 }
 
 
-static InterpResult run(void) 
+/*
+ * intrinsic_global()
+ * What the global an intrinsic's opcode stands for holds, which is only
+ * called when it can't apply the native itself.
+ */
+static bool intrinsic_global(Intrinsic id, Value* callee)
 {
-	CallFrame* frame = &vm.frames[vm.frame_count-1];
+	ObjString* name = vm.intrinsic_names[id];
+	if(!table_get(&vm.globals, name, callee))
+	{
+		runtime_error("Undefined variable '%s'.", name->chars);
+		return false;
+	}
 
-	// NOTE: why use a macro here? Faster? Because its inlined?
-#define READ_BYTE() (*frame->ip++)
-#define READ_CONSTANT() (frame->function->chunk.constants.values[READ_BYTE()])
-#define READ_STRING() AS_STRING(READ_CONSTANT())
-#define READ_SHORT() (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
+	return true;
+}
 
-#define BINARY_OP(value_type, op) \
-	do { \
-		if(!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {\
-			runtime_error("Operands must be numbers"); \
-			return INTERPRET_RUNTIME_ERROR; \
-		} \
-		double b = AS_NUMBER(pop()); \
-		double a = AS_NUMBER(pop()); \
-		push(value_type(a op b)); \
-	} while(false)
 
-	for(;;)
-	{
-#ifdef DEBUG_TRACE_EXECUTION
-		fprintf(stdout, "      ");
-		for(Value* slot = vm.stack; slot < vm.stack_top; slot++)
-		{
-			fprintf(stdout, "[");
-			print_value(*slot);
-			fprintf(stdout, "]");
-		}
-		fprintf(stdout, "\n");
+/*
+ * call_intrinsic_registers()
+ * The slow path of an intrinsic's register instruction. The destination
+ * register and the ones above it become the window ROP_CALL would have
+ * set up, with the global as the callee.
+ */
+static bool call_intrinsic_registers(Intrinsic id, Value* slots, RegInstr instr, int arg_count)
+{
+	Value callee;
+	if(!intrinsic_global(id, &callee))
+		return false;
 
-		disassemble_instr(&frame->function->chunk, (int)(frame->ip - frame->function->chunk.code));
-#endif /*DEBUG_TRACE_EXECUTION*/
+	// The operands may be in the window, so read them before writing it
+	Value b = slots[REG_B(instr)];
+	Value c = slots[REG_C(instr)];
+	Value* window = &slots[REG_A(instr)];
+	window[0] = callee;
+	window[1] = b;
+	if(arg_count == 2)
+		window[2] = c;
+
+	vm.stack_top = window + arg_count + 1;
+	if(!call_value(callee, arg_count))
+		return false;
 
-		uint8_t instr = READ_BYTE();
-		switch(instr)
-		{
-			case OP_CONSTANT: {
-				Value constant = READ_CONSTANT();
-				push(constant);
-				print_value(constant);
-				fprintf(stdout, "\n");
-				break;
-			}
+	CallFrame* frame = &vm.frames[vm.frame_count-1];
+	vm.stack_top = frame->slots + frame->function->reg_chunk.max_regs;
+	return true;
+}
 
-			case OP_NIL:
-				push(NIL_VAL);
-				break;
 
-			case OP_TRUE:
-				push(BOOL_VAL(true));
-				break;
+// ==== Fiber natives ==== //
 
-			case OP_FALSE:
-				push(BOOL_VAL(false));
-				break;
+/*
+ * fiber_native()
+ * fiber(fn) makes a fiber that will call fn. If fn takes an argument it
+ * gets the value passed to the first resume().
+ */
+static bool fiber_native(int arg_count, Value* args)
+{
+	if(arg_count != 1 || !IS_FUNCTION(args[0]) || AS_FUNCTION(args[0])->arity > 1)
+	{
+		runtime_error("fiber() takes a function of at most one argument.");
+		return false;
+	}
 
-			case OP_POP:
-				pop();
-				break;
+	ObjFiber* fiber = new_fiber(AS_FUNCTION(args[0]));
+	vm.stack_top -= arg_count + 1;
+	push(OBJ_VAL(fiber));
 
-			case OP_DEFINE_GLOBAL: {
-				ObjString* name = READ_STRING();
-				table_set(&vm.globals, name, peek(0));
-				pop();
-				break;
+	return true;
+}
 
-			}
 
-			case OP_GET_GLOBAL: {
-				ObjString* name = READ_STRING();
-				Value value;
+/*
+ * hook_switch_in()
+ * The call profiler and the timeline follow the running fiber. A new
+ * fiber's function is a call from the resume() or run() that started
+ * it, and a resumed fiber carries on with the calls it had open.
+ */
+static void hook_switch_in(bool started)
+{
+	if(!vm.profiler.enabled && !vm.timeline.enabled)
+		return;
 
-				if(!table_get(&vm.globals, name, &value))
-				{
-					runtime_error("Undefined variable '%s'.", name->chars);
-					return INTERPRET_RUNTIME_ERROR;
-				}
+	for(int i = vm.frame_base; i < vm.frame_count; i++)
+	{
+		Value callee = OBJ_VAL(vm.frames[i].function);
+		int line = 0;
+		if(i > vm.frame_base)
+		{
+			CallFrame* caller = &vm.frames[i-1];
+			line = caller->function->chunk.lines[caller->ip - caller->function->chunk.code - 1];
+		}
 
-				push(value);
-				break;
-			}
+		if(vm.profiler.enabled && started)
+			profiler_enter(&vm.profiler, callee, line);
+		else if(vm.profiler.enabled)
+			profiler_reenter(&vm.profiler, callee, line);
+		if(vm.timeline.enabled)
+			timeline_enter(&vm.timeline, callee);
+	}
+}
 
-			case OP_SET_GLOBAL: {
-				ObjString* name = READ_STRING();
 
-				// Variable declaration in Lox is not implicit,
-				// so setting a value to a name that has not 
-				// been declared is an error.
-				if(table_set(&vm.globals, name, peek(0)))
-				{
-					table_delete(&vm.globals, name);
-					runtime_error("Undefined variable '%s'.", name->chars);
-					return INTERPRET_RUNTIME_ERROR;
-				}
+/*
+ * hook_switch_out()
+ * A native is about to suspend the running fiber, so it doesn't return
+ * through the loop's hooks. Close its call, the calls open in the fiber
+ * and the call of the resume() or run() that the fiber returns to.
+ */
+static void hook_switch_out(void)
+{
+	if(!vm.profiler.enabled && !vm.timeline.enabled)
+		return;
 
-				break;
-			}
+	for(int i = vm.frame_base; i < vm.frame_count + 2; i++)
+	{
+		if(vm.profiler.enabled)
+			profiler_exit(&vm.profiler);
+		if(vm.timeline.enabled)
+			timeline_exit(&vm.timeline);
+	}
+}
 
-			case OP_GET_LOCAL: {
-				uint8_t slot = READ_BYTE();
-				push(frame->slots[slot]);
-				break;
-			}
 
-			case OP_SET_LOCAL: {
-				uint8_t slot = READ_BYTE();
-				frame->slots[slot] = peek(0);
-				break;
-			}
+/*
+ * switch_to_fiber()
+ * Replace the native's callee and arguments with the fiber, which runs
+ * until it yields or returns. value is what the yield() it stopped in
+ * returns, or the argument of its function if it hasn't started.
+ */
+static bool switch_to_fiber(ObjFiber* fiber, Value value, int arg_count)
+{
+	if(!fiber_fits(fiber))
+	{
+		runtime_error("Stack overflow");
+		return false;
+	}
 
-			case OP_EQUAL: {
-				Value b = pop();
-				Value a = pop();
-				push(BOOL_VAL(values_equal(a, b)));
-				break;
-			}
+	// Whatever the fiber yields or returns takes the place of the call
+	vm.stack_top -= arg_count + 1;
 
-			case OP_GREATER:
-				BINARY_OP(BOOL_VAL, >); break;
-			case OP_LESS:
-				BINARY_OP(BOOL_VAL, <); break;
+	if(fiber->state != FIBER_NEW)
+	{
+		restore_fiber(fiber);
+		hook_switch_in(false);
+		push(value);
+		return true;
+	}
 
-			// Add either two numbers or concat two strings
-			case OP_ADD: {
-				if(IS_STR(peek(0)) && IS_STR(peek(1)))
-					concatenate();
-				else if(IS_NUMBER(peek(0)) && IS_NUMBER(peek(1)))
-				{
-					double b = AS_NUMBER(pop());
-					double a = AS_NUMBER(pop());
-					push(NUMBER_VAL(a + b));
-				}
-				else
-				{
-					runtime_error("Operands must be numbers or strings");
-					return INTERPRET_RUNTIME_ERROR;
-				}
-				break;
-			}
+	ObjFunction* function = fiber->function;
+	start_fiber(fiber);
+	push(OBJ_VAL(function));
+	if(function->arity == 1)
+		push(value);
 
-			case OP_SUB: BINARY_OP(NUMBER_VAL, -); break;
-			case OP_MUL: BINARY_OP(NUMBER_VAL, *); break;
-			case OP_DIV: BINARY_OP(NUMBER_VAL, /); break;
-			case OP_NOT:
-				push(BOOL_VAL(is_falsey(pop())));
-				break;
+	if(!call(function, function->arity))
+		return false;
 
-			case OP_NEGATE: {
-				if(!IS_NUMBER(peek(0))) {
-					runtime_error("Operand must be a number");
-					return INTERPRET_RUNTIME_ERROR;
-				}
+	hook_switch_in(true);
+	return true;
+}
 
-				push(NUMBER_VAL(-AS_NUMBER(pop())));
-				break;
-			}
 
-			case OP_PRINT: {
-				print_value(pop());
-				printf("\n");
-				break;
+/*
+ * resume_native()
+ * resume(fiber, value) runs the fiber until it yields or returns, and
+ * evaluates to the value it yielded or returned. value is what the
+ * yield() the fiber stopped in returns.
+ */
+static bool resume_native(int arg_count, Value* args)
+{
+	if(arg_count < 1 || arg_count > 2 || !IS_FIBER(args[0]))
+	{
+		runtime_error("resume() takes a fiber and an optional value.");
+		return false;
+	}
+
+	ObjFiber* fiber = AS_FIBER(args[0]);
+
+	if(fiber->state == FIBER_RUNNING)
+	{
+		runtime_error("Cannot resume a fiber that is already running.");
+		return false;
+	}
+	if(fiber->state == FIBER_WAITING)
+	{
+		runtime_error("Cannot resume a fiber that is waiting for I/O.");
+		return false;
+	}
+	if(fiber->state == FIBER_DONE)
+	{
+		runtime_error("Cannot resume a fiber that has finished.");
+		return false;
+	}
+
+	return switch_to_fiber(fiber, arg_count == 2 ? args[1] : NIL_VAL, arg_count);
+}
+
+
+/*
+ * yield_native()
+ * yield(value) stops the running fiber and makes value the result of
+ * the resume() that ran it.
+ */
+static bool yield_native(int arg_count, Value* args)
+{
+	if(arg_count > 1)
+	{
+		runtime_error("yield() takes at most one value.");
+		return false;
+	}
+	if(vm.fiber == NULL)
+	{
+		runtime_error("Cannot yield outside of a fiber.");
+		return false;
+	}
+	if(vm.frame_base == vm.run_base)
+	{
+		runtime_error("Cannot yield from a task or bench(), only from a fiber they resumed.");
+		return false;
+	}
+
+	Value value = arg_count == 1 ? args[0] : NIL_VAL;
+
+	// The value passed to the next resume() takes the place of the call
+	hook_switch_out();
+	vm.stack_top -= arg_count + 1;
+	suspend_fiber();
+	push(value);
+
+	return true;
+}
+
+
+/*
+ * done_native()
+ * done(fiber) is true once the fiber has returned.
+ */
+static Value done_native(int arg_count, Value* args)
+{
+	return BOOL_VAL(arg_count == 1 && IS_FIBER(args[0]) && AS_FIBER(args[0])->state == FIBER_DONE);
+}
+
+
+// ==== Event loop natives ==== //
+
+/*
+ * native_result()
+ * Replace a control native's callee and arguments with its result.
+ */
+static bool native_result(int arg_count, Value result)
+{
+	vm.stack_top -= arg_count + 1;
+	push(result);
+
+	return true;
+}
+
+
+static bool io_error(const char* operation, int error)
+{
+	runtime_error("%s() failed: %s", operation, strerror(error));
+	return false;
+}
+
+
+/*
+ * number_args()
+ * Check that a native got count numbers.
+ */
+static bool number_args(const char* name, int arg_count, Value* args, int count)
+{
+	bool ok = arg_count == count;
+	for(int i = 0; ok && i < count; i++)
+		ok = IS_NUMBER(args[i]);
+
+	if(!ok)
+		runtime_error("%s() takes %d number%s.", name, count, count == 1 ? "" : "s");
+
+	return ok;
+}
+
+
+/*
+ * in_task()
+ * True when the running fiber is the one run() resumed, which can be
+ * parked rather than block the whole VM.
+ */
+static bool in_task(void)
+{
+	return vm.fiber != NULL && vm.fiber == vm.events.current;
+}
+
+
+/*
+ * park_task()
+ * Once the event loop has taken the running task's operation, with error
+ * 0, go back to the run() that resumed the task, which evaluates to nil.
+ */
+static bool park_task(const char* operation, int error, int arg_count)
+{
+	if(error == EEXIST)
+	{
+		runtime_error("%s() failed: another fiber is already waiting on this descriptor.", operation);
+		return false;
+	}
+	if(error != 0)
+		return io_error(operation, error);
+
+	ObjFiber* fiber = vm.fiber;
+	hook_switch_out();
+	vm.stack_top -= arg_count + 1;
+	suspend_fiber();
+	fiber->state = FIBER_WAITING;
+	push(NIL_VAL);
+
+	return true;
+}
+
+
+/*
+ * task_descriptor()
+ * A task parks rather than block on fd, which needs it to be
+ * non-blocking, see io_nonblocking().
+ */
+static bool task_descriptor(const char* operation, int fd)
+{
+	if(!in_task())
+		return true;
+
+	int error = io_nonblocking(&vm.events, fd);
+	if(error != 0)
+		return io_error(operation, error);
+
+	return true;
+}
+
+
+/*
+ * schedule_native()
+ * schedule(fiber, value) queues the fiber for run(), which resumes it
+ * with value.
+ */
+static bool schedule_native(int arg_count, Value* args)
+{
+	if(arg_count < 1 || arg_count > 2 || !IS_FIBER(args[0]) ||
+			(AS_FIBER(args[0])->state != FIBER_NEW && AS_FIBER(args[0])->state != FIBER_SUSPENDED))
+	{
+		runtime_error("schedule() takes a new or suspended fiber and an optional value.");
+		return false;
+	}
+
+	loop_schedule(&vm.events, AS_FIBER(args[0]), arg_count == 2 ? args[1] : NIL_VAL);
+
+	return native_result(arg_count, NIL_VAL);
+}
+
+
+/*
+ * pending_native()
+ * pending() is the number of scheduled fibers that are queued or waiting.
+ */
+static Value pending_native(int arg_count, Value* args)
+{
+	return NUMBER_VAL(loop_pending(&vm.events));
+}
+
+
+/*
+ * run_native()
+ * run() resumes the next scheduled fiber, waiting for I/O first if they
+ * are all parked. It evaluates to what the fiber yields or returns, or
+ * nil if the fiber parks again or nothing is scheduled. A fiber that
+ * yielded goes to the back of the queue.
+ */
+static bool run_native(int arg_count, Value* args)
+{
+	EventLoop* loop = &vm.events;
+
+	if(arg_count != 0)
+	{
+		runtime_error("run() takes no arguments.");
+		return false;
+	}
+
+	if(loop->current != NULL && loop->current->state == FIBER_SUSPENDED)
+		loop_schedule(loop, loop->current, NIL_VAL);
+	loop->current = NULL;
+
+	ReadyTask task;
+	for(;;)
+	{
+		if(loop_pending(loop) == 0)
+			return native_result(arg_count, NIL_VAL);
+
+		if(!loop_next(loop, &task))
+		{
+			int error = loop_wait(loop);
+			if(error != 0)
+				return io_error("run", error);
+			continue;
+		}
+
+		// Fibers can be resumed or finish by other means while queued
+		if(task.fiber->state != FIBER_RUNNING && task.fiber->state != FIBER_DONE)
+			break;
+	}
+
+	loop->current = task.fiber;
+	if(!switch_to_fiber(task.fiber, task.value, arg_count))
+		return false;
+
+	// Raised in the fiber, where the operation was
+	if(task.error != 0)
+		return io_error(task.operation, task.error);
+
+	return true;
+}
+
+
+/*
+ * sleep_native()
+ * sleep(ms) parks a task for ms milliseconds, anywhere else it blocks.
+ */
+static bool sleep_native(int arg_count, Value* args)
+{
+	if(!number_args("sleep", arg_count, args, 1))
+		return false;
+
+	double ms = AS_NUMBER(args[0]);
+
+	if(in_task())
+		return park_task("sleep", loop_sleep(&vm.events, vm.fiber, ms), arg_count);
+
+	int error = io_sleep(ms);
+	if(error != 0)
+		return io_error("sleep", error);
+
+	return native_result(arg_count, NIL_VAL);
+}
+
+
+/*
+ * read_native()
+ * read(fd) is a string of what could be read, up to LOOP_READ_SIZE
+ * bytes, or nil at the end of the file.
+ */
+static bool read_native(int arg_count, Value* args)
+{
+	if(!number_args("read", arg_count, args, 1))
+		return false;
+
+	int fd = (int) AS_NUMBER(args[0]);
+	Value result;
+	IoStatus status;
+
+	if(!task_descriptor("read", fd))
+		return false;
+
+	while((status = io_read(fd, &result)) == IO_AGAIN)
+	{
+		if(in_task())
+			return park_task("read", loop_park(&vm.events, vm.fiber, WAIT_READ, fd, NULL, 0), arg_count);
+
+		int error = io_wait(fd, WAIT_READ);
+		if(error != 0)
+			return io_error("read", error);
+	}
+
+	if(status == IO_FAILED)
+		return io_error("read", errno);
+
+	return native_result(arg_count, result);
+}
+
+
+/*
+ * write_native()
+ * write(fd, string) writes all of the string and is its length.
+ */
+static bool write_native(int arg_count, Value* args)
+{
+	if(arg_count != 2 || !IS_NUMBER(args[0]) || !IS_STR(args[1]))
+	{
+		runtime_error("write() takes a descriptor and a string.");
+		return false;
+	}
+
+	int fd = (int) AS_NUMBER(args[0]);
+	ObjString* data = AS_STRING(args[1]);
+	int written = 0;
+	IoStatus status;
+
+	if(!task_descriptor("write", fd))
+		return false;
+
+	while((status = io_write(fd, data, &written)) == IO_AGAIN)
+	{
+		if(in_task())
+			return park_task("write", loop_park(&vm.events, vm.fiber, WAIT_WRITE, fd, data, written), arg_count);
+
+		int error = io_wait(fd, WAIT_WRITE);
+		if(error != 0)
+			return io_error("write", error);
+	}
+
+	if(status == IO_FAILED)
+		return io_error("write", errno);
+
+	return native_result(arg_count, NUMBER_VAL(written));
+}
+
+
+/*
+ * accept_native()
+ * accept(fd) is the descriptor of the next connection on a socket from
+ * listen().
+ */
+static bool accept_native(int arg_count, Value* args)
+{
+	if(!number_args("accept", arg_count, args, 1))
+		return false;
+
+	int fd = (int) AS_NUMBER(args[0]);
+	Value result;
+	IoStatus status;
+
+	if(!task_descriptor("accept", fd))
+		return false;
+
+	while((status = io_accept(fd, &result)) == IO_AGAIN)
+	{
+		if(in_task())
+			return park_task("accept", loop_park(&vm.events, vm.fiber, WAIT_ACCEPT, fd, NULL, 0), arg_count);
+
+		int error = io_wait(fd, WAIT_ACCEPT);
+		if(error != 0)
+			return io_error("accept", error);
+	}
+
+	if(status == IO_FAILED)
+		return io_error("accept", errno);
+
+	return native_result(arg_count, result);
+}
+
+
+/*
+ * listen_native()
+ * listen(path) is a UNIX socket listening at path.
+ */
+static bool listen_native(int arg_count, Value* args)
+{
+	if(arg_count != 1 || !IS_STR(args[0]))
+	{
+		runtime_error("listen() takes a path.");
+		return false;
+	}
+
+	int fd;
+	int error = io_listen(AS_CSTRING(args[0]), &fd);
+	if(error != 0)
+		return io_error("listen", error);
+
+	return native_result(arg_count, NUMBER_VAL(fd));
+}
+
+
+/*
+ * connect_native()
+ * connect(path) is a socket connected to the UNIX socket at path.
+ */
+static bool connect_native(int arg_count, Value* args)
+{
+	if(arg_count != 1 || !IS_STR(args[0]))
+	{
+		runtime_error("connect() takes a path.");
+		return false;
+	}
+
+	int fd;
+	int error = io_connect(AS_CSTRING(args[0]), &fd);
+	if(error != 0)
+		return io_error("connect", error);
+
+	return native_result(arg_count, NUMBER_VAL(fd));
+}
+
+
+/*
+ * socketpair_native()
+ * socketpair() is one end of a connected pair of sockets, peer() of it
+ * is the other.
+ */
+static bool socketpair_native(int arg_count, Value* args)
+{
+	if(arg_count != 0)
+	{
+		runtime_error("socketpair() takes no arguments.");
+		return false;
+	}
+
+	int fd;
+	int error = io_socketpair(&vm.events, &fd);
+	if(error != 0)
+		return io_error("socketpair", error);
+
+	return native_result(arg_count, NUMBER_VAL(fd));
+}
+
+
+/*
+ * peer_native()
+ * peer(fd) is the other end of a socketpair(), or nil.
+ */
+static Value peer_native(int arg_count, Value* args)
+{
+	if(arg_count != 1 || !IS_NUMBER(args[0]))
+		return NIL_VAL;
+
+	int peer = io_peer(&vm.events, (int) AS_NUMBER(args[0]));
+
+	return peer < 0 ? NIL_VAL : NUMBER_VAL(peer);
+}
+
+
+/*
+ * close_native()
+ * close(fd) closes a descriptor, close(channel) a channel.
+ */
+static bool close_native(int arg_count, Value* args)
+{
+	if(arg_count == 1 && IS_CHANNEL(args[0]))
+	{
+		if(!channel_close(AS_CHANNEL(args[0])->channel))
+		{
+			runtime_error("Channel is already closed.");
+			return false;
+		}
+		return native_result(arg_count, NIL_VAL);
+	}
+
+	if(!number_args("close", arg_count, args, 1))
+		return false;
+
+	int error = io_close(&vm.events, (int) AS_NUMBER(args[0]));
+	if(error != 0)
+		return io_error("close", error);
+
+	return native_result(arg_count, NIL_VAL);
+}
+
+
+// ==== Task natives ==== //
+
+/*
+ * spawn_native()
+ * spawn(fn, value) runs fn(value) as a task on one of the worker
+ * threads and evaluates to a handle for join().
+ */
+static bool spawn_native(int arg_count, Value* args)
+{
+	if(arg_count < 1 || arg_count > 2 || !IS_FUNCTION(args[0]) || AS_FUNCTION(args[0])->arity > 1)
+	{
+		runtime_error("spawn() takes a function of at most one argument and an optional value.");
+		return false;
+	}
+
+	Value arg = arg_count == 2 ? args[1] : NIL_VAL;
+	if(!can_share(arg))
+	{
+		runtime_error("A task can only be passed nil, a boolean, a number, a string or a channel.");
+		return false;
+	}
+
+	const char* error = NULL;
+	Task* task = spawn_task(AS_FUNCTION(args[0]), arg, &error);
+	if(task == NULL)
+	{
+		runtime_error("%s", error);
+		return false;
+	}
+
+	return native_result(arg_count, OBJ_VAL(new_task(task, AS_FUNCTION(args[0]))));
+}
+
+
+/*
+ * suspend_task()
+ * Suspend the fiber of a task that has just been parked. The native then
+ * returns false without an error so that run() stops, and resume_task()
+ * carries on from the native's result later.
+ */
+static bool suspend_task(int arg_count)
+{
+	ObjFiber* fiber = vm.fiber;
+	vm.stack_top -= arg_count + 1;
+	suspend_fiber();
+	fiber->state = FIBER_WAITING;
+
+	return false;
+}
+
+
+/*
+ * join_task()
+ * Wait for task, parked or blocked, and make its result the native's.
+ */
+static bool join_task(Task* task, int arg_count)
+{
+	Value result = NIL_VAL;
+
+	if(task_result(task, &result) < TASK_DONE)
+	{
+		if(parkable_task() != NULL && park_on_task(task))
+			return suspend_task(arg_count);
+
+		wait_task(task);
+	}
+
+	// A worker stops waiting once the scheduler is stopping
+	if(task_result(task, &result) != TASK_DONE)
+	{
+		runtime_error("Joined task failed.");
+		return false;
+	}
+
+	return native_result(arg_count, result);
+}
+
+
+/*
+ * join_native()
+ * join(task) evaluates to what the task returned, once it has. A task
+ * that joins one that is still running is parked and its worker runs
+ * other tasks meanwhile. Anywhere else join() blocks the thread.
+ */
+static bool join_native(int arg_count, Value* args)
+{
+	if(arg_count != 1 || !IS_TASK(args[0]))
+	{
+		runtime_error("join() takes a task.");
+		return false;
+	}
+
+	return join_task(AS_TASK(args[0])->task, arg_count);
+}
+
+
+/*
+ * parallel_for_native()
+ * parallel_for(start, end, fn, reduce) calls fn(i) for each i from start
+ * up to end on the workers and evaluates to what they return folded
+ * together with reduce(a, b), in order of i. Without reduce it evaluates
+ * to nil. It waits for the calls the way join() does.
+ */
+static bool parallel_for_native(int arg_count, Value* args)
+{
+	if((arg_count != 3 && arg_count != 4) || !IS_NUMBER(args[0]) || !IS_NUMBER(args[1]) ||
+			!IS_FUNCTION(args[2]) || AS_FUNCTION(args[2])->arity != 1 ||
+			(arg_count == 4 && (!IS_FUNCTION(args[3]) || AS_FUNCTION(args[3])->arity != 2)))
+	{
+		runtime_error("parallel_for() takes a start, an end, a function of one argument and an optional function of two.");
+		return false;
+	}
+
+	if(AS_NUMBER(args[1]) <= AS_NUMBER(args[0]))
+		return native_result(arg_count, NIL_VAL);
+
+	const char* error = NULL;
+	ObjFunction* reduce = arg_count == 4 ? AS_FUNCTION(args[3]) : NULL;
+	Task* task = spawn_range(AS_FUNCTION(args[2]), reduce, AS_NUMBER(args[0]), AS_NUMBER(args[1]), &error);
+	if(task == NULL)
+	{
+		runtime_error("%s", error);
+		return false;
+	}
+
+	// A handle holds the reference spawn_range() returned, as for spawn()
+	new_task(task, AS_FUNCTION(args[2]));
+
+	return join_task(task, arg_count);
+}
+
+
+// ==== Channel natives ==== //
+
+/*
+ * channel_native()
+ * channel(capacity) is a channel that holds up to capacity messages.
+ */
+static bool channel_native(int arg_count, Value* args)
+{
+	if(arg_count != 1 || !IS_NUMBER(args[0]) || AS_NUMBER(args[0]) < 1 || AS_NUMBER(args[0]) > CHANNEL_CAPACITY_MAX)
+	{
+		runtime_error("channel() takes a capacity from 1 to %d.", CHANNEL_CAPACITY_MAX);
+		return false;
+	}
+
+	Channel* channel = make_channel((int) AS_NUMBER(args[0]));
+
+	return native_result(arg_count, OBJ_VAL(new_channel(channel)));
+}
+
+
+/*
+ * send_native()
+ * send(channel, value) waits for room in the channel and puts value in
+ * it. A task waits parked, anywhere else send() blocks the thread.
+ */
+static bool send_native(int arg_count, Value* args)
+{
+	if(arg_count != 2 || !IS_CHANNEL(args[0]))
+	{
+		runtime_error("send() takes a channel and a value.");
+		return false;
+	}
+
+	if(!can_share(args[1]))
+	{
+		runtime_error("A channel can only carry nil, a boolean, a number, a string or a channel.");
+		return false;
+	}
+
+	SharedValue message;
+	share_value(args[1], &message);
+
+	switch(channel_send(AS_CHANNEL(args[0])->channel, &message, parkable_task()))
+	{
+		case CHANNEL_PARKED:
+			return suspend_task(arg_count);
+		case CHANNEL_CLOSED:
+			release_value(&message);
+			runtime_error("Channel is closed.");
+			return false;
+		default:
+			return native_result(arg_count, NIL_VAL);
+	}
+}
+
+
+/*
+ * recv_native()
+ * recv(channel) waits for the oldest message in the channel and
+ * evaluates to it, or to nil once the channel is closed and empty.
+ */
+static bool recv_native(int arg_count, Value* args)
+{
+	if(arg_count != 1 || !IS_CHANNEL(args[0]))
+	{
+		runtime_error("recv() takes a channel.");
+		return false;
+	}
+
+	SharedValue message;
+	if(channel_receive(AS_CHANNEL(args[0])->channel, &message, parkable_task()) == CHANNEL_PARKED)
+		return suspend_task(arg_count);
+
+	Value value = unshare_value(&message);
+	release_value(&message);
+
+	return native_result(arg_count, value);
+}
+
+
+/*
+ * load_extension_native()
+ * load_extension(path) loads a shared library of natives, see lox.h.
+ */
+static bool load_extension_native(int arg_count, Value* args)
+{
+	if(arg_count != 1 || !IS_STR(args[0]))
+	{
+		runtime_error("load_extension() takes the path of a shared library.");
+		return false;
+	}
+
+	const char* error = load_extension(AS_CSTRING(args[0]));
+	if(error != NULL)
+	{
+		runtime_error("Can't load extension '%s': %s", AS_CSTRING(args[0]), error);
+		return false;
+	}
+
+	share_extension(AS_CSTRING(args[0]));
+	return native_result(arg_count, NIL_VAL);
+}
+
+
+/*
+ * record_sample()
+ * Fold the current call stack into "outer:line;...;inner:line" for the
+ * sampling profiler. Callers are charged to the line of their call.
+ */
+static void record_sample(void)
+{
+	char stack[SAMPLE_STACK_MAX];
+	int length = 0;
+
+	for(int i = 0; i < vm.frame_count; i++)
+	{
+		CallFrame* frame = &vm.frames[i];
+		Chunk* chunk = &frame->function->chunk;
+		int offset = (int)(frame->ip - chunk->code);
+		if(i < vm.frame_count - 1)
+			offset--;		// callers have already moved past the call
+
+		int written = snprintf(stack + length, sizeof(stack) - length, "%s%s:%d",
+				i > 0 ? ";" : "", callable_name((Obj*) frame->function), chunk->lines[offset]);
+		if(written < 0 || written >= (int) sizeof(stack) - length)
+			break;
+		length += written;
+	}
+
+	sampler_record(&vm.sampler, stack, length);
+}
+
+
+#ifdef DEBUG_COUNT_TRAFFIC
+// Number of Value reads and writes in the frame window made by each 
+// instruction. These are used to compare the two backends.
+static uint8_t stack_traffic[UINT8_COUNT] = {
+	[OP_CONSTANT] = 1, [OP_NIL] = 1, [OP_TRUE] = 1, [OP_FALSE] = 1,
+	[OP_POP] = 1, [OP_DEFINE_GLOBAL] = 1, [OP_GET_GLOBAL] = 1,
+	[OP_SET_GLOBAL] = 1, [OP_GET_LOCAL] = 2, [OP_SET_LOCAL] = 2,
+	[OP_EQUAL] = 3, [OP_GREATER] = 3, [OP_LESS] = 3, [OP_ADD] = 3,
+	[OP_SUB] = 3, [OP_MUL] = 3, [OP_DIV] = 3, [OP_NOT] = 2,
+	[OP_NEGATE] = 2, [OP_PRINT] = 1, [OP_JUMP] = 0,
+	[OP_JUMP_IF_FALSE] = 1, [OP_LOOP] = 0, [OP_CALL] = 1, [OP_RETURN] = 2,
+#define INTRINSIC_1_TRAFFIC(op, name, fn) [OP_##op] = 2,
+#define INTRINSIC_2_TRAFFIC(op, name, fn) [OP_##op] = 3,
+	MATH_INTRINSICS_1(INTRINSIC_1_TRAFFIC)
+	MATH_INTRINSICS_2(INTRINSIC_2_TRAFFIC)
+#undef INTRINSIC_1_TRAFFIC
+#undef INTRINSIC_2_TRAFFIC
+};
+
+static const uint8_t reg_traffic[] = {
+	[ROP_MOVE] = 2, [ROP_LOADK] = 1, [ROP_LOADNIL] = 1, [ROP_LOADBOOL] = 1,
+	[ROP_DEFINE_GLOBAL] = 1, [ROP_GET_GLOBAL] = 1, [ROP_SET_GLOBAL] = 1,
+	[ROP_EQUAL] = 3, [ROP_GREATER] = 3, [ROP_LESS] = 3, [ROP_ADD] = 3,
+	[ROP_SUB] = 3, [ROP_MUL] = 3, [ROP_DIV] = 3, [ROP_NOT] = 2,
+	[ROP_NEGATE] = 2, [ROP_PRINT] = 1, [ROP_JUMP] = 0,
+	[ROP_JUMP_IF_FALSE] = 1, [ROP_CALL] = 1, [ROP_RETURN] = 2,
+#define INTRINSIC_1_TRAFFIC(op, name, fn) [ROP_##op] = 2,
+#define INTRINSIC_2_TRAFFIC(op, name, fn) [ROP_##op] = 3,
+	MATH_INTRINSICS_1(INTRINSIC_1_TRAFFIC)
+	MATH_INTRINSICS_2(INTRINSIC_2_TRAFFIC)
+#undef INTRINSIC_1_TRAFFIC
+#undef INTRINSIC_2_TRAFFIC
+};
+
+#define COUNT_TRAFFIC(table, instr) \
+	do { \
+		vm.dispatch_count++; \
+		vm.slot_traffic += table[instr]; \
+	} while(false)
+#else
+#define COUNT_TRAFFIC(table, instr) do {} while(false)
+#endif /*DEBUG_COUNT_TRAFFIC*/
+
+
+#ifdef DEBUG_PROFILE_NGRAMS
+// Dynamic opcode n-gram counts. These feed gen_superinstr, which picks 
+// the sequences worth fusing into superinstructions.
+static uint64_t unigram_counts[OP_BASE_COUNT];
+static uint64_t bigram_counts[OP_BASE_COUNT][OP_BASE_COUNT];
+static uint64_t trigram_counts[OP_BASE_COUNT][OP_BASE_COUNT][OP_BASE_COUNT];
+static int prev_ops[2] = {-1, -1};
+
+#define PROFILE_NGRAM(instr) \
+	do { \
+		unigram_counts[instr]++; \
+		if(prev_ops[0] != -1) \
+			bigram_counts[prev_ops[0]][instr]++; \
+		if(prev_ops[1] != -1) \
+			trigram_counts[prev_ops[1]][prev_ops[0]][instr]++; \
+		prev_ops[1] = prev_ops[0]; \
+		prev_ops[0] = instr; \
+	} while(false)
+
+
+/*
+ * write_ngram_profile()
+ * Append the opcode n-gram counts to file, one n-gram per line.
+ */
+void write_ngram_profile(FILE* file)
+{
+	for(int a = 0; a < OP_BASE_COUNT; a++)
+	{
+		if(unigram_counts[a] > 0)
+			fprintf(file, "1 %s %lu\n", opcode_name(a), (unsigned long) unigram_counts[a]);
+
+		for(int b = 0; b < OP_BASE_COUNT; b++)
+		{
+			if(bigram_counts[a][b] > 0)
+			{
+				fprintf(file, "2 %s %s %lu\n", opcode_name(a), opcode_name(b),
+						(unsigned long) bigram_counts[a][b]);
+			}
+
+			for(int c = 0; c < OP_BASE_COUNT; c++)
+			{
+				if(trigram_counts[a][b][c] > 0)
+				{
+					fprintf(file, "3 %s %s %s %lu\n", opcode_name(a), opcode_name(b),
+							opcode_name(c), (unsigned long) trigram_counts[a][b][c]);
+				}
 			}
+		}
+	}
+}
+#else
+#define PROFILE_NGRAM(instr) do {} while(false)
+#endif /*DEBUG_PROFILE_NGRAMS*/
 
-			case OP_JUMP: {
-				uint16_t offset = READ_SHORT();
-				frame->ip += offset;
-				break;
-			}
 
-			case OP_JUMP_IF_FALSE: {
-				uint16_t offset = READ_SHORT();
-				if(is_falsey(peek(0)))
-					frame->ip += offset;
-				break;
-		    }
+// ======== Stack interpreter loop ======== //
 
-			case OP_LOOP: {
-				uint16_t offset = READ_SHORT();
-				frame->ip -= offset;
-				break;
-			}
+// NOTE: why use a macro here? Faster? Because its inlined?
+#define READ_BYTE() (*frame->ip++)
+#define READ_CONSTANT() (frame->function->chunk.constants.values[READ_BYTE()])
+#define READ_STRING() AS_STRING(READ_CONSTANT())
+#define READ_SHORT() (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
 
-			case OP_CALL: {
-				int arg_count = READ_BYTE();
-				if(!call_value(peek(arg_count), arg_count))
-					return INTERPRET_RUNTIME_ERROR;
+// Runtime error once an allocation has gone over the heap limit. Only
+// needed after instructions that can grow the heap.
+#define CHECK_HEAP() \
+	do { \
+		if(vm.memory.exceeded) \
+		{ \
+			heap_limit_error(); \
+			return INTERPRET_RUNTIME_ERROR; \
+		} \
+	} while(false)
 
-				frame = &vm.frames[vm.frame_count-1];
-				break;
-			}
+#define BINARY_OP(value_type, op) \
+	do { \
+		if(!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {\
+			runtime_error("Operands must be numbers"); \
+			return INTERPRET_RUNTIME_ERROR; \
+		} \
+		double b = AS_NUMBER(pop()); \
+		double a = AS_NUMBER(pop()); \
+		push(value_type(a op b)); \
+	} while(false)
 
-			case OP_RETURN: {
-				Value result = pop();
-				vm.frame_count--;
-				
-				if(vm.frame_count == 0)
-				{
-					// No more call frames - program is over
-					pop();
-					return INTERPRET_OK;
-				}
+// The body of each instruction is a macro so that the generated 
+// superinstructions can run several of them back to back without
+// going through the dispatch switch in between.
+#define OP_BODY_CONSTANT() \
+	do { \
+		Value constant = READ_CONSTANT(); \
+		push(constant); \
+	} while(false)
 
-				vm.stack_top = frame->slots;
-				push(result);
+#define OP_BODY_NIL()   push(NIL_VAL)
+#define OP_BODY_TRUE()  push(BOOL_VAL(true))
+#define OP_BODY_FALSE() push(BOOL_VAL(false))
+#define OP_BODY_POP()   pop()
 
-				frame = &vm.frames[vm.frame_count-1];
-				break;
-			}
-		}
-	}
+#define OP_BODY_DEFINE_GLOBAL() \
+	do { \
+		ObjString* name = READ_STRING(); \
+		LOOP_HOOK_GLOBAL(name); \
+		note_global(name); \
+		table_set(&vm.globals, name, peek(0)); \
+		pop(); \
+		CHECK_HEAP(); \
+	} while(false)
+
+#define OP_BODY_GET_GLOBAL() \
+	do { \
+		ObjString* name = READ_STRING(); \
+		LOOP_HOOK_GLOBAL(name); \
+		Value value; \
+		if(!table_get(&vm.globals, name, &value)) \
+		{ \
+			runtime_error("Undefined variable '%s'.", name->chars); \
+			return INTERPRET_RUNTIME_ERROR; \
+		} \
+		push(value); \
+	} while(false)
+
+// Variable declaration in Lox is not implicit, so setting a value 
+// to a name that has not been declared is an error.
+#define OP_BODY_SET_GLOBAL() \
+	do { \
+		ObjString* name = READ_STRING(); \
+		LOOP_HOOK_GLOBAL(name); \
+		note_global(name); \
+		if(table_set(&vm.globals, name, peek(0))) \
+		{ \
+			table_delete(&vm.globals, name); \
+			runtime_error("Undefined variable '%s'.", name->chars); \
+			return INTERPRET_RUNTIME_ERROR; \
+		} \
+		CHECK_HEAP(); \
+	} while(false)
+
+#define OP_BODY_GET_LOCAL() \
+	do { \
+		uint8_t slot = READ_BYTE(); \
+		push(frame->slots[slot]); \
+	} while(false)
+
+#define OP_BODY_SET_LOCAL() \
+	do { \
+		uint8_t slot = READ_BYTE(); \
+		frame->slots[slot] = peek(0); \
+	} while(false)
+
+#define OP_BODY_EQUAL() \
+	do { \
+		Value b = pop(); \
+		Value a = pop(); \
+		push(BOOL_VAL(values_equal(a, b))); \
+	} while(false)
+
+#define OP_BODY_GREATER() BINARY_OP(BOOL_VAL, >)
+#define OP_BODY_LESS()    BINARY_OP(BOOL_VAL, <)
+
+// Add either two numbers or concat two strings
+#define OP_BODY_ADD() \
+	do { \
+		if(IS_STR(peek(0)) && IS_STR(peek(1))) \
+		{ \
+			if(!concatenate()) \
+				return INTERPRET_RUNTIME_ERROR; \
+		} \
+		else if(IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) \
+		{ \
+			double b = AS_NUMBER(pop()); \
+			double a = AS_NUMBER(pop()); \
+			push(NUMBER_VAL(a + b)); \
+		} \
+		else \
+		{ \
+			runtime_error("Operands must be numbers or strings"); \
+			return INTERPRET_RUNTIME_ERROR; \
+		} \
+	} while(false)
+
+#define OP_BODY_SUB() BINARY_OP(NUMBER_VAL, -)
+#define OP_BODY_MUL() BINARY_OP(NUMBER_VAL, *)
+#define OP_BODY_DIV() BINARY_OP(NUMBER_VAL, /)
+#define OP_BODY_NOT() push(BOOL_VAL(is_falsey(pop())))
+
+#define OP_BODY_NEGATE() \
+	do { \
+		if(!IS_NUMBER(peek(0))) { \
+			runtime_error("Operand must be a number"); \
+			return INTERPRET_RUNTIME_ERROR; \
+		} \
+		push(NUMBER_VAL(-AS_NUMBER(pop()))); \
+	} while(false)
+
+#define OP_BODY_PRINT() \
+	do { \
+		print_value(pop()); \
+		printf("\n"); \
+	} while(false)
+
+#define OP_BODY_JUMP() \
+	do { \
+		uint16_t offset = READ_SHORT(); \
+		frame->ip += offset; \
+	} while(false)
+
+#define OP_BODY_JUMP_IF_FALSE() \
+	do { \
+		uint16_t offset = READ_SHORT(); \
+		if(is_falsey(peek(0))) \
+			frame->ip += offset; \
+	} while(false)
+
+// The limits are checked before jumping so an error is reported on the loop's line
+#define OP_BODY_LOOP() \
+	do { \
+		uint16_t offset = READ_SHORT(); \
+		uint8_t cost = READ_BYTE(); \
+		if(!charge_instructions(cost)) \
+			return INTERPRET_RUNTIME_ERROR; \
+		frame->ip -= offset; \
+	} while(false)
+
+#define OP_BODY_CALL() \
+	do { \
+		int arg_count = READ_BYTE(); \
+		Value callee = peek(arg_count); \
+		LOOP_HOOK_CALL(callee); \
+		if(!call_value(callee, arg_count)) \
+			return INTERPRET_RUNTIME_ERROR; \
+		LOOP_HOOK_CALLED(callee); \
+		frame = &vm.frames[vm.frame_count-1]; \
+	} while(false)
+
+// When there are no more call frames the program is over. When a fiber's
+// first frame returns, the result goes to the resume() that ran it, or
+// for a task's fiber to the bottom of the stack, see resume_task(). A
+// fiber a native runs to its end starts at vm.run_base, see run_nested().
+// The resume() or run() returns along with the fiber, see hook_switch_in().
+#define OP_BODY_RETURN() \
+	do { \
+		Value result = pop(); \
+		LOOP_HOOK_RETURN(); \
+		vm.frame_count--; \
+		if(vm.frame_count == vm.frame_base) \
+		{ \
+			if(vm.fiber == NULL) \
+			{ \
+				pop(); \
+				return INTERPRET_OK; \
+			} \
+			finish_fiber(); \
+			if(vm.frame_count == vm.run_base) \
+			{ \
+				vm.stack_top = frame->slots; \
+				push(result); \
+				return INTERPRET_OK; \
+			} \
+			LOOP_HOOK_RETURN(); \
+		} \
+		vm.stack_top = frame->slots; \
+		push(result); \
+		frame = &vm.frames[vm.frame_count-1]; \
+	} while(false)
+
+// A math native's opcode, see intrinsics.h. The slow path lines the
+// stack up the way OP_CALL finds it and calls whatever the global holds.
+#define INTRINSIC_CALL(op, arg_count) \
+	do { \
+		Value callee; \
+		if(!intrinsic_global(INTRINSIC_##op, &callee)) \
+			return INTERPRET_RUNTIME_ERROR; \
+		Value* args = vm.stack_top - (arg_count); \
+		memmove(args + 1, args, (arg_count) * sizeof(Value)); \
+		args[0] = callee; \
+		vm.stack_top++; \
+		LOOP_HOOK_CALL(callee); \
+		if(!call_value(callee, arg_count)) \
+			return INTERPRET_RUNTIME_ERROR; \
+		LOOP_HOOK_CALLED(callee); \
+		frame = &vm.frames[vm.frame_count-1]; \
+	} while(false)
+
+#define OP_BODY_INTRINSIC_1(op, fn) \
+	do { \
+		if(IS_NUMBER(peek(0)) && !(vm.shadowed & (1u << INTRINSIC_##op))) \
+			vm.stack_top[-1] = NUMBER_VAL(fn(AS_NUMBER(vm.stack_top[-1]))); \
+		else \
+			INTRINSIC_CALL(op, 1); \
+	} while(false)
+
+#define OP_BODY_INTRINSIC_2(op, fn) \
+	do { \
+		if(IS_NUMBER(peek(0)) && IS_NUMBER(peek(1)) && !(vm.shadowed & (1u << INTRINSIC_##op))) \
+		{ \
+			double b = AS_NUMBER(pop()); \
+			vm.stack_top[-1] = NUMBER_VAL(fn(AS_NUMBER(vm.stack_top[-1]), b)); \
+		} \
+		else \
+			INTRINSIC_CALL(op, 2); \
+	} while(false)
+
+#define INTRINSIC_1_CASE(op, name, fn) case OP_##op: OP_BODY_INTRINSIC_1(op, fn); break;
+#define INTRINSIC_2_CASE(op, name, fn) case OP_##op: OP_BODY_INTRINSIC_2(op, fn); break;
+
+// A superinstruction runs each body in turn. The opcode bytes of the
+// later instructions are still in the stream, so we step over them.
+#define SUPER2_CASE(a, b) \
+	case OP_##a##__##b: \
+		OP_BODY_##a(); \
+		frame->ip++; \
+		OP_BODY_##b(); \
+		break;
+
+#define SUPER3_CASE(a, b, c) \
+	case OP_##a##__##b##__##c: \
+		OP_BODY_##a(); \
+		frame->ip++; \
+		OP_BODY_##b(); \
+		frame->ip++; \
+		OP_BODY_##c(); \
+		break;
+
+
+// The plain loop
+#define RUN_LOOP run
+#define LOOP_INSTRUMENTED 0
+#define LOOP_TRACE 0
+#define LOOP_COUNT 0
+#include "vm_loop.h"
+#undef RUN_LOOP
+#undef LOOP_INSTRUMENTED
+#undef LOOP_TRACE
+#undef LOOP_COUNT
+
+// The plain loop, counting instructions for --perf
+#define RUN_LOOP run_counted
+#define LOOP_INSTRUMENTED 0
+#define LOOP_TRACE 0
+#define LOOP_COUNT 1
+#include "vm_loop.h"
+#undef RUN_LOOP
+#undef LOOP_INSTRUMENTED
+#undef LOOP_TRACE
+#undef LOOP_COUNT
+
+// Loop used when any of the diagnostics in instrumented() is on
+#define RUN_LOOP run_instrumented
+#define LOOP_INSTRUMENTED 1
+#define LOOP_TRACE 0
+#define LOOP_COUNT 1
+#include "vm_loop.h"
+#undef RUN_LOOP
+#undef LOOP_INSTRUMENTED
+#undef LOOP_TRACE
+#undef LOOP_COUNT
+
+// Loop used for --trace-exec
+#define RUN_LOOP run_traced
+#define LOOP_INSTRUMENTED 1
+#define LOOP_TRACE 1
+#define LOOP_COUNT 1
+#include "vm_loop.h"
+#undef RUN_LOOP
+#undef LOOP_INSTRUMENTED
+#undef LOOP_TRACE
+#undef LOOP_COUNT
 
 #undef READ_BYTE
 #undef READ_CONSTANT
 #undef READ_SHORT
 #undef READ_STRING
 #undef BINARY_OP
+#undef SUPER2_CASE
+#undef SUPER3_CASE
+#undef INTRINSIC_1_CASE
+#undef INTRINSIC_2_CASE
+
+
+// The register backend's loop
+#define RUN_LOOP run_registers
+#define LOOP_TRACE 0
+#include "vm_reg_loop.h"
+#undef RUN_LOOP
+#undef LOOP_TRACE
+
+// The register backend's loop for --trace-exec
+#define RUN_LOOP run_registers_traced
+#define LOOP_TRACE 1
+#include "vm_reg_loop.h"
+#undef RUN_LOOP
+#undef LOOP_TRACE
+
+#undef CHECK_HEAP
+
+
+// ==== Benchmark native ==== //
+
+#define BENCH_MAX_ITERATIONS 10000000
+
+
+/*
+ * run_nested()
+ * Call function on fiber from inside a native and run it to its return,
+ * with the loop that execute() would use. The fiber's frames start at
+ * vm.run_base, so its return ends the loop rather than carrying on with
+ * the native's caller. What it returns is thrown away.
+ */
+static bool run_nested(ObjFiber* fiber, ObjFunction* function)
+{
+	if(!fiber_fits(fiber))
+	{
+		runtime_error("Stack overflow");
+		return false;
+	}
+
+	int run_base = vm.run_base;
+	Value* stack_top = vm.stack_top;
+
+	vm.run_base = vm.frame_count;
+	fiber->state = FIBER_NEW;
+	fiber->function = function;
+	start_fiber(fiber);
+	push(OBJ_VAL(function));
+	if(!call(function, 0))
+	{
+		vm.run_base = run_base;
+		return false;
+	}
+
+	InterpResult result = run_called(function);
+	vm.run_base = run_base;
+	if(result != INTERPRET_OK)
+		return false;
+
+	vm.stack_top = stack_top;
+	return true;
+}
+
+
+static int compare_samples(const void* a, const void* b)
+{
+	uint64_t x = *(const uint64_t*) a;
+	uint64_t y = *(const uint64_t*) b;
+
+	return (x > y) - (x < y);
+}
+
+
+/*
+ * bench_native()
+ * bench(fn, iterations) calls fn with no arguments a tenth of iterations
+ * times to warm up, then iterations times more, reading the monotonic
+ * clock around each call. It prints the fastest, median and 99th
+ * percentile call and evaluates to the median in nanoseconds.
+ */
+static bool bench_native(int arg_count, Value* args)
+{
+	if(arg_count != 2 || !IS_FUNCTION(args[0]) || !IS_NUMBER(args[1]) ||
+			AS_NUMBER(args[1]) < 1 || AS_NUMBER(args[1]) > BENCH_MAX_ITERATIONS)
+	{
+		runtime_error("bench() takes a function and from 1 to %d iterations.", BENCH_MAX_ITERATIONS);
+		return false;
+	}
+
+	ObjFunction* function = AS_FUNCTION(args[0]);
+	int iterations = (int) AS_NUMBER(args[1]);
+	ObjFiber* fiber = new_fiber(function);
+
+	for(int i = 0; i < (iterations + 9) / 10; i++)
+	{
+		if(!run_nested(fiber, function))
+			return false;
+	}
+
+	uint64_t* samples = ALLOCATE(uint64_t, iterations);
+	for(int i = 0; i < iterations; i++)
+	{
+		uint64_t start = now_ns();
+		if(!run_nested(fiber, function))
+		{
+			FREE_ARRAY(uint64_t, samples, iterations);
+			return false;
+		}
+		samples[i] = now_ns() - start;
+	}
+
+	qsort(samples, iterations, sizeof(uint64_t), compare_samples);
+
+	uint64_t min = samples[0];
+	double median = iterations % 2 == 1 ? (double) samples[iterations / 2] :
+		((double) samples[iterations / 2 - 1] + (double) samples[iterations / 2]) / 2;
+	uint64_t p99 = samples[(iterations * 99 + 99) / 100 - 1];
+	FREE_ARRAY(uint64_t, samples, iterations);
+
+	printf("bench %s(): %d calls, min %lu ns, median %.0f ns, p99 %lu ns\n",
+			function->name != NULL ? function->name->chars : "script", iterations,
+			(unsigned long) min, median, (unsigned long) p99);
+
+	return native_result(arg_count, NUMBER_VAL(median));
 }
 
 
 void init_vm(void)
 {
+	init_memory_stats(&vm.memory);
+	vm.fiber = NULL;
+	vm.frame_base = 0;
+	vm.run_base = 0;
 	reset_stack();
 	vm.objects = NULL;
+	vm.function_count = 0;
+	vm.workers = 0;
+	vm.scheduler = NULL;
+	vm.backend = BACKEND_STACK;
+	vm.limits.max_instructions = 0;
+	vm.limits.max_ns = 0;
+	vm.limits.executed = 0;
+	vm.limits.window = INT64_MAX;
+	vm.limits.budget = INT64_MAX;
+	vm.limits.deadline = 0;
+	vm.limits.cancel = NULL;
+	vm.superinstructions = true;
+	vm.shadowed = 0;
+	init_stats(&vm.stats);
+	init_sampler(&vm.sampler);
+	init_profiler(&vm.profiler);
+	vm.hotness = false;
+	init_recorder(&vm.recorder);
+	init_timeline(&vm.timeline);
+	init_heap_profile(&vm.heap_profile);
+	init_perf(&vm.perf);
+	init_event_loop(&vm.events);
+	vm.trace_exec = false;
+	vm.dump_bytecode = false;
+	vm.trace_tokens = false;
+	vm.trace_parse = false;
+#ifdef DEBUG_COUNT_TRAFFIC
+	vm.dispatch_count = 0;
+	vm.slot_traffic = 0;
+
+	// A superinstruction moves as many values as the sequence it replaces
+	for(int i = 0; i < super_instr_count; i++)
+	{
+		stack_traffic[OP_BASE_COUNT + i] = 0;
+		for(int j = 0; j < super_instrs[i].count; j++)
+			stack_traffic[OP_BASE_COUNT + i] += stack_traffic[super_instrs[i].ops[j]];
+	}
+#endif /*DEBUG_COUNT_TRAFFIC*/
 	init_table(&vm.strings);
 	init_table(&vm.globals);
+	vm.read_globals = NULL;
+	vm.read_global_count = 0;
+	vm.read_global_capacity = 0;
 
 	// Define native functions here 
 	define_native("clock", clock_native);
+	define_native("clock_ns", clock_ns_native);
+	define_control_native("bench", bench_native);
+#define DEFINE_INTRINSIC_1(op, name, fn) define_intrinsic(INTRINSIC_##op, name, fn, NULL);
+#define DEFINE_INTRINSIC_2(op, name, fn) define_intrinsic(INTRINSIC_##op, name, NULL, fn);
+	MATH_INTRINSICS_1(DEFINE_INTRINSIC_1)
+	MATH_INTRINSICS_2(DEFINE_INTRINSIC_2)
+#undef DEFINE_INTRINSIC_1
+#undef DEFINE_INTRINSIC_2
+	define_native("done", done_native);
+	define_control_native("fiber", fiber_native);
+	define_control_native("resume", resume_native);
+	define_control_native("yield", yield_native);
+	define_native("pending", pending_native);
+	define_native("peer", peer_native);
+	define_control_native("schedule", schedule_native);
+	define_control_native("run", run_native);
+	define_control_native("sleep", sleep_native);
+	define_control_native("read", read_native);
+	define_control_native("write", write_native);
+	define_control_native("accept", accept_native);
+	define_control_native("listen", listen_native);
+	define_control_native("connect", connect_native);
+	define_control_native("socketpair", socketpair_native);
+	define_control_native("close", close_native);
+	define_control_native("spawn", spawn_native);
+	define_control_native("join", join_native);
+	define_control_native("parallel_for", parallel_for_native);
+	define_control_native("channel", channel_native);
+	define_control_native("send", send_native);
+	define_control_native("recv", recv_native);
+	define_control_native("load_extension", load_extension_native);
 }
 
 
+/*
+ * free_vm()
+ * vm.perf is left open so the caller can report the teardown phase,
+ * free_perf() closes it.
+ */
 void free_vm(void)
 {
+	perf_begin(&vm.perf);
+
+	// The workers may still be running tasks
+	stop_scheduler();
+
+	// First, so freeing everything else isn't recorded
+	free_timeline(&vm.timeline);
+	free_heap_profile(&vm.heap_profile);
+	free_event_loop(&vm.events);
 	free_table(&vm.strings);
 	free_table(&vm.globals);
+	free(vm.read_globals);
+	free_stats(&vm.stats);
+	free_sampler(&vm.sampler);
+	free_profiler(&vm.profiler);
+	free_recorder(&vm.recorder);
 	free_objects();
+	detach_host();
+
+	perf_end(&vm.perf, PERF_PHASE_TEARDOWN);
 }
 
 
-InterpResult interpret(const char* source)
+/*
+ * instrumented()
+ * True if any feature that needs the instrumented loop is on.
+ */
+static bool instrumented(void)
+{
+	return vm.stats.enabled || vm.sampler.enabled || vm.profiler.enabled ||
+		vm.hotness || vm.recorder.enabled || vm.timeline.enabled || vm.trace_exec;
+}
+
+
+/*
+ * execute()
+ * Run the script function, which is already in the first call frame.
+ */
+static InterpResult execute(ObjFunction* function)
+{
+	if(vm.backend == BACKEND_REGISTER)
+		return vm.trace_exec ? run_registers_traced() : run_registers();
+
+	if(!instrumented())
+		return vm.perf.enabled ? run_counted() : run();
+
+	if(vm.profiler.enabled)
+		profiler_enter(&vm.profiler, OBJ_VAL(function), 0);
+	if(vm.timeline.enabled)
+		timeline_enter(&vm.timeline, OBJ_VAL(function));
+
+	if(vm.sampler.enabled && !start_sampler(&vm.sampler))
+	{
+		fprintf(stderr, "Failed to start the sampling profiler\n");
+		vm.sampler.enabled = false;
+	}
+
+	InterpResult result = vm.trace_exec ? run_traced() : run_instrumented();
+	stop_sampler(&vm.sampler);
+	profiler_unwind(&vm.profiler);
+	timeline_unwind(&vm.timeline);
+
+	if(result == INTERPRET_RUNTIME_ERROR && vm.recorder.enabled && !dump_recorder(&vm.recorder))
+		fprintf(stderr, "Failed to write the execution record to [%s]\n", vm.recorder.dump_path);
+
+	return result;
+}
+
+
+/*
+ * run_task_frame()
+ * Run from the top frame, a task's, with the backend in use. Workers
+ * are never instrumented, see watching_vm().
+ */
+static InterpResult run_task_frame(void)
+{
+	if(vm.backend == BACKEND_REGISTER)
+	{
+		CallFrame* frame = &vm.frames[vm.frame_count-1];
+		vm.stack_top = frame->slots + frame->function->reg_chunk.max_regs;
+		return vm.trace_exec ? run_registers_traced() : run_registers();
+	}
+
+	return run();
+}
+
+
+/*
+ * run_called()
+ * Run function, just called from outside the loop into the top frame,
+ * with the loop that execute() would use.
+ */
+static InterpResult run_called(ObjFunction* function)
+{
+	if(vm.backend == BACKEND_REGISTER)
+		return run_task_frame();
+	if(!instrumented())
+		return vm.perf.enabled ? run_counted() : run();
+
+	// The return is charged to a call, as the loop does for OP_CALL
+	if(vm.profiler.enabled)
+		profiler_enter(&vm.profiler, OBJ_VAL(function), 0);
+	if(vm.timeline.enabled)
+		timeline_enter(&vm.timeline, OBJ_VAL(function));
+
+	return vm.trace_exec ? run_traced() : run_instrumented();
+}
+
+
+/*
+ * watching_vm()
+ * Whether a profiling or tracing option is on for this thread's VM. The
+ * workers' VMs have none, so tasks would run without being seen.
+ */
+bool watching_vm(void)
+{
+	return instrumented() || vm.perf.enabled || vm.heap_profile.enabled;
+}
+
+
+/*
+ * note_read_global()
+ * Called by the compiler for each global a function reads. Only these
+ * are copied into the VM a task runs on, the ones just the script's own
+ * code reads needn't be.
+ */
+void note_read_global(ObjString* name)
+{
+	if(name->read_in_function)
+		return;
+
+	if(vm.read_global_count == vm.read_global_capacity)
+	{
+		vm.read_global_capacity = vm.read_global_capacity < 8 ? 8 : vm.read_global_capacity * 2;
+		vm.read_globals = realloc(vm.read_globals, sizeof(ObjString*) * vm.read_global_capacity);
+	}
+
+	vm.read_globals[vm.read_global_count++] = name;
+	name->read_in_function = true;
+}
+
+
+/*
+ * resume_task()
+ * Run a scheduler task's fiber on this worker's idle VM. A new fiber is
+ * started with value as its argument, a parked one carries on with value
+ * as what its join() evaluates to, or with error raised there instead.
+ * The fiber has no resumer, what its function returns is left at the
+ * bottom of the stack.
+ */
+InterpResult resume_task(ObjFiber* fiber, Value value, const char* error)
+{
+	if(fiber->state == FIBER_NEW)
+	{
+		ObjFunction* function = fiber->function;
+		start_fiber(fiber);
+		push(OBJ_VAL(function));
+		if(function->arity == 1)
+			push(value);
+
+		if(!call(function, function->arity))
+			return INTERPRET_RUNTIME_ERROR;
+	}
+	else
+	{
+		restore_fiber(fiber);
+		if(error != NULL)
+		{
+			runtime_error("%s", error);
+			return INTERPRET_RUNTIME_ERROR;
+		}
+		push(value);
+	}
+
+	return run_task_frame();
+}
+
+
+/*
+ * call_fiber()
+ * Call function with args on fiber, a task's or the embedder's, with
+ * the VM otherwise idle, and run it to the end. What it returns is left
+ * at the bottom of the stack.
+ */
+InterpResult call_fiber(ObjFiber* fiber, ObjFunction* function, int arg_count, Value* args)
+{
+	fiber->state = FIBER_NEW;
+	fiber->function = function;
+	start_fiber(fiber);
+
+	push(OBJ_VAL(function));
+	for(int i = 0; i < arg_count; i++)
+		push(args[i]);
+
+	if(!call(function, arg_count))
+		return INTERPRET_RUNTIME_ERROR;
+
+	return run_called(function);
+}
+
+
+/*
+ * compile_source()
+ * Compile a script to the function that runs it, NULL after a compile
+ * error.
+ */
+ObjFunction* compile_source(const char* source)
 {
+	// Without a collector nothing is freed, so if the last script ran
+	// out of heap this one will soon find out again
+	vm.memory.exceeded = false;
+
+	share_script(source);
+
+	perf_begin(&vm.perf);
 	ObjFunction* function = compile(source);
+	perf_end(&vm.perf, PERF_PHASE_COMPILE);
+
+	if(vm.memory.exceeded)
+	{
+		fprintf(stderr, "Out of memory while compiling, the heap limit is %lu bytes.\n",
+				(unsigned long) vm.memory.limit);
+		return NULL;
+	}
+
+	return function;
+}
+
+
+InterpResult interpret(const char* source)
+{
+	ObjFunction* function = compile_source(source);
 	if(function == NULL)
 		return INTERPRET_COMPILE_ERROR;
 
+	start_limits();
 	push(OBJ_VAL(function));
-	call_value(OBJ_VAL(function), 0);
+	if(!call_value(OBJ_VAL(function), 0))
+		return INTERPRET_RUNTIME_ERROR;
 
-	return run();
+	perf_begin(&vm.perf);
+	InterpResult result = execute(function);
+	perf_end(&vm.perf, PERF_PHASE_RUN);
+
+	return result;
 }
 
 
@@ -3,31 +3,104 @@
 #define __LOX_VM_H
 
 
+#include <stdio.h>
+
 #include "chunk.h"
 #include "value.h"
 #include "table.h"
 #include "object.h"
+#include "stats.h"
+#include "sampler.h"
+#include "profiler.h"
+#include "recorder.h"
+#include "perfcount.h"
+#include "timeline.h"
+#include "heapprof.h"
+#include "eventloop.h"
 
 
 #define FRAMES_MAX 64
 #define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
 
 
-typedef struct {
+typedef struct CallFrame {
 	ObjFunction* function;
 	uint8_t* ip;
+	RegInstr* rip;  // instruction pointer when running the register backend
 	Value* slots; // points into the VMs value stack at the first slot function can use
 } CallFrame;
 
 
+/*
+ * Backend
+ * Which instruction set interpret() compiles to and executes.
+ */
+typedef enum {
+	BACKEND_STACK,
+	BACKEND_REGISTER,
+} Backend;
+
+
+/*
+ * ExecLimits
+ * Limits on one call of interpret(). Instructions are only counted
+ * where they are checked, at loop back edges and calls: a loop iteration
+ * is charged the instructions in its body, and a call the instructions
+ * of its function outside of its loops, ObjFunction.call_cost. Either is
+ * what runs unless a branch skips some of them.
+ */
+
+typedef struct {
+	uint64_t max_instructions;	// 0 for no limit
+	uint64_t max_ns;			// wall time, 0 for no limit
+	uint64_t executed;			// charged up to the last check
+	int64_t window;				// budget at the last check
+	int64_t budget;				// left to charge before the next check
+	uint64_t deadline;			// CLOCK_MONOTONIC in ns
+	const bool* cancel;			// set from another thread to stop at the next check, or NULL
+} ExecLimits;
+
+
 typedef struct {
 	CallFrame frames[FRAMES_MAX];
 	int frame_count;
+	int frame_base;		// first frame of the running fiber, 0 outside of fibers
+	int run_base;		// frame count at which a fiber's return ends the loop, see run_nested()
 	Value stack[STACK_MAX];
 	Value* stack_top;
+	ObjFiber* fiber;	// running fiber, NULL for the script itself
 	Table strings;
 	Table globals;
+	ObjString** read_globals;	// globals read inside functions, which a task is spawned with
+	int read_global_count;
+	int read_global_capacity;
 	Obj* objects;		// head of objects linked list
+	MemoryStats memory;	// what reallocate() has handed out, and the heap limit
+	int function_count;	// functions created so far, the next ObjFunction id
+	int workers;		// threads spawn() runs tasks on, 0 for one per CPU
+	struct Scheduler* scheduler;	// of spawn()'s tasks, shared with their workers, NULL until needed
+	Backend backend;
+	ExecLimits limits;
+	EventLoop events;	// fibers scheduled with schedule() and what they wait on
+	bool superinstructions;		// fuse common opcode sequences when compiling
+	uint32_t shadowed;			// a bit per Intrinsic whose global has been set since init_vm()
+	ObjString* intrinsic_names[INTRINSIC_COUNT];
+	VMStats stats;
+	Sampler sampler;
+	CallProfiler profiler;
+	bool hotness;				// count dispatches per code offset
+	Recorder recorder;
+	Timeline timeline;
+	HeapProfiler heap_profile;
+	PerfCounters perf;			// outlives free_vm() so it can count the teardown
+	bool trace_exec;			// print the stack and each instruction as it runs
+	bool dump_bytecode;			// disassemble each function once it is compiled
+	bool trace_tokens;			// print each token as it is scanned
+	bool trace_parse;			// print what the parser is doing
+#ifdef DEBUG_COUNT_TRAFFIC
+	uint64_t dispatch_count;	// instructions executed
+	uint64_t slot_traffic;		// reads and writes of Values in the frame window
+#endif /*DEBUG_COUNT_TRAFFIC*/
 } VM;
 
 
@@ -46,10 +119,38 @@ Value peek(int dist);
 // Virtual Machine
 void init_vm(void);
 void free_vm(void);
+ObjFunction* compile_source(const char* source);
 InterpResult interpret(const char* source);
-
-
-extern VM vm;
+void start_limits(void);
+InterpResult resume_task(ObjFiber* fiber, Value value, const char* error);
+void note_read_global(ObjString* name);
+InterpResult call_fiber(ObjFiber* fiber, ObjFunction* function, int arg_count, Value* args);
+bool watching_vm(void);
+
+// Embedding API, lox.c
+bool call_host(ObjNative* native, int arg_count, Value* args, Value* result);
+const char* load_extension(const char* path);
+void detach_host(void);
+
+
+extern THREAD_LOCAL VM vm;
+
+
+/*
+ * note_global()
+ * Called whenever a global is set outside of init_vm(). A script that
+ * sets one of the intrinsics' names gets its own value called from then
+ * on, see intrinsics.h.
+ */
+static inline void note_global(ObjString* name)
+{
+	if(name->intrinsic != 0)
+		vm.shadowed |= 1u << (name->intrinsic - 1);
+}
+
+#ifdef DEBUG_PROFILE_NGRAMS
+void write_ngram_profile(FILE* file);
+#endif /*DEBUG_PROFILE_NGRAMS*/
 
 void print_vm_stack(void);
 
@@ -0,0 +1,176 @@
+/*
+ * STACK INTERPRETER LOOP
+ * This file is a template for the stack VM loop and is only meant to
+ * be included from vm.c, once per variant of the loop. Before each 
+ * include vm.c defines
+ *
+ *   RUN_LOOP          - name of the function to generate
+ *   LOOP_INSTRUMENTED - 1 for the loop that serves the diagnostic 
+ *                       features (stats, sampling, profiling, hotness,
+ *                       recording, timeline), 0 for the plain loop
+ *   LOOP_TRACE        - 1 to print the stack and each instruction before
+ *                       it runs (--trace-exec), 0 otherwise
+ *   LOOP_COUNT        - 1 to count executed instructions in
+ *                       vm.perf.dispatches, 0 otherwise
+ *
+ * The plain loop carries no checks for features that are switched on 
+ * at runtime. The instrumented loop checks each of them at its hook.
+ */
+
+#if LOOP_INSTRUMENTED
+#define LOOP_HOOK_DISPATCH(instr) \
+	do { \
+		if(vm.recorder.enabled) \
+		{ \
+			record_event(&vm.recorder, (uint16_t) frame->function->id, \
+					(uint32_t) (frame->ip - frame->function->chunk.code - 1), instr, \
+					vm.stack_top > vm.stack ? value_tag(vm.stack_top[-1]) : TAG_EMPTY); \
+		} \
+		if(vm.hotness) \
+			frame->function->hits[frame->ip - frame->function->chunk.code - 1]++; \
+		if(vm.stats.enabled) \
+		{ \
+			vm.stats.op_counts[instr]++; \
+			if(vm.stats.cycles) \
+			{ \
+				uint64_t now = read_cycles(); \
+				if(last_instr != -1) \
+					vm.stats.op_cycles[last_instr] += now - last_cycles; \
+				last_cycles = now; \
+				last_instr = instr; \
+			} \
+		} \
+	} while(false)
+#define LOOP_HOOK_CALL(callee) \
+	do { \
+		if(vm.stats.enabled) \
+			stats_count_call(&vm.stats, callee); \
+		if(vm.profiler.enabled) \
+			profiler_enter(&vm.profiler, callee, \
+					frame->function->chunk.lines[frame->ip - frame->function->chunk.code - 1]); \
+		if(vm.timeline.enabled) \
+			timeline_enter(&vm.timeline, callee); \
+	} while(false)
+// Natives have already returned by the time call_value() does, unless
+// they switched fibers, which hook_switch_in() and _out() take care of
+#define LOOP_HOOK_CALLED(callee) \
+	do { \
+		bool returned = IS_NATIVE(callee) && frame == &vm.frames[vm.frame_count-1]; \
+		if(vm.profiler.enabled && returned) \
+			profiler_exit(&vm.profiler); \
+		if(vm.timeline.enabled && returned) \
+			timeline_exit(&vm.timeline); \
+	} while(false)
+#define LOOP_HOOK_RETURN() \
+	do { \
+		if(vm.profiler.enabled) \
+			profiler_exit(&vm.profiler); \
+		if(vm.timeline.enabled) \
+			timeline_exit(&vm.timeline); \
+	} while(false)
+#define LOOP_HOOK_GLOBAL(name) \
+	do { \
+		if(vm.stats.enabled) \
+			stats_count_probes(&vm.stats, &vm.globals, name); \
+	} while(false)
+// Runs between instructions, when the frames and stack are consistent
+#define LOOP_HOOK_SAFEPOINT() \
+	do { \
+		if(vm.sampler.pending) \
+		{ \
+			vm.sampler.pending = 0; \
+			record_sample(); \
+		} \
+	} while(false)
+#else
+#define LOOP_HOOK_DISPATCH(instr) do {} while(false)
+#define LOOP_HOOK_CALL(callee)    do {} while(false)
+#define LOOP_HOOK_CALLED(callee)  do {} while(false)
+#define LOOP_HOOK_RETURN()        do {} while(false)
+#define LOOP_HOOK_GLOBAL(name)    do {} while(false)
+#define LOOP_HOOK_SAFEPOINT()     do {} while(false)
+#endif /*LOOP_INSTRUMENTED*/
+
+#if LOOP_COUNT
+#define LOOP_HOOK_COUNT() vm.perf.dispatches++
+#else
+#define LOOP_HOOK_COUNT() do {} while(false)
+#endif /*LOOP_COUNT*/
+
+
+static InterpResult RUN_LOOP(void) 
+{
+	CallFrame* frame = &vm.frames[vm.frame_count-1];
+
+#if LOOP_INSTRUMENTED
+	// Cycles between two dispatches are charged to the earlier opcode
+	uint64_t last_cycles = 0;
+	int last_instr = -1;
+#endif /*LOOP_INSTRUMENTED*/
+
+	for(;;)
+	{
+#if LOOP_TRACE
+		fprintf(stdout, "      ");
+		for(Value* slot = vm.stack; slot < vm.stack_top; slot++)
+		{
+			fprintf(stdout, "[");
+			print_value(*slot);
+			fprintf(stdout, "]");
+		}
+		fprintf(stdout, "\n");
+
+		disassemble_instr(&frame->function->chunk, (int)(frame->ip - frame->function->chunk.code));
+#endif /*LOOP_TRACE*/
+
+		LOOP_HOOK_SAFEPOINT();
+		uint8_t instr = READ_BYTE();
+		COUNT_TRAFFIC(stack_traffic, instr);
+		PROFILE_NGRAM(instr);
+		LOOP_HOOK_DISPATCH(instr);
+		LOOP_HOOK_COUNT();
+		switch(instr)
+		{
+			case OP_CONSTANT:      OP_BODY_CONSTANT(); break;
+			case OP_NIL:           OP_BODY_NIL(); break;
+			case OP_TRUE:          OP_BODY_TRUE(); break;
+			case OP_FALSE:         OP_BODY_FALSE(); break;
+			case OP_POP:           OP_BODY_POP(); break;
+			case OP_DEFINE_GLOBAL: OP_BODY_DEFINE_GLOBAL(); break;
+			case OP_GET_GLOBAL:    OP_BODY_GET_GLOBAL(); break;
+			case OP_SET_GLOBAL:    OP_BODY_SET_GLOBAL(); break;
+			case OP_GET_LOCAL:     OP_BODY_GET_LOCAL(); break;
+			case OP_SET_LOCAL:     OP_BODY_SET_LOCAL(); break;
+			case OP_EQUAL:         OP_BODY_EQUAL(); break;
+			case OP_GREATER:       OP_BODY_GREATER(); break;
+			case OP_LESS:          OP_BODY_LESS(); break;
+			case OP_ADD:           OP_BODY_ADD(); break;
+			case OP_SUB:           OP_BODY_SUB(); break;
+			case OP_MUL:           OP_BODY_MUL(); break;
+			case OP_DIV:           OP_BODY_DIV(); break;
+			case OP_NOT:           OP_BODY_NOT(); break;
+			case OP_NEGATE:        OP_BODY_NEGATE(); break;
+			case OP_PRINT:         OP_BODY_PRINT(); break;
+			case OP_JUMP:          OP_BODY_JUMP(); break;
+			case OP_JUMP_IF_FALSE: OP_BODY_JUMP_IF_FALSE(); break;
+			case OP_LOOP:          OP_BODY_LOOP(); break;
+			case OP_CALL:          OP_BODY_CALL(); break;
+			case OP_RETURN:        OP_BODY_RETURN(); break;
+
+			MATH_INTRINSICS_1(INTRINSIC_1_CASE)
+			MATH_INTRINSICS_2(INTRINSIC_2_CASE)
+
+			SUPERINSTRUCTIONS_2(SUPER2_CASE)
+			SUPERINSTRUCTIONS_3(SUPER3_CASE)
+		}
+	}
+}
+
+
+#undef LOOP_HOOK_DISPATCH
+#undef LOOP_HOOK_CALL
+#undef LOOP_HOOK_CALLED
+#undef LOOP_HOOK_RETURN
+#undef LOOP_HOOK_GLOBAL
+#undef LOOP_HOOK_SAFEPOINT
+#undef LOOP_HOOK_COUNT
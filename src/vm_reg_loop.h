@@ -0,0 +1,225 @@
+/*
+ * REGISTER INTERPRETER LOOP
+ * This file is a template for the register VM loop and is only meant to
+ * be included from vm.c, once per variant of the loop. Operands are read
+ * and written directly in the frame window rather than through
+ * push()/pop(). Before each include vm.c defines
+ *
+ *   RUN_LOOP          - name of the function to generate
+ *   LOOP_TRACE        - 1 to print each instruction before it runs
+ *                       (--trace-exec), 0 otherwise
+ */
+
+static InterpResult RUN_LOOP(void)
+{
+	CallFrame* frame = &vm.frames[vm.frame_count-1];
+
+#define R(x) (frame->slots[(x)])
+#define K(x) (frame->function->chunk.constants.values[(x)])
+
+#define BINARY_OP(value_type, op) \
+	do { \
+		Value b = R(REG_B(instr)); \
+		Value c = R(REG_C(instr)); \
+		if(!IS_NUMBER(b) || !IS_NUMBER(c)) {\
+			runtime_error("Operands must be numbers"); \
+			return INTERPRET_RUNTIME_ERROR; \
+		} \
+		R(REG_A(instr)) = value_type(AS_NUMBER(b) op AS_NUMBER(c)); \
+	} while(false)
+
+	for(;;)
+	{
+#if LOOP_TRACE
+		disassemble_reg_instr(
+				&frame->function->reg_chunk,
+				&frame->function->chunk.constants,
+				(int)(frame->rip - frame->function->reg_chunk.code)
+		);
+#endif /*LOOP_TRACE*/
+
+		RegInstr instr = *frame->rip++;
+		COUNT_TRAFFIC(reg_traffic, REG_OP(instr));
+		switch(REG_OP(instr))
+		{
+			case ROP_MOVE:
+				R(REG_A(instr)) = R(REG_B(instr));
+				break;
+
+			case ROP_LOADK:
+				R(REG_A(instr)) = K(REG_B(instr));
+				break;
+
+			case ROP_LOADNIL:
+				R(REG_A(instr)) = NIL_VAL;
+				break;
+
+			case ROP_LOADBOOL:
+				R(REG_A(instr)) = BOOL_VAL(REG_B(instr) != 0);
+				break;
+
+			case ROP_DEFINE_GLOBAL: {
+				ObjString* name = AS_STRING(K(REG_B(instr)));
+				note_global(name);
+				table_set(&vm.globals, name, R(REG_A(instr)));
+				CHECK_HEAP();
+				break;
+			}
+
+			case ROP_GET_GLOBAL: {
+				ObjString* name = AS_STRING(K(REG_B(instr)));
+				if(!table_get(&vm.globals, name, &R(REG_A(instr))))
+				{
+					runtime_error("Undefined variable '%s'.", name->chars);
+					return INTERPRET_RUNTIME_ERROR;
+				}
+				break;
+			}
+
+			case ROP_SET_GLOBAL: {
+				ObjString* name = AS_STRING(K(REG_B(instr)));
+				note_global(name);
+				if(table_set(&vm.globals, name, R(REG_A(instr))))
+				{
+					table_delete(&vm.globals, name);
+					runtime_error("Undefined variable '%s'.", name->chars);
+					return INTERPRET_RUNTIME_ERROR;
+				}
+				CHECK_HEAP();
+				break;
+			}
+
+			case ROP_EQUAL:
+				R(REG_A(instr)) = BOOL_VAL(values_equal(R(REG_B(instr)), R(REG_C(instr))));
+				break;
+
+			case ROP_GREATER: BINARY_OP(BOOL_VAL, >); break;
+			case ROP_LESS:    BINARY_OP(BOOL_VAL, <); break;
+
+			case ROP_ADD: {
+				Value b = R(REG_B(instr));
+				Value c = R(REG_C(instr));
+				if(IS_STR(b) && IS_STR(c))
+				{
+					// concatenate() works on the top of the value stack
+					push(b);
+					push(c);
+					if(!concatenate())
+						return INTERPRET_RUNTIME_ERROR;
+					R(REG_A(instr)) = pop();
+				}
+				else if(IS_NUMBER(b) && IS_NUMBER(c))
+					R(REG_A(instr)) = NUMBER_VAL(AS_NUMBER(b) + AS_NUMBER(c));
+				else
+				{
+					runtime_error("Operands must be numbers or strings");
+					return INTERPRET_RUNTIME_ERROR;
+				}
+				break;
+			}
+
+			case ROP_SUB: BINARY_OP(NUMBER_VAL, -); break;
+			case ROP_MUL: BINARY_OP(NUMBER_VAL, *); break;
+			case ROP_DIV: BINARY_OP(NUMBER_VAL, /); break;
+
+			case ROP_NOT:
+				R(REG_A(instr)) = BOOL_VAL(is_falsey(R(REG_B(instr))));
+				break;
+
+			case ROP_NEGATE: {
+				if(!IS_NUMBER(R(REG_B(instr)))) {
+					runtime_error("Operand must be a number");
+					return INTERPRET_RUNTIME_ERROR;
+				}
+				R(REG_A(instr)) = NUMBER_VAL(-AS_NUMBER(R(REG_B(instr))));
+				break;
+			}
+
+			case ROP_PRINT:
+				print_value(R(REG_A(instr)));
+				printf("\n");
+				break;
+
+			case ROP_JUMP:
+				// Backwards jumps are loops
+				if(REG_SBX(instr) < 0 && !charge_instructions(-REG_SBX(instr)))
+					return INTERPRET_RUNTIME_ERROR;
+				frame->rip += REG_SBX(instr);
+				break;
+
+			case ROP_JUMP_IF_FALSE:
+				if(is_falsey(R(REG_A(instr))))
+					frame->rip += REG_SBX(instr);
+				break;
+
+			case ROP_CALL: {
+				int base = REG_A(instr);
+				int arg_count = REG_B(instr);
+
+				// Line the stack top up with the end of the call window so
+				// that call_value() sees the same layout as the stack VM.
+				vm.stack_top = &R(base + arg_count + 1);
+				if(!call_value(R(base), arg_count))
+					return INTERPRET_RUNTIME_ERROR;
+
+				frame = &vm.frames[vm.frame_count-1];
+				vm.stack_top = frame->slots + frame->function->reg_chunk.max_regs;
+				break;
+			}
+
+#define INTRINSIC_CASE(op, name, fn, arg_count, fast) \
+			case ROP_##op: \
+				if(fast && !(vm.shadowed & (1u << INTRINSIC_##op))) \
+					R(REG_A(instr)) = NUMBER_VAL(fn); \
+				else \
+				{ \
+					if(!call_intrinsic_registers(INTRINSIC_##op, frame->slots, instr, arg_count)) \
+						return INTERPRET_RUNTIME_ERROR; \
+					frame = &vm.frames[vm.frame_count-1]; \
+				} \
+				break;
+#define INTRINSIC_1_CASE(op, name, fn) \
+			INTRINSIC_CASE(op, name, fn(AS_NUMBER(R(REG_B(instr)))), 1, \
+					IS_NUMBER(R(REG_B(instr))))
+#define INTRINSIC_2_CASE(op, name, fn) \
+			INTRINSIC_CASE(op, name, fn(AS_NUMBER(R(REG_B(instr))), AS_NUMBER(R(REG_C(instr)))), 2, \
+					IS_NUMBER(R(REG_B(instr))) && IS_NUMBER(R(REG_C(instr))))
+			MATH_INTRINSICS_1(INTRINSIC_1_CASE)
+			MATH_INTRINSICS_2(INTRINSIC_2_CASE)
+#undef INTRINSIC_CASE
+#undef INTRINSIC_1_CASE
+#undef INTRINSIC_2_CASE
+
+			case ROP_RETURN: {
+				Value result = R(REG_A(instr));
+				vm.frame_count--;
+
+				if(vm.frame_count == vm.frame_base)
+				{
+					if(vm.fiber == NULL)
+					{
+						reset_stack();
+						return INTERPRET_OK;
+					}
+					finish_fiber();
+					if(vm.frame_count == vm.run_base)
+					{
+						frame->slots[0] = result;
+						return INTERPRET_OK;
+					}
+				}
+
+				// The callee sat in the callers register, which now takes the result
+				frame->slots[0] = result;
+
+				frame = &vm.frames[vm.frame_count-1];
+				vm.stack_top = frame->slots + frame->function->reg_chunk.max_regs;
+				break;
+			}
+		}
+	}
+
+#undef R
+#undef K
+#undef BINARY_OP
+}
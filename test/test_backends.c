@@ -0,0 +1,317 @@
+/*
+ * Unit test for the backends, runs the same scripts on the stack VM
+ * with and without superinstructions and on the register VM lowered
+ * from the same bytecode, and checks they all agree
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <check.h>
+
+
+#include "lox.h"
+#include "vm.h"
+#include "util.h"
+
+
+typedef struct {
+	const char* name;
+	Backend backend;
+	bool superinstructions;
+} Config;
+
+
+static const Config configs[] = {
+	{"stack",     BACKEND_STACK,    true},
+	{"no-super",  BACKEND_STACK,    false},
+	{"registers", BACKEND_REGISTER, false},
+};
+
+#define CONFIG_COUNT ((int) (sizeof(configs) / sizeof(configs[0])))
+
+
+/*
+ * Outcome
+ * What calling f() did, with strings copied out before the VM is freed.
+ */
+typedef struct {
+	LoxStatus status;
+	LoxType type;
+	bool boolean;
+	double number;
+	char string[64];
+} Outcome;
+
+
+/*
+ * run_on()
+ * Load a script defining f() into a new VM set up like config and call
+ * f() with no arguments.
+ */
+static Outcome run_on(const Config* config, const char* source)
+{
+	Outcome outcome;
+	memset(&outcome, 0, sizeof(outcome));
+
+	LoxVM* lox = lox_new_vm();
+	vm.backend = config->backend;
+	vm.superinstructions = config->superinstructions;
+
+	outcome.status = lox_load(lox, source);
+	if(outcome.status == LOX_OK)
+	{
+		LoxFunction* f = lox_function(lox, "f");
+		ck_assert(f != NULL);
+		outcome.status = lox_call(lox, f, 0);
+	}
+
+	LoxValue result = lox_result(lox);
+	outcome.type = result.type;
+	outcome.boolean = result.boolean;
+	outcome.number = result.number;
+	if(result.type == LOX_STRING)
+		snprintf(outcome.string, sizeof(outcome.string), "%s", result.string);
+
+	lox_free_vm(lox);
+	return outcome;
+}
+
+
+/*
+ * run_all()
+ * Run a script on every config, check they agree with the stack VM and
+ * return what it did.
+ */
+static Outcome run_all(const char* source)
+{
+	Outcome expect = run_on(&configs[0], source);
+
+	for(int i = 1; i < CONFIG_COUNT; i++)
+	{
+		Outcome got = run_on(&configs[i], source);
+
+		ck_assert(got.status == expect.status);
+		ck_assert(got.type == expect.type);
+		ck_assert(got.boolean == expect.boolean);
+		ck_assert(got.number == expect.number);
+		ck_assert(strcmp(got.string, expect.string) == 0);
+	}
+
+	return expect;
+}
+
+
+START_TEST(test_recursion)
+{
+	// CONSTANT SUB CALL and ADD RETURN are fused on the stack VM
+	Outcome out = run_all(
+		"func fib(n) { if(n < 2) return n; return fib(n - 2) + fib(n - 1); }\n"
+		"func f() { return fib(20); }\n"
+	);
+
+	ck_assert(out.status == LOX_OK);
+	ck_assert(float_equal(out.number, 6765.0f));
+}
+END_TEST
+
+
+START_TEST(test_loops)
+{
+	// CONSTANT LESS JUMP_IF_FALSE in the loop conditions
+	Outcome out = run_all(
+		"func f() {\n"
+		"	var total = 0;\n"
+		"	var i = 0;\n"
+		"	while(i < 10) {\n"
+		"		var j = 0;\n"
+		"		while(j < i) { total = total + j * i; j = j + 1; }\n"
+		"		i = i + 1;\n"
+		"	}\n"
+		"	return total;\n"
+		"}\n"
+	);
+
+	ck_assert(out.status == LOX_OK);
+	ck_assert(float_equal(out.number, 870.0f));
+}
+END_TEST
+
+
+START_TEST(test_globals)
+{
+	// GET_GLOBAL GET_LOCAL and POP GET_GLOBAL GET_LOCAL
+	Outcome out = run_all(
+		"var scale = 3;\n"
+		"var count = 0;\n"
+		"func bump(x) { count = count + 1; return scale * x; }\n"
+		"func f() {\n"
+		"	var x = 2;\n"
+		"	var y = scale + x;\n"
+		"	bump(x);\n"
+		"	return bump(y) + count;\n"
+		"}\n"
+	);
+
+	ck_assert(out.status == LOX_OK);
+	ck_assert(float_equal(out.number, 17.0f));
+}
+END_TEST
+
+
+START_TEST(test_locals)
+{
+	// The lowering defers copies of locals, which must be made before
+	// the local they copy is overwritten
+	Outcome out = run_all(
+		"func f() {\n"
+		"	var a = 1;\n"
+		"	var b = a;\n"
+		"	a = 10;\n"
+		"	{\n"
+		"		var a = b + 100;\n"
+		"		b = a + b;\n"
+		"	}\n"
+		"	return a * 1000 + b;\n"
+		"}\n"
+	);
+
+	ck_assert(out.status == LOX_OK);
+	ck_assert(float_equal(out.number, 10102.0f));
+}
+END_TEST
+
+
+START_TEST(test_temporaries)
+{
+	// Calls nested in arguments need a window of registers each
+	Outcome out = run_all(
+		"func g(a, b) { return a - b; }\n"
+		"func f() { return g(g(10, 3), g(g(4, 5), g(9, 1))) * (2 + 3); }\n"
+	);
+
+	ck_assert(out.status == LOX_OK);
+	ck_assert(float_equal(out.number, 80.0f));
+}
+END_TEST
+
+
+START_TEST(test_branches)
+{
+	Outcome out = run_all(
+		"func pick(x) {\n"
+		"	var r;\n"
+		"	if(x > 2) { if(!(x >= 5)) r = true; else r = x == 7; } else r = x != x;\n"
+		"	return r;\n"
+		"}\n"
+		"func f() { return pick(3) == pick(7) == !pick(1) == !pick(5); }\n"
+	);
+
+	ck_assert(out.status == LOX_OK);
+	ck_assert(out.type == LOX_BOOL);
+	ck_assert(out.boolean == true);
+}
+END_TEST
+
+
+START_TEST(test_strings)
+{
+	Outcome out = run_all(
+		"func f() {\n"
+		"	var s = \"a\";\n"
+		"	while(s != \"abbb\") s = s + \"b\";\n"
+		"	if(s == \"abbb\") s = s + \"!\"; else s = nil;\n"
+		"	return s;\n"
+		"}\n"
+	);
+
+	ck_assert(out.status == LOX_OK);
+	ck_assert(out.type == LOX_STRING);
+	ck_assert(strcmp(out.string, "abbb!") == 0);
+}
+END_TEST
+
+
+START_TEST(test_runtime_error)
+{
+	Outcome out = run_all("func f() { var x = 1; return x + nil; }\n");
+
+	ck_assert(out.status == LOX_RUNTIME_ERROR);
+	ck_assert(out.type == LOX_NIL);
+}
+END_TEST
+
+
+START_TEST(test_call_cost)
+{
+	// A call is charged all the instructions of a function with no loops,
+	// so the limit stops this long before 100000 calls
+	char source[8192] = "var calls = 0;\nfunc long(x) {\n";
+	for(int i = 0; i < 200; i++)
+		strcat(source, "x = x + 1;\n");
+	strcat(source, "return x;\n}\nfunc f() { while(true) { long(0); calls = calls + 1; } }\n");
+
+	for(int i = 0; i < CONFIG_COUNT; i++)
+	{
+		LoxVM* lox = lox_new_vm();
+		vm.backend = configs[i].backend;
+		vm.superinstructions = configs[i].superinstructions;
+		vm.limits.max_instructions = 100000;
+
+		ck_assert(lox_load(lox, source) == LOX_OK);
+		ck_assert(lox_call(lox, lox_function(lox, "f"), 0) == LOX_RUNTIME_ERROR);
+
+		// Each call runs over 800 instructions
+		vm.limits.max_instructions = 0;
+		ck_assert(lox_load(lox, "func g() { return calls; }\n") == LOX_OK);
+		ck_assert(lox_call(lox, lox_function(lox, "g"), 0) == LOX_OK);
+		ck_assert(lox_result(lox).number > 0);
+		ck_assert(lox_result(lox).number <= 100000 / 800);
+
+		lox_free_vm(lox);
+	}
+}
+END_TEST
+
+
+Suite* backend_suite(void)
+{
+	Suite* s;
+
+	s = suite_create("backends");
+
+	TCase* tc_programs = tcase_create("Programs");
+	tcase_add_test(tc_programs, test_recursion);
+	tcase_add_test(tc_programs, test_loops);
+	tcase_add_test(tc_programs, test_globals);
+	tcase_add_test(tc_programs, test_locals);
+	tcase_add_test(tc_programs, test_temporaries);
+	tcase_add_test(tc_programs, test_branches);
+	tcase_add_test(tc_programs, test_strings);
+	suite_add_tcase(s, tc_programs);
+
+	TCase* tc_errors = tcase_create("Errors");
+	tcase_add_test(tc_errors, test_runtime_error);
+	tcase_add_test(tc_errors, test_call_cost);
+	suite_add_tcase(s, tc_errors);
+
+	return s;
+}
+
+
+int main(void)
+{
+	int num_failed;
+
+	Suite* s;
+	SRunner* sr;
+
+	s = backend_suite();
+	sr = srunner_create(s);
+
+	srunner_run_all(sr, CK_NORMAL);
+	num_failed = srunner_ntests_failed(sr);
+
+	srunner_free(sr);
+
+	return num_failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,131 @@
+/*
+ * Unit test for bench() and clock_ns()
+ */
+
+#include <stdlib.h>
+#include <check.h>
+
+
+#include "lox.h"
+#include "vm.h"
+#include "util.h"
+
+
+static const Backend backends[] = {BACKEND_STACK, BACKEND_REGISTER};
+
+#define BACKEND_COUNT ((int) (sizeof(backends) / sizeof(backends[0])))
+
+
+/*
+ * call_f()
+ * Load a script and call the f() it defines with no arguments.
+ */
+static LoxStatus call_f(LoxVM* lox, const char* source)
+{
+	ck_assert(lox_load(lox, source) == LOX_OK);
+
+	LoxFunction* f = lox_function(lox, "f");
+	ck_assert(f != NULL);
+
+	return lox_call(lox, f, 0);
+}
+
+
+START_TEST(test_calls)
+{
+	for(int i = 0; i < BACKEND_COUNT; i++)
+	{
+		LoxVM* lox = lox_new_vm();
+		vm.backend = backends[i];
+
+		// A tenth of the iterations to warm up, then all of them timed
+		ck_assert(call_f(lox,
+			"var calls = 0;\n"
+			"func work() { calls = calls + 1; return calls; }\n"
+			"func f() {\n"
+			"	var median = bench(work, 100);\n"
+			"	if(median <= 0) return -1;\n"
+			"	return calls;\n"
+			"}\n") == LOX_OK);
+		ck_assert(float_equal(lox_result(lox).number, 110.0f));
+
+		lox_free_vm(lox);
+	}
+}
+END_TEST
+
+
+START_TEST(test_clock_ns)
+{
+	LoxVM* lox = lox_new_vm();
+
+	ck_assert(call_f(lox,
+		"func f() {\n"
+		"	var start = clock_ns();\n"
+		"	var i = 0;\n"
+		"	while(i < 1000) i = i + 1;\n"
+		"	return clock_ns() - start;\n"
+		"}\n") == LOX_OK);
+	ck_assert(lox_result(lox).number > 0);
+
+	lox_free_vm(lox);
+}
+END_TEST
+
+
+START_TEST(test_errors)
+{
+	for(int i = 0; i < BACKEND_COUNT; i++)
+	{
+		LoxVM* lox = lox_new_vm();
+		vm.backend = backends[i];
+
+		ck_assert(call_f(lox, "func g() {}\nfunc f() { return bench(g, 0); }\n") == LOX_RUNTIME_ERROR);
+		ck_assert(call_f(lox, "func f() { return bench(1, 10); }\n") == LOX_RUNTIME_ERROR);
+		ck_assert(call_f(lox, "func g() { return nil + 1; }\nfunc f() { return bench(g, 10); }\n") == LOX_RUNTIME_ERROR);
+		ck_assert(call_f(lox, "func g() { yield(1); }\nfunc f() { return bench(g, 10); }\n") == LOX_RUNTIME_ERROR);
+
+		// The VM is still usable after an error inside the benchmarked call
+		ck_assert(call_f(lox, "func g() { return 1; }\nfunc f() { return bench(g, 10) > 0; }\n") == LOX_OK);
+		ck_assert(lox_result(lox).type == LOX_BOOL);
+		ck_assert(lox_result(lox).boolean == true);
+
+		lox_free_vm(lox);
+	}
+}
+END_TEST
+
+
+Suite* bench_suite(void)
+{
+	Suite* s;
+
+	s = suite_create("bench");
+
+	TCase* tc_timing = tcase_create("Timing");
+	tcase_add_test(tc_timing, test_calls);
+	tcase_add_test(tc_timing, test_clock_ns);
+	tcase_add_test(tc_timing, test_errors);
+	suite_add_tcase(s, tc_timing);
+
+	return s;
+}
+
+
+int main(void)
+{
+	int num_failed;
+
+	Suite* s;
+	SRunner* sr;
+
+	s = bench_suite();
+	sr = srunner_create(s);
+
+	srunner_run_all(sr, CK_NORMAL);
+	num_failed = srunner_ntests_failed(sr);
+
+	srunner_free(sr);
+
+	return num_failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
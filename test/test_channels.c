@@ -0,0 +1,170 @@
+/*
+ * Unit test for channels, between the script and tasks and between
+ * tasks parked on them
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <check.h>
+
+
+#include "lox.h"
+#include "vm.h"
+#include "util.h"
+
+
+/*
+ * call_f()
+ * Load a script and call the f() it defines with no arguments.
+ */
+static LoxStatus call_f(LoxVM* lox, const char* source)
+{
+	ck_assert(lox_load(lox, source) == LOX_OK);
+
+	LoxFunction* f = lox_function(lox, "f");
+	ck_assert(f != NULL);
+
+	return lox_call(lox, f, 0);
+}
+
+
+START_TEST(test_buffer)
+{
+	LoxVM* lox = lox_new_vm();
+
+	// Messages come out oldest first, strings by reference
+	ck_assert(call_f(lox,
+		"func f() {\n"
+		"	var ch = channel(3);\n"
+		"	send(ch, \"a\"); send(ch, \"b\"); send(ch, \"c\");\n"
+		"	return recv(ch) + recv(ch) + recv(ch);\n"
+		"}\n") == LOX_OK);
+	ck_assert(lox_result(lox).type == LOX_STRING);
+	ck_assert(strcmp(lox_result(lox).string, "abc") == 0);
+
+	lox_free_vm(lox);
+}
+END_TEST
+
+
+START_TEST(test_close)
+{
+	LoxVM* lox = lox_new_vm();
+
+	// What was sent before close() is still received, then nil
+	ck_assert(call_f(lox,
+		"func f() {\n"
+		"	var ch = channel(2);\n"
+		"	send(ch, 1); send(ch, 2);\n"
+		"	close(ch);\n"
+		"	var total = recv(ch) + recv(ch);\n"
+		"	if(recv(ch) != nil) return -1;\n"
+		"	return total;\n"
+		"}\n") == LOX_OK);
+	ck_assert(float_equal(lox_result(lox).number, 3.0f));
+
+	ck_assert(call_f(lox, "func f() { var ch = channel(1); close(ch); send(ch, 1); }\n") == LOX_RUNTIME_ERROR);
+	ck_assert(call_f(lox, "func f() { send(channel(1), f); }\n") == LOX_RUNTIME_ERROR);
+
+	lox_free_vm(lox);
+}
+END_TEST
+
+
+START_TEST(test_tasks)
+{
+	LoxVM* lox = lox_new_vm();
+	vm.workers = 1;
+
+	// With one worker and room for one message the producer and the
+	// consumer park on the channel in turn
+	ck_assert(call_f(lox,
+		"func produce(ch) {\n"
+		"	var i = 1;\n"
+		"	while(i <= 100) { send(ch, i); i = i + 1; }\n"
+		"	close(ch);\n"
+		"}\n"
+		"func consume(ch) {\n"
+		"	var total = 0;\n"
+		"	var n = recv(ch);\n"
+		"	while(n != nil) { total = total + n; n = recv(ch); }\n"
+		"	return total;\n"
+		"}\n"
+		"func f() {\n"
+		"	var ch = channel(1);\n"
+		"	var consumer = spawn(consume, ch);\n"
+		"	spawn(produce, ch);\n"
+		"	return join(consumer);\n"
+		"}\n") == LOX_OK);
+	ck_assert(float_equal(lox_result(lox).number, 5050.0f));
+
+	lox_free_vm(lox);
+}
+END_TEST
+
+
+START_TEST(test_reply)
+{
+	LoxVM* lox = lox_new_vm();
+	vm.workers = 2;
+
+	// A channel sent over a channel is the same channel at the other end
+	ck_assert(call_f(lox,
+		"func server(requests) {\n"
+		"	var reply = recv(requests);\n"
+		"	while(reply != nil) { send(reply, recv(requests) * 2); reply = recv(requests); }\n"
+		"}\n"
+		"func f() {\n"
+		"	var requests = channel(2);\n"
+		"	var reply = channel(1);\n"
+		"	var task = spawn(server, requests);\n"
+		"	send(requests, reply); send(requests, 21);\n"
+		"	var answer = recv(reply);\n"
+		"	close(requests);\n"
+		"	join(task);\n"
+		"	return answer;\n"
+		"}\n") == LOX_OK);
+	ck_assert(float_equal(lox_result(lox).number, 42.0f));
+
+	lox_free_vm(lox);
+}
+END_TEST
+
+
+Suite* channel_suite(void)
+{
+	Suite* s;
+
+	s = suite_create("channels");
+
+	TCase* tc_script = tcase_create("Script");
+	tcase_add_test(tc_script, test_buffer);
+	tcase_add_test(tc_script, test_close);
+	suite_add_tcase(s, tc_script);
+
+	TCase* tc_tasks = tcase_create("Tasks");
+	tcase_add_test(tc_tasks, test_tasks);
+	tcase_add_test(tc_tasks, test_reply);
+	suite_add_tcase(s, tc_tasks);
+
+	return s;
+}
+
+
+int main(void)
+{
+	int num_failed;
+
+	Suite* s;
+	SRunner* sr;
+
+	s = channel_suite();
+	sr = srunner_create(s);
+
+	srunner_run_all(sr, CK_NORMAL);
+	num_failed = srunner_ntests_failed(sr);
+
+	srunner_free(sr);
+
+	return num_failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,112 @@
+/*
+ * Unit test for the compiler's scoping of local variables
+ */
+
+#include <stdlib.h>
+#include <check.h>
+
+
+#include "lox.h"
+#include "util.h"
+
+
+/*
+ * call_f()
+ * Load a script and call the f() it defines with one number.
+ */
+static LoxStatus call_f(LoxVM* lox, const char* source, double arg)
+{
+	ck_assert(lox_load(lox, source) == LOX_OK);
+
+	LoxFunction* f = lox_function(lox, "f");
+	ck_assert(f != NULL);
+
+	lox_push(lox, lox_number(arg));
+	return lox_call(lox, f, 1);
+}
+
+
+START_TEST(test_reload)
+{
+	LoxVM* lox = lox_new_vm();
+
+	// Each script is compiled on a fresh compiler, which must not see the
+	// locals the last one left behind in its slots
+	ck_assert(call_f(lox, "func f(x) { var y = x + 1; return y; }\n", 1) == LOX_OK);
+	ck_assert(float_equal(lox_result(lox).number, 2.0f));
+	ck_assert(call_f(lox, "func f(y) { return y * 2; }\n", 3) == LOX_OK);
+	ck_assert(float_equal(lox_result(lox).number, 6.0f));
+	ck_assert(call_f(lox, "func f(x) { var x2 = x; return x2 - 1; }\n", 3) == LOX_OK);
+	ck_assert(float_equal(lox_result(lox).number, 2.0f));
+
+	lox_free_vm(lox);
+}
+END_TEST
+
+
+START_TEST(test_shadowing)
+{
+	LoxVM* lox = lox_new_vm();
+
+	// An inner scope can reuse a name, the outer local is untouched
+	ck_assert(call_f(lox,
+		"func f(x) {\n"
+		"	var a = x;\n"
+		"	{ var a = 10; { var a = 100; x = x + a; } x = x + a; }\n"
+		"	return x + a;\n"
+		"}\n", 1) == LOX_OK);
+	ck_assert(float_equal(lox_result(lox).number, 112.0f));
+
+	lox_free_vm(lox);
+}
+END_TEST
+
+
+START_TEST(test_redeclare)
+{
+	LoxVM* lox = lox_new_vm();
+
+	// The search starts at the last local, a stale slot past it from an
+	// earlier scope or compile must not end it before the clash is seen
+	ck_assert(lox_load(lox, "func f() { var a = 1; var a = 2; }\n") == LOX_COMPILE_ERROR);
+	ck_assert(lox_load(lox, "func f() { { var b = 1; { var c = b; } var b = 2; } }\n") == LOX_COMPILE_ERROR);
+	ck_assert(lox_load(lox, "func f() { var a = 1; { var b = a; var b = 2; } }\n") == LOX_COMPILE_ERROR);
+
+	lox_free_vm(lox);
+}
+END_TEST
+
+
+Suite* compiler_suite(void)
+{
+	Suite* s;
+
+	s = suite_create("compiler");
+
+	TCase* tc_scopes = tcase_create("Scopes");
+	tcase_add_test(tc_scopes, test_reload);
+	tcase_add_test(tc_scopes, test_shadowing);
+	tcase_add_test(tc_scopes, test_redeclare);
+	suite_add_tcase(s, tc_scopes);
+
+	return s;
+}
+
+
+int main(void)
+{
+	int num_failed;
+
+	Suite* s;
+	SRunner* sr;
+
+	s = compiler_suite();
+	sr = srunner_create(s);
+
+	srunner_run_all(sr, CK_NORMAL);
+	num_failed = srunner_ntests_failed(sr);
+
+	srunner_free(sr);
+
+	return num_failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
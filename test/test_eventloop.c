@@ -0,0 +1,201 @@
+/*
+ * Unit test for the event loop, runs scheduled fibers doing I/O over
+ * socketpairs and pipes
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <check.h>
+
+
+#include "lox.h"
+
+
+#define DRIVE "while(pending() > 0) run();\n"
+
+
+/*
+ * call_f()
+ * Load a script and call the f() it defines with one number.
+ */
+static LoxStatus call_f(LoxVM* lox, const char* source, double arg)
+{
+	ck_assert(lox_load(lox, source) == LOX_OK);
+
+	LoxFunction* f = lox_function(lox, "f");
+	ck_assert(f != NULL);
+
+	lox_push(lox, lox_number(arg));
+	return lox_call(lox, f, 1);
+}
+
+
+START_TEST(test_echo)
+{
+	LoxVM* lox = lox_new_vm();
+
+	// Each side parks on read() until the other has written
+	ck_assert(call_f(lox,
+		"var reply = \"\";\n"
+		"func server(fd) {\n"
+		"	var msg = read(fd);\n"
+		"	while(msg != nil) { write(fd, msg + \"!\"); msg = read(fd); }\n"
+		"	close(fd);\n"
+		"}\n"
+		"func client(fd) {\n"
+		"	write(fd, \"a\"); reply = reply + read(fd);\n"
+		"	write(fd, \"b\"); reply = reply + read(fd);\n"
+		"	close(fd);\n"
+		"}\n"
+		"func f(x) {\n"
+		"	var fd = socketpair();\n"
+		"	schedule(fiber(server), peer(fd));\n"
+		"	schedule(fiber(client), fd);\n"
+		"	" DRIVE
+		"	return reply;\n"
+		"}\n", 0) == LOX_OK);
+
+	ck_assert(lox_result(lox).type == LOX_STRING);
+	ck_assert(strcmp(lox_result(lox).string, "a!b!") == 0);
+
+	lox_free_vm(lox);
+}
+END_TEST
+
+
+START_TEST(test_sleep_order)
+{
+	LoxVM* lox = lox_new_vm();
+
+	// Sleeping fibers wake in the order of their timers
+	ck_assert(call_f(lox,
+		"var order = 0;\n"
+		"func nap(ms) { sleep(ms); order = order * 10 + ms / 10; }\n"
+		"func f(x) {\n"
+		"	schedule(fiber(nap), 30);\n"
+		"	schedule(fiber(nap), 10);\n"
+		"	schedule(fiber(nap), 20);\n"
+		"	" DRIVE
+		"	return order;\n"
+		"}\n", 0) == LOX_OK);
+
+	ck_assert(lox_result(lox).number == 123);
+
+	lox_free_vm(lox);
+}
+END_TEST
+
+
+START_TEST(test_close_wakes)
+{
+	LoxVM* lox = lox_new_vm();
+
+	// Closing the descriptor a fiber is parked on fails its read rather
+	// than leaving pending() above 0 with nothing left for epoll to report
+	ck_assert(call_f(lox,
+		"func reader(fd) { return read(fd); }\n"
+		"func closer(fd) { sleep(10); close(fd); }\n"
+		"func f(x) {\n"
+		"	var fd = socketpair();\n"
+		"	schedule(fiber(reader), fd);\n"
+		"	schedule(fiber(closer), fd);\n"
+		"	" DRIVE
+		"	return true;\n"
+		"}\n", 0) == LOX_RUNTIME_ERROR);
+
+	lox_free_vm(lox);
+}
+END_TEST
+
+
+static void* write_later(void* arg)
+{
+	int fd = *(int*) arg;
+
+	usleep(100 * 1000);
+	ck_assert(write(fd, "hello", 5) == 5);
+	close(fd);
+
+	return NULL;
+}
+
+
+START_TEST(test_pipe)
+{
+	int fds[2];
+	ck_assert(pipe(fds) == 0);
+
+	pthread_t writer;
+	ck_assert(pthread_create(&writer, NULL, write_later, &fds[1]) == 0);
+
+	LoxVM* lox = lox_new_vm();
+
+	// The read end is blocking, the reader is still parked so that the
+	// ticker keeps running until the write
+	ck_assert(call_f(lox,
+		"var got = nil;\n"
+		"var ticks = 0;\n"
+		"func reader(fd) { got = read(fd); }\n"
+		"func ticker(ms) { while(got == nil) { sleep(ms); ticks = ticks + 1; } }\n"
+		"func f(fd) {\n"
+		"	schedule(fiber(reader), fd);\n"
+		"	schedule(fiber(ticker), 5);\n"
+		"	" DRIVE
+		"	if(got != \"hello\") return 0;\n"
+		"	return ticks;\n"
+		"}\n", fds[0]) == LOX_OK);
+
+	ck_assert(lox_result(lox).number > 1);
+
+	lox_free_vm(lox);
+	pthread_join(writer, NULL);
+
+	// The descriptor gets its flags back along with the VM
+	ck_assert((fcntl(fds[0], F_GETFL) & O_NONBLOCK) == 0);
+	close(fds[0]);
+}
+END_TEST
+
+
+Suite* eventloop_suite(void)
+{
+	Suite* s;
+
+	s = suite_create("event loop");
+
+	TCase* tc_sockets = tcase_create("Sockets");
+	tcase_add_test(tc_sockets, test_echo);
+	tcase_add_test(tc_sockets, test_close_wakes);
+	suite_add_tcase(s, tc_sockets);
+
+	TCase* tc_waits = tcase_create("Waits");
+	tcase_add_test(tc_waits, test_sleep_order);
+	tcase_add_test(tc_waits, test_pipe);
+	suite_add_tcase(s, tc_waits);
+
+	return s;
+}
+
+
+int main(void)
+{
+	int num_failed;
+
+	Suite* s;
+	SRunner* sr;
+
+	s = eventloop_suite();
+	sr = srunner_create(s);
+
+	srunner_run_all(sr, CK_NORMAL);
+	num_failed = srunner_ntests_failed(sr);
+
+	srunner_free(sr);
+
+	return num_failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,172 @@
+/*
+ * Unit test for extensions, runs from the top directory after
+ * make extensions
+ */
+
+#include <stdlib.h>
+#include <check.h>
+
+
+#include "lox.h"
+#include "util.h"
+
+
+#define EXTENSION "load_extension(\"ext/fastmath.so\");\n"
+
+
+/*
+ * call_script()
+ * Load the extension and a script defining f(), then call f() with one
+ * number.
+ */
+static LoxStatus call_script(LoxVM* vm, const char* source, double arg)
+{
+	ck_assert(lox_load(vm, EXTENSION) == LOX_OK);
+	ck_assert(lox_load(vm, source) == LOX_OK);
+
+	LoxFunction* f = lox_function(vm, "f");
+	ck_assert(f != NULL);
+
+	lox_push(vm, lox_number(arg));
+	return lox_call(vm, f, 1);
+}
+
+
+START_TEST(test_natives)
+{
+	LoxVM* vm = lox_new_vm();
+
+	ck_assert(call_script(vm, "func f(x) { return hypot(x, 4) + clamp(x, 0, 1); }", 3) == LOX_OK);
+	ck_assert(lox_result(vm).type == LOX_NUMBER);
+	ck_assert(float_equal(lox_result(vm).number, 6.0f));
+
+	lox_free_vm(vm);
+}
+END_TEST
+
+
+START_TEST(test_variadic)
+{
+	LoxVM* vm = lox_new_vm();
+
+	ck_assert(call_script(vm, "func f(x) { return sum() + sum(x) + sum(x, x, x); }", 2) == LOX_OK);
+	ck_assert(float_equal(lox_result(vm).number, 8.0f));
+
+	lox_free_vm(vm);
+}
+END_TEST
+
+
+START_TEST(test_tasks)
+{
+	LoxVM* vm = lox_new_vm();
+
+	// The workers start before the extension is loaded
+	ck_assert(lox_load(vm,
+		"func hash(s) { return fnv1a(s); }\n"
+		"func g() { return join(spawn(hash, \"lox\")); }\n") == LOX_OK);
+	LoxFunction* g = lox_function(vm, "g");
+	ck_assert(lox_call(vm, g, 0) == LOX_RUNTIME_ERROR);
+
+	ck_assert(call_script(vm,
+		"func side(i) { return hypot(3, 4); }\n"
+		"func add(a, b) { return a + b; }\n"
+		"func f(x) { return join(spawn(hash, \"lox\")) - fnv1a(\"lox\") + parallel_for(0, x, side, add); }\n", 3) == LOX_OK);
+	ck_assert(float_equal(lox_result(vm).number, 15.0f));
+
+	// A function compiled before the extension was loaded sees it too
+	ck_assert(lox_call(vm, g, 0) == LOX_OK);
+	ck_assert(lox_result(vm).type == LOX_NUMBER);
+
+	lox_free_vm(vm);
+}
+END_TEST
+
+
+START_TEST(test_arity)
+{
+	LoxVM* vm = lox_new_vm();
+
+	// Checked before the native runs
+	ck_assert(call_script(vm, "func f(x) { return hypot(x); }", 1) == LOX_RUNTIME_ERROR);
+	ck_assert(lox_result(vm).type == LOX_NIL);
+
+	lox_free_vm(vm);
+}
+END_TEST
+
+
+START_TEST(test_types)
+{
+	LoxVM* vm = lox_new_vm();
+
+	ck_assert(call_script(vm, "func f(x) { return fnv1a(x); }", 1) == LOX_RUNTIME_ERROR);
+
+	lox_free_vm(vm);
+}
+END_TEST
+
+
+START_TEST(test_native_error)
+{
+	LoxVM* vm = lox_new_vm();
+
+	ck_assert(call_script(vm, "func f(x) { return clamp(x, 1, 0); }", 1) == LOX_RUNTIME_ERROR);
+
+	lox_free_vm(vm);
+}
+END_TEST
+
+
+START_TEST(test_bad_path)
+{
+	LoxVM* vm = lox_new_vm();
+
+	ck_assert(lox_load(vm, "load_extension(\"ext/missing.so\");") == LOX_RUNTIME_ERROR);
+	ck_assert(lox_function(vm, "hypot") == NULL);
+
+	lox_free_vm(vm);
+}
+END_TEST
+
+
+Suite* extension_suite(void)
+{
+	Suite* s;
+
+	s = suite_create("extension");
+
+	TCase* tc_natives = tcase_create("Natives");
+	tcase_add_test(tc_natives, test_natives);
+	tcase_add_test(tc_natives, test_variadic);
+	tcase_add_test(tc_natives, test_tasks);
+	suite_add_tcase(s, tc_natives);
+
+	TCase* tc_errors = tcase_create("Errors");
+	tcase_add_test(tc_errors, test_arity);
+	tcase_add_test(tc_errors, test_types);
+	tcase_add_test(tc_errors, test_native_error);
+	tcase_add_test(tc_errors, test_bad_path);
+	suite_add_tcase(s, tc_errors);
+
+	return s;
+}
+
+
+int main(void)
+{
+	int num_failed;
+
+	Suite* s;
+	SRunner* sr;
+
+	s = extension_suite();
+	sr = srunner_create(s);
+
+	srunner_run_all(sr, CK_NORMAL);
+	num_failed = srunner_ntests_failed(sr);
+
+	srunner_free(sr);
+
+	return num_failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,214 @@
+/*
+ * Unit test for fibers, resume(), yield() and done(), and for the call
+ * profiler and timeline following them
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <check.h>
+
+
+#include "lox.h"
+#include "vm.h"
+#include "util.h"
+
+
+#define GENERATOR \
+	"func numbers(limit) {\n" \
+	"	var i = 0;\n" \
+	"	while(i < limit) { yield(i); i = i + 1; }\n" \
+	"	return limit;\n" \
+	"}\n"
+
+
+/*
+ * call_f()
+ * Load a script and call the f() it defines with no arguments.
+ */
+static LoxStatus call_f(LoxVM* lox, const char* source)
+{
+	ck_assert(lox_load(lox, source) == LOX_OK);
+
+	LoxFunction* f = lox_function(lox, "f");
+	ck_assert(f != NULL);
+
+	return lox_call(lox, f, 0);
+}
+
+
+/*
+ * find_profile()
+ * The call profiler's totals for the function called name.
+ */
+static FunctionProfile* find_profile(const char* name)
+{
+	for(int i = 0; i < vm.profiler.function_capacity; i++)
+	{
+		FunctionProfile* function = &vm.profiler.functions[i];
+		if(function->callee == NULL || function->callee->type != OBJ_FUNCTION)
+			continue;
+
+		ObjString* function_name = ((ObjFunction*) function->callee)->name;
+		if(function_name != NULL && strcmp(function_name->chars, name) == 0)
+			return function;
+	}
+
+	return NULL;
+}
+
+
+START_TEST(test_generator)
+{
+	LoxVM* lox = lox_new_vm();
+
+	// 0 + 1 + 2 from the yields and 3 from the return
+	ck_assert(call_f(lox, GENERATOR
+		"func f() {\n"
+		"	var gen = fiber(numbers);\n"
+		"	var total = resume(gen, 3);\n"
+		"	while(!done(gen)) total = total + resume(gen);\n"
+		"	return total;\n"
+		"}\n") == LOX_OK);
+	ck_assert(float_equal(lox_result(lox).number, 6.0f));
+
+	lox_free_vm(lox);
+}
+END_TEST
+
+
+START_TEST(test_resume_value)
+{
+	LoxVM* lox = lox_new_vm();
+
+	// What resume() passes in is what yield() returns
+	ck_assert(call_f(lox,
+		"func echo(x) { while(true) x = yield(x * 2); }\n"
+		"func f() {\n"
+		"	var e = fiber(echo);\n"
+		"	return resume(e, 1) + resume(e, 10) + resume(e, 100);\n"
+		"}\n") == LOX_OK);
+	ck_assert(float_equal(lox_result(lox).number, 222.0f));
+
+	lox_free_vm(lox);
+}
+END_TEST
+
+
+START_TEST(test_nested)
+{
+	LoxVM* lox = lox_new_vm();
+
+	// A fiber resuming another, both yielding from inside calls
+	ck_assert(call_f(lox, GENERATOR
+		"func inner(gen) { return resume(gen) * 10; }\n"
+		"func outer(limit) {\n"
+		"	var gen = fiber(numbers);\n"
+		"	yield(resume(gen, limit));\n"
+		"	while(true) yield(inner(gen));\n"
+		"}\n"
+		"func f() {\n"
+		"	var o = fiber(outer);\n"
+		"	return resume(o, 4) + resume(o) + resume(o);\n"
+		"}\n") == LOX_OK);
+	ck_assert(float_equal(lox_result(lox).number, 30.0f));
+
+	lox_free_vm(lox);
+}
+END_TEST
+
+
+START_TEST(test_errors)
+{
+	LoxVM* lox = lox_new_vm();
+
+	ck_assert(call_f(lox, GENERATOR
+		"func f() {\n"
+		"	var gen = fiber(numbers);\n"
+		"	resume(gen, 0);\n"
+		"	return resume(gen);\n"
+		"}\n") == LOX_RUNTIME_ERROR);
+	ck_assert(call_f(lox, "func f() { return yield(1); }\n") == LOX_RUNTIME_ERROR);
+	ck_assert(call_f(lox, "func f() { return resume(1); }\n") == LOX_RUNTIME_ERROR);
+
+	// The VM is still usable after the errors
+	ck_assert(call_f(lox, "func f() { return done(fiber(f)); }\n") == LOX_OK);
+	ck_assert(lox_result(lox).type == LOX_BOOL);
+	ck_assert(lox_result(lox).boolean == false);
+
+	lox_free_vm(lox);
+}
+END_TEST
+
+
+START_TEST(test_profile)
+{
+	LoxVM* lox = lox_new_vm();
+	vm.profiler.enabled = true;
+	vm.timeline.enabled = true;
+
+	ck_assert(call_f(lox, GENERATOR
+		"func f() {\n"
+		"	var gen = fiber(numbers);\n"
+		"	var total = resume(gen, 3);\n"
+		"	while(!done(gen)) total = total + resume(gen);\n"
+		"	return total;\n"
+		"}\n") == LOX_OK);
+
+	// The fiber's function is one call however often it was resumed, and
+	// every call opened around the switches has been closed again
+	FunctionProfile* numbers = find_profile("numbers");
+	ck_assert(numbers != NULL);
+	ck_assert(numbers->calls == 1);
+	ck_assert(numbers->depth == 0);
+
+	FunctionProfile* f = find_profile("f");
+	ck_assert(f != NULL);
+	ck_assert(f->calls == 1);
+	ck_assert(f->inclusive >= numbers->inclusive);
+
+	ck_assert(vm.profiler.depth == 0);
+	ck_assert(vm.timeline.depth == 0);
+
+	lox_free_vm(lox);
+}
+END_TEST
+
+
+Suite* fiber_suite(void)
+{
+	Suite* s;
+
+	s = suite_create("fibers");
+
+	TCase* tc_switch = tcase_create("Switching");
+	tcase_add_test(tc_switch, test_generator);
+	tcase_add_test(tc_switch, test_resume_value);
+	tcase_add_test(tc_switch, test_nested);
+	tcase_add_test(tc_switch, test_errors);
+	suite_add_tcase(s, tc_switch);
+
+	TCase* tc_hooks = tcase_create("Profiler");
+	tcase_add_test(tc_hooks, test_profile);
+	suite_add_tcase(s, tc_hooks);
+
+	return s;
+}
+
+
+int main(void)
+{
+	int num_failed;
+
+	Suite* s;
+	SRunner* sr;
+
+	s = fiber_suite();
+	sr = srunner_create(s);
+
+	srunner_run_all(sr, CK_NORMAL);
+	num_failed = srunner_ntests_failed(sr);
+
+	srunner_free(sr);
+
+	return num_failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,162 @@
+/*
+ * Unit test for the intrinsic opcodes of the math natives, and for
+ * scripts and hosts that define their own function of the same name
+ */
+
+#include <stdlib.h>
+#include <check.h>
+
+
+#include "lox.h"
+#include "vm.h"
+#include "util.h"
+
+
+typedef struct {
+	Backend backend;
+	bool superinstructions;
+} Config;
+
+
+static const Config configs[] = {
+	{BACKEND_STACK,    true},
+	{BACKEND_STACK,    false},
+	{BACKEND_REGISTER, false},
+};
+
+#define CONFIG_COUNT ((int) (sizeof(configs) / sizeof(configs[0])))
+
+
+/*
+ * new_vm()
+ * A VM set up like config.
+ */
+static LoxVM* new_vm(const Config* config)
+{
+	LoxVM* lox = lox_new_vm();
+	vm.backend = config->backend;
+	vm.superinstructions = config->superinstructions;
+
+	return lox;
+}
+
+
+/*
+ * call_f()
+ * Call the f() that the scripts loaded so far define, with no arguments.
+ */
+static LoxStatus call_f(LoxVM* lox)
+{
+	LoxFunction* f = lox_function(lox, "f");
+	ck_assert(f != NULL);
+
+	return lox_call(lox, f, 0);
+}
+
+
+static bool negate(LoxVM* lox, int arg_count, const LoxValue* args, LoxValue* result, void* userdata)
+{
+	*result = lox_number(-args[0].number);
+	return true;
+}
+
+
+START_TEST(test_natives)
+{
+	for(int i = 0; i < CONFIG_COUNT; i++)
+	{
+		LoxVM* lox = new_vm(&configs[i]);
+
+		ck_assert(lox_load(lox,
+			"func f() {\n"
+			"	var x = 16;\n"
+			"	return sqrt(x) + floor(2.7) + abs(-3) + min(2, x) + max(2, 5) + pow(2, 10) + cos(0);\n"
+			"}\n") == LOX_OK);
+		ck_assert(call_f(lox) == LOX_OK);
+		ck_assert(float_equal(lox_result(lox).number, 1041.0f));
+
+		// The native's own check of its arguments
+		ck_assert(lox_load(lox, "func f() { return sqrt(\"16\"); }\n") == LOX_OK);
+		ck_assert(call_f(lox) == LOX_RUNTIME_ERROR);
+
+		lox_free_vm(lox);
+	}
+}
+END_TEST
+
+
+START_TEST(test_script_shadows)
+{
+	for(int i = 0; i < CONFIG_COUNT; i++)
+	{
+		LoxVM* lox = new_vm(&configs[i]);
+
+		// f() was compiled to the opcode before the script redefined sqrt
+		ck_assert(lox_load(lox, "func f() { return sqrt(16) + max(1, 2); }\n") == LOX_OK);
+		ck_assert(call_f(lox) == LOX_OK);
+		ck_assert(float_equal(lox_result(lox).number, 6.0f));
+
+		ck_assert(lox_load(lox, "func sqrt(x) { return x; }\n") == LOX_OK);
+		ck_assert(call_f(lox) == LOX_OK);
+		ck_assert(float_equal(lox_result(lox).number, 18.0f));
+
+		// Assigning something that isn't a function is seen as well
+		ck_assert(lox_load(lox, "max = nil;\n") == LOX_OK);
+		ck_assert(call_f(lox) == LOX_RUNTIME_ERROR);
+
+		lox_free_vm(lox);
+	}
+}
+END_TEST
+
+
+START_TEST(test_host_shadows)
+{
+	for(int i = 0; i < CONFIG_COUNT; i++)
+	{
+		LoxVM* lox = new_vm(&configs[i]);
+
+		ck_assert(lox_load(lox, "func f() { return abs(4); }\n") == LOX_OK);
+		lox_define_native(lox, "abs", negate, NULL);
+		ck_assert(call_f(lox) == LOX_OK);
+		ck_assert(float_equal(lox_result(lox).number, -4.0f));
+
+		lox_free_vm(lox);
+	}
+}
+END_TEST
+
+
+Suite* intrinsic_suite(void)
+{
+	Suite* s;
+
+	s = suite_create("intrinsics");
+
+	TCase* tc_calls = tcase_create("Calls");
+	tcase_add_test(tc_calls, test_natives);
+	tcase_add_test(tc_calls, test_script_shadows);
+	tcase_add_test(tc_calls, test_host_shadows);
+	suite_add_tcase(s, tc_calls);
+
+	return s;
+}
+
+
+int main(void)
+{
+	int num_failed;
+
+	Suite* s;
+	SRunner* sr;
+
+	s = intrinsic_suite();
+	sr = srunner_create(s);
+
+	srunner_run_all(sr, CK_NORMAL);
+	num_failed = srunner_ntests_failed(sr);
+
+	srunner_free(sr);
+
+	return num_failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,281 @@
+/*
+ * Unit test for the scheduler, runs tasks on the workers with the limits
+ * the script has
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <check.h>
+
+
+#include "lox.h"
+#include "vm.h"
+#include "util.h"
+
+
+#define SPIN "func spin(x) { while(true) {} }\n"
+
+
+/*
+ * call_f()
+ * Load a script and call the f() it defines with no arguments.
+ */
+static LoxStatus call_f(LoxVM* lox, const char* source)
+{
+	ck_assert(lox_load(lox, source) == LOX_OK);
+
+	LoxFunction* f = lox_function(lox, "f");
+	ck_assert(f != NULL);
+
+	return lox_call(lox, f, 0);
+}
+
+
+START_TEST(test_spawn_join)
+{
+	LoxVM* lox = lox_new_vm();
+	vm.workers = 2;
+
+	ck_assert(call_f(lox,
+		"func square(x) { return x * x; }\n"
+		"func f() {\n"
+		"	var a = spawn(square, 3);\n"
+		"	var b = spawn(square, 4);\n"
+		"	return join(a) + join(b);\n"
+		"}\n") == LOX_OK);
+	ck_assert(float_equal(lox_result(lox).number, 25.0f));
+
+	lox_free_vm(lox);
+}
+END_TEST
+
+
+START_TEST(test_globals)
+{
+	LoxVM* lox = lox_new_vm();
+	vm.workers = 2;
+
+	// A task sees the globals as they were when it was spawned, and what
+	// it assigns to them stays on its worker
+	ck_assert(call_f(lox,
+		"var scale = 10;\n"
+		"var suffix = \"!\";\n"
+		"func scaled(x) { var r = x * scale; scale = 0; return r; }\n"
+		"func shout(s) { return s + suffix; }\n"
+		"func offset(i) { return i + scale; }\n"
+		"func add(a, b) { return a + b; }\n"
+		"func f() {\n"
+		"	var a = join(spawn(scaled, 3));\n"
+		"	scale = 100;\n"
+		"	var b = join(spawn(scaled, 3));\n"
+		"	if(join(spawn(shout, \"hey\")) != \"hey!\") return -1;\n"
+		"	return a + b + scale + parallel_for(0, 4, offset, add);\n"
+		"}\n") == LOX_OK);
+	ck_assert(float_equal(lox_result(lox).number, 30.0f + 300.0f + 100.0f + 406.0f));
+
+	lox_free_vm(lox);
+}
+END_TEST
+
+
+START_TEST(test_parallel_for_waits)
+{
+	// A body that joins or receives parks its part, so a single worker
+	// still gets to the tasks it waits for
+	for(int workers = 1; workers <= 2; workers++)
+	{
+		LoxVM* lox = lox_new_vm();
+		vm.workers = workers;
+
+		ck_assert(call_f(lox,
+			"func square(x) { return x * x; }\n"
+			"func add(a, b) { return a + b; }\n"
+			"func joined(i) { return join(spawn(square, i)); }\n"
+			"func nested(i) { return parallel_for(0, 4, square, add); }\n"
+			"var ch = channel(1);\n"
+			"func produce(n) { var i = 0; while(i < n) { send(ch, i); i = i + 1; } return n; }\n"
+			"func take(i) { return recv(ch); }\n"
+			"func f() {\n"
+			"	var producer = spawn(produce, 10);\n"
+			"	var taken = parallel_for(0, 10, take, add);\n"
+			"	join(producer);\n"
+			"	return parallel_for(0, 10, joined, add) * 10000 + parallel_for(0, 3, nested, add) * 100 + taken;\n"
+			"}\n") == LOX_OK);
+		ck_assert(float_equal(lox_result(lox).number, 285.0f * 10000 + 42.0f * 100 + 45.0f));
+
+		// An error in a body that was parked fails the whole loop
+		ck_assert(call_f(lox,
+			"func failing(x) { if(x == 3) return nil + 1; return x; }\n"
+			"func f() { return parallel_for(0, 10, joined_failing, add); }\n"
+			"func joined_failing(i) { return join(spawn(failing, i)); }\n") == LOX_RUNTIME_ERROR);
+
+		lox_free_vm(lox);
+	}
+}
+END_TEST
+
+
+/*
+ * Host
+ * A host thread with a VM of its own, which calls f() rounds times and
+ * counts the calls that returned expected.
+ */
+typedef struct {
+	const char* source;
+	double expected;
+	int rounds;
+	int passed;
+} Host;
+
+
+static void* run_host(void* arg)
+{
+	Host* host = (Host*) arg;
+	LoxVM* lox = lox_new_vm();
+	vm.workers = 2;
+
+	host->passed = 0;
+	if(lox_load(lox, host->source) == LOX_OK)
+	{
+		LoxFunction* f = lox_function(lox, "f");
+		for(int i = 0; f != NULL && i < host->rounds; i++)
+		{
+			if(lox_call(lox, f, 0) == LOX_OK && float_equal(lox_result(lox).number, host->expected))
+				host->passed++;
+		}
+	}
+
+	lox_free_vm(lox);
+	return NULL;
+}
+
+
+START_TEST(test_two_vms)
+{
+	// The scripts number their functions differently, and the first host
+	// frees its VM, and stops its workers, while the second still spawns
+	Host hosts[2] = {
+		{
+			"func square(x) { return x * x; }\n"
+			"func f() { return join(spawn(square, 3)); }\n",
+			9.0, 50, 0,
+		},
+		{
+			"func unused() {}\n"
+			"func add(a, b) { return a + b; }\n"
+			"func cube(x) { return x * x * x; }\n"
+			"func f() { return join(spawn(cube, 3)) + parallel_for(0, 4, cube, add); }\n",
+			27.0 + 36.0, 500, 0,
+		},
+	};
+	pthread_t threads[2];
+
+	for(int i = 0; i < 2; i++)
+		ck_assert(pthread_create(&threads[i], NULL, run_host, &hosts[i]) == 0);
+	for(int i = 0; i < 2; i++)
+		pthread_join(threads[i], NULL);
+
+	for(int i = 0; i < 2; i++)
+		ck_assert(hosts[i].passed == hosts[i].rounds);
+}
+END_TEST
+
+
+START_TEST(test_instruction_limit)
+{
+	LoxVM* lox = lox_new_vm();
+	vm.workers = 1;
+	vm.limits.max_instructions = 10000;
+
+	ck_assert(call_f(lox, SPIN "func f() { return join(spawn(spin, 1)); }\n") == LOX_RUNTIME_ERROR);
+
+	lox_free_vm(lox);
+}
+END_TEST
+
+
+START_TEST(test_time_limit)
+{
+	LoxVM* lox = lox_new_vm();
+	vm.workers = 1;
+	vm.limits.max_ns = 50 * 1000000;
+
+	ck_assert(call_f(lox, SPIN "func f() { return join(spawn(spin, 1)); }\n") == LOX_RUNTIME_ERROR);
+
+	lox_free_vm(lox);
+}
+END_TEST
+
+
+START_TEST(test_heap_limit)
+{
+	LoxVM* lox = lox_new_vm();
+	vm.workers = 1;
+	vm.memory.limit = 1 << 20;
+
+	// Doubling a string goes over the limit long before it gets too big
+	// for its length
+	ck_assert(call_f(lox,
+		"func grow(x) { var s = \"xxxxxxxxxxxxxxxx\"; while(true) s = s + s; }\n"
+		"func f() { return join(spawn(grow, 1)); }\n") == LOX_RUNTIME_ERROR);
+
+	lox_free_vm(lox);
+}
+END_TEST
+
+
+START_TEST(test_cancel_at_exit)
+{
+	LoxVM* lox = lox_new_vm();
+	vm.workers = 1;
+
+	// Nothing joins the task, freeing the VM stops it rather than wait
+	ck_assert(call_f(lox, SPIN "func f() { spawn(spin, 1); return true; }\n") == LOX_OK);
+
+	lox_free_vm(lox);
+}
+END_TEST
+
+
+Suite* scheduler_suite(void)
+{
+	Suite* s;
+
+	s = suite_create("scheduler");
+
+	TCase* tc_tasks = tcase_create("Tasks");
+	tcase_add_test(tc_tasks, test_spawn_join);
+	tcase_add_test(tc_tasks, test_globals);
+	tcase_add_test(tc_tasks, test_parallel_for_waits);
+	tcase_add_test(tc_tasks, test_two_vms);
+	suite_add_tcase(s, tc_tasks);
+
+	TCase* tc_limits = tcase_create("Limits");
+	tcase_add_test(tc_limits, test_instruction_limit);
+	tcase_add_test(tc_limits, test_time_limit);
+	tcase_add_test(tc_limits, test_heap_limit);
+	tcase_add_test(tc_limits, test_cancel_at_exit);
+	suite_add_tcase(s, tc_limits);
+
+	return s;
+}
+
+
+int main(void)
+{
+	int num_failed;
+
+	Suite* s;
+	SRunner* sr;
+
+	s = scheduler_suite();
+	sr = srunner_create(s);
+
+	srunner_run_all(sr, CK_NORMAL);
+	num_failed = srunner_ntests_failed(sr);
+
+	srunner_free(sr);
+
+	return num_failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -45,6 +45,32 @@ START_TEST(test_insert_value)
 END_TEST
 
 
+START_TEST(test_load_factor)
+{
+	Table table;
+	Value out_value;
+
+	init_table(&table);
+
+	// The table grows before it fills up, so a probe for a missing key
+	// always reaches an empty slot rather than going round forever
+	for(int i = 0; i < 100; i++)
+	{
+		char* chars = malloc(8);
+		int length = snprintf(chars, 8, "k%d", i);
+		ck_assert(table_set(&table, make_objstring(chars, length), NUMBER_VAL(i)));
+		ck_assert(table.count <= table.capacity * TABLE_MAX_LOAD);
+	}
+
+	ck_assert(table.count == 100);
+
+	ObjString* missing = make_objstring("missing", 7);
+	ck_assert(table_get(&table, missing, &out_value) == false);
+	ck_assert(table_find_string(&table, "missing", 7, missing->hash) == NULL);
+}
+END_TEST
+
+
 Suite* table_suite(void)
 {
 	Suite* s;
@@ -54,6 +80,7 @@ Suite* table_suite(void)
 	// Test insert values 
 	TCase* tc_insert = tcase_create("Insert Values");
 	tcase_add_test(tc_insert, test_insert_value);
+	tcase_add_test(tc_insert, test_load_factor);
 	suite_add_tcase(s, tc_insert);
 
 	return s;